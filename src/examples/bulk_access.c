@@ -0,0 +1,115 @@
+/***************************************************************************
+ *   Copyright (C) 2018 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+/*
+ * This example compares getting and setting a large array one element at a
+ * time against the bulk array accessors.  No PLC traffic is timed, only the
+ * access to the tag data buffer.
+ *
+ * By default it uses a 1000 element REAL array tag on the lgx_sim simulator
+ * on the local machine.  Pass a different tag attribute string as the first
+ * argument to use a real PLC.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "../lib/libplctag.h"
+#include "utils.h"
+
+
+#define TAG_ATTRIBS "protocol=ab_eip&gateway=127.0.0.1&path=1,0&cpu=LGX&elem_size=4&elem_count=1000&name=TestBigArray"
+#define NUM_ELEMS (1000)
+#define NUM_ROUNDS (1000)
+#define DATA_TIMEOUT (5000)
+
+
+int main(int argc, char **argv)
+{
+    const char *attribs = (argc > 1 ? argv[1] : TAG_ATTRIBS);
+    static float vals[NUM_ELEMS];
+    int32_t tag = 0;
+    int rc = PLCTAG_STATUS_OK;
+    int64_t start = 0;
+    int64_t single_ms = 0;
+    int64_t bulk_ms = 0;
+    double sum = 0.0;
+
+    tag = plc_tag_create(attribs, DATA_TIMEOUT);
+    if(tag < 0) {
+        fprintf(stderr,"Error %s: could not create tag!\n", plc_tag_decode_error(tag));
+        return 1;
+    }
+
+    if(plc_tag_get_size(tag) < NUM_ELEMS * (int)sizeof(float)) {
+        fprintf(stderr,"Tag is too small, need %d bytes!\n", NUM_ELEMS * (int)sizeof(float));
+        plc_tag_destroy(tag);
+        return 1;
+    }
+
+    for(int i=0; i < NUM_ELEMS; i++) {
+        vals[i] = (float)i * 1.5f;
+    }
+
+    /* one element at a time. */
+    start = util_time_ms();
+
+    for(int round=0; round < NUM_ROUNDS; round++) {
+        for(int i=0; i < NUM_ELEMS; i++) {
+            plc_tag_set_float32(tag, i * (int)sizeof(float), vals[i]);
+        }
+
+        for(int i=0; i < NUM_ELEMS; i++) {
+            sum += plc_tag_get_float32(tag, i * (int)sizeof(float));
+        }
+    }
+
+    single_ms = util_time_ms() - start;
+
+    /* the whole array at once. */
+    start = util_time_ms();
+
+    for(int round=0; round < NUM_ROUNDS && rc == PLCTAG_STATUS_OK; round++) {
+        rc = plc_tag_set_float32_array(tag, 0, vals, NUM_ELEMS);
+
+        if(rc == PLCTAG_STATUS_OK) {
+            rc = plc_tag_get_float32_array(tag, 0, vals, NUM_ELEMS);
+        }
+
+        sum += vals[round % NUM_ELEMS];
+    }
+
+    bulk_ms = util_time_ms() - start;
+
+    if(rc != PLCTAG_STATUS_OK) {
+        fprintf(stderr,"ERROR: bulk access failed with %s!\n", plc_tag_decode_error(rc));
+        plc_tag_destroy(tag);
+        return 1;
+    }
+
+    fprintf(stderr, "Per element: %d rounds of %d elements set and get in %dms.\n", NUM_ROUNDS, NUM_ELEMS, (int)single_ms);
+    fprintf(stderr, "Bulk:        %d rounds of %d elements set and get in %dms.\n", NUM_ROUNDS, NUM_ELEMS, (int)bulk_ms);
+    fprintf(stderr, "(checksum %f)\n", sum);
+
+    plc_tag_destroy(tag);
+
+    return 0;
+}
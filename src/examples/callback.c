@@ -0,0 +1,130 @@
+/***************************************************************************
+ *   Copyright (C) 2018 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+/*
+ * This example shows how to use the callback API instead of polling.  It
+ * creates a tag for each element of a small DINT array, registers the same
+ * callback on all of them and fires off all the reads at once.  The callback
+ * counts the completions.
+ *
+ * By default it talks to the lgx_sim simulator on the local machine.  Any
+ * argument is appended to the tag attributes.  The simulator does not handle
+ * packed requests, so use "&allow_packing=0" with it.
+ */
+
+
+#include <stdio.h>
+#include "../lib/libplctag.h"
+#include "utils.h"
+
+
+#define TAG_ATTRIBS "protocol=ab_eip&gateway=127.0.0.1&path=1,0&cpu=LGX&elem_size=4&elem_count=1&name=TestDINTArray[%d]%s"
+#define NUM_TAGS  (10)
+#define DATA_TIMEOUT (5000)
+
+
+/* the callbacks are all called from the same library thread. */
+static volatile int num_done = 0;
+static volatile int num_failed = 0;
+
+
+static void tag_callback(int32_t tag_id, int event, int status, void *userdata)
+{
+    int index = *(int *)userdata;
+
+    switch(event) {
+        case PLCTAG_EVENT_READ_COMPLETED:
+            fprintf(stderr, "Tag %d (index %d) read completed, data=%d\n", tag_id, index, plc_tag_get_int32(tag_id, 0));
+            break;
+
+        case PLCTAG_EVENT_ABORTED:
+        case PLCTAG_EVENT_ERROR:
+            fprintf(stderr, "Tag %d (index %d) failed with %s!\n", tag_id, index, plc_tag_decode_error(status));
+            num_failed++;
+            break;
+
+        default:
+            fprintf(stderr, "Tag %d (index %d) got unexpected event %d!\n", tag_id, index, event);
+            break;
+    }
+
+    num_done++;
+}
+
+
+int main(int argc, char **argv)
+{
+    const char *extra_attribs = (argc > 1 ? argv[1] : "");
+    int32_t tag[NUM_TAGS];
+    int index[NUM_TAGS];
+    int rc;
+    int i;
+    int64_t timeout = 0;
+    int64_t start = 0;
+
+    /* create the tags */
+    for(i=0; i< NUM_TAGS; i++) {
+        char tmp_tag_path[256] = {0,};
+        snprintf_platform(tmp_tag_path, sizeof tmp_tag_path, TAG_ATTRIBS, i, extra_attribs);
+
+        tag[i] = plc_tag_create(tmp_tag_path, DATA_TIMEOUT);
+        if(tag[i] < 0) {
+            fprintf(stderr,"Error %s: could not create tag %d\n",plc_tag_decode_error(tag[i]), i);
+            return 1;
+        }
+
+        index[i] = i;
+
+        plc_tag_register_callback(tag[i], tag_callback, &index[i]);
+    }
+
+    start = util_time_ms();
+
+    /* fire off all the reads, the callbacks tell us when they are done. */
+    for(i=0; i < NUM_TAGS; i++) {
+        rc = plc_tag_read(tag[i], 0);
+
+        if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_STATUS_PENDING) {
+            fprintf(stderr,"ERROR: Unable to read the data! Got error code %d: %s\n",rc, plc_tag_decode_error(rc));
+            return 1;
+        }
+    }
+
+    /* a real application would go do something else here. */
+    timeout = util_time_ms() + DATA_TIMEOUT;
+
+    while(num_done < NUM_TAGS && timeout > util_time_ms()) {
+        util_sleep_ms(10);
+    }
+
+    if(num_done < NUM_TAGS) {
+        fprintf(stderr, "Timeout waiting for callbacks, only got %d of %d!\n", num_done, NUM_TAGS);
+    } else {
+        fprintf(stderr, "Got %d callbacks, %d failed, in %dms\n", num_done, num_failed, (int)(util_time_ms() - start));
+    }
+
+    /* we are done */
+    for(i=0; i < NUM_TAGS; i++) {
+        plc_tag_destroy(tag[i]);
+    }
+
+    return (num_done == NUM_TAGS && num_failed == 0) ? 0 : 1;
+}
@@ -0,0 +1,111 @@
+/***************************************************************************
+ *   Copyright (C) 2018 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+/*
+ * This example measures the round trip time of single tag reads.  It does
+ * one read after another, first with the blocking API and then with the
+ * asynchronous API, and prints the average time per read.
+ *
+ * By default it talks to the lgx_sim simulator on the local machine.  Pass
+ * a different tag attribute string as the first argument to use a real PLC.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "../lib/libplctag.h"
+#include "utils.h"
+
+
+#define TAG_ATTRIBS "protocol=ab_eip&gateway=127.0.0.1&path=1,0&cpu=LGX&elem_size=4&elem_count=1&name=TestDINTArray"
+#define NUM_READS (1000)
+#define DATA_TIMEOUT (5000)
+
+
+int main(int argc, char **argv)
+{
+    const char *attribs = (argc > 1 ? argv[1] : TAG_ATTRIBS);
+    int num_reads = (argc > 2 ? atoi(argv[2]) : NUM_READS);
+    int32_t tag = 0;
+    int rc = PLCTAG_STATUS_OK;
+    int64_t start = 0;
+    int64_t end = 0;
+
+    if(num_reads <= 0) {
+        fprintf(stderr, "Usage: latency [tag attributes] [number of reads]\n");
+        return 1;
+    }
+
+    tag = plc_tag_create(attribs, DATA_TIMEOUT);
+    if(tag < 0) {
+        fprintf(stderr,"Error %s: could not create tag!\n", plc_tag_decode_error(tag));
+        return 1;
+    }
+
+    if((rc = plc_tag_status(tag)) != PLCTAG_STATUS_OK) {
+        fprintf(stderr,"Error setting up tag internal state. %s\n", plc_tag_decode_error(rc));
+        plc_tag_destroy(tag);
+        return 1;
+    }
+
+    /* blocking reads. */
+    start = util_time_ms();
+
+    for(int i=0; i < num_reads; i++) {
+        rc = plc_tag_read(tag, DATA_TIMEOUT);
+        if(rc != PLCTAG_STATUS_OK) {
+            fprintf(stderr,"ERROR: Unable to read the data! Got error code %d: %s\n",rc, plc_tag_decode_error(rc));
+            plc_tag_destroy(tag);
+            return 1;
+        }
+    }
+
+    end = util_time_ms();
+
+    fprintf(stderr, "Blocking reads: %d reads in %dms, %.3fms per read.\n", num_reads, (int)(end - start), (double)(end - start)/(double)num_reads);
+
+    /* asynchronous reads, spin on the status. */
+    start = util_time_ms();
+
+    for(int i=0; i < num_reads; i++) {
+        int64_t timeout = DATA_TIMEOUT + util_time_ms();
+
+        rc = plc_tag_read(tag, 0);
+
+        while(rc == PLCTAG_STATUS_PENDING && timeout > util_time_ms()) {
+            rc = plc_tag_status(tag);
+        }
+
+        if(rc != PLCTAG_STATUS_OK) {
+            fprintf(stderr,"ERROR: Unable to read the data! Got error code %d: %s\n",rc, plc_tag_decode_error(rc));
+            plc_tag_destroy(tag);
+            return 1;
+        }
+    }
+
+    end = util_time_ms();
+
+    fprintf(stderr, "Asynchronous reads: %d reads in %dms, %.3fms per read.\n", num_reads, (int)(end - start), (double)(end - start)/(double)num_reads);
+
+    plc_tag_destroy(tag);
+
+    return 0;
+}
@@ -106,12 +106,70 @@ void test_debug(void)
 
 
 
+void test_resolver(void)
+{
+    int32_t tag = 0;
+
+    fprintf(stderr,"Testing resolver tag.\n");
+
+    tag = plc_tag_create("make=system&family=library&name=resolver&debug=4", TAG_CREATE_TIMEOUT);
+    if(tag < 0) {
+        fprintf(stderr,"ERROR %s: Could not create tag!\n", plc_tag_decode_error(tag));
+        return;
+    }
+
+    plc_tag_read(tag, 0);
+
+    fprintf(stderr,"Host name cache hits %u, misses %u, background refreshes %u.\n",
+            plc_tag_get_uint32(tag,0),
+            plc_tag_get_uint32(tag,4),
+            plc_tag_get_uint32(tag,8));
+
+    fprintf(stderr,"Name lookups %u, failed %u, took %ums in total and %ums at most.\n",
+            plc_tag_get_uint32(tag,16),
+            plc_tag_get_uint32(tag,12),
+            plc_tag_get_uint32(tag,20),
+            plc_tag_get_uint32(tag,24));
+
+    plc_tag_destroy(tag);
+}
+
+
+
+void test_deadlines(void)
+{
+    int32_t tag = 0;
+
+    fprintf(stderr,"Testing deadlines tag.\n");
+
+    tag = plc_tag_create("make=system&family=library&name=deadlines&debug=4", TAG_CREATE_TIMEOUT);
+    if(tag < 0) {
+        fprintf(stderr,"ERROR %s: Could not create tag!\n", plc_tag_decode_error(tag));
+        return;
+    }
+
+    plc_tag_read(tag, 0);
+
+    fprintf(stderr,"Requests with deadlines %u, missed %u, worst by %ums.\n",
+            plc_tag_get_uint32(tag,0),
+            plc_tag_get_uint32(tag,4),
+            plc_tag_get_uint32(tag,8));
+
+    plc_tag_destroy(tag);
+}
+
+
+
 int main()
 {
     test_version();
 
     test_debug();
 
+    test_resolver();
+
+    test_deadlines();
+
     return 0;
 }
 
@@ -34,6 +34,7 @@
 
 #include <limits.h>
 #include <float.h>
+#include <string.h>
 #include <lib/libplctag.h>
 #include <lib/tag.h>
 #include <lib/init.h>
@@ -41,7 +42,7 @@
 #include <util/attr.h>
 #include <util/debug.h>
 #include <util/hash.h>
-#include <util/hashtable.h>
+#include <util/handle_table.h>
 #include <util/rc.h>
 #include <util/vector.h>
 #include <ab/ab.h>
@@ -49,18 +50,43 @@
 
 #define INITIAL_TAG_TABLE_SIZE (201)
 
-#define TAG_ID_MASK (0xFFFFFFF)
+#define TAG_TICKLER_MAX_WAIT_MS (100)
 
-#define MAX_TAG_MAP_ATTEMPTS (50)
+#define TAG_CALLBACK_MAX_WAIT_MS (100)
+
+/* the operation outstanding on a tag, used to raise callback events. */
+#define TAG_OP_NONE (0)
+#define TAG_OP_READ (1)
+#define TAG_OP_WRITE (2)
+
+struct tag_event_t {
+    int32_t tag_id;
+    int event;
+    int status;
+    plc_tag_callback_func callback;
+    void *userdata;
+};
+
+typedef struct tag_event_t *tag_event_p;
 
 /* these are only internal to the file */
 
-static volatile int32_t next_tag_id = 10; /* MAGIC */
-static volatile hashtable_p tags = NULL;
-static mutex_p tag_lookup_mutex = NULL;
+static handle_table_p tags = NULL;
 
 static volatile int library_terminating = 0;
 static thread_p tag_tickler_thread = NULL;
+static cond_p tag_tickler_wait = NULL;
+static vector_p tag_active_list = NULL;
+static mutex_p tag_active_mutex = NULL;
+
+static thread_p tag_callback_thread = NULL;
+static mutex_p tag_callback_mutex = NULL;
+static cond_p tag_callback_wait = NULL;
+static vector_p tag_callback_events = NULL;
+
+/* held while a callback runs, so that unregistering can wait it out. */
+static mutex_p tag_callback_call_mutex = NULL;
+static THREAD_LOCAL int in_tag_callback_thread = 0;
 
 //static mutex_p global_library_mutex = NULL;
 
@@ -69,8 +95,23 @@ static thread_p tag_tickler_thread = NULL;
 /* helper functions. */
 static plc_tag_p lookup_tag(int32_t id);
 static int add_tag_lookup(plc_tag_p tag);
-static int tag_id_inc(int id);
+static int tag_is_mapped(int32_t id);
 static THREAD_FUNC(tag_tickler_func);
+static void wait_for_tag(plc_tag_p tag, int64_t timeout_time);
+static int tag_tick(plc_tag_p tag);
+static void tag_activate(plc_tag_p tag);
+static void tag_drop_events(int32_t tag_id);
+static int tag_deactivate(plc_tag_p tag);
+static void tag_poll(plc_tag_p tag, int status, int64_t now);
+static int64_t tag_next_poll_time(plc_tag_p tag, int64_t now);
+static void tag_op_started(plc_tag_p tag, int op, int rc);
+static void tag_op_aborted(plc_tag_p tag);
+static void tag_raise_event(plc_tag_p tag, int event, int status);
+static THREAD_FUNC(tag_callback_func);
+static int tag_op_many(int32_t *ids, int *statuses, int count, int timeout, int is_write);
+static int tag_get_array(int32_t id, int offset, void *buf, int elem_size, int count);
+static int tag_set_array(int32_t id, int offset, const void *buf, int elem_size, int count);
+static void copy_elements(uint8_t *dest, const uint8_t *src, int elem_size, int count, int swap);
 //static int to_tag_index(int id);
 
 /*
@@ -84,22 +125,66 @@ int lib_init(void)
 
     pdebug(DEBUG_INFO,"Setting up global library data.");
 
-    pdebug(DEBUG_INFO,"Creating tag hashtable.");
-    if((tags = hashtable_create(INITIAL_TAG_TABLE_SIZE)) == NULL) { /* MAGIC */
-        pdebug(DEBUG_ERROR, "Unable to create tag hashtable!");
+    pdebug(DEBUG_INFO,"Creating tag handle table.");
+    if((tags = handle_table_create()) == NULL) {
+        pdebug(DEBUG_ERROR, "Unable to create tag handle table!");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    pdebug(DEBUG_INFO,"Creating tag tickler active list.");
+    if((tag_active_list = vector_create(INITIAL_TAG_TABLE_SIZE, INITIAL_TAG_TABLE_SIZE)) == NULL) {
+        pdebug(DEBUG_ERROR, "Unable to create tag tickler active list!");
         return PLCTAG_ERR_NO_MEM;
     }
 
-    pdebug(DEBUG_INFO,"Creating tag hashtable mutex.");
-    rc = mutex_create((mutex_p *)&tag_lookup_mutex);
+    rc = mutex_create(&tag_active_mutex);
     if (rc != PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_ERROR, "Unable to create tag hashtable mutex!");
+        pdebug(DEBUG_ERROR, "Unable to create tag tickler active list mutex!");
+        return rc;
+    }
+
+    pdebug(DEBUG_INFO,"Creating tag tickler wake up condition.");
+    rc = cond_create(&tag_tickler_wait);
+    if (rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to create tag tickler wake up condition!");
+        return rc;
     }
 
     pdebug(DEBUG_INFO,"Creating tag tickler thread.");
     rc = thread_create(&tag_tickler_thread, tag_tickler_func, 32*1024, NULL);
     if (rc != PLCTAG_STATUS_OK) {
         pdebug(DEBUG_ERROR, "Unable to create tag tickler thread!");
+        return rc;
+    }
+
+    pdebug(DEBUG_INFO,"Creating tag callback event queue.");
+    if((tag_callback_events = vector_create(20, 20)) == NULL) { /* MAGIC */
+        pdebug(DEBUG_ERROR, "Unable to create tag callback event queue!");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    rc = mutex_create(&tag_callback_mutex);
+    if (rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to create tag callback mutex!");
+        return rc;
+    }
+
+    rc = mutex_create(&tag_callback_call_mutex);
+    if (rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to create tag callback call mutex!");
+        return rc;
+    }
+
+    rc = cond_create(&tag_callback_wait);
+    if (rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to create tag callback wake up condition!");
+        return rc;
+    }
+
+    pdebug(DEBUG_INFO,"Creating tag callback thread.");
+    rc = thread_create(&tag_callback_thread, tag_callback_func, 32*1024, NULL);
+    if (rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to create tag callback thread!");
     }
 
     pdebug(DEBUG_INFO,"Done.");
@@ -116,14 +201,49 @@ void lib_teardown(void)
 
     pdebug(DEBUG_INFO,"Tearing down tag tickler thread.");
     library_terminating = 1;
+    plc_tag_tickler_wake();
     thread_join(tag_tickler_thread);
     thread_destroy(&tag_tickler_thread);
 
-    pdebug(DEBUG_INFO,"Tearing down tag lookup mutex.");
-    mutex_destroy(&tag_lookup_mutex);
+    pdebug(DEBUG_INFO,"Tearing down tag tickler wake up condition.");
+    cond_destroy(&tag_tickler_wait);
 
-    pdebug(DEBUG_INFO, "Destroying tag hashtable.");
-    hashtable_destroy(tags);
+    pdebug(DEBUG_INFO,"Tearing down tag tickler active list.");
+    if(tag_active_list) {
+        while(vector_length(tag_active_list) > 0) {
+            rc_dec(vector_remove(tag_active_list, 0));
+        }
+
+        vector_destroy(tag_active_list);
+        tag_active_list = NULL;
+    }
+
+    mutex_destroy(&tag_active_mutex);
+
+    pdebug(DEBUG_INFO,"Tearing down tag callback thread.");
+    if(tag_callback_thread) {
+        cond_signal(tag_callback_wait);
+        thread_join(tag_callback_thread);
+        thread_destroy(&tag_callback_thread);
+    }
+
+    pdebug(DEBUG_INFO,"Tearing down tag callback event queue.");
+    if(tag_callback_events) {
+        while(vector_length(tag_callback_events) > 0) {
+            mem_free(vector_remove(tag_callback_events, 0));
+        }
+
+        vector_destroy(tag_callback_events);
+        tag_callback_events = NULL;
+    }
+
+    mutex_destroy(&tag_callback_mutex);
+    mutex_destroy(&tag_callback_call_mutex);
+    cond_destroy(&tag_callback_wait);
+
+    pdebug(DEBUG_INFO, "Destroying tag handle table.");
+    handle_table_destroy(tags);
+    tags = NULL;
 
 //    pdebug(DEBUG_INFO,"Destroying global library mutex.");
 //    if(global_library_mutex) {
@@ -145,48 +265,76 @@ THREAD_FUNC(tag_tickler_func)
     pdebug(DEBUG_INFO,"Starting.");
 
     while(!library_terminating) {
-        int max_index;
+        int64_t now = time_ms();
+        int64_t next_wake = now + TAG_TICKLER_MAX_WAIT_MS;
 
-        critical_block(tag_lookup_mutex) {
-            max_index = hashtable_capacity(tags);
-        }
-
-        for(int i=0; i < max_index; i++) {
+        /*
+         * Only tags with an operation outstanding or that are polled are
+         * in the active list.  Idle tags cost nothing here.
+         *
+         * Only this thread and plc_tag_destroy() remove tags from the list.
+         */
+        for(int i=0; !library_terminating; i++) {
             plc_tag_p tag = NULL;
+            int removed = 0;
 
-            critical_block(tag_lookup_mutex) {
-                /* look up the max index again. it may have changed. */
-                max_index = hashtable_capacity(tags);
-
-                if(i < max_index) {
-                    tag = hashtable_get_index(tags, i);
-
-                    if(tag) {
-                        debug_set_tag_id(tag->tag_id);
-                        tag = rc_inc(tag);
-                    }
-                } else {
-                    debug_set_tag_id(0);
-                    tag = NULL;
+            critical_block(tag_active_mutex) {
+                if(i < vector_length(tag_active_list)) {
+                    /* the list holds a reference so this cannot fail. */
+                    tag = rc_inc(vector_get(tag_active_list, i));
                 }
             }
 
-            if(tag && tag->vtable->tickler) {
-                if(mutex_try_lock(tag->api_mutex) == PLCTAG_STATUS_OK) {
-                    tag->vtable->tickler(tag);
+            if(!tag) {
+                break;
+            }
+
+            debug_set_tag_id(tag->tag_id);
+
+            if(mutex_try_lock(tag->api_mutex) == PLCTAG_STATUS_OK) {
+                int rc = tag_tick(tag);
+
+                if(tag->poll_ms > 0) {
+                    tag_poll(tag, rc, now);
+                }
 
-                    mutex_unlock(tag->api_mutex);
+                /* done with this tag?  We must hold the API mutex to decide. */
+                if(tag->pending_op == TAG_OP_NONE && tag->poll_ms <= 0) {
+                    removed = tag_deactivate(tag);
                 }
+
+                mutex_unlock(tag->api_mutex);
             }
 
-            if(tag) {
-                debug_set_tag_id(0);
+            if(tag->poll_ms > 0 && tag->next_poll < next_wake) {
+                next_wake = tag->next_poll;
+            }
+
+            debug_set_tag_id(0);
+
+            if(removed) {
+                /* the last tag moved into this slot, look at it again. */
+                i--;
                 rc_dec(tag);
             }
+
+            rc_dec(tag);
         }
 
+        /*
+         * Sleep until something completes.  The protocol layers ring
+         * the doorbell via plc_tag_tickler_wake() when a response comes
+         * in, so the timeout is only a backstop.
+         */
         if(!library_terminating) {
-            sleep_ms(1);
+            int64_t wait_ms = next_wake - time_ms();
+
+            /* a tag that is due but busy should not make us spin. */
+            if(wait_ms < 1) {
+                wait_ms = 1;
+            }
+
+            cond_wait(tag_tickler_wait, (int)wait_ms);
         }
     }
 
@@ -199,203 +347,624 @@ THREAD_FUNC(tag_tickler_func)
 
 
 
-/**************************************************************************
- ***************************  API Functions  ******************************
- **************************************************************************/
-
 
 /*
- * plc_tag_decode_error()
+ * plc_tag_tickler_wake
  *
- * This takes an integer error value and turns it into a printable string.
- *
- * FIXME - this should produce better errors than this!
+ * Wake up the tag tickler thread.  This is called by the protocol
+ * layers when a request completes so that the tag state is updated
+ * right away instead of on the next polling interval.
  */
 
+void plc_tag_tickler_wake(void)
+{
+    if(tag_tickler_wait) {
+        cond_signal(tag_tickler_wait);
+    }
+}
+
 
 
-LIB_EXPORT const char *plc_tag_decode_error(int rc)
+
+/*
+ * plc_tag_wake
+ *
+ * Called by the protocol layers when a request for the tag with the
+ * passed ID completes.  This wakes up any API call blocked waiting on
+ * the tag and the tag tickler thread.
+ *
+ * We hold a reference to the tag while signaling so the condition
+ * cannot go away underneath us.
+ */
+
+void plc_tag_wake(int tag_id)
 {
-    switch(rc) {
-    case PLCTAG_STATUS_PENDING:
-        return "PLCTAG_STATUS_PENDING";
-    case PLCTAG_STATUS_OK:
-        return "PLCTAG_STATUS_OK";
-    case PLCTAG_ERR_ABORT:
-        return "PLCTAG_ERR_ABORT";
-    case PLCTAG_ERR_BAD_CONFIG:
-        return "PLCTAG_ERR_BAD_CONFIG";
-    case PLCTAG_ERR_BAD_CONNECTION:
-        return "PLCTAG_ERR_BAD_CONNECTION";
-    case PLCTAG_ERR_BAD_DATA:
-        return "PLCTAG_ERR_BAD_DATA";
-    case PLCTAG_ERR_BAD_DEVICE:
-        return "PLCTAG_ERR_BAD_DEVICE";
-    case PLCTAG_ERR_BAD_GATEWAY:
-        return "PLCTAG_ERR_BAD_GATEWAY";
-    case PLCTAG_ERR_BAD_PARAM:
-        return "PLCTAG_ERR_BAD_PARAM";
-    case PLCTAG_ERR_BAD_REPLY:
-        return "PLCTAG_ERR_BAD_REPLY";
-    case PLCTAG_ERR_BAD_STATUS:
-        return "PLCTAG_ERR_BAD_STATUS";
-    case PLCTAG_ERR_CLOSE:
-        return "PLCTAG_ERR_CLOSE";
-    case PLCTAG_ERR_CREATE:
-        return "PLCTAG_ERR_CREATE";
-    case PLCTAG_ERR_DUPLICATE:
-        return "PLCTAG_ERR_DUPLICATE";
-    case PLCTAG_ERR_ENCODE:
-        return "PLCTAG_ERR_ENCODE";
-    case PLCTAG_ERR_MUTEX_DESTROY:
-        return "PLCTAG_ERR_MUTEX_DESTROY";
-    case PLCTAG_ERR_MUTEX_INIT:
-        return "PLCTAG_ERR_MUTEX_INIT";
-    case PLCTAG_ERR_MUTEX_LOCK:
-        return "PLCTAG_ERR_MUTEX_LOCK";
-    case PLCTAG_ERR_MUTEX_UNLOCK:
-        return "PLCTAG_ERR_MUTEX_UNLOCK";
-    case PLCTAG_ERR_NOT_ALLOWED:
-        return "PLCTAG_ERR_NOT_ALLOWED";
-    case PLCTAG_ERR_NOT_FOUND:
-        return "PLCTAG_ERR_NOT_FOUND";
-    case PLCTAG_ERR_NOT_IMPLEMENTED:
-        return "PLCTAG_ERR_NOT_IMPLEMENTED";
-    case PLCTAG_ERR_NO_DATA:
-        return "PLCTAG_ERR_NO_DATA";
-    case PLCTAG_ERR_NO_MATCH:
-        return "PLCTAG_ERR_NO_MATCH";
-    case PLCTAG_ERR_NO_MEM:
-        return "PLCTAG_ERR_NO_MEM";
-    case PLCTAG_ERR_NO_RESOURCES:
-        return "PLCTAG_ERR_NO_RESOURCES";
-    case PLCTAG_ERR_NULL_PTR:
-        return "PLCTAG_ERR_NULL_PTR";
-    case PLCTAG_ERR_OPEN:
-        return "PLCTAG_ERR_OPEN";
-    case PLCTAG_ERR_OUT_OF_BOUNDS:
-        return "PLCTAG_ERR_OUT_OF_BOUNDS";
-    case PLCTAG_ERR_READ:
-        return "PLCTAG_ERR_READ";
-    case PLCTAG_ERR_REMOTE_ERR:
-        return "PLCTAG_ERR_REMOTE_ERR";
-    case PLCTAG_ERR_THREAD_CREATE:
-        return "PLCTAG_ERR_THREAD_CREATE";
-    case PLCTAG_ERR_THREAD_JOIN:
-        return "PLCTAG_ERR_THREAD_JOIN";
-    case PLCTAG_ERR_TIMEOUT:
-        return "PLCTAG_ERR_TIMEOUT";
-    case PLCTAG_ERR_TOO_LARGE:
-        return "PLCTAG_ERR_TOO_LARGE";
-    case PLCTAG_ERR_TOO_SMALL:
-        return "PLCTAG_ERR_TOO_SMALL";
-    case PLCTAG_ERR_UNSUPPORTED:
-        return "PLCTAG_ERR_UNSUPPORTED";
-    case PLCTAG_ERR_WINSOCK:
-        return "PLCTAG_ERR_WINSOCK";
-    case PLCTAG_ERR_WRITE:
-        return "PLCTAG_ERR_WRITE";
-    case PLCTAG_ERR_PARTIAL:
-        return "PLCTAG_ERR_PARTIAL";
+    plc_tag_p tag = handle_table_get(tags, tag_id);
 
-    default:
-        return "Unknown error.";
-        break;
+    if(tag) {
+        if(tag->tag_cond_wait) {
+            cond_signal(tag->tag_cond_wait);
+        }
+
+        rc_dec(tag);
     }
 
-    return "Unknown error.";
+    plc_tag_tickler_wake();
 }
 
 
 
+
 /*
- * plc_tag_create()
+ * tag_callback_func
  *
- * Just pass through to the plc_tag_create_sync() function.
+ * Deliver queued tag events to the application callbacks.  This runs in
+ * its own thread so that a slow callback does not hold up the tickler
+ * thread or the API caller that noticed the completion.
  *
- * This is where the dispatch occurs to the protocol specific implementation.
+ * Events for tags that have been destroyed since the event was queued
+ * are dropped.  The call mutex is held from taking an event off the queue
+ * until its callback returns, see tag_drop_events().
  */
 
-LIB_EXPORT int32_t plc_tag_create(const char *attrib_str, int timeout)
+THREAD_FUNC(tag_callback_func)
 {
-    plc_tag_p tag = PLC_TAG_P_NULL;
-    int id = PLCTAG_ERR_OUT_OF_BOUNDS;
-    attr attribs = NULL;
-    int rc = PLCTAG_STATUS_OK;
-    int read_cache_ms = 0;
-    tag_create_function tag_constructor;
+    (void)arg;
 
-    pdebug(DEBUG_INFO,"Starting");
+    debug_set_tag_id(0);
 
-    if((rc = initialize_modules()) != PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_ERROR,"Unable to initialize the internal library state!");
-        return rc;
-    }
+    in_tag_callback_thread = 1;
 
-    if(!attrib_str || str_length(attrib_str) == 0) {
-        pdebug(DEBUG_WARN,"Tag attribute string is null or zero length!");
-        return PLCTAG_ERR_TOO_SMALL;
-    }
+    pdebug(DEBUG_INFO,"Starting.");
 
-    attribs = attr_create_from_str(attrib_str);
-    if(!attribs) {
-        pdebug(DEBUG_WARN,"Unable to parse attribute string!");
-        return PLCTAG_ERR_BAD_DATA;
-    }
+    while(!library_terminating) {
+        tag_event_p event = NULL;
 
-    /* set debug level */
-    set_debug_level(attr_get_int(attribs, "debug", DEBUG_NONE));
+        do {
+            event = NULL;
 
-    /*
-     * create the tag, this is protocol specific.
-     *
-     * If this routine wants to keep the attributes around, it needs
-     * to clone them.
-     */
-    tag_constructor = find_tag_create_func(attribs);
+            critical_block(tag_callback_call_mutex) {
+                critical_block(tag_callback_mutex) {
+                    if(vector_length(tag_callback_events) > 0) {
+                        event = vector_remove(tag_callback_events, 0);
+                    }
+                }
 
-    if(!tag_constructor) {
-        pdebug(DEBUG_WARN,"Tag creation failed, no tag constructor found for tag type!");
-        attr_destroy(attribs);
-        return PLCTAG_ERR_BAD_PARAM;
-    }
+                if(event && tag_is_mapped(event->tag_id)) {
+                    pdebug(DEBUG_DETAIL, "Calling callback for tag %d with event %d and status %s.", event->tag_id, event->event, plc_tag_decode_error(event->status));
+                    event->callback(event->tag_id, event->event, event->status, event->userdata);
+                }
+            }
 
-    tag = tag_constructor(attribs);
+            if(!event) {
+                break;
+            }
 
-    /*
-     * FIXME - this really should be here???  Maybe not?  But, this is
-     * the only place it can be without making every protocol type do this automatically.
-     */
-    if(!tag) {
-        pdebug(DEBUG_WARN, "Tag creation failed, skipping mutex creation and other generic setup.");
-        attr_destroy(attribs);
-        return PLCTAG_ERR_CREATE;
-    }
+            mem_free(event);
+        } while(!library_terminating);
 
-    rc = mutex_create(&(tag->ext_mutex));
-    if(rc != PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_WARN,"Unable to create tag external mutex!");
-        rc_dec(tag);
-        return PLCTAG_ERR_CREATE;
+        if(!library_terminating) {
+            cond_wait(tag_callback_wait, TAG_CALLBACK_MAX_WAIT_MS);
+        }
     }
 
-    rc = mutex_create(&(tag->api_mutex));
-    if(rc != PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_WARN,"Unable to create tag API mutex!");
-        rc_dec(tag);
-        return PLCTAG_ERR_CREATE;
-    }
+    pdebug(DEBUG_INFO,"Terminating.");
 
-    /* set up the read cache config. */
-    read_cache_ms = attr_get_int(attribs,"read_cache_ms",0);
-    if(read_cache_ms < 0) {
-        pdebug(DEBUG_WARN, "read_cache_ms value must be positive, using zero.");
+    THREAD_RETURN(0);
+}
+
+
+
+
+/*
+ * tag_drop_events
+ *
+ * Throw away the queued events of a tag whose callback was replaced or
+ * that was destroyed, and wait for a callback of it that is running now
+ * to return.  After this the old callback and userdata are not used
+ * again.  From within a callback only the queued events are dropped,
+ * the running callback is the caller.
+ *
+ * Must not be called with the tag API mutex held.
+ */
+
+void tag_drop_events(int32_t tag_id)
+{
+    int dropped = 0;
+
+    if(!in_tag_callback_thread) {
+        mutex_lock(tag_callback_call_mutex);
+    }
+
+    critical_block(tag_callback_mutex) {
+        for(int i=0; i < vector_length(tag_callback_events); i++) {
+            tag_event_p event = vector_get(tag_callback_events, i);
+
+            if(event->tag_id == tag_id) {
+                vector_remove(tag_callback_events, i);
+                mem_free(event);
+                dropped++;
+                i--;
+            }
+        }
+    }
+
+    if(!in_tag_callback_thread) {
+        mutex_unlock(tag_callback_call_mutex);
+    }
+
+    if(dropped) {
+        pdebug(DEBUG_DETAIL, "Dropped %d queued events for tag %d.", dropped, tag_id);
+    }
+}
+
+
+
+
+/*
+ * tag_raise_event
+ *
+ * Queue an event for delivery to the tag's callback, if it has one.
+ *
+ * Must be called with the tag API mutex held.
+ */
+
+void tag_raise_event(plc_tag_p tag, int event, int status)
+{
+    tag_event_p ev = NULL;
+    int rc = PLCTAG_STATUS_OK;
+
+    if(!tag->callback) {
+        return;
+    }
+
+    ev = mem_alloc((int)sizeof(struct tag_event_t));
+    if(!ev) {
+        pdebug(DEBUG_ERROR, "Unable to allocate tag event, dropping it!");
+        return;
+    }
+
+    ev->tag_id = tag->tag_id;
+    ev->event = event;
+    ev->status = status;
+    ev->callback = tag->callback;
+    ev->userdata = tag->userdata;
+
+    critical_block(tag_callback_mutex) {
+        rc = vector_put(tag_callback_events, vector_length(tag_callback_events), ev);
+    }
+
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to queue tag event, dropping it!");
+        mem_free(ev);
+        return;
+    }
+
+    cond_signal(tag_callback_wait);
+}
+
+
+
+
+/*
+ * tag_op_started
+ *
+ * Note the start of a read or write on the tag.  The passed status is
+ * what the protocol layer returned when the operation was started.  If
+ * the operation is already done, the completion event is raised now.
+ *
+ * Must be called with the tag API mutex held.
+ */
+
+void tag_op_started(plc_tag_p tag, int op, int rc)
+{
+    tag->pending_op = op;
+
+    if(rc == PLCTAG_STATUS_PENDING) {
+        tag_activate(tag);
+    } else {
+        int op_event = (op == TAG_OP_READ ? PLCTAG_EVENT_READ_COMPLETED : PLCTAG_EVENT_WRITE_COMPLETED);
+
+        tag->pending_op = TAG_OP_NONE;
+
+        tag_raise_event(tag, (rc == PLCTAG_STATUS_OK ? op_event : PLCTAG_EVENT_ERROR), rc);
+    }
+}
+
+
+
+
+/*
+ * tag_activate
+ *
+ * Put the tag on the tickler's active list if it is not already there.
+ * The list holds a reference to the tag.
+ *
+ * Must be called with the tag API mutex held.
+ */
+
+void tag_activate(plc_tag_p tag)
+{
+    critical_block(tag_active_mutex) {
+        if(!tag->tickler_active) {
+            plc_tag_p ref = rc_inc(tag);
+
+            int index = vector_length(tag_active_list);
+
+            if(ref && vector_put(tag_active_list, index, ref) == PLCTAG_STATUS_OK) {
+                tag->tickler_active = 1;
+                tag->tickler_index = index;
+            } else if(ref) {
+                pdebug(DEBUG_ERROR, "Unable to add tag to the tickler active list!");
+                rc_dec(ref);
+            }
+        }
+    }
+}
+
+
+
+
+/*
+ * tag_deactivate
+ *
+ * Take the tag off the tickler's active list.  The last tag in the list
+ * takes its slot, so nothing is searched or shifted.  Returns true if it
+ * was on the list, in which case the caller must release the list's
+ * reference to the tag.
+ */
+
+int tag_deactivate(plc_tag_p tag)
+{
+    int removed = 0;
+
+    critical_block(tag_active_mutex) {
+        if(tag->tickler_active) {
+            int last_index = vector_length(tag_active_list) - 1;
+            plc_tag_p last = vector_remove(tag_active_list, last_index);
+
+            if(last != tag) {
+                vector_put(tag_active_list, tag->tickler_index, last);
+                last->tickler_index = tag->tickler_index;
+            }
+
+            tag->tickler_active = 0;
+            removed = 1;
+        }
+    }
+
+    return removed;
+}
+
+
+
+
+/*
+ * tag_op_aborted
+ *
+ * Raise the abort event if an operation was outstanding on the tag.
+ *
+ * Must be called with the tag API mutex held.
+ */
+
+void tag_op_aborted(plc_tag_p tag)
+{
+    if(tag->pending_op != TAG_OP_NONE) {
+        tag->pending_op = TAG_OP_NONE;
+
+        tag_raise_event(tag, PLCTAG_EVENT_ABORTED, PLCTAG_ERR_ABORT);
+    }
+}
+
+
+
+
+/*
+ * tag_tick
+ *
+ * Give the protocol layer some time to process the tag and return the
+ * tag status.  If this finishes the outstanding operation, raise the
+ * completion event.
+ *
+ * The session calls plc_tag_wake() when a response comes in, which
+ * wakes up the tickler thread or the blocked API call which then calls
+ * this.  So events are driven from the response path.
+ *
+ * Must be called with the tag API mutex held.
+ */
+
+int tag_tick(plc_tag_p tag)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    if(tag->vtable->tickler) {
+        tag->vtable->tickler(tag);
+    }
+
+    rc = tag->vtable->status(tag);
+
+    if(tag->pending_op != TAG_OP_NONE && rc != PLCTAG_STATUS_PENDING) {
+        tag_op_started(tag, tag->pending_op, rc);
+    }
+
+    return rc;
+}
+
+
+
+/*
+ * tag_next_poll_time
+ *
+ * Poll times are aligned to multiples of the poll period.  All tags with
+ * the same period come due at the same time and are started in the
+ * same pass of the tickler.  Their requests are queued together so the
+ * session can pack them.
+ */
+
+int64_t tag_next_poll_time(plc_tag_p tag, int64_t now)
+{
+    return ((now / tag->poll_ms) + 1) * tag->poll_ms;
+}
+
+
+
+
+/*
+ * tag_poll
+ *
+ * Start a read on a polled tag if it is due.  If the previous
+ * operation is still running we skip this period rather than queue up
+ * reads behind it.  The data ends up in the tag buffer and the
+ * tag callback is called as for any other read.
+ *
+ * Must be called with the tag API mutex held.
+ */
+
+void tag_poll(plc_tag_p tag, int status, int64_t now)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    if(tag->next_poll > now) {
+        return;
+    }
+
+    tag->next_poll = tag_next_poll_time(tag, now);
+
+    if(status == PLCTAG_STATUS_PENDING) {
+        pdebug(DEBUG_DETAIL, "Tag is busy, skipping this poll.");
+        return;
+    }
+
+    pdebug(DEBUG_DETAIL, "Starting poll read.");
+
+    rc = tag->vtable->read(tag);
+
+    tag_op_started(tag, TAG_OP_READ, rc);
+
+    if(rc == PLCTAG_STATUS_PENDING || rc == PLCTAG_STATUS_OK) {
+        tag->read_cache_expire = now + tag->read_cache_ms;
+    } else {
+        pdebug(DEBUG_WARN, "Unable to start poll read, got %s!", plc_tag_decode_error(rc));
+    }
+}
+
+
+
+/**************************************************************************
+ ***************************  API Functions  ******************************
+ **************************************************************************/
+
+
+/*
+ * plc_tag_decode_error()
+ *
+ * This takes an integer error value and turns it into a printable string.
+ *
+ * FIXME - this should produce better errors than this!
+ */
+
+
+
+LIB_EXPORT const char *plc_tag_decode_error(int rc)
+{
+    switch(rc) {
+    case PLCTAG_STATUS_PENDING:
+        return "PLCTAG_STATUS_PENDING";
+    case PLCTAG_STATUS_OK:
+        return "PLCTAG_STATUS_OK";
+    case PLCTAG_ERR_ABORT:
+        return "PLCTAG_ERR_ABORT";
+    case PLCTAG_ERR_BAD_CONFIG:
+        return "PLCTAG_ERR_BAD_CONFIG";
+    case PLCTAG_ERR_BAD_CONNECTION:
+        return "PLCTAG_ERR_BAD_CONNECTION";
+    case PLCTAG_ERR_BAD_DATA:
+        return "PLCTAG_ERR_BAD_DATA";
+    case PLCTAG_ERR_BAD_DEVICE:
+        return "PLCTAG_ERR_BAD_DEVICE";
+    case PLCTAG_ERR_BAD_GATEWAY:
+        return "PLCTAG_ERR_BAD_GATEWAY";
+    case PLCTAG_ERR_BAD_PARAM:
+        return "PLCTAG_ERR_BAD_PARAM";
+    case PLCTAG_ERR_BAD_REPLY:
+        return "PLCTAG_ERR_BAD_REPLY";
+    case PLCTAG_ERR_BAD_STATUS:
+        return "PLCTAG_ERR_BAD_STATUS";
+    case PLCTAG_ERR_CLOSE:
+        return "PLCTAG_ERR_CLOSE";
+    case PLCTAG_ERR_CREATE:
+        return "PLCTAG_ERR_CREATE";
+    case PLCTAG_ERR_DUPLICATE:
+        return "PLCTAG_ERR_DUPLICATE";
+    case PLCTAG_ERR_ENCODE:
+        return "PLCTAG_ERR_ENCODE";
+    case PLCTAG_ERR_MUTEX_DESTROY:
+        return "PLCTAG_ERR_MUTEX_DESTROY";
+    case PLCTAG_ERR_MUTEX_INIT:
+        return "PLCTAG_ERR_MUTEX_INIT";
+    case PLCTAG_ERR_MUTEX_LOCK:
+        return "PLCTAG_ERR_MUTEX_LOCK";
+    case PLCTAG_ERR_MUTEX_UNLOCK:
+        return "PLCTAG_ERR_MUTEX_UNLOCK";
+    case PLCTAG_ERR_NOT_ALLOWED:
+        return "PLCTAG_ERR_NOT_ALLOWED";
+    case PLCTAG_ERR_NOT_FOUND:
+        return "PLCTAG_ERR_NOT_FOUND";
+    case PLCTAG_ERR_NOT_IMPLEMENTED:
+        return "PLCTAG_ERR_NOT_IMPLEMENTED";
+    case PLCTAG_ERR_NO_DATA:
+        return "PLCTAG_ERR_NO_DATA";
+    case PLCTAG_ERR_NO_MATCH:
+        return "PLCTAG_ERR_NO_MATCH";
+    case PLCTAG_ERR_NO_MEM:
+        return "PLCTAG_ERR_NO_MEM";
+    case PLCTAG_ERR_NO_RESOURCES:
+        return "PLCTAG_ERR_NO_RESOURCES";
+    case PLCTAG_ERR_NULL_PTR:
+        return "PLCTAG_ERR_NULL_PTR";
+    case PLCTAG_ERR_OPEN:
+        return "PLCTAG_ERR_OPEN";
+    case PLCTAG_ERR_OUT_OF_BOUNDS:
+        return "PLCTAG_ERR_OUT_OF_BOUNDS";
+    case PLCTAG_ERR_READ:
+        return "PLCTAG_ERR_READ";
+    case PLCTAG_ERR_REMOTE_ERR:
+        return "PLCTAG_ERR_REMOTE_ERR";
+    case PLCTAG_ERR_THREAD_CREATE:
+        return "PLCTAG_ERR_THREAD_CREATE";
+    case PLCTAG_ERR_THREAD_JOIN:
+        return "PLCTAG_ERR_THREAD_JOIN";
+    case PLCTAG_ERR_TIMEOUT:
+        return "PLCTAG_ERR_TIMEOUT";
+    case PLCTAG_ERR_TOO_LARGE:
+        return "PLCTAG_ERR_TOO_LARGE";
+    case PLCTAG_ERR_TOO_SMALL:
+        return "PLCTAG_ERR_TOO_SMALL";
+    case PLCTAG_ERR_UNSUPPORTED:
+        return "PLCTAG_ERR_UNSUPPORTED";
+    case PLCTAG_ERR_WINSOCK:
+        return "PLCTAG_ERR_WINSOCK";
+    case PLCTAG_ERR_WRITE:
+        return "PLCTAG_ERR_WRITE";
+    case PLCTAG_ERR_PARTIAL:
+        return "PLCTAG_ERR_PARTIAL";
+
+    default:
+        return "Unknown error.";
+        break;
+    }
+
+    return "Unknown error.";
+}
+
+
+
+/*
+ * plc_tag_create()
+ *
+ * Just pass through to the plc_tag_create_sync() function.
+ *
+ * This is where the dispatch occurs to the protocol specific implementation.
+ */
+
+LIB_EXPORT int32_t plc_tag_create(const char *attrib_str, int timeout)
+{
+    plc_tag_p tag = PLC_TAG_P_NULL;
+    int id = PLCTAG_ERR_OUT_OF_BOUNDS;
+    attr attribs = NULL;
+    int rc = PLCTAG_STATUS_OK;
+    int read_cache_ms = 0;
+    int poll_ms = 0;
+    tag_create_function tag_constructor;
+
+    pdebug(DEBUG_INFO,"Starting");
+
+    if((rc = initialize_modules()) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR,"Unable to initialize the internal library state!");
+        return rc;
+    }
+
+    if(!attrib_str || str_length(attrib_str) == 0) {
+        pdebug(DEBUG_WARN,"Tag attribute string is null or zero length!");
+        return PLCTAG_ERR_TOO_SMALL;
+    }
+
+    attribs = attr_create_from_str(attrib_str);
+    if(!attribs) {
+        pdebug(DEBUG_WARN,"Unable to parse attribute string!");
+        return PLCTAG_ERR_BAD_DATA;
+    }
+
+    /* set debug level */
+    set_debug_level(attr_get_int(attribs, "debug", DEBUG_NONE));
+
+    /*
+     * create the tag, this is protocol specific.
+     *
+     * If this routine wants to keep the attributes around, it needs
+     * to clone them.
+     */
+    tag_constructor = find_tag_create_func(attribs);
+
+    if(!tag_constructor) {
+        pdebug(DEBUG_WARN,"Tag creation failed, no tag constructor found for tag type!");
+        attr_destroy(attribs);
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    tag = tag_constructor(attribs);
+
+    /*
+     * FIXME - this really should be here???  Maybe not?  But, this is
+     * the only place it can be without making every protocol type do this automatically.
+     */
+    if(!tag) {
+        pdebug(DEBUG_WARN, "Tag creation failed, skipping mutex creation and other generic setup.");
+        attr_destroy(attribs);
+        return PLCTAG_ERR_CREATE;
+    }
+
+    rc = mutex_create(&(tag->ext_mutex));
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN,"Unable to create tag external mutex!");
+        rc_dec(tag);
+        return PLCTAG_ERR_CREATE;
+    }
+
+    rc = mutex_create(&(tag->api_mutex));
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN,"Unable to create tag API mutex!");
+        rc_dec(tag);
+        return PLCTAG_ERR_CREATE;
+    }
+
+    rc = cond_create(&(tag->tag_cond_wait));
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN,"Unable to create tag wait condition!");
+        rc_dec(tag);
+        return PLCTAG_ERR_CREATE;
+    }
+
+    /* set up the read cache config. */
+    read_cache_ms = attr_get_int(attribs,"read_cache_ms",0);
+    if(read_cache_ms < 0) {
+        pdebug(DEBUG_WARN, "read_cache_ms value must be positive, using zero.");
         read_cache_ms = 0;
     }
 
     tag->read_cache_expire = (uint64_t)0;
     tag->read_cache_ms = (uint64_t)read_cache_ms;
 
+    /* set up automatic polling. */
+    poll_ms = attr_get_int(attribs, "poll_ms", 0);
+    if(poll_ms < 0) {
+        pdebug(DEBUG_WARN, "poll_ms value must be positive, disabling polling.");
+        poll_ms = 0;
+    }
+
+    tag->poll_ms = poll_ms;
+    tag->next_poll = (poll_ms > 0 ? tag_next_poll_time(tag, time_ms()) : 0);
+
     /*
      * Release memory for attributes
      *
@@ -433,6 +1002,10 @@ LIB_EXPORT int32_t plc_tag_create(const char *attrib_str, int timeout)
                 break;
             }
 
+            /*
+             * the tag is not mapped yet so nothing can find it to signal
+             * completion.  Poll.
+             */
             sleep_ms(1); /* MAGIC */
         }
 
@@ -471,6 +1044,15 @@ LIB_EXPORT int32_t plc_tag_create(const char *attrib_str, int timeout)
     /* save this for later. */
     tag->tag_id = id;
 
+    /* start polling now that the tickler can find the tag. */
+    if(tag->poll_ms > 0) {
+        critical_block(tag->api_mutex) {
+            tag_activate(tag);
+        }
+
+        plc_tag_tickler_wake();
+    }
+
     debug_set_tag_id(id);
 
     pdebug(DEBUG_INFO, "Returning mapped tag ID %d", id);
@@ -500,20 +1082,262 @@ LIB_EXPORT int plc_tag_lock(int32_t id)
     int rc = PLCTAG_STATUS_OK;
     plc_tag_p tag = lookup_tag(id);
 
-    pdebug(DEBUG_INFO, "Starting.");
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    critical_block(tag->api_mutex) {
+        rc = mutex_lock(tag->ext_mutex);
+    }
+
+    rc_dec(tag);
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return rc;
+}
+
+
+
+
+/*
+ * plc_tag_unlock
+ *
+ * The opposite action of plc_tag_unlock.  This allows other threads to access the
+ * tag.
+ */
+
+LIB_EXPORT int plc_tag_unlock(int32_t id)
+{
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = lookup_tag(id);
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    critical_block(tag->api_mutex) {
+        rc = mutex_unlock(tag->ext_mutex);
+    }
+
+    rc_dec(tag);
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return rc;
+}
+
+
+
+
+/*
+ * plc_tag_abort()
+ *
+ * This function calls through the vtable in the passed tag to call
+ * the protocol-specific implementation.
+ *
+ * The implementation must do whatever is necessary to abort any
+ * ongoing IO.
+ *
+ * The status of the operation is returned.
+ */
+
+int plc_tag_abort(int32_t id)
+{
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = lookup_tag(id);
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    critical_block(tag->api_mutex) {
+        /* who knows what state the tag data is in.  */
+        tag->read_cache_expire = (uint64_t)0;
+
+        if(!tag->vtable || !tag->vtable->abort) {
+            pdebug(DEBUG_WARN,"Tag does not have a abort function!");
+            rc = PLCTAG_ERR_NOT_IMPLEMENTED;
+        }
+
+        /* this may be synchronous. */
+        rc = tag->vtable->abort(tag);
+
+        tag_op_aborted(tag);
+    }
+
+    rc_dec(tag);
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return rc;
+}
+
+
+
+
+/*
+ * plc_tag_destroy()
+ *
+ * Remove all implementation specific details about a tag and clear its
+ * memory.
+ */
+
+
+LIB_EXPORT int plc_tag_destroy(int32_t tag_id)
+{
+    plc_tag_p tag = NULL;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(tag_id <= 0 || tag_id > HANDLE_TABLE_MAX_HANDLE) {
+        pdebug(DEBUG_WARN, "Called with zero or invalid tag!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    tag = handle_table_remove(tags, tag_id);
+
+    if(!tag) {
+        pdebug(DEBUG_WARN, "Called with non-existent tag!");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    /*
+     * stop polling and take the tag off the tickler's list so that the
+     * tag can be released now.  Any operation still in flight is aborted
+     * when the protocol layer destroys the tag.
+     */
+    critical_block(tag->api_mutex) {
+        tag->poll_ms = 0;
+    }
+
+    if(tag_deactivate(tag)) {
+        rc_dec(tag);
+    }
+
+    /* events still queued would call back for a tag that is gone. */
+    tag_drop_events(tag_id);
+
+    /* release the reference outside the mutex. */
+    rc_dec(tag);
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    debug_set_tag_id(0);
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+
+
+/*
+ * plc_tag_read()
+ *
+ * This function calls through the vtable in the passed tag to call
+ * the protocol-specific implementation.  That starts the read operation.
+ * If there is a timeout passed, then this routine waits for either
+ * a timeout or an error.
+ *
+ * The status of the operation is returned.
+ */
+
+LIB_EXPORT int plc_tag_read(int32_t id, int timeout)
+{
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = lookup_tag(id);
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    critical_block(tag->api_mutex) {
+        /* check read cache, if not expired, return existing data. */
+        if(tag->read_cache_expire > time_ms()) {
+            pdebug(DEBUG_INFO, "Returning cached data.");
+            rc = PLCTAG_STATUS_OK;
+            tag_op_started(tag, TAG_OP_READ, rc);
+            break;
+        }
+
+        /* the protocol implementation does not do the timeout. */
+        rc = tag->vtable->read(tag);
+
+        tag_op_started(tag, TAG_OP_READ, rc);
+
+        /* if error, return now */
+        if(rc != PLCTAG_STATUS_PENDING && rc != PLCTAG_STATUS_OK) {
+            break;
+        }
+
+        /* set up the cache time.  This works when read_cache_ms is zero as it is already expired. */
+        tag->read_cache_expire = time_ms() + tag->read_cache_ms;
+
+        /*
+         * if there is a timeout, then loop until we get
+         * an error or we timeout.
+         */
+        if(timeout) {
+            int64_t timeout_time = timeout + time_ms();
+            int64_t start_time = time_ms();
+
+            while(rc == PLCTAG_STATUS_PENDING && timeout_time > time_ms()) {
+                /* give some time to the tickler function. */
+                rc = tag_tick(tag);
+
+                /*
+                 * terminate early and do not wait again if the
+                 * IO is done.
+                 */
+                if(rc != PLCTAG_STATUS_PENDING) {
+                    break;
+                }
+
+                /* sleep until the protocol layer signals completion or we time out. */
+                wait_for_tag(tag, timeout_time);
+            }
 
-    if(!tag) {
-        pdebug(DEBUG_WARN,"Tag not found.");
-        return PLCTAG_ERR_NOT_FOUND;
-    }
+            /*
+             * if we dropped out of the while loop but the status is
+             * still pending, then we timed out.
+             *
+             * Abort the operation and set the status to show the timeout.
+             */
+            if(rc != PLCTAG_STATUS_OK) {
+                /* abort the request. */
+                if(tag->vtable->abort) {
+                    tag->vtable->abort(tag);
+                }
 
-    critical_block(tag->api_mutex) {
-        rc = mutex_lock(tag->ext_mutex);
-    }
+                tag_op_aborted(tag);
+                
+                /* translate error if we are still pending. */
+                if(rc == PLCTAG_STATUS_PENDING) {
+                    pdebug(DEBUG_WARN, "Read operation timed out.");
+                    rc = PLCTAG_ERR_TIMEOUT;
+                }
+            }
+
+            pdebug(DEBUG_INFO,"elapsed time %ldms",(time_ms()-start_time));
+        }
+    } /* end of api mutex block */
 
     rc_dec(tag);
 
-    pdebug(DEBUG_INFO, "Done.");
+    pdebug(DEBUG_INFO, "Done");
 
     return rc;
 }
@@ -521,19 +1345,25 @@ LIB_EXPORT int plc_tag_lock(int32_t id)
 
 
 
+
+
 /*
- * plc_tag_unlock
+ * plc_tag_status
  *
- * The opposite action of plc_tag_unlock.  This allows other threads to access the
- * tag.
+ * Return the current status of the tag.  This will be PLCTAG_STATUS_PENDING if there is
+ * an uncompleted IO operation.  It will be PLCTAG_STATUS_OK if everything is fine.  Other
+ * errors will be returned as appropriate.
+ *
+ * This is a function provided by the underlying protocol implementation.
  */
 
-LIB_EXPORT int plc_tag_unlock(int32_t id)
+
+int plc_tag_status(int32_t id)
 {
     int rc = PLCTAG_STATUS_OK;
     plc_tag_p tag = lookup_tag(id);
 
-    pdebug(DEBUG_INFO, "Starting.");
+    pdebug(DEBUG_SPEW, "Starting.");
 
     if(!tag) {
         pdebug(DEBUG_WARN,"Tag not found.");
@@ -541,12 +1371,12 @@ LIB_EXPORT int plc_tag_unlock(int32_t id)
     }
 
     critical_block(tag->api_mutex) {
-        rc = mutex_unlock(tag->ext_mutex);
+        rc = tag_tick(tag);
     }
 
     rc_dec(tag);
 
-    pdebug(DEBUG_INFO, "Done.");
+    pdebug(DEBUG_SPEW, "Done with rc=%s.", plc_tag_decode_error(rc));
 
     return rc;
 }
@@ -554,21 +1384,21 @@ LIB_EXPORT int plc_tag_unlock(int32_t id)
 
 
 
+
 /*
- * plc_tag_abort()
- *
- * This function calls through the vtable in the passed tag to call
- * the protocol-specific implementation.
+ * plc_tag_register_callback
  *
- * The implementation must do whatever is necessary to abort any
- * ongoing IO.
+ * Set the function to call when an operation on the tag completes,
+ * fails or is aborted.  The callback is called from a library thread
+ * with the tag ID, the event, the status and the passed userdata.
  *
- * The status of the operation is returned.
+ * Only one callback can be registered per tag.  Passing a NULL callback
+ * removes the callback.  Events queued for the old callback are dropped
+ * and a call to it that is running now is waited for.
  */
 
-int plc_tag_abort(int32_t id)
+LIB_EXPORT int plc_tag_register_callback(int32_t id, plc_tag_callback_func callback, void *userdata)
 {
-    int rc = PLCTAG_STATUS_OK;
     plc_tag_p tag = lookup_tag(id);
 
     pdebug(DEBUG_INFO, "Starting.");
@@ -579,64 +1409,25 @@ int plc_tag_abort(int32_t id)
     }
 
     critical_block(tag->api_mutex) {
-        /* who knows what state the tag data is in.  */
-        tag->read_cache_expire = (uint64_t)0;
-
-        if(!tag->vtable || !tag->vtable->abort) {
-            pdebug(DEBUG_WARN,"Tag does not have a abort function!");
-            rc = PLCTAG_ERR_NOT_IMPLEMENTED;
-        }
-
-        /* this may be synchronous. */
-        rc = tag->vtable->abort(tag);
+        tag->callback = callback;
+        tag->userdata = (callback ? userdata : NULL);
     }
 
+    /* new events use the new callback, the old one must not be called again. */
+    tag_drop_events(id);
+
     rc_dec(tag);
 
     pdebug(DEBUG_INFO, "Done.");
 
-    return rc;
+    return PLCTAG_STATUS_OK;
 }
 
 
 
-
-/*
- * plc_tag_destroy()
- *
- * Remove all implementation specific details about a tag and clear its
- * memory.
- */
-
-
-LIB_EXPORT int plc_tag_destroy(int32_t tag_id)
+LIB_EXPORT int plc_tag_unregister_callback(int32_t id)
 {
-    plc_tag_p tag = NULL;
-
-    pdebug(DEBUG_INFO, "Starting.");
-
-    if(tag_id <= 0 || tag_id >= TAG_ID_MASK) {
-        pdebug(DEBUG_WARN, "Called with zero or invalid tag!");
-        return PLCTAG_ERR_NULL_PTR;
-    }
-
-    critical_block(tag_lookup_mutex) {
-        tag = hashtable_remove(tags, tag_id);
-    }
-
-    if(!tag) {
-        pdebug(DEBUG_WARN, "Called with non-existent tag!");
-        return PLCTAG_ERR_NOT_FOUND;
-    }
-
-    /* release the reference outside the mutex. */
-    rc_dec(tag);
-
-    pdebug(DEBUG_INFO, "Done.");
-
-    debug_set_tag_id(0);
-
-    return PLCTAG_STATUS_OK;
+    return plc_tag_register_callback(id, NULL, NULL);
 }
 
 
@@ -644,22 +1435,22 @@ LIB_EXPORT int plc_tag_destroy(int32_t tag_id)
 
 
 /*
- * plc_tag_read()
+ * plc_tag_write()
  *
  * This function calls through the vtable in the passed tag to call
- * the protocol-specific implementation.  That starts the read operation.
+ * the protocol-specific implementation.  That starts the write operation.
  * If there is a timeout passed, then this routine waits for either
  * a timeout or an error.
  *
  * The status of the operation is returned.
  */
 
-LIB_EXPORT int plc_tag_read(int32_t id, int timeout)
+LIB_EXPORT int plc_tag_write(int32_t id, int timeout)
 {
     int rc = PLCTAG_STATUS_OK;
     plc_tag_p tag = lookup_tag(id);
 
-    pdebug(DEBUG_INFO, "Starting.");
+    pdebug(DEBUG_SPEW, "Starting.");
 
     if(!tag) {
         pdebug(DEBUG_WARN,"Tag not found.");
@@ -667,39 +1458,28 @@ LIB_EXPORT int plc_tag_read(int32_t id, int timeout)
     }
 
     critical_block(tag->api_mutex) {
-        /* check read cache, if not expired, return existing data. */
-        if(tag->read_cache_expire > time_ms()) {
-            pdebug(DEBUG_INFO, "Returning cached data.");
-            rc = PLCTAG_STATUS_OK;
-            break;
-        }
-
         /* the protocol implementation does not do the timeout. */
-        rc = tag->vtable->read(tag);
+        rc = tag->vtable->write(tag);
+
+        tag_op_started(tag, TAG_OP_WRITE, rc);
 
         /* if error, return now */
         if(rc != PLCTAG_STATUS_PENDING && rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN,"Response from write command is not OK!");
             break;
         }
 
-        /* set up the cache time.  This works when read_cache_ms is zero as it is already expired. */
-        tag->read_cache_expire = time_ms() + tag->read_cache_ms;
-
         /*
          * if there is a timeout, then loop until we get
          * an error or we timeout.
          */
         if(timeout) {
-            int64_t timeout_time = timeout + time_ms();
             int64_t start_time = time_ms();
+            int64_t timeout_time = timeout + start_time;
 
             while(rc == PLCTAG_STATUS_PENDING && timeout_time > time_ms()) {
                 /* give some time to the tickler function. */
-                if(tag->vtable->tickler) {
-                    tag->vtable->tickler(tag);
-                }
-
-                rc = tag->vtable->status(tag);
+                rc = tag_tick(tag);
 
                 /*
                  * terminate early and do not wait again if the
@@ -709,7 +1489,8 @@ LIB_EXPORT int plc_tag_read(int32_t id, int timeout)
                     break;
                 }
 
-                sleep_ms(1); /* MAGIC */
+                /* sleep until the protocol layer signals completion or we time out. */
+                wait_for_tag(tag, timeout_time);
             }
 
             /*
@@ -723,21 +1504,171 @@ LIB_EXPORT int plc_tag_read(int32_t id, int timeout)
                 if(tag->vtable->abort) {
                     tag->vtable->abort(tag);
                 }
+
+                tag_op_aborted(tag);
                 
                 /* translate error if we are still pending. */
                 if(rc == PLCTAG_STATUS_PENDING) {
-                    pdebug(DEBUG_WARN, "Read operation timed out.");
+                    pdebug(DEBUG_WARN, "Write operation timed out.");
                     rc = PLCTAG_ERR_TIMEOUT;
                 }
             }
 
-            pdebug(DEBUG_INFO,"elapsed time %ldms",(time_ms()-start_time));
+            pdebug(DEBUG_INFO,"elapsed time %lldms",(time_ms()-start_time));
+        }
+    } /* end of api mutex block */
+
+    rc_dec(tag);
+
+    pdebug(DEBUG_INFO, "Done");
+
+    return rc;
+}
+
+
+
+
+
+/*
+ * plc_tag_read_many()
+ * plc_tag_write_many()
+ *
+ * Start an operation on every tag in the array, then wait once for all
+ * of them.  Queuing all the requests before waiting lets the protocol
+ * layer pack them together into as few packets as possible.
+ */
+
+LIB_EXPORT int plc_tag_read_many(int32_t *ids, int *statuses, int count, int timeout)
+{
+    return tag_op_many(ids, statuses, count, timeout, 0);
+}
+
+
+LIB_EXPORT int plc_tag_write_many(int32_t *ids, int *statuses, int count, int timeout)
+{
+    return tag_op_many(ids, statuses, count, timeout, 1);
+}
+
+
+
+
+
+/*
+ * Tag data accessors.
+ */
+
+
+
+LIB_EXPORT int plc_tag_get_size(int32_t id)
+{
+    int result = 0;
+    plc_tag_p tag = lookup_tag(id);
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    critical_block(tag->api_mutex) {
+        result = tag->size;
+    }
+
+    rc_dec(tag);
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return result;
+}
+
+
+
+
+
+
+LIB_EXPORT uint64_t plc_tag_get_uint64(int32_t id, int offset)
+{
+    uint64_t res = UINT64_MAX;
+    plc_tag_p tag = lookup_tag(id);
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return res;
+    }
+
+    critical_block(tag->api_mutex) {
+        /* is there data? */
+        if(!tag->data) {
+            pdebug(DEBUG_WARN,"Tag has no data!");
+            break;
+        }
+
+        /* is there enough data */
+        if((offset < 0) || (offset + ((int)sizeof(uint64_t)) > tag->size)) {
+            pdebug(DEBUG_WARN,"Data offset out of bounds.");
+            break;
+        }
+
+        res = ((uint64_t)(tag->data[offset])) +
+              ((uint64_t)(tag->data[offset+1]) << 8) +
+              ((uint64_t)(tag->data[offset+2]) << 16) +
+              ((uint64_t)(tag->data[offset+3]) << 24) +
+              ((uint64_t)(tag->data[offset+4]) << 32) +
+              ((uint64_t)(tag->data[offset+5]) << 40) +
+              ((uint64_t)(tag->data[offset+6]) << 48) +
+              ((uint64_t)(tag->data[offset+7]) << 56);
+
+    }
+
+    rc_dec(tag);
+
+    return res;
+}
+
+
+
+LIB_EXPORT int plc_tag_set_uint64(int32_t id, int offset, uint64_t val)
+{
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = lookup_tag(id);
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    critical_block(tag->api_mutex) {
+        /* is there data? */
+        if(!tag->data) {
+            pdebug(DEBUG_WARN,"Tag has no data!");
+            rc = PLCTAG_ERR_NO_DATA;
+            break;
         }
-    } /* end of api mutex block */
 
-    rc_dec(tag);
+        /* is there enough data */
+        if((offset < 0) || (offset + ((int)sizeof(uint64_t)) > tag->size)) {
+            pdebug(DEBUG_WARN,"Data offset out of bounds.");
+            rc = PLCTAG_ERR_OUT_OF_BOUNDS;
+            break;
+        }
 
-    pdebug(DEBUG_INFO, "Done");
+        /* write the data. */
+        tag->data[offset]   = (uint8_t)(val & 0xFF);
+        tag->data[offset+1] = (uint8_t)((val >> 8) & 0xFF);
+        tag->data[offset+2] = (uint8_t)((val >> 16) & 0xFF);
+        tag->data[offset+3] = (uint8_t)((val >> 24) & 0xFF);
+        tag->data[offset+4] = (uint8_t)((val >> 32) & 0xFF);
+        tag->data[offset+5] = (uint8_t)((val >> 40) & 0xFF);
+        tag->data[offset+6] = (uint8_t)((val >> 48) & 0xFF);
+        tag->data[offset+7] = (uint8_t)((val >> 56) & 0xFF);
+    }
+
+    rc_dec(tag);
 
     return rc;
 }
@@ -745,63 +1676,51 @@ LIB_EXPORT int plc_tag_read(int32_t id, int timeout)
 
 
 
-
-
-/*
- * plc_tag_status
- *
- * Return the current status of the tag.  This will be PLCTAG_STATUS_PENDING if there is
- * an uncompleted IO operation.  It will be PLCTAG_STATUS_OK if everything is fine.  Other
- * errors will be returned as appropriate.
- *
- * This is a function provided by the underlying protocol implementation.
- */
-
-
-int plc_tag_status(int32_t id)
+LIB_EXPORT int64_t  plc_tag_get_int64(int32_t id, int offset)
 {
-    int rc = PLCTAG_STATUS_OK;
+    int64_t res = INT64_MIN;
     plc_tag_p tag = lookup_tag(id);
 
     pdebug(DEBUG_SPEW, "Starting.");
 
     if(!tag) {
         pdebug(DEBUG_WARN,"Tag not found.");
-        return PLCTAG_ERR_NOT_FOUND;
+        return res;
     }
 
     critical_block(tag->api_mutex) {
-        if(tag && tag->vtable->tickler) {
-            tag->vtable->tickler(tag);
+        /* is there data? */
+        if(!tag->data) {
+            pdebug(DEBUG_WARN,"Tag has no data!");
+            break;
         }
 
-        rc = tag->vtable->status(tag);
+        /* is there enough data */
+        if((offset < 0) || (offset + ((int)sizeof(int64_t)) > tag->size)) {
+            pdebug(DEBUG_WARN,"Data offset out of bounds.");
+            break;
+        }
+
+        res = (int64_t)(((uint64_t)(tag->data[offset])) +
+                        ((uint64_t)(tag->data[offset+1]) << 8) +
+                        ((uint64_t)(tag->data[offset+2]) << 16) +
+                        ((uint64_t)(tag->data[offset+3]) << 24) +
+                        ((uint64_t)(tag->data[offset+4]) << 32) +
+                        ((uint64_t)(tag->data[offset+5]) << 40) +
+                        ((uint64_t)(tag->data[offset+6]) << 48) +
+                        ((uint64_t)(tag->data[offset+7]) << 56));
     }
 
     rc_dec(tag);
 
-    pdebug(DEBUG_SPEW, "Done with rc=%s.", plc_tag_decode_error(rc));
-
-    return rc;
+    return res;
 }
 
 
 
-
-
-/*
- * plc_tag_write()
- *
- * This function calls through the vtable in the passed tag to call
- * the protocol-specific implementation.  That starts the write operation.
- * If there is a timeout passed, then this routine waits for either
- * a timeout or an error.
- *
- * The status of the operation is returned.
- */
-
-LIB_EXPORT int plc_tag_write(int32_t id, int timeout)
+LIB_EXPORT int plc_tag_set_int64(int32_t id, int offset, int64_t ival)
 {
+    uint64_t val = (uint64_t)(ival);
     int rc = PLCTAG_STATUS_OK;
     plc_tag_p tag = lookup_tag(id);
 
@@ -813,85 +1732,84 @@ LIB_EXPORT int plc_tag_write(int32_t id, int timeout)
     }
 
     critical_block(tag->api_mutex) {
-        /* the protocol implementation does not do the timeout. */
-        rc = tag->vtable->write(tag);
+        /* is there data? */
+        if(!tag->data) {
+            pdebug(DEBUG_WARN,"Tag has no data!");
+            rc = PLCTAG_ERR_NO_DATA;
+            break;
+        }
 
-        /* if error, return now */
-        if(rc != PLCTAG_STATUS_PENDING && rc != PLCTAG_STATUS_OK) {
-            pdebug(DEBUG_WARN,"Response from write command is not OK!");
+        /* is there enough data */
+        if((offset < 0) || (offset + ((int)sizeof(int64_t)) > tag->size)) {
+            pdebug(DEBUG_WARN,"Data offset out of bounds.");
+            rc = PLCTAG_ERR_OUT_OF_BOUNDS;
             break;
         }
 
-        /*
-         * if there is a timeout, then loop until we get
-         * an error or we timeout.
-         */
-        if(timeout) {
-            int64_t start_time = time_ms();
-            int64_t timeout_time = timeout + start_time;
+        tag->data[offset]   = (uint8_t)(val & 0xFF);
+        tag->data[offset+1] = (uint8_t)((val >> 8) & 0xFF);
+        tag->data[offset+2] = (uint8_t)((val >> 16) & 0xFF);
+        tag->data[offset+3] = (uint8_t)((val >> 24) & 0xFF);
+        tag->data[offset+4] = (uint8_t)((val >> 32) & 0xFF);
+        tag->data[offset+5] = (uint8_t)((val >> 40) & 0xFF);
+        tag->data[offset+6] = (uint8_t)((val >> 48) & 0xFF);
+        tag->data[offset+7] = (uint8_t)((val >> 56) & 0xFF);
+    }
 
-            while(rc == PLCTAG_STATUS_PENDING && timeout_time > time_ms()) {
-                /* give some time to the tickler function. */
-                if(tag->vtable->tickler) {
-                    tag->vtable->tickler(tag);
-                }
+    rc_dec(tag);
 
-                rc = tag->vtable->status(tag);
+    return rc;
+}
 
-                /*
-                 * terminate early and do not wait again if the
-                 * IO is done.
-                 */
-                if(rc != PLCTAG_STATUS_PENDING) {
-                    break;
-                }
 
-                sleep_ms(1); /* MAGIC */
-            }
 
-            /*
-             * if we dropped out of the while loop but the status is
-             * still pending, then we timed out.
-             *
-             * Abort the operation and set the status to show the timeout.
-             */
-            if(rc != PLCTAG_STATUS_OK) {
-                /* abort the request. */
-                if(tag->vtable->abort) {
-                    tag->vtable->abort(tag);
-                }
-                
-                /* translate error if we are still pending. */
-                if(rc == PLCTAG_STATUS_PENDING) {
-                    pdebug(DEBUG_WARN, "Write operation timed out.");
-                    rc = PLCTAG_ERR_TIMEOUT;
-                }
-            }
 
-            pdebug(DEBUG_INFO,"elapsed time %lldms",(time_ms()-start_time));
-        }
-    } /* end of api mutex block */
 
-    rc_dec(tag);
 
-    pdebug(DEBUG_INFO, "Done");
 
-    return rc;
-}
 
 
+LIB_EXPORT uint32_t plc_tag_get_uint32(int32_t id, int offset)
+{
+    uint32_t res = UINT32_MAX;
+    plc_tag_p tag = lookup_tag(id);
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return res;
+    }
+
+    critical_block(tag->api_mutex) {
+        /* is there data? */
+        if(!tag->data) {
+            pdebug(DEBUG_WARN,"Tag has no data!");
+            break;
+        }
+
+        /* is there enough data */
+        if((offset < 0) || (offset + ((int)sizeof(uint32_t)) > tag->size)) {
+            pdebug(DEBUG_WARN,"Data offset out of bounds.");
+            break;
+        }
 
+        res = ((uint32_t)(tag->data[offset])) +
+              ((uint32_t)(tag->data[offset+1]) << 8) +
+              ((uint32_t)(tag->data[offset+2]) << 16) +
+              ((uint32_t)(tag->data[offset+3]) << 24);
+    }
 
+    rc_dec(tag);
 
-/*
- * Tag data accessors.
- */
+    return res;
+}
 
 
 
-LIB_EXPORT int plc_tag_get_size(int32_t id)
+LIB_EXPORT int plc_tag_set_uint32(int32_t id, int offset, uint32_t val)
 {
-    int result = 0;
+    int rc = PLCTAG_STATUS_OK;
     plc_tag_p tag = lookup_tag(id);
 
     pdebug(DEBUG_SPEW, "Starting.");
@@ -902,24 +1820,38 @@ LIB_EXPORT int plc_tag_get_size(int32_t id)
     }
 
     critical_block(tag->api_mutex) {
-        result = tag->size;
+        /* is there data? */
+        if(!tag->data) {
+            pdebug(DEBUG_WARN,"Tag has no data!");
+            rc = PLCTAG_ERR_NO_DATA;
+            break;
+        }
+
+        /* is there enough data */
+        if((offset < 0) || (offset + ((int)sizeof(uint32_t)) > tag->size)) {
+            pdebug(DEBUG_WARN,"Data offset out of bounds.");
+            rc = PLCTAG_ERR_OUT_OF_BOUNDS;
+            break;
+        }
+
+        /* write the data. */
+        tag->data[offset]   = (uint8_t)(val & 0xFF);
+        tag->data[offset+1] = (uint8_t)((val >> 8) & 0xFF);
+        tag->data[offset+2] = (uint8_t)((val >> 16) & 0xFF);
+        tag->data[offset+3] = (uint8_t)((val >> 24) & 0xFF);
     }
 
     rc_dec(tag);
 
-    pdebug(DEBUG_SPEW, "Done.");
-
-    return result;
+    return rc;
 }
 
 
 
 
-
-
-LIB_EXPORT uint64_t plc_tag_get_uint64(int32_t id, int offset)
+LIB_EXPORT int32_t  plc_tag_get_int32(int32_t id, int offset)
 {
-    uint64_t res = UINT64_MAX;
+    int32_t res = INT32_MIN;
     plc_tag_p tag = lookup_tag(id);
 
     pdebug(DEBUG_SPEW, "Starting.");
@@ -937,20 +1869,15 @@ LIB_EXPORT uint64_t plc_tag_get_uint64(int32_t id, int offset)
         }
 
         /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(uint64_t)) > tag->size)) {
+        if((offset < 0) || (offset + ((int)sizeof(int32_t)) > tag->size)) {
             pdebug(DEBUG_WARN,"Data offset out of bounds.");
             break;
         }
 
-        res = ((uint64_t)(tag->data[offset])) +
-              ((uint64_t)(tag->data[offset+1]) << 8) +
-              ((uint64_t)(tag->data[offset+2]) << 16) +
-              ((uint64_t)(tag->data[offset+3]) << 24) +
-              ((uint64_t)(tag->data[offset+4]) << 32) +
-              ((uint64_t)(tag->data[offset+5]) << 40) +
-              ((uint64_t)(tag->data[offset+6]) << 48) +
-              ((uint64_t)(tag->data[offset+7]) << 56);
-
+        res = (int32_t)(((uint32_t)(tag->data[offset])) +
+                        ((uint32_t)(tag->data[offset+1]) << 8) +
+                        ((uint32_t)(tag->data[offset+2]) << 16) +
+                        ((uint32_t)(tag->data[offset+3]) << 24));
     }
 
     rc_dec(tag);
@@ -960,8 +1887,9 @@ LIB_EXPORT uint64_t plc_tag_get_uint64(int32_t id, int offset)
 
 
 
-LIB_EXPORT int plc_tag_set_uint64(int32_t id, int offset, uint64_t val)
+LIB_EXPORT int plc_tag_set_int32(int32_t id, int offset, int32_t ival)
 {
+    uint32_t val = (uint32_t)(ival);
     int rc = PLCTAG_STATUS_OK;
     plc_tag_p tag = lookup_tag(id);
 
@@ -981,21 +1909,16 @@ LIB_EXPORT int plc_tag_set_uint64(int32_t id, int offset, uint64_t val)
         }
 
         /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(uint64_t)) > tag->size)) {
+        if((offset < 0) || (offset + ((int)sizeof(int32_t)) > tag->size)) {
             pdebug(DEBUG_WARN,"Data offset out of bounds.");
             rc = PLCTAG_ERR_OUT_OF_BOUNDS;
             break;
         }
 
-        /* write the data. */
         tag->data[offset]   = (uint8_t)(val & 0xFF);
         tag->data[offset+1] = (uint8_t)((val >> 8) & 0xFF);
         tag->data[offset+2] = (uint8_t)((val >> 16) & 0xFF);
         tag->data[offset+3] = (uint8_t)((val >> 24) & 0xFF);
-        tag->data[offset+4] = (uint8_t)((val >> 32) & 0xFF);
-        tag->data[offset+5] = (uint8_t)((val >> 40) & 0xFF);
-        tag->data[offset+6] = (uint8_t)((val >> 48) & 0xFF);
-        tag->data[offset+7] = (uint8_t)((val >> 56) & 0xFF);
     }
 
     rc_dec(tag);
@@ -1006,9 +1929,14 @@ LIB_EXPORT int plc_tag_set_uint64(int32_t id, int offset, uint64_t val)
 
 
 
-LIB_EXPORT int64_t  plc_tag_get_int64(int32_t id, int offset)
+
+
+
+
+
+LIB_EXPORT uint16_t plc_tag_get_uint16(int32_t id, int offset)
 {
-    int64_t res = INT64_MIN;
+    uint16_t res = UINT16_MAX;
     plc_tag_p tag = lookup_tag(id);
 
     pdebug(DEBUG_SPEW, "Starting.");
@@ -1026,19 +1954,13 @@ LIB_EXPORT int64_t  plc_tag_get_int64(int32_t id, int offset)
         }
 
         /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(int64_t)) > tag->size)) {
+        if((offset < 0) || (offset + ((int)sizeof(uint16_t)) > tag->size)) {
             pdebug(DEBUG_WARN,"Data offset out of bounds.");
             break;
         }
 
-        res = (int64_t)(((uint64_t)(tag->data[offset])) +
-                        ((uint64_t)(tag->data[offset+1]) << 8) +
-                        ((uint64_t)(tag->data[offset+2]) << 16) +
-                        ((uint64_t)(tag->data[offset+3]) << 24) +
-                        ((uint64_t)(tag->data[offset+4]) << 32) +
-                        ((uint64_t)(tag->data[offset+5]) << 40) +
-                        ((uint64_t)(tag->data[offset+6]) << 48) +
-                        ((uint64_t)(tag->data[offset+7]) << 56));
+        res = (uint16_t)((tag->data[offset]) +
+                         ((tag->data[offset+1]) << 8));
     }
 
     rc_dec(tag);
@@ -1048,9 +1970,9 @@ LIB_EXPORT int64_t  plc_tag_get_int64(int32_t id, int offset)
 
 
 
-LIB_EXPORT int plc_tag_set_int64(int32_t id, int offset, int64_t ival)
+
+LIB_EXPORT int plc_tag_set_uint16(int32_t id, int offset, uint16_t val)
 {
-    uint64_t val = (uint64_t)(ival);
     int rc = PLCTAG_STATUS_OK;
     plc_tag_p tag = lookup_tag(id);
 
@@ -1070,7 +1992,7 @@ LIB_EXPORT int plc_tag_set_int64(int32_t id, int offset, int64_t ival)
         }
 
         /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(int64_t)) > tag->size)) {
+        if((offset < 0) || (offset + ((int)sizeof(uint16_t)) > tag->size)) {
             pdebug(DEBUG_WARN,"Data offset out of bounds.");
             rc = PLCTAG_ERR_OUT_OF_BOUNDS;
             break;
@@ -1078,12 +2000,6 @@ LIB_EXPORT int plc_tag_set_int64(int32_t id, int offset, int64_t ival)
 
         tag->data[offset]   = (uint8_t)(val & 0xFF);
         tag->data[offset+1] = (uint8_t)((val >> 8) & 0xFF);
-        tag->data[offset+2] = (uint8_t)((val >> 16) & 0xFF);
-        tag->data[offset+3] = (uint8_t)((val >> 24) & 0xFF);
-        tag->data[offset+4] = (uint8_t)((val >> 32) & 0xFF);
-        tag->data[offset+5] = (uint8_t)((val >> 40) & 0xFF);
-        tag->data[offset+6] = (uint8_t)((val >> 48) & 0xFF);
-        tag->data[offset+7] = (uint8_t)((val >> 56) & 0xFF);
     }
 
     rc_dec(tag);
@@ -1099,9 +2015,9 @@ LIB_EXPORT int plc_tag_set_int64(int32_t id, int offset, int64_t ival)
 
 
 
-LIB_EXPORT uint32_t plc_tag_get_uint32(int32_t id, int offset)
+LIB_EXPORT int16_t  plc_tag_get_int16(int32_t id, int offset)
 {
-    uint32_t res = UINT32_MAX;
+    int16_t res = INT16_MIN;
     plc_tag_p tag = lookup_tag(id);
 
     pdebug(DEBUG_SPEW, "Starting.");
@@ -1119,15 +2035,13 @@ LIB_EXPORT uint32_t plc_tag_get_uint32(int32_t id, int offset)
         }
 
         /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(uint32_t)) > tag->size)) {
+        if((offset < 0) || (offset + ((int)sizeof(int16_t)) > tag->size)) {
             pdebug(DEBUG_WARN,"Data offset out of bounds.");
             break;
         }
 
-        res = ((uint32_t)(tag->data[offset])) +
-              ((uint32_t)(tag->data[offset+1]) << 8) +
-              ((uint32_t)(tag->data[offset+2]) << 16) +
-              ((uint32_t)(tag->data[offset+3]) << 24);
+        res = (int16_t)(((tag->data[offset])) +
+                        ((tag->data[offset+1]) << 8));
     }
 
     rc_dec(tag);
@@ -1137,8 +2051,10 @@ LIB_EXPORT uint32_t plc_tag_get_uint32(int32_t id, int offset)
 
 
 
-LIB_EXPORT int plc_tag_set_uint32(int32_t id, int offset, uint32_t val)
+
+LIB_EXPORT int plc_tag_set_int16(int32_t id, int offset, int16_t ival)
 {
+    uint16_t val = (uint16_t)(ival);
     int rc = PLCTAG_STATUS_OK;
     plc_tag_p tag = lookup_tag(id);
 
@@ -1158,17 +2074,14 @@ LIB_EXPORT int plc_tag_set_uint32(int32_t id, int offset, uint32_t val)
         }
 
         /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(uint32_t)) > tag->size)) {
+        if((offset < 0) || (offset + ((int)sizeof(int16_t)) > tag->size)) {
             pdebug(DEBUG_WARN,"Data offset out of bounds.");
             rc = PLCTAG_ERR_OUT_OF_BOUNDS;
             break;
         }
 
-        /* write the data. */
         tag->data[offset]   = (uint8_t)(val & 0xFF);
         tag->data[offset+1] = (uint8_t)((val >> 8) & 0xFF);
-        tag->data[offset+2] = (uint8_t)((val >> 16) & 0xFF);
-        tag->data[offset+3] = (uint8_t)((val >> 24) & 0xFF);
     }
 
     rc_dec(tag);
@@ -1179,9 +2092,13 @@ LIB_EXPORT int plc_tag_set_uint32(int32_t id, int offset, uint32_t val)
 
 
 
-LIB_EXPORT int32_t  plc_tag_get_int32(int32_t id, int offset)
+
+
+
+
+LIB_EXPORT uint8_t plc_tag_get_uint8(int32_t id, int offset)
 {
-    int32_t res = INT32_MIN;
+    uint8_t res = UINT8_MAX;
     plc_tag_p tag = lookup_tag(id);
 
     pdebug(DEBUG_SPEW, "Starting.");
@@ -1199,15 +2116,12 @@ LIB_EXPORT int32_t  plc_tag_get_int32(int32_t id, int offset)
         }
 
         /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(int32_t)) > tag->size)) {
+        if((offset < 0) || (offset + ((int)sizeof(uint8_t)) > tag->size)) {
             pdebug(DEBUG_WARN,"Data offset out of bounds.");
             break;
         }
 
-        res = (int32_t)(((uint32_t)(tag->data[offset])) +
-                        ((uint32_t)(tag->data[offset+1]) << 8) +
-                        ((uint32_t)(tag->data[offset+2]) << 16) +
-                        ((uint32_t)(tag->data[offset+3]) << 24));
+        res = tag->data[offset];
     }
 
     rc_dec(tag);
@@ -1217,9 +2131,9 @@ LIB_EXPORT int32_t  plc_tag_get_int32(int32_t id, int offset)
 
 
 
-LIB_EXPORT int plc_tag_set_int32(int32_t id, int offset, int32_t ival)
+
+LIB_EXPORT int plc_tag_set_uint8(int32_t id, int offset, uint8_t val)
 {
-    uint32_t val = (uint32_t)(ival);
     int rc = PLCTAG_STATUS_OK;
     plc_tag_p tag = lookup_tag(id);
 
@@ -1239,16 +2153,13 @@ LIB_EXPORT int plc_tag_set_int32(int32_t id, int offset, int32_t ival)
         }
 
         /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(int32_t)) > tag->size)) {
+        if((offset < 0) || (offset + ((int)sizeof(uint8_t)) > tag->size)) {
             pdebug(DEBUG_WARN,"Data offset out of bounds.");
             rc = PLCTAG_ERR_OUT_OF_BOUNDS;
             break;
         }
 
-        tag->data[offset]   = (uint8_t)(val & 0xFF);
-        tag->data[offset+1] = (uint8_t)((val >> 8) & 0xFF);
-        tag->data[offset+2] = (uint8_t)((val >> 16) & 0xFF);
-        tag->data[offset+3] = (uint8_t)((val >> 24) & 0xFF);
+        tag->data[offset] = val;
     }
 
     rc_dec(tag);
@@ -1260,13 +2171,9 @@ LIB_EXPORT int plc_tag_set_int32(int32_t id, int offset, int32_t ival)
 
 
 
-
-
-
-
-LIB_EXPORT uint16_t plc_tag_get_uint16(int32_t id, int offset)
+LIB_EXPORT int8_t plc_tag_get_int8(int32_t id, int offset)
 {
-    uint16_t res = UINT16_MAX;
+    int8_t res = INT8_MIN;
     plc_tag_p tag = lookup_tag(id);
 
     pdebug(DEBUG_SPEW, "Starting.");
@@ -1284,13 +2191,12 @@ LIB_EXPORT uint16_t plc_tag_get_uint16(int32_t id, int offset)
         }
 
         /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(uint16_t)) > tag->size)) {
+        if((offset < 0) || (offset + ((int)sizeof(int8_t)) > tag->size)) {
             pdebug(DEBUG_WARN,"Data offset out of bounds.");
             break;
         }
 
-        res = (uint16_t)((tag->data[offset]) +
-                         ((tag->data[offset+1]) << 8));
+        res = (int8_t)(tag->data[offset]);
     }
 
     rc_dec(tag);
@@ -1301,8 +2207,9 @@ LIB_EXPORT uint16_t plc_tag_get_uint16(int32_t id, int offset)
 
 
 
-LIB_EXPORT int plc_tag_set_uint16(int32_t id, int offset, uint16_t val)
+LIB_EXPORT int plc_tag_set_int8(int32_t id, int offset, int8_t ival)
 {
+    uint8_t val = (uint8_t)(ival);
     int rc = PLCTAG_STATUS_OK;
     plc_tag_p tag = lookup_tag(id);
 
@@ -1322,14 +2229,13 @@ LIB_EXPORT int plc_tag_set_uint16(int32_t id, int offset, uint16_t val)
         }
 
         /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(uint16_t)) > tag->size)) {
+        if((offset < 0) || (offset + ((int)sizeof(int8_t)) > tag->size)) {
             pdebug(DEBUG_WARN,"Data offset out of bounds.");
             rc = PLCTAG_ERR_OUT_OF_BOUNDS;
             break;
         }
 
-        tag->data[offset]   = (uint8_t)(val & 0xFF);
-        tag->data[offset+1] = (uint8_t)((val >> 8) & 0xFF);
+        tag->data[offset] = (uint8_t)val;
     }
 
     rc_dec(tag);
@@ -1342,12 +2248,10 @@ LIB_EXPORT int plc_tag_set_uint16(int32_t id, int offset, uint16_t val)
 
 
 
-
-
-
-LIB_EXPORT int16_t  plc_tag_get_int16(int32_t id, int offset)
+LIB_EXPORT double plc_tag_get_float64(int32_t id, int offset)
 {
-    int16_t res = INT16_MIN;
+    uint64_t ures = 0;
+    double res = DBL_MAX;
     plc_tag_p tag = lookup_tag(id);
 
     pdebug(DEBUG_SPEW, "Starting.");
@@ -1365,27 +2269,36 @@ LIB_EXPORT int16_t  plc_tag_get_int16(int32_t id, int offset)
         }
 
         /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(int16_t)) > tag->size)) {
+        if((offset < 0) || (offset + ((int)sizeof(ures)) > tag->size)) {
             pdebug(DEBUG_WARN,"Data offset out of bounds.");
             break;
         }
 
-        res = (int16_t)(((tag->data[offset])) +
-                        ((tag->data[offset+1]) << 8));
+        ures = ((uint64_t)(tag->data[offset])) +
+               ((uint64_t)(tag->data[offset+1]) << 8) +
+               ((uint64_t)(tag->data[offset+2]) << 16) +
+               ((uint64_t)(tag->data[offset+3]) << 24) +
+               ((uint64_t)(tag->data[offset+4]) << 32) +
+               ((uint64_t)(tag->data[offset+5]) << 40) +
+               ((uint64_t)(tag->data[offset+6]) << 48) +
+               ((uint64_t)(tag->data[offset+7]) << 56);
     }
 
     rc_dec(tag);
 
+    /* copy the data */
+    mem_copy(&res,&ures,sizeof(res));
+
     return res;
 }
 
 
 
 
-LIB_EXPORT int plc_tag_set_int16(int32_t id, int offset, int16_t ival)
+LIB_EXPORT int plc_tag_set_float64(int32_t id, int offset, double fval)
 {
-    uint16_t val = (uint16_t)(ival);
     int rc = PLCTAG_STATUS_OK;
+    uint64_t val = 0;
     plc_tag_p tag = lookup_tag(id);
 
     pdebug(DEBUG_SPEW, "Starting.");
@@ -1395,6 +2308,8 @@ LIB_EXPORT int plc_tag_set_int16(int32_t id, int offset, int16_t ival)
         return PLCTAG_ERR_NOT_FOUND;
     }
 
+    mem_copy(&val, &fval, sizeof(val));
+
     critical_block(tag->api_mutex) {
         /* is there data? */
         if(!tag->data) {
@@ -1404,7 +2319,7 @@ LIB_EXPORT int plc_tag_set_int16(int32_t id, int offset, int16_t ival)
         }
 
         /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(int16_t)) > tag->size)) {
+        if((offset < 0) || (offset + ((int)sizeof(val)) > tag->size)) {
             pdebug(DEBUG_WARN,"Data offset out of bounds.");
             rc = PLCTAG_ERR_OUT_OF_BOUNDS;
             break;
@@ -1412,6 +2327,12 @@ LIB_EXPORT int plc_tag_set_int16(int32_t id, int offset, int16_t ival)
 
         tag->data[offset]   = (uint8_t)(val & 0xFF);
         tag->data[offset+1] = (uint8_t)((val >> 8) & 0xFF);
+        tag->data[offset+2] = (uint8_t)((val >> 16) & 0xFF);
+        tag->data[offset+3] = (uint8_t)((val >> 24) & 0xFF);
+        tag->data[offset+4] = (uint8_t)((val >> 32) & 0xFF);
+        tag->data[offset+5] = (uint8_t)((val >> 40) & 0xFF);
+        tag->data[offset+6] = (uint8_t)((val >> 48) & 0xFF);
+        tag->data[offset+7] = (uint8_t)((val >> 56) & 0xFF);
     }
 
     rc_dec(tag);
@@ -1421,14 +2342,10 @@ LIB_EXPORT int plc_tag_set_int16(int32_t id, int offset, int16_t ival)
 
 
 
-
-
-
-
-
-LIB_EXPORT uint8_t plc_tag_get_uint8(int32_t id, int offset)
+LIB_EXPORT float plc_tag_get_float32(int32_t id, int offset)
 {
-    uint8_t res = UINT8_MAX;
+    uint32_t ures;
+    float res = FLT_MAX;
     plc_tag_p tag = lookup_tag(id);
 
     pdebug(DEBUG_SPEW, "Starting.");
@@ -1446,25 +2363,32 @@ LIB_EXPORT uint8_t plc_tag_get_uint8(int32_t id, int offset)
         }
 
         /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(uint8_t)) > tag->size)) {
+        if((offset < 0) || (offset + ((int)sizeof(ures)) > tag->size)) {
             pdebug(DEBUG_WARN,"Data offset out of bounds.");
             break;
         }
 
-        res = tag->data[offset];
+        ures = ((uint32_t)(tag->data[offset])) +
+               ((uint32_t)(tag->data[offset+1]) << 8) +
+               ((uint32_t)(tag->data[offset+2]) << 16) +
+               ((uint32_t)(tag->data[offset+3]) << 24);
     }
 
     rc_dec(tag);
 
+    /* copy the data */
+    mem_copy(&res,&ures,sizeof(res));
+
     return res;
 }
 
 
 
 
-LIB_EXPORT int plc_tag_set_uint8(int32_t id, int offset, uint8_t val)
+LIB_EXPORT int plc_tag_set_float32(int32_t id, int offset, float fval)
 {
     int rc = PLCTAG_STATUS_OK;
+    uint32_t val = 0;
     plc_tag_p tag = lookup_tag(id);
 
     pdebug(DEBUG_SPEW, "Starting.");
@@ -1474,6 +2398,8 @@ LIB_EXPORT int plc_tag_set_uint8(int32_t id, int offset, uint8_t val)
         return PLCTAG_ERR_NOT_FOUND;
     }
 
+    mem_copy(&val, &fval, sizeof(val));
+
     critical_block(tag->api_mutex) {
         /* is there data? */
         if(!tag->data) {
@@ -1483,68 +2409,251 @@ LIB_EXPORT int plc_tag_set_uint8(int32_t id, int offset, uint8_t val)
         }
 
         /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(uint8_t)) > tag->size)) {
+        if((offset < 0) || (offset + ((int)sizeof(val)) > tag->size)) {
             pdebug(DEBUG_WARN,"Data offset out of bounds.");
             rc = PLCTAG_ERR_OUT_OF_BOUNDS;
             break;
         }
 
-        tag->data[offset] = val;
+        tag->data[offset]   = (uint8_t)(val & 0xFF);
+        tag->data[offset+1] = (uint8_t)((val >> 8) & 0xFF);
+        tag->data[offset+2] = (uint8_t)((val >> 16) & 0xFF);
+        tag->data[offset+3] = (uint8_t)((val >> 24) & 0xFF);
     }
 
-    rc_dec(tag);
+    rc_dec(tag);
+
+    return rc;
+}
+
+
+
+/*
+ * Bulk array accessors.
+ *
+ * These copy count elements starting at the byte offset in one call.  The
+ * tag is looked up and locked once.  If the tag byte order matches the
+ * host, the data is copied as one block.  Otherwise each element is
+ * swapped a whole word at a time.
+ */
+
+LIB_EXPORT int plc_tag_get_uint64_array(int32_t id, int offset, uint64_t *buf, int count)
+{
+    return tag_get_array(id, offset, buf, (int)sizeof(uint64_t), count);
+}
+
+LIB_EXPORT int plc_tag_set_uint64_array(int32_t id, int offset, const uint64_t *buf, int count)
+{
+    return tag_set_array(id, offset, buf, (int)sizeof(uint64_t), count);
+}
+
+
+LIB_EXPORT int plc_tag_get_int64_array(int32_t id, int offset, int64_t *buf, int count)
+{
+    return tag_get_array(id, offset, buf, (int)sizeof(int64_t), count);
+}
+
+LIB_EXPORT int plc_tag_set_int64_array(int32_t id, int offset, const int64_t *buf, int count)
+{
+    return tag_set_array(id, offset, buf, (int)sizeof(int64_t), count);
+}
+
+
+LIB_EXPORT int plc_tag_get_uint32_array(int32_t id, int offset, uint32_t *buf, int count)
+{
+    return tag_get_array(id, offset, buf, (int)sizeof(uint32_t), count);
+}
+
+LIB_EXPORT int plc_tag_set_uint32_array(int32_t id, int offset, const uint32_t *buf, int count)
+{
+    return tag_set_array(id, offset, buf, (int)sizeof(uint32_t), count);
+}
+
+
+LIB_EXPORT int plc_tag_get_int32_array(int32_t id, int offset, int32_t *buf, int count)
+{
+    return tag_get_array(id, offset, buf, (int)sizeof(int32_t), count);
+}
+
+LIB_EXPORT int plc_tag_set_int32_array(int32_t id, int offset, const int32_t *buf, int count)
+{
+    return tag_set_array(id, offset, buf, (int)sizeof(int32_t), count);
+}
+
+
+LIB_EXPORT int plc_tag_get_uint16_array(int32_t id, int offset, uint16_t *buf, int count)
+{
+    return tag_get_array(id, offset, buf, (int)sizeof(uint16_t), count);
+}
+
+LIB_EXPORT int plc_tag_set_uint16_array(int32_t id, int offset, const uint16_t *buf, int count)
+{
+    return tag_set_array(id, offset, buf, (int)sizeof(uint16_t), count);
+}
+
+
+LIB_EXPORT int plc_tag_get_int16_array(int32_t id, int offset, int16_t *buf, int count)
+{
+    return tag_get_array(id, offset, buf, (int)sizeof(int16_t), count);
+}
+
+LIB_EXPORT int plc_tag_set_int16_array(int32_t id, int offset, const int16_t *buf, int count)
+{
+    return tag_set_array(id, offset, buf, (int)sizeof(int16_t), count);
+}
+
+
+LIB_EXPORT int plc_tag_get_uint8_array(int32_t id, int offset, uint8_t *buf, int count)
+{
+    return tag_get_array(id, offset, buf, (int)sizeof(uint8_t), count);
+}
+
+LIB_EXPORT int plc_tag_set_uint8_array(int32_t id, int offset, const uint8_t *buf, int count)
+{
+    return tag_set_array(id, offset, buf, (int)sizeof(uint8_t), count);
+}
+
+
+LIB_EXPORT int plc_tag_get_int8_array(int32_t id, int offset, int8_t *buf, int count)
+{
+    return tag_get_array(id, offset, buf, (int)sizeof(int8_t), count);
+}
+
+LIB_EXPORT int plc_tag_set_int8_array(int32_t id, int offset, const int8_t *buf, int count)
+{
+    return tag_set_array(id, offset, buf, (int)sizeof(int8_t), count);
+}
+
+
+LIB_EXPORT int plc_tag_get_float64_array(int32_t id, int offset, double *buf, int count)
+{
+    return tag_get_array(id, offset, buf, (int)sizeof(double), count);
+}
+
+LIB_EXPORT int plc_tag_set_float64_array(int32_t id, int offset, const double *buf, int count)
+{
+    return tag_set_array(id, offset, buf, (int)sizeof(double), count);
+}
+
+
+LIB_EXPORT int plc_tag_get_float32_array(int32_t id, int offset, float *buf, int count)
+{
+    return tag_get_array(id, offset, buf, (int)sizeof(float), count);
+}
+
+LIB_EXPORT int plc_tag_set_float32_array(int32_t id, int offset, const float *buf, int count)
+{
+    return tag_set_array(id, offset, buf, (int)sizeof(float), count);
+}
+
+
+
+
+/*****************************************************************************************************
+ *****************************  Support routines for extra indirection *******************************
+ ****************************************************************************************************/
+
+
+/*
+ * host_endian
+ *
+ * Figure out the byte order of the host.  The compiler folds this.
+ */
+
+static int host_endian(void)
+{
+    const uint16_t test = 1;
 
-    return rc;
+    return (*(const uint8_t *)&test == 1 ? PLCTAG_DATA_LITTLE_ENDIAN : PLCTAG_DATA_BIG_ENDIAN);
 }
 
 
 
 
+/*
+ * copy_elements
+ *
+ * Copy count elements of elem_size bytes, reversing the bytes of each
+ * element if swap is set.  Elements are loaded and stored as whole
+ * words so the compiler can vectorize the loops.
+ */
 
-LIB_EXPORT int8_t plc_tag_get_int8(int32_t id, int offset)
+void copy_elements(uint8_t *dest, const uint8_t *src, int elem_size, int count, int swap)
 {
-    int8_t res = INT8_MIN;
-    plc_tag_p tag = lookup_tag(id);
-
-    pdebug(DEBUG_SPEW, "Starting.");
-
-    if(!tag) {
-        pdebug(DEBUG_WARN,"Tag not found.");
-        return res;
+    if(!swap || elem_size == 1) {
+        mem_copy(dest, (void *)src, elem_size * count);
+        return;
     }
 
-    critical_block(tag->api_mutex) {
-        /* is there data? */
-        if(!tag->data) {
-            pdebug(DEBUG_WARN,"Tag has no data!");
+    switch(elem_size) {
+        case 2:
+            for(int i=0; i < count; i++) {
+                uint16_t val;
+
+                memcpy(&val, src + (i * 2), sizeof(val));
+                val = (uint16_t)((val >> 8) | (val << 8));
+                memcpy(dest + (i * 2), &val, sizeof(val));
+            }
             break;
-        }
 
-        /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(int8_t)) > tag->size)) {
-            pdebug(DEBUG_WARN,"Data offset out of bounds.");
+        case 4:
+            for(int i=0; i < count; i++) {
+                uint32_t val;
+
+                memcpy(&val, src + (i * 4), sizeof(val));
+                val = ((val >> 24) & 0x000000FF) | ((val >> 8) & 0x0000FF00) |
+                      ((val << 8) & 0x00FF0000) | ((val << 24) & 0xFF000000);
+                memcpy(dest + (i * 4), &val, sizeof(val));
+            }
             break;
-        }
 
-        res = (int8_t)(tag->data[offset]);
-    }
+        case 8:
+            for(int i=0; i < count; i++) {
+                uint64_t val;
 
-    rc_dec(tag);
+                memcpy(&val, src + (i * 8), sizeof(val));
+                val = ((val >> 56) & 0x00000000000000FFULL) | ((val >> 40) & 0x000000000000FF00ULL) |
+                      ((val >> 24) & 0x0000000000FF0000ULL) | ((val >> 8)  & 0x00000000FF000000ULL) |
+                      ((val << 8)  & 0x000000FF00000000ULL) | ((val << 24) & 0x0000FF0000000000ULL) |
+                      ((val << 40) & 0x00FF000000000000ULL) | ((val << 56) & 0xFF00000000000000ULL);
+                memcpy(dest + (i * 8), &val, sizeof(val));
+            }
+            break;
 
-    return res;
+        default:
+            pdebug(DEBUG_ERROR, "Unsupported element size %d!", elem_size);
+            break;
+    }
 }
 
 
 
 
-LIB_EXPORT int plc_tag_set_int8(int32_t id, int offset, int8_t ival)
+/*
+ * tag_get_array
+ * tag_set_array
+ *
+ * Shared implementation of the bulk accessors.
+ */
+
+int tag_get_array(int32_t id, int offset, void *buf, int elem_size, int count)
 {
-    uint8_t val = (uint8_t)(ival);
     int rc = PLCTAG_STATUS_OK;
-    plc_tag_p tag = lookup_tag(id);
+    plc_tag_p tag = NULL;
 
     pdebug(DEBUG_SPEW, "Starting.");
 
+    if(!buf) {
+        pdebug(DEBUG_WARN, "Null buffer pointer!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(count <= 0) {
+        pdebug(DEBUG_WARN, "Element count must be positive!");
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    tag = lookup_tag(id);
     if(!tag) {
         pdebug(DEBUG_WARN,"Tag not found.");
         return PLCTAG_ERR_NOT_FOUND;
@@ -1558,14 +2667,14 @@ LIB_EXPORT int plc_tag_set_int8(int32_t id, int offset, int8_t ival)
             break;
         }
 
-        /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(int8_t)) > tag->size)) {
+        /* is there enough data, be careful of overflow. */
+        if((offset < 0) || (count > (tag->size / elem_size)) || (offset + (elem_size * count) > tag->size)) {
             pdebug(DEBUG_WARN,"Data offset out of bounds.");
             rc = PLCTAG_ERR_OUT_OF_BOUNDS;
             break;
         }
 
-        tag->data[offset] = (uint8_t)val;
+        copy_elements((uint8_t *)buf, tag->data + offset, elem_size, count, (tag->endian != host_endian()));
     }
 
     rc_dec(tag);
@@ -1575,287 +2684,272 @@ LIB_EXPORT int plc_tag_set_int8(int32_t id, int offset, int8_t ival)
 
 
 
-
-
-
-LIB_EXPORT double plc_tag_get_float64(int32_t id, int offset)
+int tag_set_array(int32_t id, int offset, const void *buf, int elem_size, int count)
 {
-    uint64_t ures = 0;
-    double res = DBL_MAX;
-    plc_tag_p tag = lookup_tag(id);
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = NULL;
 
     pdebug(DEBUG_SPEW, "Starting.");
 
+    if(!buf) {
+        pdebug(DEBUG_WARN, "Null buffer pointer!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(count <= 0) {
+        pdebug(DEBUG_WARN, "Element count must be positive!");
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    tag = lookup_tag(id);
     if(!tag) {
         pdebug(DEBUG_WARN,"Tag not found.");
-        return res;
+        return PLCTAG_ERR_NOT_FOUND;
     }
 
     critical_block(tag->api_mutex) {
         /* is there data? */
         if(!tag->data) {
             pdebug(DEBUG_WARN,"Tag has no data!");
+            rc = PLCTAG_ERR_NO_DATA;
             break;
         }
 
-        /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(ures)) > tag->size)) {
+        /* is there enough data, be careful of overflow. */
+        if((offset < 0) || (count > (tag->size / elem_size)) || (offset + (elem_size * count) > tag->size)) {
             pdebug(DEBUG_WARN,"Data offset out of bounds.");
+            rc = PLCTAG_ERR_OUT_OF_BOUNDS;
             break;
         }
 
-        ures = ((uint64_t)(tag->data[offset])) +
-               ((uint64_t)(tag->data[offset+1]) << 8) +
-               ((uint64_t)(tag->data[offset+2]) << 16) +
-               ((uint64_t)(tag->data[offset+3]) << 24) +
-               ((uint64_t)(tag->data[offset+4]) << 32) +
-               ((uint64_t)(tag->data[offset+5]) << 40) +
-               ((uint64_t)(tag->data[offset+6]) << 48) +
-               ((uint64_t)(tag->data[offset+7]) << 56);
+        copy_elements(tag->data + offset, (const uint8_t *)buf, elem_size, count, (tag->endian != host_endian()));
     }
 
     rc_dec(tag);
 
-    /* copy the data */
-    mem_copy(&res,&ures,sizeof(res));
-
-    return res;
+    return rc;
 }
 
 
 
 
-LIB_EXPORT int plc_tag_set_float64(int32_t id, int offset, double fval)
+/*
+ * tag_op_many
+ *
+ * Shared implementation of plc_tag_read_many() and plc_tag_write_many().
+ *
+ * All the tags are looked up first.  Then each operation is started under the tag API mutex.  Then, if there is
+ * a timeout, we wait for each tag in turn.  The operations run in
+ * parallel, so the total wait is about the time of the slowest one.
+ */
+
+int tag_op_many(int32_t *ids, int *statuses, int count, int timeout, int is_write)
 {
     int rc = PLCTAG_STATUS_OK;
-    uint64_t val = 0;
-    plc_tag_p tag = lookup_tag(id);
+    plc_tag_p *tag_list = NULL;
+    int64_t start_time = time_ms();
+    int64_t timeout_time = start_time + timeout;
 
-    pdebug(DEBUG_SPEW, "Starting.");
+    pdebug(DEBUG_INFO, "Starting %s of %d tags.", (is_write ? "write" : "read"), count);
 
-    if(!tag) {
-        pdebug(DEBUG_WARN,"Tag not found.");
-        return PLCTAG_ERR_NOT_FOUND;
+    if(!ids || !statuses) {
+        pdebug(DEBUG_WARN, "Null tag ID or status array!");
+        return PLCTAG_ERR_NULL_PTR;
     }
 
-    mem_copy(&val, &fval, sizeof(val));
-
-    critical_block(tag->api_mutex) {
-        /* is there data? */
-        if(!tag->data) {
-            pdebug(DEBUG_WARN,"Tag has no data!");
-            rc = PLCTAG_ERR_NO_DATA;
-            break;
-        }
-
-        /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(val)) > tag->size)) {
-            pdebug(DEBUG_WARN,"Data offset out of bounds.");
-            rc = PLCTAG_ERR_OUT_OF_BOUNDS;
-            break;
-        }
-
-        tag->data[offset]   = (uint8_t)(val & 0xFF);
-        tag->data[offset+1] = (uint8_t)((val >> 8) & 0xFF);
-        tag->data[offset+2] = (uint8_t)((val >> 16) & 0xFF);
-        tag->data[offset+3] = (uint8_t)((val >> 24) & 0xFF);
-        tag->data[offset+4] = (uint8_t)((val >> 32) & 0xFF);
-        tag->data[offset+5] = (uint8_t)((val >> 40) & 0xFF);
-        tag->data[offset+6] = (uint8_t)((val >> 48) & 0xFF);
-        tag->data[offset+7] = (uint8_t)((val >> 56) & 0xFF);
+    if(count <= 0 || timeout < 0) {
+        pdebug(DEBUG_WARN, "Count must be positive and timeout must not be negative!");
+        return PLCTAG_ERR_BAD_PARAM;
     }
 
-    rc_dec(tag);
+    tag_list = mem_alloc((int)sizeof(plc_tag_p) * count);
+    if(!tag_list) {
+        pdebug(DEBUG_ERROR, "Unable to allocate tag list!");
+        return PLCTAG_ERR_NO_MEM;
+    }
 
-    return rc;
-}
+    /* look up all the tags at once. */
+    for(int i=0; i < count; i++) {
+        tag_list[i] = handle_table_get(tags, ids[i]);
+    }
 
+    /* start all the operations. */
+    for(int i=0; i < count; i++) {
+        plc_tag_p tag = tag_list[i];
 
+        if(!tag) {
+            pdebug(DEBUG_WARN, "Tag %d not found.", ids[i]);
+            statuses[i] = PLCTAG_ERR_NOT_FOUND;
+            continue;
+        }
 
-LIB_EXPORT float plc_tag_get_float32(int32_t id, int offset)
-{
-    uint32_t ures;
-    float res = FLT_MAX;
-    plc_tag_p tag = lookup_tag(id);
+        critical_block(tag->api_mutex) {
+            if(is_write) {
+                statuses[i] = tag->vtable->write(tag);
+                tag_op_started(tag, TAG_OP_WRITE, statuses[i]);
+            } else {
+                /* check read cache, if not expired, return existing data. */
+                if(tag->read_cache_expire > time_ms()) {
+                    statuses[i] = PLCTAG_STATUS_OK;
+                    tag_op_started(tag, TAG_OP_READ, statuses[i]);
+                    break;
+                }
 
-    pdebug(DEBUG_SPEW, "Starting.");
+                statuses[i] = tag->vtable->read(tag);
+                tag_op_started(tag, TAG_OP_READ, statuses[i]);
 
-    if(!tag) {
-        pdebug(DEBUG_WARN,"Tag not found.");
-        return res;
+                if(statuses[i] == PLCTAG_STATUS_PENDING || statuses[i] == PLCTAG_STATUS_OK) {
+                    tag->read_cache_expire = time_ms() + tag->read_cache_ms;
+                }
+            }
+        }
     }
 
-    critical_block(tag->api_mutex) {
-        /* is there data? */
-        if(!tag->data) {
-            pdebug(DEBUG_WARN,"Tag has no data!");
-            break;
-        }
+    /* wait for them to finish. */
+    for(int i=0; timeout && i < count; i++) {
+        plc_tag_p tag = tag_list[i];
 
-        /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(ures)) > tag->size)) {
-            pdebug(DEBUG_WARN,"Data offset out of bounds.");
-            break;
+        if(!tag || statuses[i] != PLCTAG_STATUS_PENDING) {
+            continue;
         }
 
-        ures = ((uint32_t)(tag->data[offset])) +
-               ((uint32_t)(tag->data[offset+1]) << 8) +
-               ((uint32_t)(tag->data[offset+2]) << 16) +
-               ((uint32_t)(tag->data[offset+3]) << 24);
-    }
-
-    rc_dec(tag);
-
-    /* copy the data */
-    mem_copy(&res,&ures,sizeof(res));
+        critical_block(tag->api_mutex) {
+            int tag_rc = tag->vtable->status(tag);
 
-    return res;
-}
+            while(tag_rc == PLCTAG_STATUS_PENDING && timeout_time > time_ms()) {
+                tag_rc = tag_tick(tag);
 
+                if(tag_rc != PLCTAG_STATUS_PENDING) {
+                    break;
+                }
 
+                wait_for_tag(tag, timeout_time);
+            }
 
+            if(tag_rc != PLCTAG_STATUS_OK) {
+                if(tag->vtable->abort) {
+                    tag->vtable->abort(tag);
+                }
 
-LIB_EXPORT int plc_tag_set_float32(int32_t id, int offset, float fval)
-{
-    int rc = PLCTAG_STATUS_OK;
-    uint32_t val = 0;
-    plc_tag_p tag = lookup_tag(id);
+                tag_op_aborted(tag);
 
-    pdebug(DEBUG_SPEW, "Starting.");
+                if(tag_rc == PLCTAG_STATUS_PENDING) {
+                    pdebug(DEBUG_WARN, "Operation on tag %d timed out.", ids[i]);
+                    tag_rc = PLCTAG_ERR_TIMEOUT;
+                }
+            }
 
-    if(!tag) {
-        pdebug(DEBUG_WARN,"Tag not found.");
-        return PLCTAG_ERR_NOT_FOUND;
+            statuses[i] = tag_rc;
+        }
     }
 
-    mem_copy(&val, &fval, sizeof(val));
-
-    critical_block(tag->api_mutex) {
-        /* is there data? */
-        if(!tag->data) {
-            pdebug(DEBUG_WARN,"Tag has no data!");
-            rc = PLCTAG_ERR_NO_DATA;
+    /* the first error wins, then pending. */
+    for(int i=0; i < count; i++) {
+        if(statuses[i] != PLCTAG_STATUS_OK && statuses[i] != PLCTAG_STATUS_PENDING) {
+            rc = statuses[i];
             break;
         }
 
-        /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(val)) > tag->size)) {
-            pdebug(DEBUG_WARN,"Data offset out of bounds.");
-            rc = PLCTAG_ERR_OUT_OF_BOUNDS;
-            break;
+        if(statuses[i] == PLCTAG_STATUS_PENDING) {
+            rc = PLCTAG_STATUS_PENDING;
         }
+    }
 
-        tag->data[offset]   = (uint8_t)(val & 0xFF);
-        tag->data[offset+1] = (uint8_t)((val >> 8) & 0xFF);
-        tag->data[offset+2] = (uint8_t)((val >> 16) & 0xFF);
-        tag->data[offset+3] = (uint8_t)((val >> 24) & 0xFF);
+    for(int i=0; i < count; i++) {
+        if(tag_list[i]) {
+            rc_dec(tag_list[i]);
+        }
     }
 
-    rc_dec(tag);
+    mem_free(tag_list);
+
+    pdebug(DEBUG_INFO, "Done with rc=%s, elapsed time %lldms.", plc_tag_decode_error(rc), (long long)(time_ms() - start_time));
 
     return rc;
 }
 
 
 
-/*****************************************************************************************************
- *****************************  Support routines for extra indirection *******************************
- ****************************************************************************************************/
 
+/*
+ * wait_for_tag
+ *
+ * Block until the tag is signaled or the timeout time is reached.
+ * The caller must hold the tag API mutex.  That makes the caller the
+ * only waiter on the tag condition.
+ */
 
-plc_tag_p lookup_tag(int32_t tag_id)
+void wait_for_tag(plc_tag_p tag, int64_t timeout_time)
 {
-    plc_tag_p tag = NULL;
-
-    critical_block(tag_lookup_mutex) {
-        tag = hashtable_get(tags, (int64_t)tag_id);
+    int64_t remaining = timeout_time - time_ms();
 
-        if(tag) {
-            debug_set_tag_id(tag->tag_id);
-        } else {
-            /* FIXME - remove this. */
-            pdebug(DEBUG_WARN, "Tag with ID %d not found.", tag_id);
-        }
+    if(remaining <= 0) {
+        return;
+    }
 
-        if(tag && tag->tag_id == tag_id) {
-            pdebug(DEBUG_SPEW, "Found tag %p with id %d.", tag, tag->tag_id);
-            tag = rc_inc(tag);
-        } else {
-            debug_set_tag_id(0);
-            tag = NULL;
-        }
+    if(remaining > INT_MAX) {
+        remaining = INT_MAX;
     }
 
-    return tag;
+    cond_wait(tag->tag_cond_wait, (int)remaining);
 }
 
 
 
-int tag_id_inc(int id)
-{
-    if(id <= 0) {
-        pdebug(DEBUG_ERROR, "Incoming ID is not valid! Got %d",id);
-        /* try to correct. */
-        id = (TAG_ID_MASK/2);
-    }
+/*
+ * lookup_tag
+ *
+ * Return a strong reference to the tag with the passed ID, or NULL.
+ * This takes no global lock.  The ID indexes the handle table directly.
+ */
 
-    id = (id + 1) & TAG_ID_MASK;
+plc_tag_p lookup_tag(int32_t tag_id)
+{
+    plc_tag_p tag = handle_table_get(tags, tag_id);
 
-    if(id == 0) {
-        id = 1; /* skip zero intentionally! Can't return an ID of zero because it looks like a NULL pointer */
+    if(tag) {
+        debug_set_tag_id(tag->tag_id);
+        pdebug(DEBUG_SPEW, "Found tag %p with id %d.", tag, tag->tag_id);
+    } else {
+        /* FIXME - remove this. */
+        pdebug(DEBUG_WARN, "Tag with ID %d not found.", tag_id);
     }
 
-    return id;
+    return tag;
 }
 
 
 
-int add_tag_lookup(plc_tag_p tag)
+int tag_is_mapped(int32_t tag_id)
 {
-    int rc = PLCTAG_ERR_NOT_FOUND;
-    int new_id = 0;
-
-    pdebug(DEBUG_DETAIL, "Starting.");
-
-    critical_block(tag_lookup_mutex) {
-        int attempts = 0;
+    plc_tag_p tag = handle_table_get(tags, tag_id);
 
-        /* only get this when we hold the mutex. */
-        new_id = next_tag_id;
-
-        do {
-            new_id = tag_id_inc(new_id);
+    if(tag) {
+        rc_dec(tag);
+        return 1;
+    }
 
-            if(new_id <=0) {
-                pdebug(DEBUG_WARN,"ID %d is illegal!", new_id);
-                attempts = MAX_TAG_MAP_ATTEMPTS;
-                break;
-            }
+    return 0;
+}
 
-            pdebug(DEBUG_SPEW,"Trying new ID %d.", new_id);
 
-            if(!hashtable_get(tags,(int64_t)new_id)) {
-                pdebug(DEBUG_DETAIL,"Found unused ID %d", new_id);
-                break;
-            }
 
-            attempts++;
-        } while(attempts < MAX_TAG_MAP_ATTEMPTS);
+/*
+ * add_tag_lookup
+ *
+ * Map the tag to a new ID.  The handle table takes over the creation
+ * reference to the tag.
+ */
 
-        if(attempts < MAX_TAG_MAP_ATTEMPTS) {
-            rc = hashtable_put(tags, (int64_t)new_id, tag);
-        } else {
-            rc = PLCTAG_ERR_NO_RESOURCES;
-        }
+int add_tag_lookup(plc_tag_p tag)
+{
+    int new_id = 0;
 
-        next_tag_id = new_id;
-    }
+    pdebug(DEBUG_DETAIL, "Starting.");
 
-    if(rc != PLCTAG_STATUS_OK) {
-        new_id = rc;
-    }
+    new_id = handle_table_add(tags, tag);
 
-    pdebug(DEBUG_DETAIL, "Done.");
+    pdebug(DEBUG_DETAIL, "Done with ID %d.", new_id);
 
     return new_id;
 }
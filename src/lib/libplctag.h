@@ -265,6 +265,60 @@ extern "C" {
 
 
 
+    /*
+     * plc_tag_register_callback
+     * plc_tag_unregister_callback
+     *
+     * Register a function to be called when an operation on the tag finishes.
+     * The callback is called from a thread owned by the library.  The event is
+     * one of the PLCTAG_EVENT_* values below.  The status is the final status of
+     * the operation.  Only one callback can be registered per tag; registering a
+     * new one replaces the old one.
+     *
+     * The callback must not block for long as it holds up the delivery of all
+     * other events.  It may call the other API functions.
+     *
+     * Once plc_tag_unregister_callback(), plc_tag_register_callback() or
+     * plc_tag_destroy() returns, the old callback is not called again with
+     * the old userdata, and any call to it that was running has returned.  So
+     * the userdata can be freed then.  These calls wait for a running callback,
+     * so do not make them while holding a lock the callback takes, such as the
+     * one from plc_tag_lock().
+     */
+
+    #define PLCTAG_EVENT_READ_COMPLETED     (1)
+    #define PLCTAG_EVENT_WRITE_COMPLETED    (2)
+    #define PLCTAG_EVENT_ABORTED            (3)
+    #define PLCTAG_EVENT_ERROR              (4)
+
+    typedef void (*plc_tag_callback_func)(int32_t tag_id, int event, int status, void *userdata);
+
+    LIB_EXPORT int plc_tag_register_callback(int32_t tag, plc_tag_callback_func callback, void *userdata);
+    LIB_EXPORT int plc_tag_unregister_callback(int32_t tag);
+
+
+
+
+    /*
+     * plc_tag_read_many
+     * plc_tag_write_many
+     *
+     * Start a read (write) on each of the count tags in the tags array.  All
+     * the requests are queued before any waiting is done so that the protocol
+     * layer can pack them together.  If the timeout is non-zero, wait for all
+     * of the operations to complete or for the timeout, whichever is first.
+     * Any operation still pending at the timeout is aborted.
+     *
+     * The status of each tag is stored in the matching entry in the statuses
+     * array.  The first error found is returned.  If there is no error, but some
+     * operations are still pending, PLCTAG_STATUS_PENDING is returned.
+     */
+    LIB_EXPORT int plc_tag_read_many(int32_t *tags, int *statuses, int count, int timeout);
+    LIB_EXPORT int plc_tag_write_many(int32_t *tags, int *statuses, int count, int timeout);
+
+
+
+
     /*
      * Tag data accessors.
      */
@@ -306,6 +360,45 @@ extern "C" {
     LIB_EXPORT int plc_tag_set_float32(int32_t tag, int offset, float val);
 
 
+
+    /*
+     * Bulk array accessors.
+     *
+     * Get or set count elements starting at the byte offset in the tag data.  These
+     * lock the tag once for the whole array and handle the byte order of the tag.
+     * They return PLCTAG_STATUS_OK or an error.
+     */
+    LIB_EXPORT int plc_tag_get_uint64_array(int32_t tag, int offset, uint64_t *buf, int count);
+    LIB_EXPORT int plc_tag_set_uint64_array(int32_t tag, int offset, const uint64_t *buf, int count);
+
+    LIB_EXPORT int plc_tag_get_int64_array(int32_t tag, int offset, int64_t *buf, int count);
+    LIB_EXPORT int plc_tag_set_int64_array(int32_t tag, int offset, const int64_t *buf, int count);
+
+    LIB_EXPORT int plc_tag_get_uint32_array(int32_t tag, int offset, uint32_t *buf, int count);
+    LIB_EXPORT int plc_tag_set_uint32_array(int32_t tag, int offset, const uint32_t *buf, int count);
+
+    LIB_EXPORT int plc_tag_get_int32_array(int32_t tag, int offset, int32_t *buf, int count);
+    LIB_EXPORT int plc_tag_set_int32_array(int32_t tag, int offset, const int32_t *buf, int count);
+
+    LIB_EXPORT int plc_tag_get_uint16_array(int32_t tag, int offset, uint16_t *buf, int count);
+    LIB_EXPORT int plc_tag_set_uint16_array(int32_t tag, int offset, const uint16_t *buf, int count);
+
+    LIB_EXPORT int plc_tag_get_int16_array(int32_t tag, int offset, int16_t *buf, int count);
+    LIB_EXPORT int plc_tag_set_int16_array(int32_t tag, int offset, const int16_t *buf, int count);
+
+    LIB_EXPORT int plc_tag_get_uint8_array(int32_t tag, int offset, uint8_t *buf, int count);
+    LIB_EXPORT int plc_tag_set_uint8_array(int32_t tag, int offset, const uint8_t *buf, int count);
+
+    LIB_EXPORT int plc_tag_get_int8_array(int32_t tag, int offset, int8_t *buf, int count);
+    LIB_EXPORT int plc_tag_set_int8_array(int32_t tag, int offset, const int8_t *buf, int count);
+
+    LIB_EXPORT int plc_tag_get_float64_array(int32_t tag, int offset, double *buf, int count);
+    LIB_EXPORT int plc_tag_set_float64_array(int32_t tag, int offset, const double *buf, int count);
+
+    LIB_EXPORT int plc_tag_get_float32_array(int32_t tag, int offset, float *buf, int count);
+    LIB_EXPORT int plc_tag_set_float32_array(int32_t tag, int offset, const float *buf, int count);
+
+
 #ifdef __cplusplus
 }
 #endif
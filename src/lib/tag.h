@@ -76,11 +76,19 @@ typedef struct tag_vtable_t *tag_vtable_p;
 #define TAG_BASE_STRUCT tag_vtable_p vtable; \
                         mutex_p ext_mutex; \
                         mutex_p api_mutex; \
+                        cond_p tag_cond_wait; \
                         int status; \
                         int endian; \
                         int tag_id; \
                         int64_t read_cache_expire; \
                         int64_t read_cache_ms; \
+                        int pending_op; \
+                        int tickler_active; \
+                        int tickler_index; \
+                        int poll_ms; \
+                        int64_t next_poll; \
+                        plc_tag_callback_func callback; \
+                        void *userdata; \
                         int size; \
                         uint8_t *data
 
@@ -101,6 +109,8 @@ extern void lib_teardown(void);
 extern int plc_tag_abort_mapped(plc_tag_p tag);
 extern int plc_tag_destroy_mapped(plc_tag_p tag);
 extern int plc_tag_status_mapped(plc_tag_p tag);
+extern void plc_tag_tickler_wake(void);
+extern void plc_tag_wake(int tag_id);
 
 
 
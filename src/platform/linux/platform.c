@@ -31,6 +31,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <math.h>
 #include <string.h>
@@ -41,11 +42,18 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <fcntl.h>
 #include <time.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
 
 #include <lib/libplctag.h>
 #include <util/debug.h>
@@ -549,6 +557,184 @@ int mutex_destroy(mutex_p *m)
 
 
 
+/***************************************************************************
+ ************************* Condition Variables *****************************
+ **************************************************************************/
+
+/*
+ * These work like an auto-reset event.  A signal is remembered until a
+ * waiter picks it up, so a signal that comes in before the wait starts
+ * is not lost.  They are meant to have a single waiter.
+ */
+
+struct cond_t {
+    pthread_mutex_t p_mutex;
+    pthread_cond_t p_cond;
+    int flag;
+};
+
+
+int cond_create(cond_p *c)
+{
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!c) {
+        pdebug(DEBUG_WARN, "null condition var pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    *c = (struct cond_t *)mem_alloc(sizeof(struct cond_t));
+
+    if(! *c) {
+        pdebug(DEBUG_ERROR,"Unable to allocate condition var.");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    if(pthread_mutex_init(&((*c)->p_mutex),NULL)) {
+        mem_free(*c);
+        *c = NULL;
+        pdebug(DEBUG_ERROR,"Error initializing condition var mutex.");
+        return PLCTAG_ERR_MUTEX_INIT;
+    }
+
+    if(pthread_cond_init(&((*c)->p_cond), NULL)) {
+        pthread_mutex_destroy(&((*c)->p_mutex));
+        mem_free(*c);
+        *c = NULL;
+        pdebug(DEBUG_ERROR,"Error initializing condition var.");
+        return PLCTAG_ERR_MUTEX_INIT;
+    }
+
+    (*c)->flag = 0;
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * cond_wait
+ *
+ * Wait until the condition var is signaled or the timeout passes.
+ * Returns PLCTAG_ERR_TIMEOUT if there was no signal in time.
+ */
+int cond_wait(cond_p c, int timeout_ms)
+{
+    int rc = PLCTAG_STATUS_OK;
+    struct timeval tv;
+    struct timespec deadline;
+
+    if(!c) {
+        pdebug(DEBUG_WARN, "null condition var pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(timeout_ms < 0) {
+        timeout_ms = 0;
+    }
+
+    /* pthread_cond_timedwait() wants an absolute time. */
+    gettimeofday(&tv, NULL);
+
+    deadline.tv_sec = tv.tv_sec + (timeout_ms / 1000);
+    deadline.tv_nsec = (long)(tv.tv_usec * 1000) + ((long)(timeout_ms % 1000) * 1000000L);
+
+    if(deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&(c->p_mutex));
+
+    while(!c->flag) {
+        int wait_rc = pthread_cond_timedwait(&(c->p_cond), &(c->p_mutex), &deadline);
+
+        if(wait_rc == ETIMEDOUT) {
+            break;
+        }
+    }
+
+    if(c->flag) {
+        /* we took the signal. */
+        c->flag = 0;
+        rc = PLCTAG_STATUS_OK;
+    } else {
+        rc = PLCTAG_ERR_TIMEOUT;
+    }
+
+    pthread_mutex_unlock(&(c->p_mutex));
+
+    return rc;
+}
+
+
+
+int cond_signal(cond_p c)
+{
+    if(!c) {
+        pdebug(DEBUG_WARN, "null condition var pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    pthread_mutex_lock(&(c->p_mutex));
+
+    c->flag = 1;
+    pthread_cond_signal(&(c->p_cond));
+
+    pthread_mutex_unlock(&(c->p_mutex));
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+int cond_clear(cond_p c)
+{
+    if(!c) {
+        pdebug(DEBUG_WARN, "null condition var pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    pthread_mutex_lock(&(c->p_mutex));
+
+    c->flag = 0;
+
+    pthread_mutex_unlock(&(c->p_mutex));
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+int cond_destroy(cond_p *c)
+{
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!c || !*c) {
+        pdebug(DEBUG_WARN, "null condition var pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    pthread_cond_destroy(&((*c)->p_cond));
+    pthread_mutex_destroy(&((*c)->p_mutex));
+
+    mem_free(*c);
+
+    *c = NULL;
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+
+
+
+
 /***************************************************************************
  ******************************* Threads ***********************************
  **************************************************************************/
@@ -744,14 +930,30 @@ extern void lock_release(lock_t *lock)
  ******************************* Sockets ***********************************
  **************************************************************************/
 
+#define MAX_IPS (8)
+
+/* how long a connection attempt gets before the next address is tried too. */
+#define SOCKET_CONNECT_ATTEMPT_DELAY_MS (250)
+
 struct sock_t {
     int fd;
     int port;
     int is_open;
-};
+    int watched; /* events the socket is watched for, zero if none. */
 
+    /* addresses to try when connecting. */
+    struct in_addr ips[MAX_IPS];
+    int num_ips;
+    int ip_index;
 
-#define MAX_IPS (8)
+    /*
+     * connection attempts racing each other, one per address, -1 if
+     * there is none.  While connecting, fd is one of these.
+     */
+    int attempt_fds[MAX_IPS];
+    int num_attempts;
+    int64_t next_attempt_time;
+};
 
 extern int socket_create(sock_p *s)
 {
@@ -769,264 +971,1343 @@ extern int socket_create(sock_p *s)
         return PLCTAG_ERR_NO_MEM;
     }
 
+    (*s)->fd = -1;
+
+    for(int i=0; i < MAX_IPS; i++) {
+        (*s)->attempt_fds[i] = -1;
+    }
+
     pdebug(DEBUG_DETAIL, "Done.");
 
     return PLCTAG_STATUS_OK;
 }
 
 
-extern int socket_connect_tcp(sock_p s, const char *host, int port)
-{
+/*
+ * Host name lookups are cached for the whole library, so all the
+ * sessions to a gateway share them.  A name is only looked up while the
+ * caller waits the first time it is used.  After that, the cached
+ * addresses are handed out right away.  Once they are older than
+ * RESOLVER_CACHE_TTL_MS, they are looked up again in the background.
+ * If that fails, the old addresses keep being used.
+ */
+
+#define RESOLVER_CACHE_TTL_MS (60000)
+
+/* how soon to try again after a background lookup failed. */
+#define RESOLVER_RETRY_MS (5000)
+
+typedef struct resolver_entry_t *resolver_entry_p;
+
+struct resolver_entry_t {
+    resolver_entry_p next;
+    char *host;
+
     struct in_addr ips[MAX_IPS];
-    int num_ips = 0;
-    struct sockaddr_in gw_addr;
-    int sock_opt = 1;
-    int i = 0;
-    int done = 0;
-    int fd;
-    int flags;
-    struct timeval timeout; /* used for timing out connections etc. */
-    struct linger so_linger; /* used to set up short/no lingering after connections are close()ed. */
+    int num_ips;
 
-    pdebug(DEBUG_DETAIL,"Starting.");
+    /* when to look the host up again. */
+    int64_t refresh_time;
 
-    /* Open a socket for communication with the gateway. */
-    fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    /* the background lookup, it is done when refreshing is zero. */
+    int refreshing;
+    thread_p refresh_thread;
+};
 
-    /* check for errors */
-    if(fd < 0) {
-        pdebug(DEBUG_ERROR,"Socket creation failed, errno: %d",errno);
-        return PLCTAG_ERR_OPEN;
-    }
+static lock_t resolver_lock = LOCK_INIT;
+static resolver_entry_p resolver_cache = NULL;
+static socket_resolver_stats_t resolver_stats;
 
-    /* set up our socket to allow reuse if we crash suddenly. */
-    sock_opt = 1;
 
-    if(setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,(char*)&sock_opt,sizeof(sock_opt))) {
-        close(fd);
-        pdebug(DEBUG_ERROR, "Error setting socket reuse option, errno: %d",errno);
-        return PLCTAG_ERR_OPEN;
-    }
 
-#ifdef SO_NOSIGPIPE
-    /* On *BSD and macOS, set the socket option to prevent SIGPIPE. */
-    if(setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, (char*)&sock_opt, sizeof(sock_opt))) {
-        close(fd);
-        pdebug(DEBUG_ERROR, "Error setting socket SIGPIPE suppression option, errno: %d",errno);
-        return PLCTAG_ERR_OPEN;
-    }
-#endif
+/*
+ * socket_resolve_host
+ *
+ * Look up the IPv4 addresses for the passed host name.  This can
+ * block for as long as the name service takes.
+ */
+static int socket_resolve_host(const char *host, struct in_addr *ips, int *num_ips)
+{
+    struct addrinfo hints;
+    struct addrinfo *res_head = NULL;
+    struct addrinfo *res = NULL;
+    int64_t start_time = time_ms();
+    int64_t lookup_ms = 0;
+    int rc = PLCTAG_STATUS_OK;
+    int gai_rc = 0;
 
-    timeout.tv_sec = 10;
-    timeout.tv_usec = 0;
+    *num_ips = 0;
 
-    if(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout))) {
-        close(fd);
-        pdebug(DEBUG_ERROR,"Error setting socket receive timeout option, errno: %d",errno);
-        return PLCTAG_ERR_OPEN;
+    mem_set(&hints, 0, sizeof(hints));
+
+    hints.ai_socktype = SOCK_STREAM; /* TCP */
+    hints.ai_family = AF_INET; /* IP V4 only */
+
+    if ((gai_rc = getaddrinfo(host, NULL, &hints, &res_head)) != 0) {
+        pdebug(DEBUG_WARN,"Error looking up PLC IP address %s, error = %d\n", host, gai_rc);
+        rc = PLCTAG_ERR_BAD_GATEWAY;
     }
 
-    if(setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(timeout))) {
-        close(fd);
-        pdebug(DEBUG_ERROR, "Error setting socket set timeout option, errno: %d",errno);
-        return PLCTAG_ERR_OPEN;
+    for(res = res_head; res && *num_ips < MAX_IPS; res = res->ai_next) {
+        ips[*num_ips].s_addr = ((struct sockaddr_in *)(res->ai_addr))->sin_addr.s_addr;
+        (*num_ips)++;
     }
 
-    /* abort the connection immediately upon close. */
-    so_linger.l_onoff = 1;
-    so_linger.l_linger = 0;
+    if(res_head) {
+        freeaddrinfo(res_head);
+    }
 
-    if(setsockopt(fd, SOL_SOCKET, SO_LINGER,(char*)&so_linger,sizeof(so_linger))) {
-        close(fd);
-        pdebug(DEBUG_ERROR,"Error setting socket close linger option, errno: %d",errno);
-        return PLCTAG_ERR_OPEN;
+    if(rc == PLCTAG_STATUS_OK && *num_ips == 0) {
+        pdebug(DEBUG_WARN, "No IP addresses found for %s!", host);
+        rc = PLCTAG_ERR_BAD_GATEWAY;
     }
 
-    /* figure out what address we are connecting to. */
+    lookup_ms = time_ms() - start_time;
 
-    /* try a numeric IP address conversion first. */
-    if(inet_pton(AF_INET,host,(struct in_addr *)ips) > 0) {
-        pdebug(DEBUG_DETAIL, "Found numeric IP address: %s",host);
-        num_ips = 1;
-    } else {
-        struct addrinfo hints;
-        struct addrinfo *res=NULL;
-        int rc = 0;
+    spin_block(&resolver_lock) {
+        resolver_stats.lookups++;
+        resolver_stats.lookup_total_ms += lookup_ms;
 
-        mem_set(&ips, 0, sizeof(ips));
-        mem_set(&hints, 0, sizeof(hints));
+        if(lookup_ms > resolver_stats.lookup_max_ms) {
+            resolver_stats.lookup_max_ms = lookup_ms;
+        }
 
-        hints.ai_socktype = SOCK_STREAM; /* TCP */
-        hints.ai_family = AF_INET; /* IP V4 only */
+        if(rc != PLCTAG_STATUS_OK) {
+            resolver_stats.failures++;
+        }
+    }
 
-        if ((rc = getaddrinfo(host, NULL, &hints, &res)) != 0) {
-            pdebug(DEBUG_WARN,"Error looking up PLC IP address %s, error = %d\n", host, rc);
+    pdebug(DEBUG_DETAIL, "Looking up %s took %" PRId64 "ms.", host, lookup_ms);
 
-            if(res) {
-                freeaddrinfo(res);
-            }
+    return rc;
+}
 
-            return PLCTAG_ERR_BAD_GATEWAY;
-        }
 
-        for(num_ips = 0; res && num_ips < MAX_IPS; num_ips++) {
-            ips[num_ips].s_addr = ((struct sockaddr_in *)(res->ai_addr))->sin_addr.s_addr;
-            res = res->ai_next;
-        }
 
-        freeaddrinfo(res);
-    }
+/*
+ * resolver_find_unsafe
+ *
+ * Find the cache entry for the passed host.  Call with the resolver
+ * lock held.
+ */
+static resolver_entry_p resolver_find_unsafe(const char *host)
+{
+    resolver_entry_p entry = resolver_cache;
 
+    while(entry && str_cmp_i(entry->host, host) != 0) {
+        entry = entry->next;
+    }
 
-    /* now try to connect to the remote gateway.  We may need to
-     * try several of the IPs we have.
-     */
+    return entry;
+}
 
-    i = 0;
-    done = 0;
 
-    memset((void *)&gw_addr,0, sizeof(gw_addr));
-    gw_addr.sin_family = AF_INET ;
-    gw_addr.sin_port = htons((uint16_t)port);
 
-    do {
-        int rc;
-        /* try each IP until we run out or get a connection. */
-        gw_addr.sin_addr.s_addr = ips[i].s_addr;
+/*
+ * resolver_refresh_handler
+ *
+ * Look up the host of a cache entry again without holding up anyone
+ * that wants its addresses.
+ */
+static THREAD_FUNC(resolver_refresh_handler)
+{
+    resolver_entry_p entry = (resolver_entry_p)arg;
+    struct in_addr ips[MAX_IPS];
+    int num_ips = 0;
+    int rc = PLCTAG_STATUS_OK;
 
-        pdebug(DEBUG_DETAIL, "Attempting to connect to %s",inet_ntoa(*((struct in_addr *)&ips[i])));
+    pdebug(DEBUG_DETAIL, "Refreshing addresses of %s.", entry->host);
 
-        rc = connect(fd,(struct sockaddr *)&gw_addr,sizeof(gw_addr));
+    rc = socket_resolve_host(entry->host, ips, &num_ips);
 
-        if( rc == 0) {
-            pdebug(DEBUG_DETAIL, "Attempt to connect to %s succeeded.",inet_ntoa(*((struct in_addr *)&ips[i])));
-            done = 1;
+    spin_block(&resolver_lock) {
+        if(rc == PLCTAG_STATUS_OK) {
+            mem_copy(entry->ips, ips, (int)(sizeof(ips[0]) * (size_t)num_ips));
+            entry->num_ips = num_ips;
+            entry->refresh_time = time_ms() + RESOLVER_CACHE_TTL_MS;
         } else {
-            pdebug(DEBUG_DETAIL, "Attempt to connect to %s failed, errno: %d",inet_ntoa(*((struct in_addr *)&ips[i])),errno);
-            i++;
+            entry->refresh_time = time_ms() + RESOLVER_RETRY_MS;
         }
-    } while(!done && i < num_ips);
 
-    if(!done) {
-        close(fd);
-        pdebug(DEBUG_ERROR, "Unable to connect to any gateway host IP address!");
-        return PLCTAG_ERR_OPEN;
+        entry->refreshing = 0;
     }
 
+    THREAD_RETURN(0);
+}
 
-    /* FIXME
-     * connect() is a little easier to handle in blocking mode, for now
-     * we make the socket non-blocking here, after connect(). */
-    flags=fcntl(fd,F_GETFL,0);
 
-    if(flags<0) {
-        pdebug(DEBUG_ERROR, "Error getting socket options, errno: %d", errno);
-        close(fd);
-        return PLCTAG_ERR_OPEN;
-    }
 
-    flags |= O_NONBLOCK;
+/*
+ * socket_lookup_host
+ *
+ * Find the IPv4 addresses for the passed host name or numeric IP.
+ */
+static int socket_lookup_host(const char *host, struct in_addr *ips, int *num_ips)
+{
+    resolver_entry_p entry = NULL;
+    thread_p old_thread = NULL;
+    int start_refresh = 0;
+    int rc = PLCTAG_STATUS_OK;
 
-    if(fcntl(fd,F_SETFL,flags)<0) {
-        pdebug(DEBUG_ERROR, "Error setting socket to non-blocking, errno: %d", errno);
-        close(fd);
-        return PLCTAG_ERR_OPEN;
+    *num_ips = 0;
+
+    mem_set(ips, 0, (int)(sizeof(*ips) * MAX_IPS));
+
+    /* try a numeric IP address conversion first. */
+    if(inet_pton(AF_INET, host, ips) > 0) {
+        pdebug(DEBUG_DETAIL, "Found numeric IP address: %s",host);
+        *num_ips = 1;
+        return PLCTAG_STATUS_OK;
     }
 
-    /* save the values */
-    s->fd = fd;
-    s->port = port;
+    spin_block(&resolver_lock) {
+        entry = resolver_find_unsafe(host);
 
-    pdebug(DEBUG_DETAIL, "Done.");
+        if(entry) {
+            resolver_stats.hits++;
 
-    return PLCTAG_STATUS_OK;
-}
+            mem_copy(ips, entry->ips, (int)(sizeof(ips[0]) * (size_t)entry->num_ips));
+            *num_ips = entry->num_ips;
 
+            if(!entry->refreshing && entry->refresh_time <= time_ms()) {
+                entry->refreshing = 1;
+                start_refresh = 1;
 
+                /* the last refresh is done, so this will not block. */
+                old_thread = entry->refresh_thread;
+                entry->refresh_thread = NULL;
+            }
+        } else {
+            resolver_stats.misses++;
+        }
+    }
 
+    if(entry) {
+        pdebug(DEBUG_DETAIL, "Found %d cached addresses for %s.", *num_ips, host);
 
-extern int socket_read(sock_p s, uint8_t *buf, int size)
-{
-    int rc;
+        if(old_thread) {
+            thread_join(old_thread);
+            thread_destroy(&old_thread);
+        }
 
-    if(!s || !buf) {
-        return PLCTAG_ERR_NULL_PTR;
-    }
+        if(start_refresh) {
+            spin_block(&resolver_lock) {
+                resolver_stats.refreshes++;
+            }
 
-    /* The socket is non-blocking. */
-    rc = (int)read(s->fd,buf,(size_t)size);
+            rc = thread_create(&entry->refresh_thread, resolver_refresh_handler, 32*1024, entry);
+            if(rc != PLCTAG_STATUS_OK) {
+                pdebug(DEBUG_WARN, "Unable to start the lookup of %s, error %s!", host, plc_tag_decode_error(rc));
 
-    if(rc < 0) {
-        if(errno == EAGAIN || errno == EWOULDBLOCK) {
-            return 0;
-        } else {
-            pdebug(DEBUG_WARN,"Socket read error: rc=%d, errno=%d", rc, errno);
-            return PLCTAG_ERR_READ;
+                /* the cached addresses are still good enough, try again later. */
+                spin_block(&resolver_lock) {
+                    entry->refresh_thread = NULL;
+                    entry->refresh_time = time_ms() + RESOLVER_RETRY_MS;
+                    entry->refreshing = 0;
+                }
+            }
         }
+
+        return PLCTAG_STATUS_OK;
     }
 
-    return rc;
-}
+    rc = socket_resolve_host(host, ips, num_ips);
+    if(rc != PLCTAG_STATUS_OK) {
+        return rc;
+    }
 
+    /* if we cannot cache the addresses, the next caller looks them up again. */
+    entry = (resolver_entry_p)mem_alloc((int)sizeof(struct resolver_entry_t));
+    if(!entry) {
+        return PLCTAG_STATUS_OK;
+    }
 
-extern int socket_write(sock_p s, uint8_t *buf, int size)
+    entry->host = str_dup(host);
+    if(!entry->host) {
+        mem_free(entry);
+        return PLCTAG_STATUS_OK;
+    }
+
+    mem_copy(entry->ips, ips, (int)(sizeof(ips[0]) * (size_t)*num_ips));
+    entry->num_ips = *num_ips;
+    entry->refresh_time = time_ms() + RESOLVER_CACHE_TTL_MS;
+
+    spin_block(&resolver_lock) {
+        /* someone else may have looked it up at the same time. */
+        if(!resolver_find_unsafe(host)) {
+            entry->next = resolver_cache;
+            resolver_cache = entry;
+            entry = NULL;
+        }
+    }
+
+    if(entry) {
+        mem_free(entry->host);
+        mem_free(entry);
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * socket_get_resolver_stats
+ *
+ * Copy out the counters of the host name cache.
+ */
+extern void socket_get_resolver_stats(socket_resolver_stats_t *stats)
+{
+    spin_block(&resolver_lock) {
+        *stats = resolver_stats;
+    }
+}
+
+
+
+/*
+ * socket_open_fd
+ *
+ * Create a non-blocking TCP socket with all our options set.
+ */
+static int socket_open_fd(int *fd_out)
+{
+    int sock_opt = 1;
+    int fd;
+    int flags;
+    struct linger so_linger; /* used to set up short/no lingering after connections are close()ed. */
+
+    /* Open a socket for communication with the gateway. */
+    fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+    /* check for errors */
+    if(fd < 0) {
+        pdebug(DEBUG_ERROR,"Socket creation failed, errno: %d",errno);
+        return PLCTAG_ERR_OPEN;
+    }
+
+    /* set up our socket to allow reuse if we crash suddenly. */
+    sock_opt = 1;
+
+    if(setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,(char*)&sock_opt,sizeof(sock_opt))) {
+        close(fd);
+        pdebug(DEBUG_ERROR, "Error setting socket reuse option, errno: %d",errno);
+        return PLCTAG_ERR_OPEN;
+    }
+
+#ifdef SO_NOSIGPIPE
+    /* On *BSD and macOS, set the socket option to prevent SIGPIPE. */
+    if(setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, (char*)&sock_opt, sizeof(sock_opt))) {
+        close(fd);
+        pdebug(DEBUG_ERROR, "Error setting socket SIGPIPE suppression option, errno: %d",errno);
+        return PLCTAG_ERR_OPEN;
+    }
+#endif
+
+    /* no send or receive timeouts, the socket never blocks. */
+
+    /* abort the connection immediately upon close. */
+    so_linger.l_onoff = 1;
+    so_linger.l_linger = 0;
+
+    if(setsockopt(fd, SOL_SOCKET, SO_LINGER,(char*)&so_linger,sizeof(so_linger))) {
+        close(fd);
+        pdebug(DEBUG_ERROR,"Error setting socket close linger option, errno: %d",errno);
+        return PLCTAG_ERR_OPEN;
+    }
+
+    /* several packets may be in flight, do not let Nagle hold them back. */
+    sock_opt = 1;
+
+    if(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char*)&sock_opt, sizeof(sock_opt))) {
+        close(fd);
+        pdebug(DEBUG_ERROR,"Error setting socket no-delay option, errno: %d",errno);
+        return PLCTAG_ERR_OPEN;
+    }
+
+    /* connect() and everything after it is non-blocking. */
+    flags=fcntl(fd,F_GETFL,0);
+
+    if(flags<0) {
+        pdebug(DEBUG_ERROR, "Error getting socket options, errno: %d", errno);
+        close(fd);
+        return PLCTAG_ERR_OPEN;
+    }
+
+    flags |= O_NONBLOCK;
+
+    if(fcntl(fd,F_SETFL,flags)<0) {
+        pdebug(DEBUG_ERROR, "Error setting socket to non-blocking, errno: %d", errno);
+        close(fd);
+        return PLCTAG_ERR_OPEN;
+    }
+
+    *fd_out = fd;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * socket_connect_done
+ *
+ * The passed descriptor got through.  Give up on all the other attempts
+ * and use it.
+ */
+static void socket_connect_done(sock_p s, int fd)
+{
+    for(int i=0; i < MAX_IPS; i++) {
+        if(s->attempt_fds[i] >= 0 && s->attempt_fds[i] != fd) {
+            /* closing it drops it out of any event loop too. */
+            close(s->attempt_fds[i]);
+        }
+
+        s->attempt_fds[i] = -1;
+    }
+
+    if(s->fd != fd) {
+        s->fd = fd;
+        s->watched = 0;
+    }
+
+    s->num_attempts = 0;
+    s->is_open = 1;
+}
+
+
+
+/*
+ * socket_connect_drop
+ *
+ * Give up on the connection attempt to the address at the passed index.
+ */
+static void socket_connect_drop(sock_p s, int index)
+{
+    int fd = s->attempt_fds[index];
+
+    close(fd);
+
+    s->attempt_fds[index] = -1;
+    s->num_attempts--;
+
+    /* watch another attempt instead. */
+    if(s->fd == fd) {
+        s->fd = -1;
+        s->watched = 0;
+
+        for(int i=0; i < MAX_IPS && s->fd < 0; i++) {
+            s->fd = s->attempt_fds[i];
+        }
+    }
+}
+
+
+
+/*
+ * socket_connect_next
+ *
+ * Start a connection attempt to the next address we have not tried.
+ * The attempts already going keep going.
+ */
+static int socket_connect_next(sock_p s)
+{
+    struct sockaddr_in gw_addr;
+    int rc = PLCTAG_STATUS_OK;
+    int fd = -1;
+
+    while(s->ip_index < s->num_ips) {
+        int index = s->ip_index;
+
+        s->ip_index++;
+
+        rc = socket_open_fd(&fd);
+        if(rc != PLCTAG_STATUS_OK) {
+            return rc;
+        }
+
+        mem_set((void *)&gw_addr, 0, sizeof(gw_addr));
+        gw_addr.sin_family = AF_INET ;
+        gw_addr.sin_port = htons((uint16_t)s->port);
+        gw_addr.sin_addr.s_addr = s->ips[index].s_addr;
+
+        pdebug(DEBUG_DETAIL, "Attempting to connect to %s",inet_ntoa(s->ips[index]));
+
+        rc = connect(fd,(struct sockaddr *)&gw_addr,sizeof(gw_addr));
+
+        if(rc == 0) {
+            pdebug(DEBUG_DETAIL, "Attempt to connect to %s succeeded.",inet_ntoa(s->ips[index]));
+            socket_connect_done(s, fd);
+            return PLCTAG_STATUS_OK;
+        }
+
+        if(errno == EINPROGRESS) {
+            pdebug(DEBUG_DETAIL, "Connection to %s is in progress.",inet_ntoa(s->ips[index]));
+
+            s->attempt_fds[index] = fd;
+            s->num_attempts++;
+            s->next_attempt_time = time_ms() + SOCKET_CONNECT_ATTEMPT_DELAY_MS;
+
+            if(s->fd < 0) {
+                s->fd = fd;
+            }
+
+            return PLCTAG_STATUS_PENDING;
+        }
+
+        pdebug(DEBUG_DETAIL, "Attempt to connect to %s failed, errno: %d",inet_ntoa(s->ips[index]),errno);
+
+        close(fd);
+    }
+
+    if(s->num_attempts > 0) {
+        return PLCTAG_STATUS_PENDING;
+    }
+
+    pdebug(DEBUG_ERROR, "Unable to connect to any gateway host IP address!");
+
+    return PLCTAG_ERR_OPEN;
+}
+
+
+
+/*
+ * socket_connect_tcp_start
+ *
+ * Look up the host and start a non-blocking connection to it.  Returns
+ * PLCTAG_STATUS_PENDING if the connection is in progress.  In that case
+ * socket_connect_tcp_check() must be called to find out how it went.
+ *
+ * If the host has several addresses, they race each other.  Every
+ * SOCKET_CONNECT_ATTEMPT_DELAY_MS without an answer, or as soon as an
+ * attempt fails, another address is tried without giving up on the
+ * ones already going.  The first one to connect wins.
+ */
+extern int socket_connect_tcp_start(sock_p s, const char *host, int port)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_DETAIL,"Starting.");
+
+    if(!s || !host) {
+        pdebug(DEBUG_WARN, "Null socket or host pointer!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(s->fd >= 0) {
+        pdebug(DEBUG_WARN, "Socket is already open!");
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    rc = socket_lookup_host(host, s->ips, &s->num_ips);
+    if(rc != PLCTAG_STATUS_OK) {
+        return rc;
+    }
+
+    s->ip_index = 0;
+    s->num_attempts = 0;
+    s->port = port;
+
+    rc = socket_connect_next(s);
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return rc;
+}
+
+
+
+/*
+ * socket_connect_tcp_check
+ *
+ * Wait up to timeout_ms for one of the connection attempts to finish.
+ * Failed attempts are dropped and the next address is tried when it is
+ * time.  Only the descriptor in fd is watched by an event loop, so call
+ * this every so often while connecting, not just when the socket is
+ * ready.
+ */
+extern int socket_connect_tcp_check(sock_p s, int timeout_ms)
+{
+    struct pollfd pfds[MAX_IPS];
+    int indexes[MAX_IPS];
+    int num_pfds = 0;
+    int rc = 0;
+
+    if(!s) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(s->is_open) {
+        return PLCTAG_STATUS_OK;
+    }
+
+    if(s->num_attempts == 0) {
+        return PLCTAG_ERR_OPEN;
+    }
+
+    /* do not wait past the time to start the next attempt. */
+    if(s->ip_index < s->num_ips) {
+        int64_t until_next = s->next_attempt_time - time_ms();
+
+        if(until_next < timeout_ms) {
+            timeout_ms = (until_next > 0 ? (int)until_next : 0);
+        }
+    }
+
+    for(int i=0; i < MAX_IPS; i++) {
+        if(s->attempt_fds[i] >= 0) {
+            pfds[num_pfds].fd = s->attempt_fds[i];
+            pfds[num_pfds].events = POLLOUT;
+            pfds[num_pfds].revents = 0;
+            indexes[num_pfds] = i;
+            num_pfds++;
+        }
+    }
+
+    rc = poll(pfds, (nfds_t)num_pfds, timeout_ms);
+    if(rc < 0 && errno != EINTR) {
+        pdebug(DEBUG_WARN, "Error waiting for connection, errno: %d", errno);
+        return PLCTAG_ERR_OPEN;
+    }
+
+    for(int i=0; rc > 0 && i < num_pfds; i++) {
+        int sock_err = 0;
+        socklen_t sock_err_len = (socklen_t)sizeof(sock_err);
+
+        if(!pfds[i].revents) {
+            continue;
+        }
+
+        if(getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &sock_err, &sock_err_len) < 0) {
+            sock_err = errno;
+        }
+
+        if(sock_err == 0) {
+            pdebug(DEBUG_DETAIL, "Connection to %s succeeded.",inet_ntoa(s->ips[indexes[i]]));
+            socket_connect_done(s, pfds[i].fd);
+            return PLCTAG_STATUS_OK;
+        }
+
+        pdebug(DEBUG_DETAIL, "Connection to %s failed, errno: %d",inet_ntoa(s->ips[indexes[i]]),sock_err);
+
+        socket_connect_drop(s, indexes[i]);
+    }
+
+    /* bring in the next address if the others are slow or all failed. */
+    if(s->ip_index < s->num_ips && (s->num_attempts == 0 || s->next_attempt_time <= time_ms())) {
+        return socket_connect_next(s);
+    }
+
+    if(s->num_attempts == 0) {
+        pdebug(DEBUG_ERROR, "Unable to connect to any gateway host IP address!");
+        return PLCTAG_ERR_OPEN;
+    }
+
+    return PLCTAG_STATUS_PENDING;
+}
+
+
+
+extern int socket_connect_tcp(sock_p s, const char *host, int port)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_DETAIL,"Starting.");
+
+    rc = socket_connect_tcp_start(s, host, port);
+
+    while(rc == PLCTAG_STATUS_PENDING) {
+        rc = socket_connect_tcp_check(s, 100);
+    }
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return rc;
+}
+
+
+
+
+extern int socket_read(sock_p s, uint8_t *buf, int size)
+{
+    int rc;
+
+    if(!s || !buf) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    /* The socket is non-blocking. */
+    rc = (int)read(s->fd,buf,(size_t)size);
+
+    if(rc == 0 && size > 0) {
+        pdebug(DEBUG_WARN,"Socket closed by the remote end.");
+        return PLCTAG_ERR_READ;
+    }
+
+    if(rc < 0) {
+        if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        } else {
+            pdebug(DEBUG_WARN,"Socket read error: rc=%d, errno=%d", rc, errno);
+            return PLCTAG_ERR_READ;
+        }
+    }
+
+    return rc;
+}
+
+
+extern int socket_write(sock_p s, uint8_t *buf, int size)
+{
+    int rc;
+
+    if(!s || !buf) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    /* The socket is non-blocking. */
+#ifdef SO_NOSIGPIPE
+    /* On *BSD and macOS, the socket option is set to prevent SIGPIPE. */
+    rc = (int)write(s->fd, buf, (size_t)size);
+#else
+    /* on Linux, we use MSG_NOSIGNAL */
+    rc = (int)send(s->fd, buf, (size_t)size, MSG_NOSIGNAL);
+#endif
+
+    if(rc < 0) {
+        if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            return PLCTAG_ERR_NO_DATA;
+        } else {
+            pdebug(DEBUG_WARN, "Socket write error: rc=%d, errno=%d", rc, errno);
+            return PLCTAG_ERR_WRITE;
+        }
+    }
+
+    return rc;
+}
+
+
+
+/*
+ * socket_write_bufs
+ *
+ * Gather write of several buffers in one call.  At most
+ * SOCKET_MAX_WRITE_BUFS are sent at once.  Returns the number of bytes
+ * written which may be less than the total, like socket_write().
+ */
+extern int socket_write_bufs(sock_p s, sock_buf_t *bufs, int num_bufs)
+{
+    struct iovec iov[SOCKET_MAX_WRITE_BUFS];
+    struct msghdr msg;
+    int flags = 0;
+    int rc;
+
+    if(!s || !bufs) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(num_bufs > SOCKET_MAX_WRITE_BUFS) {
+        num_bufs = SOCKET_MAX_WRITE_BUFS;
+    }
+
+    for(int i=0; i < num_bufs; i++) {
+        iov[i].iov_base = bufs[i].data;
+        iov[i].iov_len = (size_t)bufs[i].size;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = (size_t)num_bufs;
+
+#ifndef SO_NOSIGPIPE
+    /* on Linux, we use MSG_NOSIGNAL */
+    flags = MSG_NOSIGNAL;
+#endif
+
+    /* The socket is non-blocking. */
+    rc = (int)sendmsg(s->fd, &msg, flags);
+
+    if(rc < 0) {
+        if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            return PLCTAG_ERR_NO_DATA;
+        } else {
+            pdebug(DEBUG_WARN, "Socket write error: rc=%d, errno=%d", rc, errno);
+            return PLCTAG_ERR_WRITE;
+        }
+    }
+
+    return rc;
+}
+
+
+
+extern int socket_close(sock_p s)
+{
+    int rc = 0;
+
+    /*pdebug(1,"Starting.");*/
+
+    if(!s)
+        return PLCTAG_ERR_NULL_PTR;
+
+    /* give up on any connection attempts that are still going. */
+    for(int i=0; i < MAX_IPS; i++) {
+        if(s->attempt_fds[i] >= 0 && s->attempt_fds[i] != s->fd) {
+            close(s->attempt_fds[i]);
+        }
+
+        s->attempt_fds[i] = -1;
+    }
+
+    s->num_attempts = 0;
+
+    if(s->fd < 0) {
+        return PLCTAG_STATUS_OK;
+    }
+
+    rc = close(s->fd);
+
+    /* do not close it twice, the descriptor may be reused. */
+    s->fd = -1;
+    s->is_open = 0;
+    s->watched = 0;
+
+    return rc;
+}
+
+
+extern int socket_destroy(sock_p *s)
+{
+    if(!s || !*s)
+        return PLCTAG_ERR_NULL_PTR;
+
+    socket_close(*s);
+
+    mem_free(*s);
+
+    *s = 0;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/***************************************************************************
+ ******************************* Event Loop ********************************
+ **************************************************************************/
+
+/*
+ * An event loop lets one thread wait for activity on many sockets.
+ * Each watched socket carries a context pointer that is handed back
+ * when the socket is ready.  Any thread can wake up the waiting thread
+ * with event_loop_wake().
+ *
+ * On Linux this is epoll plus an eventfd.  Other UNIX-like systems
+ * fall back to poll() on a table of sockets plus a pipe.
+ */
+
+#define EVENT_LOOP_MAX_READY (64)
+
+#ifdef __linux__
+
+struct event_loop_t {
+    int epoll_fd;
+    int wake_fd;
+};
+
+
+int event_loop_create(event_loop_p *loop)
 {
-    int rc;
+    event_loop_p new_loop = NULL;
+    struct epoll_event ev;
 
-    if(!s || !buf) {
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    if(!loop) {
+        pdebug(DEBUG_WARN, "Null event loop pointer!");
         return PLCTAG_ERR_NULL_PTR;
     }
 
-    /* The socket is non-blocking. */
-#ifdef SO_NOSIGPIPE
-    /* On *BSD and macOS, the socket option is set to prevent SIGPIPE. */
-    rc = (int)write(s->fd, buf, (size_t)size);
-#else
-    /* on Linux, we use MSG_NOSIGNAL */
-    rc = (int)send(s->fd, buf, (size_t)size, MSG_NOSIGNAL);
-#endif
+    new_loop = (event_loop_p)mem_alloc((int)sizeof(struct event_loop_t));
+    if(!new_loop) {
+        pdebug(DEBUG_ERROR, "Unable to allocate memory for event loop!");
+        return PLCTAG_ERR_NO_MEM;
+    }
 
-    if(rc < 0) {
-        if(errno == EAGAIN || errno == EWOULDBLOCK) {
-            return PLCTAG_ERR_NO_DATA;
+    new_loop->wake_fd = -1;
+
+    new_loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(new_loop->epoll_fd < 0) {
+        pdebug(DEBUG_ERROR, "Unable to create epoll instance, errno: %d", errno);
+        mem_free(new_loop);
+        return PLCTAG_ERR_CREATE;
+    }
+
+    new_loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(new_loop->wake_fd < 0) {
+        pdebug(DEBUG_ERROR, "Unable to create wake up eventfd, errno: %d", errno);
+        event_loop_destroy(&new_loop);
+        return PLCTAG_ERR_CREATE;
+    }
+
+    /* the wake up descriptor is the only one with a null context. */
+    mem_set(&ev, 0, (int)sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+
+    if(epoll_ctl(new_loop->epoll_fd, EPOLL_CTL_ADD, new_loop->wake_fd, &ev) < 0) {
+        pdebug(DEBUG_ERROR, "Unable to add wake up eventfd to epoll instance, errno: %d", errno);
+        event_loop_destroy(&new_loop);
+        return PLCTAG_ERR_CREATE;
+    }
+
+    *loop = new_loop;
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+int event_loop_watch(event_loop_p loop, sock_p s, int events, void *context)
+{
+    struct epoll_event ev;
+    int op = EPOLL_CTL_MOD;
+
+    if(!loop || !s || !context) {
+        pdebug(DEBUG_WARN, "Called with null event loop, socket or context!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(s->fd < 0) {
+        pdebug(DEBUG_WARN, "Socket is not open!");
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    /* nothing changed, save the system call. */
+    if(s->watched == events) {
+        return PLCTAG_STATUS_OK;
+    }
+
+    mem_set(&ev, 0, (int)sizeof(ev));
+    ev.events = ((events & EVENT_LOOP_READ) ? EPOLLIN : 0) | ((events & EVENT_LOOP_WRITE) ? EPOLLOUT : 0);
+    ev.data.ptr = context;
+
+    if(!s->watched) {
+        op = EPOLL_CTL_ADD;
+    }
+
+    if(epoll_ctl(loop->epoll_fd, op, s->fd, &ev) < 0) {
+        pdebug(DEBUG_WARN, "Unable to watch socket, errno: %d", errno);
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    s->watched = events;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+int event_loop_unwatch(event_loop_p loop, sock_p s)
+{
+    struct epoll_event ev;
+
+    if(!loop || !s) {
+        pdebug(DEBUG_WARN, "Called with null event loop or socket!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(!s->watched) {
+        return PLCTAG_STATUS_OK;
+    }
+
+    s->watched = 0;
+
+    /* older kernels want a non-null event pointer even for deletes. */
+    mem_set(&ev, 0, (int)sizeof(ev));
+
+    if(s->fd >= 0 && epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, s->fd, &ev) < 0) {
+        pdebug(DEBUG_WARN, "Unable to stop watching socket, errno: %d", errno);
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * event_loop_wait
+ *
+ * Wait up to timeout_ms milliseconds (forever if negative) for sockets
+ * to become ready or for a wake up.  The contexts of ready sockets are
+ * stored in ready[] and the number of them is returned.  A wake up or
+ * a timeout returns zero.
+ */
+int event_loop_wait(event_loop_p loop, void **ready, int max_ready, int timeout_ms)
+{
+    struct epoll_event events[EVENT_LOOP_MAX_READY];
+    int num_events = 0;
+    int num_ready = 0;
+
+    if(!loop || !ready) {
+        pdebug(DEBUG_WARN, "Called with null event loop or ready list!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(max_ready > EVENT_LOOP_MAX_READY) {
+        max_ready = EVENT_LOOP_MAX_READY;
+    }
+
+    num_events = epoll_wait(loop->epoll_fd, events, max_ready, timeout_ms);
+    if(num_events < 0) {
+        if(errno == EINTR) {
+            return 0;
+        }
+
+        pdebug(DEBUG_WARN, "Error waiting for events, errno: %d", errno);
+        return PLCTAG_ERR_READ;
+    }
+
+    for(int i=0; i < num_events; i++) {
+        if(events[i].data.ptr) {
+            ready[num_ready] = events[i].data.ptr;
+            num_ready++;
         } else {
-            pdebug(DEBUG_WARN, "Socket write error: rc=%d, errno=%d", rc, errno);
-            return PLCTAG_ERR_WRITE;
+            uint64_t count = 0;
+
+            /* drain the wake ups. */
+            if(read(loop->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                pdebug(DEBUG_WARN, "Error reading wake up eventfd, errno: %d", errno);
+            }
         }
     }
 
-    return rc;
+    return num_ready;
 }
 
 
 
-extern int socket_close(sock_p s)
+int event_loop_wake(event_loop_p loop)
 {
-    /*pdebug(1,"Starting.");*/
+    uint64_t one = 1;
 
-    if(!s)
+    if(!loop) {
+        pdebug(DEBUG_WARN, "Called with null event loop!");
         return PLCTAG_ERR_NULL_PTR;
+    }
 
-    return close(s->fd);
+    /* EAGAIN means the counter is saturated, and a wake up is already pending. */
+    if(write(loop->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        pdebug(DEBUG_WARN, "Error writing wake up eventfd, errno: %d", errno);
+        return PLCTAG_ERR_WRITE;
+    }
+
+    return PLCTAG_STATUS_OK;
 }
 
 
-extern int socket_destroy(sock_p *s)
+
+int event_loop_destroy(event_loop_p *loop)
 {
-    if(!s || !*s)
+    if(!loop || !*loop) {
         return PLCTAG_ERR_NULL_PTR;
+    }
 
-    socket_close(*s);
+    if((*loop)->wake_fd >= 0) {
+        close((*loop)->wake_fd);
+    }
+
+    if((*loop)->epoll_fd >= 0) {
+        close((*loop)->epoll_fd);
+    }
+
+    mem_free(*loop);
+
+    *loop = NULL;
+
+    return PLCTAG_STATUS_OK;
+}
+
+#else /* not __linux__ */
+
+struct event_loop_entry_t {
+    sock_p sock;
+    int events;
+    void *context;
+};
+
+struct event_loop_t {
+    pthread_mutex_t mutex;
+    int wake_fds[2];
+    int num_entries;
+    int entry_capacity;
+    struct event_loop_entry_t *entries;
+    struct pollfd *poll_fds;
+    void **poll_contexts;
+    int poll_capacity;
+};
+
+
+int event_loop_create(event_loop_p *loop)
+{
+    event_loop_p new_loop = NULL;
+
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    if(!loop) {
+        pdebug(DEBUG_WARN, "Null event loop pointer!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    new_loop = (event_loop_p)mem_alloc((int)sizeof(struct event_loop_t));
+    if(!new_loop) {
+        pdebug(DEBUG_ERROR, "Unable to allocate memory for event loop!");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    if(pipe(new_loop->wake_fds) < 0) {
+        pdebug(DEBUG_ERROR, "Unable to create wake up pipe, errno: %d", errno);
+        mem_free(new_loop);
+        return PLCTAG_ERR_CREATE;
+    }
+
+    fcntl(new_loop->wake_fds[0], F_SETFL, fcntl(new_loop->wake_fds[0], F_GETFL, 0) | O_NONBLOCK);
+    fcntl(new_loop->wake_fds[1], F_SETFL, fcntl(new_loop->wake_fds[1], F_GETFL, 0) | O_NONBLOCK);
+
+    if(pthread_mutex_init(&new_loop->mutex, NULL)) {
+        pdebug(DEBUG_ERROR, "Unable to initialize event loop mutex!");
+        close(new_loop->wake_fds[0]);
+        close(new_loop->wake_fds[1]);
+        mem_free(new_loop);
+        return PLCTAG_ERR_MUTEX_INIT;
+    }
+
+    *loop = new_loop;
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+int event_loop_watch(event_loop_p loop, sock_p s, int events, void *context)
+{
+    int rc = PLCTAG_STATUS_OK;
+    int index = -1;
+
+    if(!loop || !s || !context) {
+        pdebug(DEBUG_WARN, "Called with null event loop, socket or context!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    pthread_mutex_lock(&loop->mutex);
+
+    for(int i=0; i < loop->num_entries; i++) {
+        if(loop->entries[i].sock == s) {
+            index = i;
+            break;
+        }
+    }
+
+    if(index < 0) {
+        if(loop->num_entries >= loop->entry_capacity) {
+            int new_capacity = loop->entry_capacity + 16;
+            struct event_loop_entry_t *new_entries = mem_realloc(loop->entries, new_capacity * (int)sizeof(struct event_loop_entry_t));
+
+            if(new_entries) {
+                loop->entries = new_entries;
+                loop->entry_capacity = new_capacity;
+            } else {
+                rc = PLCTAG_ERR_NO_MEM;
+            }
+        }
+
+        if(rc == PLCTAG_STATUS_OK) {
+            index = loop->num_entries;
+            loop->num_entries++;
+        }
+    }
+
+    if(rc == PLCTAG_STATUS_OK) {
+        loop->entries[index].sock = s;
+        loop->entries[index].events = events;
+        loop->entries[index].context = context;
+        s->watched = 1;
+    }
+
+    pthread_mutex_unlock(&loop->mutex);
+
+    /* the waiting thread needs to pick up the new set of sockets. */
+    event_loop_wake(loop);
+
+    return rc;
+}
+
+
+
+int event_loop_unwatch(event_loop_p loop, sock_p s)
+{
+    if(!loop || !s) {
+        pdebug(DEBUG_WARN, "Called with null event loop or socket!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    pthread_mutex_lock(&loop->mutex);
+
+    for(int i=0; i < loop->num_entries; i++) {
+        if(loop->entries[i].sock == s) {
+            loop->num_entries--;
+            loop->entries[i] = loop->entries[loop->num_entries];
+            break;
+        }
+    }
+
+    s->watched = 0;
+
+    pthread_mutex_unlock(&loop->mutex);
+
+    event_loop_wake(loop);
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+int event_loop_wait(event_loop_p loop, void **ready, int max_ready, int timeout_ms)
+{
+    int num_fds = 0;
+    int num_ready = 0;
+    int rc = 0;
+
+    if(!loop || !ready) {
+        pdebug(DEBUG_WARN, "Called with null event loop or ready list!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    /* take a snapshot of the sockets to watch. */
+    pthread_mutex_lock(&loop->mutex);
+
+    if(loop->poll_capacity < loop->num_entries + 1) {
+        struct pollfd *new_fds = mem_realloc(loop->poll_fds, (loop->num_entries + 1) * (int)sizeof(struct pollfd));
+        void **new_contexts = NULL;
+
+        if(new_fds) {
+            loop->poll_fds = new_fds;
+
+            new_contexts = mem_realloc(loop->poll_contexts, (loop->num_entries + 1) * (int)sizeof(void *));
+            if(new_contexts) {
+                loop->poll_contexts = new_contexts;
+                loop->poll_capacity = loop->num_entries + 1;
+            }
+        }
+    }
+
+    if(loop->poll_capacity > 0) {
+        loop->poll_fds[0].fd = loop->wake_fds[0];
+        loop->poll_fds[0].events = POLLIN;
+        loop->poll_fds[0].revents = 0;
+        num_fds = 1;
+
+        for(int i=0; i < loop->num_entries && num_fds < loop->poll_capacity; i++) {
+            loop->poll_fds[num_fds].fd = loop->entries[i].sock->fd;
+            loop->poll_fds[num_fds].events = (short)(((loop->entries[i].events & EVENT_LOOP_READ) ? POLLIN : 0) | ((loop->entries[i].events & EVENT_LOOP_WRITE) ? POLLOUT : 0));
+            loop->poll_fds[num_fds].revents = 0;
+            loop->poll_contexts[num_fds] = loop->entries[i].context;
+
+            num_fds++;
+        }
+    }
+
+    pthread_mutex_unlock(&loop->mutex);
+
+    if(!num_fds) {
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    rc = poll(loop->poll_fds, (nfds_t)num_fds, timeout_ms);
+    if(rc < 0) {
+        if(errno == EINTR) {
+            return 0;
+        }
+
+        pdebug(DEBUG_WARN, "Error waiting for events, errno: %d", errno);
+        return PLCTAG_ERR_READ;
+    }
+
+    if(loop->poll_fds[0].revents) {
+        uint8_t buf[32];
+
+        /* drain the wake ups. */
+        while(read(loop->wake_fds[0], buf, sizeof(buf)) > 0) { }
+    }
+
+    for(int i=1; i < num_fds && num_ready < max_ready; i++) {
+        if(loop->poll_fds[i].revents) {
+            ready[num_ready] = loop->poll_contexts[i];
+            num_ready++;
+        }
+    }
+
+    return num_ready;
+}
 
-    mem_free(*s);
 
-    *s = 0;
+
+int event_loop_wake(event_loop_p loop)
+{
+    uint8_t one = 1;
+
+    if(!loop) {
+        pdebug(DEBUG_WARN, "Called with null event loop!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    /* EAGAIN means the pipe is full, and a wake up is already pending. */
+    if(write(loop->wake_fds[1], &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        pdebug(DEBUG_WARN, "Error writing wake up pipe, errno: %d", errno);
+        return PLCTAG_ERR_WRITE;
+    }
 
     return PLCTAG_STATUS_OK;
 }
 
 
 
+int event_loop_destroy(event_loop_p *loop)
+{
+    if(!loop || !*loop) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    close((*loop)->wake_fds[0]);
+    close((*loop)->wake_fds[1]);
+
+    pthread_mutex_destroy(&(*loop)->mutex);
+
+    if((*loop)->entries) {
+        mem_free((*loop)->entries);
+    }
+
+    if((*loop)->poll_fds) {
+        mem_free((*loop)->poll_fds);
+    }
+
+    if((*loop)->poll_contexts) {
+        mem_free((*loop)->poll_contexts);
+    }
+
+    mem_free(*loop);
+
+    *loop = NULL;
+
+    return PLCTAG_STATUS_OK;
+}
+
+#endif /* __linux__ */
 
 
 
@@ -103,6 +103,14 @@ extern int mutex_try_lock(mutex_p m);
 extern int mutex_unlock(mutex_p m);
 extern int mutex_destroy(mutex_p *m);
 
+/* condition variables, these act like auto-reset events with one waiter */
+typedef struct cond_t *cond_p;
+extern int cond_create(cond_p *c);
+extern int cond_wait(cond_p c, int timeout_ms);
+extern int cond_signal(cond_p c);
+extern int cond_clear(cond_p c);
+extern int cond_destroy(cond_p *c);
+
 
 
 /* macros are evil */
@@ -159,11 +167,47 @@ extern void lock_release(lock_t *lock);
 typedef struct sock_t *sock_p;
 extern int socket_create(sock_p *s);
 extern int socket_connect_tcp(sock_p s, const char *host, int port);
+extern int socket_connect_tcp_start(sock_p s, const char *host, int port);
+extern int socket_connect_tcp_check(sock_p s, int timeout_ms);
 extern int socket_read(sock_p s, uint8_t *buf, int size);
 extern int socket_write(sock_p s, uint8_t *buf, int size);
+
+/* one piece of a packet for socket_write_bufs(). */
+typedef struct {
+    uint8_t *data;
+    int size;
+} sock_buf_t;
+
+#define SOCKET_MAX_WRITE_BUFS (256)
+
+extern int socket_write_bufs(sock_p s, sock_buf_t *bufs, int num_bufs);
 extern int socket_close(sock_p s);
 extern int socket_destroy(sock_p *s);
 
+/* counters for the library wide cache of host name lookups. */
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t refreshes;  /* background lookups started. */
+    uint64_t failures;
+    uint64_t lookups;    /* name service lookups, in the foreground or background. */
+    int64_t lookup_total_ms;
+    int64_t lookup_max_ms;
+} socket_resolver_stats_t;
+
+extern void socket_get_resolver_stats(socket_resolver_stats_t *stats);
+
+/* event loop for waiting on many sockets at once */
+typedef struct event_loop_t *event_loop_p;
+#define EVENT_LOOP_READ     (1)
+#define EVENT_LOOP_WRITE    (2)
+extern int event_loop_create(event_loop_p *loop);
+extern int event_loop_watch(event_loop_p loop, sock_p s, int events, void *context);
+extern int event_loop_unwatch(event_loop_p loop, sock_p s);
+extern int event_loop_wait(event_loop_p loop, void **ready, int max_ready, int timeout_ms);
+extern int event_loop_wake(event_loop_p loop);
+extern int event_loop_destroy(event_loop_p *loop);
+
 /* serial handling */
 typedef struct serial_port_t *serial_port_p;
 #define PLC_SERIAL_PORT_NULL ((plc_serial_port)NULL)
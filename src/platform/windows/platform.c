@@ -49,6 +49,8 @@
 #include <process.h>
 #include <time.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <inttypes.h>
 
 #include <lib/libplctag.h>
 #include <util/debug.h>
@@ -585,6 +587,156 @@ int mutex_destroy(mutex_p *m)
 
 
 
+/***************************************************************************
+ ************************* Condition Variables *****************************
+ **************************************************************************/
+
+/*
+ * These work like an auto-reset event.  A signal is remembered until a
+ * waiter picks it up, so a signal that comes in before the wait starts
+ * is not lost.  They are meant to have a single waiter.
+ */
+
+struct cond_t {
+    CRITICAL_SECTION cs;
+    CONDITION_VARIABLE cond;
+    int flag;
+};
+
+
+int cond_create(cond_p *c)
+{
+    if(!c) {
+        pdebug(DEBUG_WARN, "null condition var pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    *c = (struct cond_t *)mem_alloc(sizeof(struct cond_t));
+
+    if(! *c) {
+        pdebug(DEBUG_ERROR,"Unable to allocate condition var.");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    InitializeCriticalSection(&((*c)->cs));
+    InitializeConditionVariable(&((*c)->cond));
+
+    (*c)->flag = 0;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * cond_wait
+ *
+ * Wait until the condition var is signaled or the timeout passes.
+ * Returns PLCTAG_ERR_TIMEOUT if there was no signal in time.
+ */
+int cond_wait(cond_p c, int timeout_ms)
+{
+    int rc = PLCTAG_STATUS_OK;
+    int64_t deadline = 0;
+
+    if(!c) {
+        pdebug(DEBUG_WARN, "null condition var pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(timeout_ms < 0) {
+        timeout_ms = 0;
+    }
+
+    deadline = time_ms() + timeout_ms;
+
+    EnterCriticalSection(&(c->cs));
+
+    while(!c->flag) {
+        int64_t remaining = deadline - time_ms();
+
+        if(remaining <= 0) {
+            break;
+        }
+
+        /* wakes up spuriously or on timeout, the loop sorts it out. */
+        SleepConditionVariableCS(&(c->cond), &(c->cs), (DWORD)remaining);
+    }
+
+    if(c->flag) {
+        /* we took the signal. */
+        c->flag = 0;
+        rc = PLCTAG_STATUS_OK;
+    } else {
+        rc = PLCTAG_ERR_TIMEOUT;
+    }
+
+    LeaveCriticalSection(&(c->cs));
+
+    return rc;
+}
+
+
+
+int cond_signal(cond_p c)
+{
+    if(!c) {
+        pdebug(DEBUG_WARN, "null condition var pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    EnterCriticalSection(&(c->cs));
+
+    c->flag = 1;
+    WakeConditionVariable(&(c->cond));
+
+    LeaveCriticalSection(&(c->cs));
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+int cond_clear(cond_p c)
+{
+    if(!c) {
+        pdebug(DEBUG_WARN, "null condition var pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    EnterCriticalSection(&(c->cs));
+
+    c->flag = 0;
+
+    LeaveCriticalSection(&(c->cs));
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+int cond_destroy(cond_p *c)
+{
+    if(!c || !*c) {
+        pdebug(DEBUG_WARN, "null condition var pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    DeleteCriticalSection(&((*c)->cs));
+
+    mem_free(*c);
+
+    *c = NULL;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+
+
+
+
 /***************************************************************************
  ******************************* Threads ***********************************
  **************************************************************************/
@@ -804,14 +956,31 @@ extern void lock_release(lock_t *lock)
  **************************************************************************/
 
 
+#define MAX_IPS (8)
+
+/* how long a connection attempt gets before the next address is tried too. */
+#define SOCKET_CONNECT_ATTEMPT_DELAY_MS (250)
+
 struct sock_t {
     SOCKET fd;
     int port;
     int is_open;
-};
+    int watched;
 
+    /* addresses to try when connecting. */
+    IN_ADDR ips[MAX_IPS];
+    int num_ips;
+    int ip_index;
 
-#define MAX_IPS (8)
+    /*
+     * connection attempts racing each other, one per address,
+     * INVALID_SOCKET if there is none.  While connecting, fd is one of
+     * these.
+     */
+    SOCKET attempt_fds[MAX_IPS];
+    int num_attempts;
+    int64_t next_attempt_time;
+};
 
 
 /* windows needs to have the Winsock library initialized
@@ -848,6 +1017,12 @@ extern int socket_create(sock_p *s)
         return PLCTAG_ERR_NO_MEM;
     }
 
+    (*s)->fd = INVALID_SOCKET;
+
+    for(int i=0; i < MAX_IPS; i++) {
+        (*s)->attempt_fds[i] = INVALID_SOCKET;
+    }
+
     pdebug(DEBUG_DETAIL, "Done.");
 
     return PLCTAG_STATUS_OK;
@@ -855,244 +1030,769 @@ extern int socket_create(sock_p *s)
 
 
 
-extern int socket_connect_tcp(sock_p s, const char *host, int port)
-{
-    IN_ADDR ips[MAX_IPS];
-    int num_ips = 0;
-    struct sockaddr_in gw_addr;
-    int sock_opt = 1;
-    u_long non_blocking=1;
-    int i = 0;
-    int done = 0;
-    SOCKET fd;
-    struct timeval timeout; /* used for timing out connections etc. */
-    struct linger so_linger;
-
-    pdebug(DEBUG_DETAIL, "Starting.");
-
-    /* Open a socket for communication with the gateway. */
-    fd = socket(AF_INET, SOCK_STREAM, 0/*IPPROTO_TCP*/);
-
-    /* check for errors */
-    if(fd < 0) {
-        /*pdebug("Socket creation failed, errno: %d",errno);*/
-        return PLCTAG_ERR_OPEN;
-    }
-
-    /* set up our socket to allow reuse if we crash suddenly. */
-    sock_opt = 1;
+/*
+ * Host name lookups are cached for the whole library, so all the
+ * sessions to a gateway share them.  A name is only looked up while the
+ * caller waits the first time it is used.  After that, the cached
+ * addresses are handed out right away.  Once they are older than
+ * RESOLVER_CACHE_TTL_MS, they are looked up again in the background.
+ * If that fails, the old addresses keep being used.
+ */
 
-    if(setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,(char*)&sock_opt,sizeof(sock_opt))) {
-        closesocket(fd);
-        pdebug(DEBUG_WARN,"Error setting socket reuse option, errno: %d",errno);
-        return PLCTAG_ERR_OPEN;
-    }
+#define RESOLVER_CACHE_TTL_MS (60000)
 
-    timeout.tv_sec = 10;
-    timeout.tv_usec = 0;
+/* how soon to try again after a background lookup failed. */
+#define RESOLVER_RETRY_MS (5000)
 
-    if(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout))) {
-        closesocket(fd);
-        pdebug(DEBUG_WARN,"Error setting socket receive timeout option, errno: %d",errno);
-        return PLCTAG_ERR_OPEN;
-    }
+typedef struct resolver_entry_t *resolver_entry_p;
 
-    if(setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(timeout))) {
-        closesocket(fd);
-        pdebug(DEBUG_WARN,"Error setting socket set timeout option, errno: %d",errno);
-        return PLCTAG_ERR_OPEN;
-    }
+struct resolver_entry_t {
+    resolver_entry_p next;
+    char *host;
 
-    /* abort the connection on close. */
-    so_linger.l_onoff = 1;
-    so_linger.l_linger = 0;
+    IN_ADDR ips[MAX_IPS];
+    int num_ips;
 
-    if(setsockopt(fd, SOL_SOCKET, SO_LINGER,(char*)&so_linger,sizeof(so_linger))) {
-        closesocket(fd);
-        pdebug(DEBUG_ERROR,"Error setting socket close linger option, errno: %d",errno);
-        return PLCTAG_ERR_OPEN;
-    }
+    /* when to look the host up again. */
+    int64_t refresh_time;
 
-    /* figure out what address we are connecting to. */
+    /* the background lookup, it is done when refreshing is zero. */
+    int refreshing;
+    thread_p refresh_thread;
+};
 
-    /* try a numeric IP address conversion first. */
-    if(inet_pton(AF_INET,host,(struct in_addr *)ips) > 0) {
-        pdebug(DEBUG_DETAIL, "Found numeric IP address: %s", host);
-        num_ips = 1;
-    } else {
-        struct addrinfo hints;
-        struct addrinfo *res = NULL;
-        int rc = 0;
+static lock_t resolver_lock = LOCK_INIT;
+static resolver_entry_p resolver_cache = NULL;
+static socket_resolver_stats_t resolver_stats;
 
-        mem_set(&ips, 0, sizeof(ips));
-        mem_set(&hints, 0, sizeof(hints));
 
-        hints.ai_socktype = SOCK_STREAM; /* TCP */
-        hints.ai_family = AF_INET; /* IP V4 only */
 
-        if ((rc = getaddrinfo(host, NULL, &hints, &res)) != 0) {
-            pdebug(DEBUG_WARN, "Error looking up PLC IP address %s, error = %d\n", host, rc);
+/*
+ * socket_resolve_host
+ *
+ * Look up the IPv4 addresses for the passed host name.  This can
+ * block for as long as the name service takes.
+ */
+static int socket_resolve_host(const char *host, IN_ADDR *ips, int *num_ips)
+{
+    struct addrinfo hints;
+    struct addrinfo *res_head = NULL;
+    struct addrinfo *res = NULL;
+    int64_t start_time = time_ms();
+    int64_t lookup_ms = 0;
+    int rc = PLCTAG_STATUS_OK;
+    int gai_rc = 0;
 
-            if (res) {
-                freeaddrinfo(res);
-            }
+    *num_ips = 0;
 
-            return PLCTAG_ERR_BAD_GATEWAY;
-        }
+    mem_set(&hints, 0, sizeof(hints));
 
-        for (num_ips = 0; res && num_ips < MAX_IPS; num_ips++) {
-            ips[num_ips].s_addr = ((struct sockaddr_in *)(res->ai_addr))->sin_addr.s_addr;
-            res = res->ai_next;
-        }
+    hints.ai_socktype = SOCK_STREAM; /* TCP */
+    hints.ai_family = AF_INET; /* IP V4 only */
 
-        freeaddrinfo(res);
+    if ((gai_rc = getaddrinfo(host, NULL, &hints, &res_head)) != 0) {
+        pdebug(DEBUG_WARN, "Error looking up PLC IP address %s, error = %d\n", host, gai_rc);
+        rc = PLCTAG_ERR_BAD_GATEWAY;
     }
 
+    for(res = res_head; res && *num_ips < MAX_IPS; res = res->ai_next) {
+        ips[*num_ips].s_addr = ((struct sockaddr_in *)(res->ai_addr))->sin_addr.s_addr;
+        (*num_ips)++;
+    }
 
-    /* now try to connect to the remote gateway.  We may need to
-     * try several of the IPs we have.
-     */
-
-    i = 0;
-    done = 0;
-
-    memset((void *)&gw_addr,0, sizeof(gw_addr));
-    gw_addr.sin_family = AF_INET ;
-    gw_addr.sin_port = htons(port);
+    if(res_head) {
+        freeaddrinfo(res_head);
+    }
 
-    do {
-        int rc;
-        /* try each IP until we run out or get a connection. */
-        gw_addr.sin_addr.s_addr = ips[i].s_addr;
+    if(rc == PLCTAG_STATUS_OK && *num_ips == 0) {
+        pdebug(DEBUG_WARN, "No IP addresses found for %s!", host);
+        rc = PLCTAG_ERR_BAD_GATEWAY;
+    }
 
-        /*pdebug(DEBUG_DETAIL,"Attempting to connect to %s",inet_ntoa(*((struct in_addr *)&ips[i])));*/
+    lookup_ms = time_ms() - start_time;
 
-        rc = connect(fd,(struct sockaddr *)&gw_addr,sizeof(gw_addr));
+    spin_block(&resolver_lock) {
+        resolver_stats.lookups++;
+        resolver_stats.lookup_total_ms += lookup_ms;
 
-        if( rc == 0) {
-            /* Windows MSVC does not like inet_ntoa(), not safe.
-             * pdebug(DEBUG_DETAIL, "Attempt to connect to %s succeeded.",inet_ntoa(*((struct in_addr *)&ips[i])));
-             */
-            done = 1;
-        } else {
-            /* MSVC does not like inet_ntoa(), not safe.
-             * pdebug(DEBUG_DETAIL, "Attempt to connect to %s failed, errno: %d",inet_ntoa(*((struct in_addr *)&ips[i])),errno);
-             */
-            i++;
+        if(lookup_ms > resolver_stats.lookup_max_ms) {
+            resolver_stats.lookup_max_ms = lookup_ms;
         }
-    } while(!done && i < num_ips);
-
-    if(!done) {
-        closesocket(fd);
-        pdebug(DEBUG_WARN,"Unable to connect to any gateway host IP address!");
-        return PLCTAG_ERR_OPEN;
-    }
-
-
-    /* FIXME
-     * connect() is a little easier to handle in blocking mode, for now
-     * we make the socket non-blocking here, after connect().
-     */
 
-    if(ioctlsocket(fd,FIONBIO,&non_blocking)) {
-        /*pdebug("Error getting socket options, errno: %d", errno);*/
-        closesocket(fd);
-        return PLCTAG_ERR_OPEN;
+        if(rc != PLCTAG_STATUS_OK) {
+            resolver_stats.failures++;
+        }
     }
 
-    /* save the values */
-    s->fd = fd;
-    s->port = port;
-    s->is_open = 1;
-
-    pdebug(DEBUG_DETAIL, "Done.");
+    pdebug(DEBUG_DETAIL, "Looking up %s took %" PRId64 "ms.", host, lookup_ms);
 
-    return PLCTAG_STATUS_OK;
+    return rc;
 }
 
 
 
+/*
+ * resolver_find_unsafe
+ *
+ * Find the cache entry for the passed host.  Call with the resolver
+ * lock held.
+ */
+static resolver_entry_p resolver_find_unsafe(const char *host)
+{
+    resolver_entry_p entry = resolver_cache;
 
+    while(entry && str_cmp_i(entry->host, host) != 0) {
+        entry = entry->next;
+    }
 
+    return entry;
+}
 
 
 
-
-
-extern int socket_read(sock_p s, uint8_t *buf, int size)
+/*
+ * resolver_refresh_handler
+ *
+ * Look up the host of a cache entry again without holding up anyone
+ * that wants its addresses.
+ */
+static THREAD_FUNC(resolver_refresh_handler)
 {
-    int rc;
-
-    if(!s || !buf) {
-        return PLCTAG_ERR_NULL_PTR;
-    }
+    resolver_entry_p entry = (resolver_entry_p)arg;
+    IN_ADDR ips[MAX_IPS];
+    int num_ips = 0;
+    int rc = PLCTAG_STATUS_OK;
 
-    /* The socket is non-blocking. */
-    rc = recv(s->fd, (char *)buf, size, 0);
+    pdebug(DEBUG_DETAIL, "Refreshing addresses of %s.", entry->host);
 
-    if(rc < 0) {
-        int err = WSAGetLastError();
+    rc = socket_resolve_host(entry->host, ips, &num_ips);
 
-        if(err == WSAEWOULDBLOCK) {
-            return 0;
+    spin_block(&resolver_lock) {
+        if(rc == PLCTAG_STATUS_OK) {
+            mem_copy(entry->ips, ips, (int)(sizeof(ips[0]) * (size_t)num_ips));
+            entry->num_ips = num_ips;
+            entry->refresh_time = time_ms() + RESOLVER_CACHE_TTL_MS;
         } else {
-            pdebug(DEBUG_WARN,"socket read error rc=%d, errno=%d", rc, err);
-            return PLCTAG_ERR_READ;
+            entry->refresh_time = time_ms() + RESOLVER_RETRY_MS;
         }
+
+        entry->refreshing = 0;
     }
 
-    return rc;
+    THREAD_RETURN(0);
 }
 
 
-extern int socket_write(sock_p s, uint8_t *buf, int size)
+
+/*
+ * socket_lookup_host
+ *
+ * Find the IPv4 addresses for the passed host name or numeric IP.
+ */
+static int socket_lookup_host(const char *host, IN_ADDR *ips, int *num_ips)
 {
-    int rc;
+    resolver_entry_p entry = NULL;
+    thread_p old_thread = NULL;
+    int start_refresh = 0;
+    int rc = PLCTAG_STATUS_OK;
 
-    if(!s || !buf) {
-        return PLCTAG_ERR_NULL_PTR;
+    *num_ips = 0;
+
+    mem_set(ips, 0, (int)(sizeof(*ips) * MAX_IPS));
+
+    /* try a numeric IP address conversion first. */
+    if(inet_pton(AF_INET,host,(struct in_addr *)ips) > 0) {
+        pdebug(DEBUG_DETAIL, "Found numeric IP address: %s", host);
+        *num_ips = 1;
+        return PLCTAG_STATUS_OK;
     }
 
-    /* The socket is non-blocking. */
-    rc = send(s->fd, (char *)buf, size, MSG_NOSIGNAL);
+    spin_block(&resolver_lock) {
+        entry = resolver_find_unsafe(host);
 
-    if(rc < 0) {
-        int err = WSAGetLastError();
+        if(entry) {
+            resolver_stats.hits++;
 
-        if(err == WSAEWOULDBLOCK) {
-            return PLCTAG_ERR_NO_DATA;
+            mem_copy(ips, entry->ips, (int)(sizeof(ips[0]) * (size_t)entry->num_ips));
+            *num_ips = entry->num_ips;
+
+            if(!entry->refreshing && entry->refresh_time <= time_ms()) {
+                entry->refreshing = 1;
+                start_refresh = 1;
+
+                /* the last refresh is done, so this will not block. */
+                old_thread = entry->refresh_thread;
+                entry->refresh_thread = NULL;
+            }
         } else {
-            pdebug(DEBUG_WARN,"socket write error rc=%d, errno=%d", rc, err);
-            return PLCTAG_ERR_WRITE;
+            resolver_stats.misses++;
         }
     }
 
-    return rc;
-}
+    if(entry) {
+        pdebug(DEBUG_DETAIL, "Found %d cached addresses for %s.", *num_ips, host);
+
+        if(old_thread) {
+            thread_join(old_thread);
+            thread_destroy(&old_thread);
+        }
 
+        if(start_refresh) {
+            spin_block(&resolver_lock) {
+                resolver_stats.refreshes++;
+            }
 
+            rc = thread_create(&entry->refresh_thread, resolver_refresh_handler, 32*1024, entry);
+            if(rc != PLCTAG_STATUS_OK) {
+                pdebug(DEBUG_WARN, "Unable to start the lookup of %s, error %s!", host, plc_tag_decode_error(rc));
 
-extern int socket_close(sock_p s)
-{
-    if(!s)
-        return PLCTAG_ERR_NULL_PTR;
+                /* the cached addresses are still good enough, try again later. */
+                spin_block(&resolver_lock) {
+                    entry->refresh_thread = NULL;
+                    entry->refresh_time = time_ms() + RESOLVER_RETRY_MS;
+                    entry->refreshing = 0;
+                }
+            }
+        }
 
-    if(!s->is_open) {
         return PLCTAG_STATUS_OK;
     }
 
-    if(!closesocket(s->fd)) {
-        return PLCTAG_ERR_CLOSE;
+    rc = socket_resolve_host(host, ips, num_ips);
+    if(rc != PLCTAG_STATUS_OK) {
+        return rc;
     }
 
-    s->fd = 0;
-    s->is_open = 0;
+    /* if we cannot cache the addresses, the next caller looks them up again. */
+    entry = (resolver_entry_p)mem_alloc((int)sizeof(struct resolver_entry_t));
+    if(!entry) {
+        return PLCTAG_STATUS_OK;
+    }
 
-    return PLCTAG_STATUS_OK;
-}
+    entry->host = str_dup(host);
+    if(!entry->host) {
+        mem_free(entry);
+        return PLCTAG_STATUS_OK;
+    }
 
+    mem_copy(entry->ips, ips, (int)(sizeof(ips[0]) * (size_t)*num_ips));
+    entry->num_ips = *num_ips;
+    entry->refresh_time = time_ms() + RESOLVER_CACHE_TTL_MS;
 
-extern int socket_destroy(sock_p *s)
+    spin_block(&resolver_lock) {
+        /* someone else may have looked it up at the same time. */
+        if(!resolver_find_unsafe(host)) {
+            entry->next = resolver_cache;
+            resolver_cache = entry;
+            entry = NULL;
+        }
+    }
+
+    if(entry) {
+        mem_free(entry->host);
+        mem_free(entry);
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * socket_get_resolver_stats
+ *
+ * Copy out the counters of the host name cache.
+ */
+extern void socket_get_resolver_stats(socket_resolver_stats_t *stats)
+{
+    spin_block(&resolver_lock) {
+        *stats = resolver_stats;
+    }
+}
+
+
+
+/*
+ * socket_open_fd
+ *
+ * Create a non-blocking TCP socket with all our options set.
+ */
+static int socket_open_fd(SOCKET *fd_out)
+{
+    int sock_opt = 1;
+    u_long non_blocking=1;
+    SOCKET fd;
+    struct linger so_linger;
+
+    /* Open a socket for communication with the gateway. */
+    fd = socket(AF_INET, SOCK_STREAM, 0/*IPPROTO_TCP*/);
+
+    /* check for errors */
+    if(fd == INVALID_SOCKET) {
+        pdebug(DEBUG_WARN,"Socket creation failed, error: %d",WSAGetLastError());
+        return PLCTAG_ERR_OPEN;
+    }
+
+    /* set up our socket to allow reuse if we crash suddenly. */
+    sock_opt = 1;
+
+    if(setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,(char*)&sock_opt,sizeof(sock_opt))) {
+        closesocket(fd);
+        pdebug(DEBUG_WARN,"Error setting socket reuse option, errno: %d",errno);
+        return PLCTAG_ERR_OPEN;
+    }
+
+    /* no send or receive timeouts, the socket never blocks. */
+
+    /* abort the connection on close. */
+    so_linger.l_onoff = 1;
+    so_linger.l_linger = 0;
+
+    if(setsockopt(fd, SOL_SOCKET, SO_LINGER,(char*)&so_linger,sizeof(so_linger))) {
+        closesocket(fd);
+        pdebug(DEBUG_ERROR,"Error setting socket close linger option, errno: %d",errno);
+        return PLCTAG_ERR_OPEN;
+    }
+
+    /* several packets may be in flight, do not let Nagle hold them back. */
+    sock_opt = 1;
+
+    if(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char*)&sock_opt, sizeof(sock_opt))) {
+        closesocket(fd);
+        pdebug(DEBUG_ERROR,"Error setting socket no-delay option, errno: %d",errno);
+        return PLCTAG_ERR_OPEN;
+    }
+
+    /* connect() and everything after it is non-blocking. */
+    if(ioctlsocket(fd,FIONBIO,&non_blocking)) {
+        pdebug(DEBUG_ERROR,"Error setting socket to non-blocking, error: %d",WSAGetLastError());
+        closesocket(fd);
+        return PLCTAG_ERR_OPEN;
+    }
+
+    *fd_out = fd;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * socket_connect_done
+ *
+ * The passed socket got through.  Give up on all the other attempts
+ * and use it.
+ */
+static void socket_connect_done(sock_p s, SOCKET fd)
+{
+    for(int i=0; i < MAX_IPS; i++) {
+        if(s->attempt_fds[i] != INVALID_SOCKET && s->attempt_fds[i] != fd) {
+            /* closing it drops it out of any event loop too. */
+            closesocket(s->attempt_fds[i]);
+        }
+
+        s->attempt_fds[i] = INVALID_SOCKET;
+    }
+
+    if(s->fd != fd) {
+        s->fd = fd;
+        s->watched = 0;
+    }
+
+    s->num_attempts = 0;
+    s->is_open = 1;
+}
+
+
+
+/*
+ * socket_connect_drop
+ *
+ * Give up on the connection attempt to the address at the passed index.
+ */
+static void socket_connect_drop(sock_p s, int index)
+{
+    SOCKET fd = s->attempt_fds[index];
+
+    closesocket(fd);
+
+    s->attempt_fds[index] = INVALID_SOCKET;
+    s->num_attempts--;
+
+    /* watch another attempt instead. */
+    if(s->fd == fd) {
+        s->fd = INVALID_SOCKET;
+        s->watched = 0;
+
+        for(int i=0; i < MAX_IPS && s->fd == INVALID_SOCKET; i++) {
+            s->fd = s->attempt_fds[i];
+        }
+    }
+}
+
+
+
+/*
+ * socket_connect_next
+ *
+ * Start a connection attempt to the next address we have not tried.
+ * The attempts already going keep going.
+ */
+static int socket_connect_next(sock_p s)
+{
+    struct sockaddr_in gw_addr;
+    int rc = PLCTAG_STATUS_OK;
+    SOCKET fd = INVALID_SOCKET;
+
+    while(s->ip_index < s->num_ips) {
+        int index = s->ip_index;
+
+        s->ip_index++;
+
+        rc = socket_open_fd(&fd);
+        if(rc != PLCTAG_STATUS_OK) {
+            return rc;
+        }
+
+        memset((void *)&gw_addr,0, sizeof(gw_addr));
+        gw_addr.sin_family = AF_INET ;
+        gw_addr.sin_port = htons((u_short)s->port);
+        gw_addr.sin_addr.s_addr = s->ips[index].s_addr;
+
+        rc = connect(fd,(struct sockaddr *)&gw_addr,sizeof(gw_addr));
+
+        if(rc == 0) {
+            pdebug(DEBUG_DETAIL, "Attempt to connect to address %d succeeded.", index);
+            socket_connect_done(s, fd);
+            return PLCTAG_STATUS_OK;
+        }
+
+        if(WSAGetLastError() == WSAEWOULDBLOCK) {
+            pdebug(DEBUG_DETAIL, "Connection to address %d is in progress.", index);
+
+            s->attempt_fds[index] = fd;
+            s->num_attempts++;
+            s->next_attempt_time = time_ms() + SOCKET_CONNECT_ATTEMPT_DELAY_MS;
+
+            if(s->fd == INVALID_SOCKET) {
+                s->fd = fd;
+            }
+
+            return PLCTAG_STATUS_PENDING;
+        }
+
+        pdebug(DEBUG_DETAIL, "Attempt to connect to address %d failed, error: %d", index, WSAGetLastError());
+
+        closesocket(fd);
+    }
+
+    if(s->num_attempts > 0) {
+        return PLCTAG_STATUS_PENDING;
+    }
+
+    pdebug(DEBUG_WARN,"Unable to connect to any gateway host IP address!");
+
+    return PLCTAG_ERR_OPEN;
+}
+
+
+
+/*
+ * socket_connect_tcp_start
+ *
+ * Look up the host and start a non-blocking connection to it.  Returns
+ * PLCTAG_STATUS_PENDING if the connection is in progress.  In that case
+ * socket_connect_tcp_check() must be called to find out how it went.
+ *
+ * If the host has several addresses, they race each other.  Every
+ * SOCKET_CONNECT_ATTEMPT_DELAY_MS without an answer, or as soon as an
+ * attempt fails, another address is tried without giving up on the
+ * ones already going.  The first one to connect wins.
+ */
+extern int socket_connect_tcp_start(sock_p s, const char *host, int port)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    if(!s || !host) {
+        pdebug(DEBUG_WARN, "Null socket or host pointer!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(s->fd != INVALID_SOCKET) {
+        pdebug(DEBUG_WARN, "Socket is already open!");
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    rc = socket_lookup_host(host, s->ips, &s->num_ips);
+    if(rc != PLCTAG_STATUS_OK) {
+        return rc;
+    }
+
+    s->ip_index = 0;
+    s->num_attempts = 0;
+    s->port = port;
+
+    rc = socket_connect_next(s);
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return rc;
+}
+
+
+
+/*
+ * socket_connect_tcp_check
+ *
+ * Wait up to timeout_ms for one of the connection attempts to finish.
+ * Failed attempts are dropped and the next address is tried when it is
+ * time.  Only the socket in fd is watched by an event loop, so call
+ * this every so often while connecting, not just when the socket is
+ * ready.
+ */
+extern int socket_connect_tcp_check(sock_p s, int timeout_ms)
+{
+    fd_set write_fds;
+    fd_set except_fds;
+    struct timeval tv;
+    int rc = 0;
+
+    if(!s) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(s->is_open) {
+        return PLCTAG_STATUS_OK;
+    }
+
+    if(s->num_attempts == 0) {
+        return PLCTAG_ERR_OPEN;
+    }
+
+    /* do not wait past the time to start the next attempt. */
+    if(s->ip_index < s->num_ips) {
+        int64_t until_next = s->next_attempt_time - time_ms();
+
+        if(until_next < timeout_ms) {
+            timeout_ms = (until_next > 0 ? (int)until_next : 0);
+        }
+    }
+
+    FD_ZERO(&write_fds);
+    FD_ZERO(&except_fds);
+
+    for(int i=0; i < MAX_IPS; i++) {
+        if(s->attempt_fds[i] != INVALID_SOCKET) {
+            FD_SET(s->attempt_fds[i], &write_fds);
+            FD_SET(s->attempt_fds[i], &except_fds);
+        }
+    }
+
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+    /* Windows reports a failed connect() as an exception. */
+    rc = select(0, NULL, &write_fds, &except_fds, &tv);
+    if(rc == SOCKET_ERROR) {
+        pdebug(DEBUG_WARN, "Error waiting for connection, error: %d", WSAGetLastError());
+        return PLCTAG_ERR_OPEN;
+    }
+
+    for(int i=0; rc > 0 && i < MAX_IPS; i++) {
+        SOCKET fd = s->attempt_fds[i];
+
+        if(fd == INVALID_SOCKET) {
+            continue;
+        }
+
+        if(FD_ISSET(fd, &write_fds)) {
+            pdebug(DEBUG_DETAIL, "Connection to address %d succeeded.", i);
+            socket_connect_done(s, fd);
+            return PLCTAG_STATUS_OK;
+        }
+
+        if(FD_ISSET(fd, &except_fds)) {
+            pdebug(DEBUG_DETAIL, "Connection to address %d failed.", i);
+            socket_connect_drop(s, i);
+        }
+    }
+
+    /* bring in the next address if the others are slow or all failed. */
+    if(s->ip_index < s->num_ips && (s->num_attempts == 0 || s->next_attempt_time <= time_ms())) {
+        return socket_connect_next(s);
+    }
+
+    if(s->num_attempts == 0) {
+        pdebug(DEBUG_WARN,"Unable to connect to any gateway host IP address!");
+        return PLCTAG_ERR_OPEN;
+    }
+
+    return PLCTAG_STATUS_PENDING;
+}
+
+
+
+extern int socket_connect_tcp(sock_p s, const char *host, int port)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    rc = socket_connect_tcp_start(s, host, port);
+
+    while(rc == PLCTAG_STATUS_PENDING) {
+        rc = socket_connect_tcp_check(s, 100);
+    }
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return rc;
+}
+
+
+
+
+extern int socket_read(sock_p s, uint8_t *buf, int size)
+{
+    int rc;
+
+    if(!s || !buf) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    /* The socket is non-blocking. */
+    rc = recv(s->fd, (char *)buf, size, 0);
+
+    if(rc == 0 && size > 0) {
+        pdebug(DEBUG_WARN,"Socket closed by the remote end.");
+        return PLCTAG_ERR_READ;
+    }
+
+    if(rc < 0) {
+        int err = WSAGetLastError();
+
+        if(err == WSAEWOULDBLOCK) {
+            return 0;
+        } else {
+            pdebug(DEBUG_WARN,"socket read error rc=%d, errno=%d", rc, err);
+            return PLCTAG_ERR_READ;
+        }
+    }
+
+    return rc;
+}
+
+
+extern int socket_write(sock_p s, uint8_t *buf, int size)
+{
+    int rc;
+
+    if(!s || !buf) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    /* The socket is non-blocking. */
+    rc = send(s->fd, (char *)buf, size, MSG_NOSIGNAL);
+
+    if(rc < 0) {
+        int err = WSAGetLastError();
+
+        if(err == WSAEWOULDBLOCK) {
+            return PLCTAG_ERR_NO_DATA;
+        } else {
+            pdebug(DEBUG_WARN,"socket write error rc=%d, errno=%d", rc, err);
+            return PLCTAG_ERR_WRITE;
+        }
+    }
+
+    return rc;
+}
+
+
+
+/*
+ * socket_write_bufs
+ *
+ * Gather write of several buffers in one call.  At most
+ * SOCKET_MAX_WRITE_BUFS are sent at once.  Returns the number of bytes
+ * written which may be less than the total, like socket_write().
+ */
+extern int socket_write_bufs(sock_p s, sock_buf_t *bufs, int num_bufs)
+{
+    WSABUF wsa_bufs[SOCKET_MAX_WRITE_BUFS];
+    DWORD bytes_sent = 0;
+    int rc;
+
+    if(!s || !bufs) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(num_bufs > SOCKET_MAX_WRITE_BUFS) {
+        num_bufs = SOCKET_MAX_WRITE_BUFS;
+    }
+
+    for(int i=0; i < num_bufs; i++) {
+        wsa_bufs[i].buf = (char *)bufs[i].data;
+        wsa_bufs[i].len = (ULONG)bufs[i].size;
+    }
+
+    /* The socket is non-blocking. */
+    rc = WSASend(s->fd, wsa_bufs, (DWORD)num_bufs, &bytes_sent, 0, NULL, NULL);
+
+    if(rc != 0) {
+        int err = WSAGetLastError();
+
+        if(err == WSAEWOULDBLOCK) {
+            return PLCTAG_ERR_NO_DATA;
+        } else {
+            pdebug(DEBUG_WARN,"socket write error rc=%d, errno=%d", rc, err);
+            return PLCTAG_ERR_WRITE;
+        }
+    }
+
+    return (int)bytes_sent;
+}
+
+
+
+extern int socket_close(sock_p s)
+{
+    if(!s)
+        return PLCTAG_ERR_NULL_PTR;
+
+    /* give up on any connection attempts that are still going. */
+    for(int i=0; i < MAX_IPS; i++) {
+        if(s->attempt_fds[i] != INVALID_SOCKET && s->attempt_fds[i] != s->fd) {
+            closesocket(s->attempt_fds[i]);
+        }
+
+        s->attempt_fds[i] = INVALID_SOCKET;
+    }
+
+    s->num_attempts = 0;
+
+    if(s->fd == INVALID_SOCKET) {
+        return PLCTAG_STATUS_OK;
+    }
+
+    /* do not try to close it again even if this fails. */
+    s->is_open = 0;
+    s->watched = 0;
+
+    if(closesocket(s->fd) != 0) {
+        s->fd = INVALID_SOCKET;
+        return PLCTAG_ERR_CLOSE;
+    }
+
+    s->fd = INVALID_SOCKET;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+extern int socket_destroy(sock_p *s)
 {
     if(!s || !*s)
         return PLCTAG_ERR_NULL_PTR;
@@ -1111,6 +1811,355 @@ extern int socket_destroy(sock_p *s)
 
 
 
+/***************************************************************************
+ ******************************* Event Loop ********************************
+ **************************************************************************/
+
+/*
+ * An event loop lets one thread wait for activity on many sockets.
+ * Each watched socket carries a context pointer that is handed back
+ * when the socket is ready.  Any thread can wake up the waiting thread
+ * with event_loop_wake().
+ *
+ * Windows has no eventfd or pipe that select() can wait on, so the
+ * wake up is a UDP socket on the loopback interface that is connected
+ * to itself.  The fd_set structures are allocated to fit the number of
+ * watched sockets so that we are not limited by FD_SETSIZE.
+ */
+
+struct event_loop_entry_t {
+    sock_p sock;
+    int events;
+    void *context;
+};
+
+struct event_loop_t {
+    mutex_p mutex;
+    SOCKET wake_sock;
+    int num_entries;
+    int entry_capacity;
+    struct event_loop_entry_t *entries;
+
+    /* used only by the waiting thread. */
+    int set_capacity;
+    fd_set *read_set;
+    fd_set *write_set;
+    struct event_loop_entry_t *snapshot;
+};
+
+
+static int event_loop_ensure_sets(event_loop_p loop, int count)
+{
+    int set_size = 0;
+
+    if(loop->set_capacity >= count) {
+        return PLCTAG_STATUS_OK;
+    }
+
+    set_size = (int)(offsetof(fd_set, fd_array) + (sizeof(SOCKET) * (size_t)count));
+
+    if(loop->read_set) {
+        mem_free(loop->read_set);
+    }
+
+    if(loop->write_set) {
+        mem_free(loop->write_set);
+    }
+
+    if(loop->snapshot) {
+        mem_free(loop->snapshot);
+    }
+
+    loop->read_set = (fd_set *)mem_alloc(set_size);
+    loop->write_set = (fd_set *)mem_alloc(set_size);
+    loop->snapshot = (struct event_loop_entry_t *)mem_alloc(count * (int)sizeof(struct event_loop_entry_t));
+
+    if(!loop->read_set || !loop->write_set || !loop->snapshot) {
+        loop->set_capacity = 0;
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    loop->set_capacity = count;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+int event_loop_create(event_loop_p *loop)
+{
+    event_loop_p new_loop = NULL;
+    struct sockaddr_in addr;
+    int addr_len = (int)sizeof(addr);
+    u_long non_blocking = 1;
+
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    if(!loop) {
+        pdebug(DEBUG_WARN, "Null event loop pointer!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(!socket_lib_init()) {
+        pdebug(DEBUG_WARN,"error initializing Windows Sockets.");
+        return PLCTAG_ERR_WINSOCK;
+    }
+
+    new_loop = (event_loop_p)mem_alloc((int)sizeof(struct event_loop_t));
+    if(!new_loop) {
+        pdebug(DEBUG_ERROR, "Unable to allocate memory for event loop!");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    new_loop->wake_sock = INVALID_SOCKET;
+
+    if(mutex_create(&new_loop->mutex) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to create event loop mutex!");
+        event_loop_destroy(&new_loop);
+        return PLCTAG_ERR_MUTEX_INIT;
+    }
+
+    new_loop->wake_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if(new_loop->wake_sock == INVALID_SOCKET) {
+        pdebug(DEBUG_ERROR, "Unable to create wake up socket, error: %d", WSAGetLastError());
+        event_loop_destroy(&new_loop);
+        return PLCTAG_ERR_CREATE;
+    }
+
+    /* bind to any free port on the loopback interface and connect the socket to itself. */
+    mem_set(&addr, 0, (int)sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+
+    if(bind(new_loop->wake_sock, (struct sockaddr *)&addr, (int)sizeof(addr)) != 0
+       || getsockname(new_loop->wake_sock, (struct sockaddr *)&addr, &addr_len) != 0
+       || connect(new_loop->wake_sock, (struct sockaddr *)&addr, (int)sizeof(addr)) != 0
+       || ioctlsocket(new_loop->wake_sock, FIONBIO, &non_blocking) != 0) {
+        pdebug(DEBUG_ERROR, "Unable to set up wake up socket, error: %d", WSAGetLastError());
+        event_loop_destroy(&new_loop);
+        return PLCTAG_ERR_CREATE;
+    }
+
+    *loop = new_loop;
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+int event_loop_watch(event_loop_p loop, sock_p s, int events, void *context)
+{
+    int rc = PLCTAG_STATUS_OK;
+    int index = -1;
+
+    if(!loop || !s || !context) {
+        pdebug(DEBUG_WARN, "Called with null event loop, socket or context!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    critical_block(loop->mutex) {
+        for(int i=0; i < loop->num_entries; i++) {
+            if(loop->entries[i].sock == s) {
+                index = i;
+                break;
+            }
+        }
+
+        if(index < 0) {
+            if(loop->num_entries >= loop->entry_capacity) {
+                int new_capacity = loop->entry_capacity + 16;
+                struct event_loop_entry_t *new_entries = mem_realloc(loop->entries, new_capacity * (int)sizeof(struct event_loop_entry_t));
+
+                if(new_entries) {
+                    loop->entries = new_entries;
+                    loop->entry_capacity = new_capacity;
+                } else {
+                    rc = PLCTAG_ERR_NO_MEM;
+                }
+            }
+
+            if(rc == PLCTAG_STATUS_OK) {
+                index = loop->num_entries;
+                loop->num_entries++;
+            }
+        }
+
+        if(rc == PLCTAG_STATUS_OK) {
+            loop->entries[index].sock = s;
+            loop->entries[index].events = events;
+            loop->entries[index].context = context;
+            s->watched = 1;
+        }
+    }
+
+    /* the waiting thread needs to pick up the new set of sockets. */
+    event_loop_wake(loop);
+
+    return rc;
+}
+
+
+
+int event_loop_unwatch(event_loop_p loop, sock_p s)
+{
+    if(!loop || !s) {
+        pdebug(DEBUG_WARN, "Called with null event loop or socket!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    critical_block(loop->mutex) {
+        for(int i=0; i < loop->num_entries; i++) {
+            if(loop->entries[i].sock == s) {
+                loop->num_entries--;
+                loop->entries[i] = loop->entries[loop->num_entries];
+                break;
+            }
+        }
+
+        s->watched = 0;
+    }
+
+    event_loop_wake(loop);
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+int event_loop_wait(event_loop_p loop, void **ready, int max_ready, int timeout_ms)
+{
+    int num_entries = 0;
+    int num_ready = 0;
+    int rc = 0;
+    struct timeval tv;
+
+    if(!loop || !ready) {
+        pdebug(DEBUG_WARN, "Called with null event loop or ready list!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    /* take a snapshot of the sockets to watch. */
+    critical_block(loop->mutex) {
+        if(event_loop_ensure_sets(loop, loop->num_entries + 1) == PLCTAG_STATUS_OK) {
+            num_entries = loop->num_entries;
+            mem_copy(loop->snapshot, loop->entries, num_entries * (int)sizeof(struct event_loop_entry_t));
+        } else {
+            num_entries = -1;
+        }
+    }
+
+    if(num_entries < 0) {
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    loop->read_set->fd_count = 0;
+    loop->write_set->fd_count = 0;
+
+    loop->read_set->fd_array[loop->read_set->fd_count++] = loop->wake_sock;
+
+    for(int i=0; i < num_entries; i++) {
+        if(loop->snapshot[i].events & EVENT_LOOP_READ) {
+            loop->read_set->fd_array[loop->read_set->fd_count++] = loop->snapshot[i].sock->fd;
+        }
+
+        if(loop->snapshot[i].events & EVENT_LOOP_WRITE) {
+            loop->write_set->fd_array[loop->write_set->fd_count++] = loop->snapshot[i].sock->fd;
+        }
+    }
+
+    if(timeout_ms >= 0) {
+        tv.tv_sec = (long)(timeout_ms / 1000);
+        tv.tv_usec = (long)((timeout_ms % 1000) * 1000);
+    }
+
+    rc = select(0, loop->read_set, (loop->write_set->fd_count ? loop->write_set : NULL), NULL, (timeout_ms >= 0 ? &tv : NULL));
+    if(rc == SOCKET_ERROR) {
+        pdebug(DEBUG_WARN, "Error waiting for events, error: %d", WSAGetLastError());
+        return PLCTAG_ERR_READ;
+    }
+
+    if(FD_ISSET(loop->wake_sock, loop->read_set)) {
+        char buf[32];
+
+        /* drain the wake ups. */
+        while(recv(loop->wake_sock, buf, (int)sizeof(buf), 0) > 0) { }
+    }
+
+    for(int i=0; i < num_entries && num_ready < max_ready; i++) {
+        if(FD_ISSET(loop->snapshot[i].sock->fd, loop->read_set) || FD_ISSET(loop->snapshot[i].sock->fd, loop->write_set)) {
+            ready[num_ready] = loop->snapshot[i].context;
+            num_ready++;
+        }
+    }
+
+    return num_ready;
+}
+
+
+
+int event_loop_wake(event_loop_p loop)
+{
+    char one = 1;
+
+    if(!loop) {
+        pdebug(DEBUG_WARN, "Called with null event loop!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    /* a full buffer means that a wake up is already pending. */
+    if(send(loop->wake_sock, &one, 1, 0) == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK) {
+        pdebug(DEBUG_WARN, "Error writing wake up socket, error: %d", WSAGetLastError());
+        return PLCTAG_ERR_WRITE;
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+int event_loop_destroy(event_loop_p *loop)
+{
+    if(!loop || !*loop) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if((*loop)->wake_sock != INVALID_SOCKET) {
+        closesocket((*loop)->wake_sock);
+    }
+
+    if((*loop)->mutex) {
+        mutex_destroy(&(*loop)->mutex);
+    }
+
+    if((*loop)->entries) {
+        mem_free((*loop)->entries);
+    }
+
+    if((*loop)->read_set) {
+        mem_free((*loop)->read_set);
+    }
+
+    if((*loop)->write_set) {
+        mem_free((*loop)->write_set);
+    }
+
+    if((*loop)->snapshot) {
+        mem_free((*loop)->snapshot);
+    }
+
+    mem_free(*loop);
+
+    *loop = NULL;
+
+    WSACleanup();
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
 
 
 
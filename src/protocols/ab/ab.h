@@ -36,6 +36,7 @@
 void ab_teardown(void);
 int ab_init();
 plc_tag_p ab_tag_create(attr attribs);
+void ab_get_deadline_stats(uint64_t *count, uint64_t *missed, int64_t *max_late_ms);
 
 
 #endif
@@ -39,6 +39,7 @@
 #include <ab/eip_slc_pccc.h>
 #include <ab/eip_dhp_pccc.h>
 #include <ab/session.h>
+#include <ab/metadata_cache.h>
 #include <ab/tag.h>
 #include <util/attr.h>
 #include <util/debug.h>
@@ -73,9 +74,33 @@ volatile int library_terminating = 0;
 #define DEFAULT_NUM_RETRIES (5)
 #define DEFAULT_RETRY_INTERVAL (300)
 
+/*
+ * The CIP types of the atomic elem_type values.  Strings are structures
+ * in the PLC and their type cannot be built without asking it.
+ */
+static const struct {
+    const char *elem_type;
+    uint8_t cip_type;
+} declared_cip_types[] = {
+    { "lint", AB_CIP_DATA_LINT },
+    { "ulint", AB_CIP_DATA_ULINT },
+    { "dint", AB_CIP_DATA_DINT },
+    { "udint", AB_CIP_DATA_UDINT },
+    { "int", AB_CIP_DATA_INT },
+    { "uint", AB_CIP_DATA_UINT },
+    { "sint", AB_CIP_DATA_SINT },
+    { "usint", AB_CIP_DATA_USINT },
+    { "bool", AB_CIP_DATA_BIT },
+    { "bool array", AB_CIP_DATA_DWORD },
+    { "real", AB_CIP_DATA_REAL },
+    { "lreal", AB_CIP_DATA_LREAL }
+};
+
 
 /* forward declarations*/
 static int get_tag_data_type(ab_tag_p tag, attr attribs);
+static void use_cached_type_info(ab_tag_p tag);
+static void use_declared_type_info(ab_tag_p tag, const char *elem_type);
 
 static void ab_tag_destroy(ab_tag_p tag);
 static int default_abort(plc_tag_p tag);
@@ -99,6 +124,11 @@ int ab_init(void)
 
     pdebug(DEBUG_INFO,"Initializing AB protocol library.");
 
+    if((rc = metadata_cache_startup()) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to initialize metadata cache!");
+        return rc;
+    }
+
     if((rc = session_startup()) != PLCTAG_STATUS_OK) {
         pdebug(DEBUG_ERROR, "Unable to initialize session library!");
         return rc;
@@ -128,11 +158,34 @@ void ab_teardown(void)
 
     session_teardown();
 
+    pdebug(DEBUG_INFO,"Freeing metadata caches.");
+
+    metadata_cache_teardown();
+
     pdebug(DEBUG_INFO,"Done.");
 }
 
 
 
+/*
+ * ab_get_deadline_stats
+ *
+ * How many requests with deadlines have completed since the library
+ * started, how many of them were late and how late the worst one was.
+ */
+void ab_get_deadline_stats(uint64_t *count, uint64_t *missed, int64_t *max_late_ms)
+{
+    session_deadline_stats_t stats;
+
+    session_get_deadline_stats(&stats);
+
+    *count = stats.count;
+    *missed = stats.missed;
+    *max_late_ms = stats.max_late_ms;
+}
+
+
+
 plc_tag_p ab_tag_create(attr attribs)
 {
     ab_tag_p tag = AB_TAG_NULL;
@@ -231,6 +284,13 @@ plc_tag_p ab_tag_create(attr attribs)
         tag->allow_packing = attr_get_int(attribs, "allow_packing", 1);
         tag->vtable = &eip_cip_vtable;
 
+        /* address the tag by symbol instance ID instead of by name? */
+        tag->use_instance_id = attr_get_int(attribs, "use_instance_id", 0);
+        if(tag->use_instance_id && (!tag->use_connected_msg || tag->tag_list)) {
+            pdebug(DEBUG_WARN, "Instance IDs need connected messaging and cannot be used for tag lists, ignoring use_instance_id.");
+            tag->use_instance_id = 0;
+        }
+
         break;
 
     case AB_PROTOCOL_MLGX800:
@@ -255,6 +315,29 @@ plc_tag_p ab_tag_create(attr attribs)
         tag->elem_count = attr_get_int(attribs,"elem_count", 1);
     }
 
+    /* CIP tags can remember their type between runs. */
+    if(tag->vtable == &eip_cip_vtable && !tag->tag_list && attr_get_str(attribs, "metadata_cache", NULL)) {
+        tag->metadata = metadata_cache_get(attr_get_str(attribs, "metadata_cache", NULL));
+        tag->metadata_key = metadata_cache_tag_key(attr_get_str(attribs, "gateway", NULL), path, attr_get_str(attribs, "name", NULL));
+
+        use_cached_type_info(tag);
+    }
+
+    /* how urgent are requests for this tag?  Higher priority goes first. */
+    tag->priority = attr_get_int(attribs, "priority", 0);
+    if(tag->priority < 0) {
+        pdebug(DEBUG_WARN, "Tag priority must be zero or greater!");
+        tag->status = PLCTAG_ERR_BAD_PARAM;
+        return (plc_tag_p)tag;
+    }
+
+    tag->deadline_ms = attr_get_int(attribs, "deadline_ms", 0);
+    if(tag->deadline_ms < 0) {
+        pdebug(DEBUG_WARN, "Tag deadline must be zero or greater!");
+        tag->status = PLCTAG_ERR_BAD_PARAM;
+        return (plc_tag_p)tag;
+    }
+
     /* pass the connection requirement since it may be overridden above. */
     attr_set_int(attribs, "use_connected_msg", tag->use_connected_msg);
 
@@ -290,7 +373,7 @@ plc_tag_p ab_tag_create(attr attribs)
      *
      * All tags need sessions.  They are the TCP connection to the gateway PLC.
      */
-    if(session_find_or_create(&tag->session, attribs) != PLCTAG_STATUS_OK) {
+    if(session_find_or_create(&tag->session, &tag->route, attribs) != PLCTAG_STATUS_OK) {
         pdebug(DEBUG_INFO,"Unable to create session!");
         tag->status = PLCTAG_ERR_BAD_GATEWAY;
         return (plc_tag_p)tag;
@@ -308,8 +391,14 @@ plc_tag_p ab_tag_create(attr attribs)
         return (plc_tag_p)tag;
     }
 
-    /* trigger the first read. */
-    tag->first_read = 1;
+    /* keep the name as given, the instance ID may have to be looked up again. */
+    if(tag->use_instance_id) {
+        mem_copy(tag->symbolic_name, tag->encoded_name, tag->encoded_name_size);
+        tag->symbolic_name_size = tag->encoded_name_size;
+    }
+
+    /* trigger the first read, unless we already know the type to write. */
+    tag->first_read = !tag->type_info_unverified;
 
     pdebug(DEBUG_INFO,"Done.");
 
@@ -317,6 +406,79 @@ plc_tag_p ab_tag_create(attr attribs)
 }
 
 
+/*
+ * use_cached_type_info
+ *
+ * Pick up the type and size of the tag from the metadata cache.  The
+ * element size is taken from the cache if the tag does not set it.  The
+ * type is only used if the size matches.  The first read checks it.
+ */
+void use_cached_type_info(ab_tag_p tag)
+{
+    int elem_size = 0;
+    int elem_count = 0;
+    uint8_t type_info[MAX_TAG_TYPE_INFO];
+    int type_info_size = 0;
+    int rc = PLCTAG_STATUS_OK;
+
+    if(!tag->metadata || !tag->metadata_key) {
+        return;
+    }
+
+    rc = metadata_cache_get_tag(tag->metadata, tag->metadata_key, &elem_size, &elem_count, type_info, &type_info_size);
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_DETAIL, "No cached type information for this tag.");
+        return;
+    }
+
+    if(!tag->elem_size && tag->elem_count == elem_count) {
+        pdebug(DEBUG_DETAIL, "Using cached element size %d.", elem_size);
+        tag->elem_size = elem_size;
+    }
+
+    if(tag->elem_size != elem_size || tag->elem_count != elem_count) {
+        pdebug(DEBUG_DETAIL, "Cached type information is for a different size, ignoring it.");
+        return;
+    }
+
+    pdebug(DEBUG_DETAIL, "Using cached type information.");
+
+    mem_copy(tag->encoded_type_info, type_info, type_info_size);
+    tag->encoded_type_info_size = type_info_size;
+    tag->type_info_unverified = 1;
+}
+
+
+
+/*
+ * use_declared_type_info
+ *
+ * Build the CIP type of the tag from its elem_type so that the first
+ * write does not have to read the tag to get it.  If the PLC does not
+ * agree, the write falls back to reading the type first.
+ */
+void use_declared_type_info(ab_tag_p tag, const char *elem_type)
+{
+    size_t i;
+
+    for(i = 0; i < sizeof(declared_cip_types)/sizeof(declared_cip_types[0]); i++) {
+        if(str_cmp_i(elem_type, declared_cip_types[i].elem_type) == 0) {
+            pdebug(DEBUG_DETAIL, "Using CIP type %x for declared element type %s.", (int)declared_cip_types[i].cip_type, elem_type);
+
+            tag->encoded_type_info[0] = declared_cip_types[i].cip_type;
+            tag->encoded_type_info[1] = 0;
+            tag->encoded_type_info_size = 2;
+            tag->type_info_unverified = 1;
+
+            return;
+        }
+    }
+
+    pdebug(DEBUG_DETAIL, "No CIP type for element type %s, the first write will read the type.", elem_type);
+}
+
+
+
 /*
  * determine the tag's data type and size.  Or at least guess it.
  */
@@ -456,6 +618,8 @@ int get_tag_data_type(ab_tag_p tag, attr attribs)
             } else {
                 pdebug(DEBUG_DETAIL, "Unknown tag type %s", elem_type);
             }
+
+            use_declared_type_info(tag, elem_type);
         } else {
             /* just for Logix, check for tag listing */
             if(tag->protocol_type == AB_PROTOCOL_LGX) {
@@ -547,6 +711,20 @@ int ab_tag_abort(ab_tag_p tag)
 {
     pdebug(DEBUG_DETAIL, "Starting.");
 
+    /* if this tag was listing the symbols, let another tag do it. */
+    if(tag->instance_id_state == INSTANCE_ID_RESOLVING) {
+        if(tag->req) {
+            session_end_symbol_listing(tag->session, tag->route, tag->instance_id_generation, tag->listing_program, 0);
+        }
+
+        tag->instance_id_state = INSTANCE_ID_UNRESOLVED;
+    }
+
+    /* a retry by name that did not finish says nothing about the IDs. */
+    if(tag->instance_id_state == INSTANCE_ID_CHECKING) {
+        tag->instance_id_state = INSTANCE_ID_UNAVAILABLE;
+    }
+
     if(tag->req) {
         spin_block(&tag->req->lock) {
             tag->req->abort_request = 1;
@@ -555,6 +733,18 @@ int ab_tag_abort(ab_tag_p tag)
         tag->req = rc_dec(tag->req);
     }
 
+    for(int i=0; i < tag->num_frags; i++) {
+        if(tag->frags[i].req) {
+            spin_block(&tag->frags[i].req->lock) {
+                tag->frags[i].req->abort_request = 1;
+            }
+
+            tag->frags[i].req = rc_dec(tag->frags[i].req);
+        }
+    }
+
+    tag->num_frags = 0;
+
     tag->read_in_progress = 0;
     tag->write_in_progress = 0;
     tag->offset = 0;
@@ -566,6 +756,26 @@ int ab_tag_abort(ab_tag_p tag)
 
 
 
+/*
+ * ab_tag_prioritize_request
+ *
+ * Copy the scheduling settings of the tag into a new request.  A
+ * polled tag without a deadline of its own should be read within its
+ * poll period.
+ */
+
+void ab_tag_prioritize_request(ab_tag_p tag, ab_request_p req)
+{
+    req->priority = tag->priority;
+    req->deadline_ms = tag->deadline_ms;
+
+    if(req->deadline_ms == 0 && tag->poll_ms > 0) {
+        req->deadline_ms = tag->poll_ms;
+    }
+}
+
+
+
 
 /*
  * ab_tag_status
@@ -621,6 +831,9 @@ void ab_tag_destroy(ab_tag_p tag)
         return;
     }
 
+    /* drop any request still in flight, the session will clean it up. */
+    ab_tag_abort(tag);
+
     session = tag->session;
 
     /* tags should always have a session.  Release it. */
@@ -629,6 +842,9 @@ void ab_tag_destroy(ab_tag_p tag)
         pdebug(DEBUG_DETAIL, "Removing tag from session.");
         rc_dec(session);
         tag->session = NULL;
+
+        /* the route belongs to the session. */
+        tag->route = NULL;
     } else {
         pdebug(DEBUG_WARN,"No session pointer!");
     }
@@ -643,11 +859,26 @@ void ab_tag_destroy(ab_tag_p tag)
         tag->api_mutex = NULL;
     }
 
+    if(tag->tag_cond_wait) {
+        cond_destroy(&(tag->tag_cond_wait));
+        tag->tag_cond_wait = NULL;
+    }
+
     if (tag->data) {
         mem_free(tag->data);
         tag->data = NULL;
     }
 
+    if(tag->metadata_key) {
+        mem_free(tag->metadata_key);
+        tag->metadata_key = NULL;
+    }
+
+    if(tag->frags) {
+        mem_free(tag->frags);
+        tag->frags = NULL;
+    }
+
     pdebug(DEBUG_INFO,"Finished releasing all tag resources.");
 
     pdebug(DEBUG_INFO, "done");
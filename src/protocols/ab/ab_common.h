@@ -41,6 +41,9 @@ typedef struct ab_tag_t *ab_tag_p;
 typedef struct ab_session_t *ab_session_p;
 #define AB_SESSION_NULL ((ab_session_p)NULL)
 
+typedef struct ab_route_t *ab_route_p;
+#define AB_ROUTE_NULL ((ab_route_p)NULL)
+
 typedef struct ab_request_t *ab_request_p;
 #define AB_REQUEST_NULL ((ab_request_p)NULL)
 
@@ -51,6 +54,7 @@ typedef struct ab_request_t *ab_request_p;
 
 
 int ab_tag_abort(ab_tag_p tag);
+void ab_tag_prioritize_request(ab_tag_p tag, ab_request_p req);
 int ab_tag_status(ab_tag_p tag);
 //int ab_tag_destroy(ab_tag_p p_tag);
 int check_cpu(ab_tag_p tag, attr attribs);
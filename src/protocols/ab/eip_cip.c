@@ -107,16 +107,36 @@ START_PACK typedef struct {
 
 
 static int build_read_request_connected(ab_tag_p tag, int byte_offset);
+static int make_read_request_connected(ab_tag_p tag, int byte_offset, int allow_packing, int fragment, ab_request_p *req_out);
+static int build_read_fragments_connected(ab_tag_p tag);
+static int reserve_fragments(ab_tag_p tag, int num_frags);
 static int build_tag_list_request_connected(ab_tag_p tag);
+static int build_symbol_list_request_connected(ab_tag_p tag, const char *program);
 static int build_read_request_unconnected(ab_tag_p tag, int byte_offset);
 static int build_write_request_connected(ab_tag_p tag, int byte_offset);
+static int make_write_request_connected(ab_tag_p tag, int byte_offset, int write_size, int allow_packing, int fragment, ab_request_p *req_out);
+static int build_write_fragments_connected(ab_tag_p tag);
 static int build_write_request_unconnected(ab_tag_p tag, int byte_offset);
 static int check_read_status_connected(ab_tag_p tag);
+static int check_read_fragments_connected(ab_tag_p tag);
+static int unpack_read_response_connected(ab_tag_p tag, ab_request_p req, uint8_t **data_out, int *data_size, int *partial);
 static int check_read_tag_list_status_connected(ab_tag_p tag);
 static int check_read_status_unconnected(ab_tag_p tag);
 static int check_write_status_connected(ab_tag_p tag);
+static int check_write_fragments_connected(ab_tag_p tag);
+static int unpack_write_response_connected(ab_tag_p tag, ab_request_p req);
 static int check_write_status_unconnected(ab_tag_p tag);
 static int calculate_write_data_per_packet(ab_tag_p tag);
+static void set_type_info(ab_tag_p tag, uint8_t *type_info, int size);
+static int retry_write_with_pre_read(ab_tag_p tag);
+static int resolve_instance_id(ab_tag_p tag, int for_write);
+static int check_instance_id_status(ab_tag_p tag);
+static int get_base_symbol(ab_tag_p tag, char *program, char *name, int name_size);
+static int encode_instance_id(ab_tag_p tag, uint32_t *instance_ids, int num_ids);
+static void restore_symbolic_name(ab_tag_p tag);
+static void check_instance_id_error(ab_tag_p tag, uint8_t cip_status);
+static int retry_by_name(ab_tag_p tag, int for_write);
+static void end_name_retry(ab_tag_p tag, int rc);
 
 static int tag_read_start(ab_tag_p tag);
 static int tag_tickler(ab_tag_p tag);
@@ -145,10 +165,22 @@ int tag_tickler(ab_tag_p tag)
 
     pdebug(DEBUG_SPEW,"Starting.");
 
+    if (tag->instance_id_state == INSTANCE_ID_RESOLVING) {
+        rc = check_instance_id_status(tag);
+
+        tag->status = rc;
+
+        pdebug(DEBUG_SPEW,"Done.  Instance ID lookup in progress.");
+
+        return rc;
+    }
+
     if (tag->read_in_progress) {
         if(tag->use_connected_msg) {
             if(tag->tag_list) {
                 rc = check_read_tag_list_status_connected(tag);
+            } else if(tag->num_frags > 0) {
+                rc = check_read_fragments_connected(tag);
             } else {
                 rc = check_read_status_connected(tag);
             }
@@ -165,7 +197,11 @@ int tag_tickler(ab_tag_p tag)
 
     if (tag->write_in_progress) {
         if(tag->use_connected_msg) {
-            rc = check_write_status_connected(tag);
+            if(tag->num_frags > 0) {
+                rc = check_write_fragments_connected(tag);
+            } else {
+                rc = check_write_status_connected(tag);
+            }
         } else {
             rc = check_write_status_unconnected(tag);
         }
@@ -201,6 +237,14 @@ int tag_read_start(ab_tag_p tag)
 
     pdebug(DEBUG_INFO, "Starting");
 
+    /* find out the instance ID first, if we need it. */
+    if(tag->use_instance_id) {
+        rc = resolve_instance_id(tag, 0);
+        if(rc != PLCTAG_STATUS_OK) {
+            return rc;
+        }
+    }
+
     /* mark the tag read in progress */
     tag->read_in_progress = 1;
 
@@ -209,7 +253,11 @@ int tag_read_start(ab_tag_p tag)
         if(tag->tag_list) {
             rc = build_tag_list_request_connected(tag);
         } else {
-            rc = build_read_request_connected(tag, tag->offset);
+            rc = build_read_fragments_connected(tag);
+
+            if(rc == PLCTAG_ERR_NOT_IMPLEMENTED) {
+                rc = build_read_request_connected(tag, tag->offset);
+            }
         }
     } else {
         rc = build_read_request_unconnected(tag, tag->offset);
@@ -260,6 +308,14 @@ int tag_write_start(ab_tag_p tag)
      * buffers.
      */
 
+    /* find out the instance ID first, if we need it. */
+    if(tag->use_instance_id) {
+        rc = resolve_instance_id(tag, 1);
+        if(rc != PLCTAG_STATUS_OK) {
+            return rc;
+        }
+    }
+
     if (tag->first_read) {
         pdebug(DEBUG_DETAIL, "No read has completed yet, doing pre-read to get type information.");
 
@@ -277,7 +333,11 @@ int tag_write_start(ab_tag_p tag)
     tag->write_in_progress = 1;
 
     if(tag->use_connected_msg) {
-        rc = build_write_request_connected(tag, tag->offset);
+        rc = build_write_fragments_connected(tag);
+
+        if(rc == PLCTAG_ERR_NOT_IMPLEMENTED) {
+            rc = build_write_request_connected(tag, tag->offset);
+        }
     } else {
         rc = build_write_request_unconnected(tag, tag->offset);
     }
@@ -296,16 +356,41 @@ int tag_write_start(ab_tag_p tag)
 
 
 int build_read_request_connected(ab_tag_p tag, int byte_offset)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    rc = make_read_request_connected(tag, byte_offset, tag->allow_packing, 0, &tag->req);
+
+    pdebug(DEBUG_INFO, "Done");
+
+    return rc;
+}
+
+
+
+/*
+ * make_read_request_connected
+ *
+ * Queue a connected read of the tag starting at byte_offset.  The new
+ * request is returned in *req_out.  Set fragment if it is one of several
+ * pieces of the tag sent at once.
+ */
+
+int make_read_request_connected(ab_tag_p tag, int byte_offset, int allow_packing, int fragment, ab_request_p *req_out)
 {
     eip_cip_co_req* cip = NULL;
     uint8_t* data = NULL;
     ab_request_p req = NULL;
     int rc = PLCTAG_STATUS_OK;
 
-    pdebug(DEBUG_INFO, "Starting.");
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    *req_out = NULL;
 
     /* get a request buffer */
-    rc = session_create_request(tag->session, tag->tag_id, &req);
+    rc = session_create_request(tag->session, tag->route, tag->tag_id, &req);
     if (rc != PLCTAG_STATUS_OK) {
         pdebug(DEBUG_ERROR, "Unable to get new request.  rc=%d", rc);
         return rc;
@@ -365,36 +450,189 @@ int build_read_request_connected(ab_tag_p tag, int byte_offset)
     /* set the session so that we know what session the request is aiming at */
     //req->session = tag->session;
 
-    req->allow_packing = tag->allow_packing;
+    req->allow_packing = allow_packing;
+    req->fragment = fragment;
+
+    /* how soon the request needs to go out. */
+    ab_tag_prioritize_request(tag, req);
 
     /* add the request to the session's list. */
     rc = session_add_request(tag->session, req);
 
     if (rc != PLCTAG_STATUS_OK) {
         pdebug(DEBUG_ERROR, "Unable to add request to session! rc=%d", rc);
-        tag->req = rc_dec(req);
+        rc_dec(req);
         return rc;
     }
 
     /* save the request for later */
-    tag->req = req;
+    *req_out = req;
 
-    pdebug(DEBUG_INFO, "Done");
+    pdebug(DEBUG_DETAIL, "Done");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * read_data_per_packet
+ *
+ * How much of the tag one connected read response can carry.  The PLC
+ * decides in the end, this only needs to be close.  The type information
+ * of an aggregate tag is not known before the first read, so a short
+ * one is assumed.
+ */
+
+static int read_data_per_packet(ab_tag_p tag)
+{
+    int type_info_size = (tag->encoded_type_info_size > 4 ? tag->encoded_type_info_size : 4);
+    int overhead = 0;
+    int data_per_packet = 0;
+
+    overhead =  2                       /* connection sequence number */
+                + 4                     /* reply service, reserved, status and extended status size */
+                + type_info_size        /* encoded type */
+                + 8;                    /* MAGIC fudge factor */
+
+    data_per_packet = session_get_max_payload(tag->session, tag->route) - overhead;
+
+    if(data_per_packet <= 0) {
+        return 0;
+    }
+
+    /* we want a multiple of 8 bytes */
+    return data_per_packet & 0xFFFFF8;
+}
+
+
+
+/*
+ * reserve_fragments
+ *
+ * Make sure the tag can track num_frags fragments.  The array is kept
+ * for the next operation.
+ */
+
+int reserve_fragments(ab_tag_p tag, int num_frags)
+{
+    ab_fragment_t *frags = NULL;
+
+    if(num_frags <= tag->frags_capacity) {
+        return PLCTAG_STATUS_OK;
+    }
+
+    frags = mem_realloc(tag->frags, (int)(sizeof(ab_fragment_t) * (size_t)num_frags));
+    if(!frags) {
+        pdebug(DEBUG_ERROR, "Unable to allocate fragment array!");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    tag->frags = frags;
+    tag->frags_capacity = num_frags;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * build_read_fragments_connected
+ *
+ * Split a read that will not fit in one response into pieces that do
+ * and queue all of them at once, rather than asking for each piece when
+ * the previous one comes back.  The session spreads them over the
+ * connections of the route and they come back in any order.
+ *
+ * Returns PLCTAG_ERR_NOT_IMPLEMENTED if the tag fits in one response or
+ * must be read one piece at a time.
+ */
+
+int build_read_fragments_connected(ab_tag_p tag)
+{
+    int rc = PLCTAG_STATUS_OK;
+    int data_per_packet = 0;
+    int num_frags = 0;
+
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    /*
+     * until the route has a connection open, the packet size is the small
+     * one and the pieces would be tiny, so that read is done one piece at
+     * a time.  A pre-write read only wants the type.
+     */
+    if(tag->pre_write_read || tag->offset != 0 || tag->protocol_type != AB_PROTOCOL_LGX
+       || !session_route_is_connected(tag->session, tag->route)) {
+        return PLCTAG_ERR_NOT_IMPLEMENTED;
+    }
+
+    data_per_packet = read_data_per_packet(tag);
+    if(data_per_packet <= 0 || tag->size <= data_per_packet) {
+        return PLCTAG_ERR_NOT_IMPLEMENTED;
+    }
+
+    num_frags = (tag->size + data_per_packet - 1) / data_per_packet;
+
+    rc = reserve_fragments(tag, num_frags);
+    if(rc != PLCTAG_STATUS_OK) {
+        return rc;
+    }
+
+    pdebug(DEBUG_DETAIL, "Reading %d bytes in %d fragments of %d bytes.", tag->size, num_frags, data_per_packet);
+
+    for(tag->num_frags = 0; tag->num_frags < num_frags; tag->num_frags++) {
+        ab_fragment_t *frag = &tag->frags[tag->num_frags];
+
+        frag->start = tag->num_frags * data_per_packet;
+        frag->end = (frag->start + data_per_packet < tag->size ? frag->start + data_per_packet : tag->size);
+
+        /* these fill a packet on their own, packing would only split them up. */
+        rc = make_read_request_connected(tag, frag->start, 0, 1, &frag->req);
+        if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Unable to queue read fragment %d!", tag->num_frags);
+            ab_tag_abort(tag);
+            return rc;
+        }
+    }
+
+    pdebug(DEBUG_DETAIL, "Done.");
 
     return PLCTAG_STATUS_OK;
 }
 
 int build_tag_list_request_connected(ab_tag_p tag)
+{
+    return build_symbol_list_request_connected(tag, NULL);
+}
+
+
+
+/*
+ * build_symbol_list_request_connected
+ *
+ * Ask for the symbols starting at instance tag->next_id.  With a
+ * program name, the symbols of that program are listed instead of the
+ * controller symbols.
+ */
+
+int build_symbol_list_request_connected(ab_tag_p tag, const char *program)
 {
     eip_cip_co_req* cip = NULL;
-    tag_list_req *list_req = NULL;
+    tag_list_req list_req;
+    uint8_t *data = NULL;
     ab_request_p req = NULL;
+    int program_len = (program ? str_length(program) : 0);
     int rc = PLCTAG_STATUS_OK;
 
     pdebug(DEBUG_INFO, "Starting.");
 
+    if(program_len > 0xFF) {
+        pdebug(DEBUG_WARN, "Program name %s is too long!", program);
+        return PLCTAG_ERR_TOO_LARGE;
+    }
+
     /* get a request buffer */
-    rc = session_create_request(tag->session, tag->tag_id, &req);
+    rc = session_create_request(tag->session, tag->route, tag->tag_id, &req);
     if (rc != PLCTAG_STATUS_OK) {
         pdebug(DEBUG_ERROR, "Unable to get new request.  rc=%d", rc);
         return rc;
@@ -404,7 +642,7 @@ int build_tag_list_request_connected(ab_tag_p tag)
     cip = (eip_cip_co_req*)(req->data);
 
     /* point to the end of the struct */
-    list_req = (tag_list_req *)(cip + 1);
+    data = (uint8_t *)(cip + 1);
 
     /*
      * set up the embedded CIP tag list request packet
@@ -422,20 +660,40 @@ int build_tag_list_request_connected(ab_tag_p tag)
                                                 0x07 attribute #7 - base type size (array element) in bytes
                                                 0x08    attribute #8 - array dimensions (3xu32)
                                                 0x01    attribute #1 - symbol name
+
+     * A program's symbols have its name segment in front of the class.
     */
 
-    list_req->request_service = AB_EIP_CMD_CIP_LIST_TAGS;
-    list_req->request_path_size = 3; /* MAGIC */
-    list_req->request_path[0] = 0x20; /* class type */
-    list_req->request_path[1] = 0x6B; /* tag info/symbol class */
-    list_req->request_path[2] = 0x25; /* 16-bit instance ID type */
-    list_req->request_path[3] = 0x00; /* padding */
-    list_req->instance_id = h2le16((uint16_t)tag->next_id);
-    list_req->num_attributes = h2le16(4); /* MAGIC, 4 attributes to get */
-    list_req->requested_attributes[0] = h2le16(0x02); /* MAGIC, symbol type */
-    list_req->requested_attributes[1] = h2le16(0x07); /* MAGIC, base type size */
-    list_req->requested_attributes[2] = h2le16(0x08); /* MAGIC, array dimensions, 3x u32 */
-    list_req->requested_attributes[3] = h2le16(0x01); /* MAGIC, symbol name */
+    list_req.request_service = AB_EIP_CMD_CIP_LIST_TAGS;
+    list_req.request_path_size = 3; /* MAGIC */
+    list_req.request_path[0] = 0x20; /* class type */
+    list_req.request_path[1] = 0x6B; /* tag info/symbol class */
+    list_req.request_path[2] = 0x25; /* 16-bit instance ID type */
+    list_req.request_path[3] = 0x00; /* padding */
+    list_req.instance_id = h2le16((uint16_t)tag->next_id);
+    list_req.num_attributes = h2le16(4); /* MAGIC, 4 attributes to get */
+    list_req.requested_attributes[0] = h2le16(0x02); /* MAGIC, symbol type */
+    list_req.requested_attributes[1] = h2le16(0x07); /* MAGIC, base type size */
+    list_req.requested_attributes[2] = h2le16(0x08); /* MAGIC, array dimensions, 3x u32 */
+    list_req.requested_attributes[3] = h2le16(0x01); /* MAGIC, symbol name */
+
+    *data++ = list_req.request_service;
+    *data++ = (uint8_t)(list_req.request_path_size + (program_len > 0 ? (2 + program_len + 1) / 2 : 0));
+
+    if(program_len > 0) {
+        *data++ = 0x91; /* symbolic segment */
+        *data++ = (uint8_t)program_len;
+        mem_copy(data, (void *)program, program_len);
+        data += program_len;
+
+        /* pad to an even number of bytes. */
+        if(program_len & 0x01) {
+            *data++ = 0;
+        }
+    }
+
+    mem_copy(data, &list_req.request_path[0], (int)sizeof(list_req) - 2);
+    data += sizeof(list_req) - 2;
 
     /* now we go back and fill in the fields of the static part */
 
@@ -450,13 +708,16 @@ int build_tag_list_request_connected(ab_tag_p tag)
     cip->cpf_cai_item_type = h2le16(AB_EIP_ITEM_CAI);/* ALWAYS 0x00A1 connected address item */
     cip->cpf_cai_item_length = h2le16(4);            /* ALWAYS 4, size of connection ID*/
     cip->cpf_cdi_item_type = h2le16(AB_EIP_ITEM_CDI);/* ALWAYS 0x00B1 - connected Data Item */
-    cip->cpf_cdi_item_length = h2le16((uint16_t)(sizeof(*list_req) + sizeof(cip->cpf_conn_seq_num)));
+    cip->cpf_cdi_item_length = h2le16((uint16_t)(data - (uint8_t*)(&cip->cpf_conn_seq_num)));
 
     /* set the size of the request */
-    req->request_size = (int)(sizeof(*cip) + sizeof(*list_req));
+    req->request_size = (int)(data - (req->data));
 
     req->allow_packing = tag->allow_packing;
 
+    /* how soon the request needs to go out. */
+    ab_tag_prioritize_request(tag, req);
+
     /* add the request to the session's list. */
     rc = session_add_request(tag->session, req);
 
@@ -487,7 +748,7 @@ int build_read_request_unconnected(ab_tag_p tag, int byte_offset)
     pdebug(DEBUG_INFO, "Starting.");
 
     /* get a request buffer */
-    rc = session_create_request(tag->session, tag->tag_id, &req);
+    rc = session_create_request(tag->session, tag->route, tag->tag_id, &req);
 
     if (rc != PLCTAG_STATUS_OK) {
         pdebug(DEBUG_ERROR, "Unable to get new request.  rc=%d", rc);
@@ -540,13 +801,13 @@ int build_read_request_unconnected(ab_tag_p tag, int byte_offset)
      * uint8_t reserved/pad (zero)
      * uint8_t[...] path (padded to even number of bytes)
      */
-    if(tag->session->conn_path_size > 0) {
-        *data = (tag->session->conn_path_size) / 2; /* in 16-bit words */
+    if(tag->route->conn_path_size > 0) {
+        *data = (tag->route->conn_path_size) / 2; /* in 16-bit words */
         data++;
         *data = 0; /* reserved/pad */
         data++;
-        mem_copy(data, tag->session->conn_path, tag->session->conn_path_size);
-        data += tag->session->conn_path_size;
+        mem_copy(data, tag->route->conn_path, tag->route->conn_path_size);
+        data += tag->route->conn_path_size;
     }
 
     /* now we go back and fill in the fields of the static part */
@@ -585,6 +846,9 @@ int build_read_request_unconnected(ab_tag_p tag, int byte_offset)
     /* allow packing if the tag allows it. */
     req->allow_packing = tag->allow_packing;
 
+    /* how soon the request needs to go out. */
+    ab_tag_prioritize_request(tag, req);
+
     /* add the request to the session's list. */
     rc = session_add_request(tag->session, req);
 
@@ -608,31 +872,73 @@ int build_read_request_unconnected(ab_tag_p tag, int byte_offset)
 int build_write_request_connected(ab_tag_p tag, int byte_offset)
 {
     int rc = PLCTAG_STATUS_OK;
-    eip_cip_co_req* cip = NULL;
-    uint8_t* data = NULL;
-    ab_request_p req = NULL;
-    int multiple_requests = 0;
     int write_size = 0;
 
     pdebug(DEBUG_INFO, "Starting.");
 
-    /* get a request buffer */
-    rc = session_create_request(tag->session, tag->tag_id, &req);
+    rc = calculate_write_data_per_packet(tag);
     if (rc != PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_ERROR, "Unable to get new request.  rc=%d", rc);
+        pdebug(DEBUG_ERROR, "Unable to calculate valid write data per packet!.  rc=%s", plc_tag_decode_error(rc));
         return rc;
     }
 
-    rc = calculate_write_data_per_packet(tag);
-    if (rc != PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_ERROR, "Unable to calculate valid write data per packet!.  rc=%s", plc_tag_decode_error(rc));
+    /* how much data to write? */
+    write_size = tag->size - tag->offset;
+
+    if(write_size > tag->write_data_per_packet) {
+        write_size = tag->write_data_per_packet;
+    }
+
+    rc = make_write_request_connected(tag, byte_offset, write_size, tag->allow_packing, 0, &tag->req);
+    if(rc != PLCTAG_STATUS_OK) {
         return rc;
     }
 
+    tag->offset += write_size;
+
+    pdebug(DEBUG_INFO, "Done");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * make_write_request_connected
+ *
+ * Queue a connected write of write_size bytes of the tag data starting
+ * at byte_offset.  The new request is returned in *req_out.  Set
+ * fragment if it is one of several pieces of the tag sent at once.
+ */
+
+int make_write_request_connected(ab_tag_p tag, int byte_offset, int write_size, int allow_packing, int fragment, ab_request_p *req_out)
+{
+    int rc = PLCTAG_STATUS_OK;
+    eip_cip_co_req* cip = NULL;
+    uint8_t* data = NULL;
+    ab_request_p req = NULL;
+    int multiple_requests = 0;
+
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    *req_out = NULL;
+
+    if (!tag->encoded_type_info_size) {
+        pdebug(DEBUG_WARN,"Data type unsupported!");
+        return PLCTAG_ERR_UNSUPPORTED;
+    }
+
     if(tag->write_data_per_packet < tag->size) {
         multiple_requests = 1;
     }
 
+    /* get a request buffer */
+    rc = session_create_request(tag->session, tag->route, tag->tag_id, &req);
+    if (rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to get new request.  rc=%d", rc);
+        return rc;
+    }
+
     cip = (eip_cip_co_req*)(req->data);
 
     /* point to the end of the struct */
@@ -664,13 +970,8 @@ int build_write_request_connected(ab_tag_p tag, int byte_offset)
     data += tag->encoded_name_size;
 
     /* copy encoded type info */
-    if (tag->encoded_type_info_size) {
-        mem_copy(data, tag->encoded_type_info, tag->encoded_type_info_size);
-        data += tag->encoded_type_info_size;
-    } else {
-        pdebug(DEBUG_WARN,"Data type unsupported!");
-        return PLCTAG_ERR_UNSUPPORTED;
-    }
+    mem_copy(data, tag->encoded_type_info, tag->encoded_type_info_size);
+    data += tag->encoded_type_info_size;
 
     /* copy the item count, little endian */
     *((uint16_le*)data) = h2le16((uint16_t)(tag->elem_count));
@@ -682,17 +983,9 @@ int build_write_request_connected(ab_tag_p tag, int byte_offset)
         data += sizeof(uint32_le);
     }
 
-    /* how much data to write? */
-    write_size = tag->size - tag->offset;
-
-    if(write_size > tag->write_data_per_packet) {
-        write_size = tag->write_data_per_packet;
-    }
-
     /* now copy the data to write */
-    mem_copy(data, tag->data + tag->offset, write_size);
+    mem_copy(data, tag->data + byte_offset, write_size);
     data += write_size;
-    tag->offset += write_size;
 
     /* need to pad data to multiple of 16-bits */
     if (write_size & 0x01) {
@@ -719,27 +1012,98 @@ int build_write_request_connected(ab_tag_p tag, int byte_offset)
     req->request_size = (int)(data - (req->data));
 
     /* allow packing if the tag allows it. */
-    req->allow_packing = tag->allow_packing;
+    req->allow_packing = allow_packing;
+    req->fragment = fragment;
+
+    /* how soon the request needs to go out. */
+    ab_tag_prioritize_request(tag, req);
 
     /* add the request to the session's list. */
     rc = session_add_request(tag->session, req);
 
     if (rc != PLCTAG_STATUS_OK) {
         pdebug(DEBUG_ERROR, "Unable to add request to session! rc=%d", rc);
-        tag->req = rc_dec(req);
+        rc_dec(req);
         return rc;
     }
 
     /* save the request for later */
-    tag->req = req;
+    *req_out = req;
 
-    pdebug(DEBUG_INFO, "Done");
+    pdebug(DEBUG_DETAIL, "Done");
 
     return PLCTAG_STATUS_OK;
 }
 
 
 
+/*
+ * build_write_fragments_connected
+ *
+ * Split a write that will not fit in one packet into pieces that do and
+ * queue all of them at once, rather than sending each piece when the
+ * previous one is acknowledged.  The pieces do not overlap, so the order
+ * the PLC applies them in does not matter.
+ *
+ * Returns PLCTAG_ERR_NOT_IMPLEMENTED if the tag fits in one packet or
+ * must be written one piece at a time.
+ */
+
+int build_write_fragments_connected(ab_tag_p tag)
+{
+    int rc = PLCTAG_STATUS_OK;
+    int num_frags = 0;
+
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    /*
+     * not all PLCs take the pieces of a write out of order.  The packet
+     * size is small until the route has a connection open.
+     */
+    if(tag->offset != 0 || tag->protocol_type != AB_PROTOCOL_LGX
+       || !session_route_is_connected(tag->session, tag->route)) {
+        return PLCTAG_ERR_NOT_IMPLEMENTED;
+    }
+
+    rc = calculate_write_data_per_packet(tag);
+    if (rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to calculate valid write data per packet!.  rc=%s", plc_tag_decode_error(rc));
+        return rc;
+    }
+
+    if(tag->size <= tag->write_data_per_packet) {
+        return PLCTAG_ERR_NOT_IMPLEMENTED;
+    }
+
+    num_frags = (tag->size + tag->write_data_per_packet - 1) / tag->write_data_per_packet;
+
+    rc = reserve_fragments(tag, num_frags);
+    if(rc != PLCTAG_STATUS_OK) {
+        return rc;
+    }
+
+    pdebug(DEBUG_DETAIL, "Writing %d bytes in %d fragments of %d bytes.", tag->size, num_frags, tag->write_data_per_packet);
+
+    for(tag->num_frags = 0; tag->num_frags < num_frags; tag->num_frags++) {
+        ab_fragment_t *frag = &tag->frags[tag->num_frags];
+
+        frag->start = tag->num_frags * tag->write_data_per_packet;
+        frag->end = (frag->start + tag->write_data_per_packet < tag->size ? frag->start + tag->write_data_per_packet : tag->size);
+
+        rc = make_write_request_connected(tag, frag->start, frag->end - frag->start, tag->allow_packing, 1, &frag->req);
+        if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Unable to queue write fragment %d!", tag->num_frags);
+            ab_tag_abort(tag);
+            return rc;
+        }
+    }
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
 
 int build_write_request_unconnected(ab_tag_p tag, int byte_offset)
 {
@@ -755,7 +1119,7 @@ int build_write_request_unconnected(ab_tag_p tag, int byte_offset)
     pdebug(DEBUG_INFO, "Starting.");
 
     /* get a request buffer */
-    rc = session_create_request(tag->session, tag->tag_id, &req);
+    rc = session_create_request(tag->session, tag->route, tag->tag_id, &req);
     if (rc != PLCTAG_STATUS_OK) {
         pdebug(DEBUG_ERROR, "Unable to get new request.  rc=%d", rc);
         return rc;
@@ -850,12 +1214,12 @@ int build_write_request_unconnected(ab_tag_p tag, int byte_offset)
      */
 
     /* Now copy in the routing information for the embedded message */
-    *data = (tag->session->conn_path_size) / 2; /* in 16-bit words */
+    *data = (tag->route->conn_path_size) / 2; /* in 16-bit words */
     data++;
     *data = 0;
     data++;
-    mem_copy(data, tag->session->conn_path, tag->session->conn_path_size);
-    data += tag->session->conn_path_size;
+    mem_copy(data, tag->route->conn_path, tag->route->conn_path_size);
+    data += tag->route->conn_path_size;
 
     /* now fill in the rest of the structure. */
 
@@ -893,6 +1257,9 @@ int build_write_request_unconnected(ab_tag_p tag, int byte_offset)
     /* allow packing if the tag allows it. */
     req->allow_packing = tag->allow_packing;
 
+    /* how soon the request needs to go out. */
+    ab_tag_prioritize_request(tag, req);
+
     /* add the request to the session's list. */
     rc = session_add_request(tag->session, req);
 
@@ -915,23 +1282,250 @@ int build_write_request_unconnected(ab_tag_p tag, int byte_offset)
 
 
 /*
- * check_read_status_connected
+ * unpack_read_response_connected
  *
- * This routine checks for any outstanding requests and copies in data
- * that has arrived.  At the end of the request, it will clean up the request
- * buffers.  This is not thread-safe!  It should be called with the tag mutex
- * locked!
+ * Check the response to a connected read and keep the type information
+ * in it.  On success, *data_out points to the tag data in the response,
+ * *data_size is how much there is and *partial is set if the PLC has
+ * more to send.
  */
 
-static int check_read_status_connected(ab_tag_p tag)
+static int unpack_read_response_connected(ab_tag_p tag, ab_request_p req, uint8_t **data_out, int *data_size, int *partial)
 {
-    int rc = PLCTAG_STATUS_OK;
-    eip_cip_co_resp* cip_resp;
-    uint8_t* data;
-    uint8_t* data_end;
-    int partial_data = 0;
+    eip_cip_co_resp* cip_resp = (eip_cip_co_resp*)(req->resp_data);
+    uint8_t* data = (req->resp_data) + sizeof(eip_cip_co_resp);
+    uint8_t* data_end = (req->resp_data + le2h16(cip_resp->encap_length) + sizeof(eip_encap));
 
-    pdebug(DEBUG_SPEW, "Starting.");
+    *data_out = NULL;
+    *data_size = 0;
+    *partial = 0;
+
+    if (le2h16(cip_resp->encap_command) != AB_EIP_CONNECTED_SEND) {
+        pdebug(DEBUG_WARN, "Unexpected EIP packet type received: %d!", cip_resp->encap_command);
+        return PLCTAG_ERR_BAD_DATA;
+    }
+
+    if (le2h32(cip_resp->encap_status) != AB_EIP_OK) {
+        pdebug(DEBUG_WARN, "EIP command failed, response code: %d", le2h32(cip_resp->encap_status));
+        return PLCTAG_ERR_REMOTE_ERR;
+    }
+
+    /*
+     * FIXME
+     *
+     * It probably should not be necessary to check for both as setting the type to anything other
+     * than fragmented is error-prone.
+     */
+
+    if (cip_resp->reply_service != (AB_EIP_CMD_CIP_READ_FRAG | AB_EIP_CMD_CIP_OK)
+        && cip_resp->reply_service != (AB_EIP_CMD_CIP_READ | AB_EIP_CMD_CIP_OK) ) {
+        pdebug(DEBUG_WARN, "CIP response reply service unexpected: %d", cip_resp->reply_service);
+        return PLCTAG_ERR_BAD_DATA;
+    }
+
+    if (cip_resp->status != AB_CIP_STATUS_OK && cip_resp->status != AB_CIP_STATUS_FRAG) {
+        pdebug(DEBUG_WARN, "CIP read failed with status: 0x%x %s", cip_resp->status, decode_cip_error_short((uint8_t *)&cip_resp->status));
+        pdebug(DEBUG_INFO, decode_cip_error_long((uint8_t *)&cip_resp->status));
+
+        check_instance_id_error(tag, cip_resp->status);
+
+        return decode_cip_error_code((uint8_t *)&cip_resp->status);
+    }
+
+    /* check to see if this is a partial response. */
+    *partial = (cip_resp->status == AB_CIP_STATUS_FRAG);
+
+    /*
+     * check to see if there is any data to process.  If this is a packed
+     * response, there might not be.
+     */
+    if((data_end - data) <= 0) {
+        pdebug(DEBUG_DETAIL, "Response returned no data and no error.");
+        return PLCTAG_STATUS_OK;
+    }
+
+    /* the first byte of the response is a type byte. */
+    pdebug(DEBUG_DETAIL, "type byte = %d (%x)", (int)*data, (int)*data);
+
+    /* handle the data type part.  This can be long. */
+
+    /* check for a simple/base type */
+    if ((*data) >= AB_CIP_DATA_BIT && (*data) <= AB_CIP_DATA_STRINGI) {
+        /* copy the type info for later. */
+        set_type_info(tag, data, 2);
+
+        /* skip the type byte and zero length byte */
+        data += 2;
+    } else if ((*data) == AB_CIP_DATA_ABREV_STRUCT || (*data) == AB_CIP_DATA_ABREV_ARRAY ||
+               (*data) == AB_CIP_DATA_FULL_STRUCT || (*data) == AB_CIP_DATA_FULL_ARRAY) {
+        /* this is an aggregate type of some sort, the type info is variable length */
+        int type_length = *(data + 1) + 2;  /*
+                                               * MAGIC
+                                               * add 2 to get the total length including
+                                               * the type byte and the length byte.
+                                               */
+
+        /* check for extra long types */
+        if (type_length > MAX_TAG_TYPE_INFO) {
+            pdebug(DEBUG_WARN, "Read data type info is too long (%d)!", type_length);
+            return PLCTAG_ERR_TOO_LARGE;
+        }
+
+        /* copy the type info for later. */
+        set_type_info(tag, data, type_length);
+
+        data += type_length;
+    } else {
+        pdebug(DEBUG_WARN, "Unsupported data type returned, type byte=%d", *data);
+        return PLCTAG_ERR_UNSUPPORTED;
+    }
+
+    if(data > data_end) {
+        pdebug(DEBUG_WARN, "Read response is too short for its type information!");
+        return PLCTAG_ERR_BAD_DATA;
+    }
+
+    *data_out = data;
+    *data_size = (int)(data_end - data);
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * check_read_fragments_connected
+ *
+ * Collect the pieces of a read started by build_read_fragments_connected.
+ * Each is copied into place as it comes in.  If the PLC sent less of a
+ * piece than was hoped, the rest of it is asked for.  The read is done
+ * when nothing is left in flight.
+ */
+
+int check_read_fragments_connected(ab_tag_p tag)
+{
+    int rc = PLCTAG_STATUS_OK;
+    int pending = 0;
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    for(int i=0; i < tag->num_frags && rc == PLCTAG_STATUS_OK; i++) {
+        ab_fragment_t *frag = &tag->frags[i];
+        uint8_t *data = NULL;
+        int data_size = 0;
+        int partial_data = 0;
+
+        if(!frag->req) {
+            continue;
+        }
+
+        /* request can be used by two threads at once. */
+        spin_block(&frag->req->lock) {
+            if(!frag->req->resp_received) {
+                rc = PLCTAG_STATUS_PENDING;
+                break;
+            }
+
+            /* check to see if it was an abort on the session side. */
+            if(frag->req->status != PLCTAG_STATUS_OK) {
+                rc = frag->req->status;
+                pdebug(DEBUG_WARN,"Session reported failure of request: %s.", plc_tag_decode_error(rc));
+            }
+        }
+
+        if(rc == PLCTAG_STATUS_PENDING) {
+            pending = 1;
+            rc = PLCTAG_STATUS_OK;
+            continue;
+        }
+
+        if(rc != PLCTAG_STATUS_OK) {
+            break;
+        }
+
+        /* the request is ours exclusively. */
+
+        rc = unpack_read_response_connected(tag, frag->req, &data, &data_size, &partial_data);
+
+        frag->req->abort_request = 1;
+
+        if(rc == PLCTAG_STATUS_OK) {
+            /* the PLC may send more than this piece, the next piece has the rest. */
+            if(data_size > frag->end - frag->start) {
+                data_size = frag->end - frag->start;
+            }
+
+            pdebug(DEBUG_DETAIL, "Got %d bytes of data at offset %d.", data_size, frag->start);
+
+            mem_copy(tag->data + frag->start, data, data_size);
+
+            frag->start += data_size;
+        }
+
+        frag->req = rc_dec(frag->req);
+
+        /* the PLC could not fit all of this piece in one response, ask for the rest. */
+        if(rc == PLCTAG_STATUS_OK && partial_data && data_size > 0 && frag->start < frag->end) {
+            pdebug(DEBUG_DETAIL, "Asking for the %d bytes left of the fragment at offset %d.", frag->end - frag->start, frag->start);
+
+            rc = make_read_request_connected(tag, frag->start, 0, 1, &frag->req);
+
+            pending = 1;
+        }
+    }
+
+    if(rc != PLCTAG_STATUS_OK) {
+        if(tag->instance_id_state == INSTANCE_ID_REJECTED) {
+            return retry_by_name(tag, 0);
+        }
+
+        pdebug(DEBUG_WARN, "Fragmented read failed!");
+
+        /* drops the other fragments too. */
+        ab_tag_abort(tag);
+
+        end_name_retry(tag, rc);
+
+        return rc;
+    }
+
+    if(pending) {
+        return PLCTAG_STATUS_PENDING;
+    }
+
+    /* done! */
+    tag->num_frags = 0;
+    tag->first_read = 0;
+    tag->offset = 0;
+    tag->read_in_progress = 0;
+
+    end_name_retry(tag, PLCTAG_STATUS_OK);
+
+    pdebug(DEBUG_INFO, "Done.  All fragments read.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+
+/*
+ * check_read_status_connected
+ *
+ * This routine checks for any outstanding requests and copies in data
+ * that has arrived.  At the end of the request, it will clean up the request
+ * buffers.  This is not thread-safe!  It should be called with the tag mutex
+ * locked!
+ */
+
+static int check_read_status_connected(ab_tag_p tag)
+{
+    int rc = PLCTAG_STATUS_OK;
+    uint8_t *data = NULL;
+    int data_size = 0;
+    int partial_data = 0;
+
+    pdebug(DEBUG_SPEW, "Starting.");
 
     if(!tag) {
         pdebug(DEBUG_ERROR,"Null tag pointer passed!");
@@ -979,135 +1573,37 @@ static int check_read_status_connected(ab_tag_p tag)
 
     /* the request is ours exclusively. */
 
-    /* point to the data */
-    cip_resp = (eip_cip_co_resp*)(tag->req->data);
-
-    /* point to the start of the data */
-    data = (tag->req->data) + sizeof(eip_cip_co_resp);
-
-    /* point the end of the data */
-    data_end = (tag->req->data + le2h16(cip_resp->encap_length) + sizeof(eip_encap));
-
-    /* check the status */
     do {
-        if (le2h16(cip_resp->encap_command) != AB_EIP_CONNECTED_SEND) {
-            pdebug(DEBUG_WARN, "Unexpected EIP packet type received: %d!", cip_resp->encap_command);
-            rc = PLCTAG_ERR_BAD_DATA;
-            break;
-        }
-
-        if (le2h32(cip_resp->encap_status) != AB_EIP_OK) {
-            pdebug(DEBUG_WARN, "EIP command failed, response code: %d", le2h32(cip_resp->encap_status));
-            rc = PLCTAG_ERR_REMOTE_ERR;
-            break;
-        }
-
-        /*
-         * FIXME
-         *
-         * It probably should not be necessary to check for both as setting the type to anything other
-         * than fragmented is error-prone.
-         */
-
-        if (cip_resp->reply_service != (AB_EIP_CMD_CIP_READ_FRAG | AB_EIP_CMD_CIP_OK)
-            && cip_resp->reply_service != (AB_EIP_CMD_CIP_READ | AB_EIP_CMD_CIP_OK) ) {
-            pdebug(DEBUG_WARN, "CIP response reply service unexpected: %d", cip_resp->reply_service);
-            rc = PLCTAG_ERR_BAD_DATA;
+        rc = unpack_read_response_connected(tag, tag->req, &data, &data_size, &partial_data);
+        if(rc != PLCTAG_STATUS_OK || data_size == 0) {
             break;
         }
 
-        if (cip_resp->status != AB_CIP_STATUS_OK && cip_resp->status != AB_CIP_STATUS_FRAG) {
-            pdebug(DEBUG_WARN, "CIP read failed with status: 0x%x %s", cip_resp->status, decode_cip_error_short((uint8_t *)&cip_resp->status));
-            pdebug(DEBUG_INFO, decode_cip_error_long((uint8_t *)&cip_resp->status));
-
-            rc = decode_cip_error_code((uint8_t *)&cip_resp->status);
-
+        /* check data size. */
+        if ((tag->offset + data_size) > tag->size) {
+            pdebug(DEBUG_WARN,
+                   "Read data is too long (%d bytes) to fit in tag data buffer (%d bytes)!",
+                   tag->offset + data_size,
+                   tag->size);
+            pdebug(DEBUG_WARN,"byte_offset=%d, data size=%d", tag->offset, data_size);
+            rc = PLCTAG_ERR_TOO_LARGE;
             break;
         }
 
-        /* check to see if this is a partial response. */
-        partial_data = (cip_resp->status == AB_CIP_STATUS_FRAG);
+        pdebug(DEBUG_INFO, "Got %d bytes of data", data_size);
 
         /*
-         * check to see if there is any data to process.  If this is a packed
-         * response, there might not be.
+         * copy the data, but only if this is not
+         * a pre-read for a subsequent write!  We do not
+         * want to overwrite the data the upstream has
+         * put into the tag's data buffer.
          */
-        if((data_end - data) > 0) {
-            /* the first byte of the response is a type byte. */
-            pdebug(DEBUG_DETAIL, "type byte = %d (%x)", (int)*data, (int)*data);
-
-            /* handle the data type part.  This can be long. */
-
-            /* check for a simple/base type */
-            if ((*data) >= AB_CIP_DATA_BIT && (*data) <= AB_CIP_DATA_STRINGI) {
-                /* copy the type info for later. */
-                if (tag->encoded_type_info_size == 0) {
-                    tag->encoded_type_info_size = 2;
-                    mem_copy(tag->encoded_type_info, data, tag->encoded_type_info_size);
-                }
-
-                /* skip the type byte and zero length byte */
-                data += 2;
-            } else if ((*data) == AB_CIP_DATA_ABREV_STRUCT || (*data) == AB_CIP_DATA_ABREV_ARRAY ||
-                       (*data) == AB_CIP_DATA_FULL_STRUCT || (*data) == AB_CIP_DATA_FULL_ARRAY) {
-                /* this is an aggregate type of some sort, the type info is variable length */
-                int type_length = *(data + 1) + 2;  /*
-                                                       * MAGIC
-                                                       * add 2 to get the total length including
-                                                       * the type byte and the length byte.
-                                                       */
-
-                /* check for extra long types */
-                if (type_length > MAX_TAG_TYPE_INFO) {
-                    pdebug(DEBUG_WARN, "Read data type info is too long (%d)!", type_length);
-                    rc = PLCTAG_ERR_TOO_LARGE;
-                    break;
-                }
-
-                /* copy the type info for later. */
-                if (tag->encoded_type_info_size == 0) {
-                    tag->encoded_type_info_size = type_length;
-                    mem_copy(tag->encoded_type_info, data, tag->encoded_type_info_size);
-                }
-
-                data += type_length;
-            } else {
-                pdebug(DEBUG_WARN, "Unsupported data type returned, type byte=%d", *data);
-                rc = PLCTAG_ERR_UNSUPPORTED;
-                break;
-            }
-
-            /* check data size. */
-            if ((tag->offset + (data_end - data)) > tag->size) {
-                pdebug(DEBUG_WARN,
-                       "Read data is too long (%d bytes) to fit in tag data buffer (%d bytes)!",
-                       tag->offset + (int)(data_end - data),
-                       tag->size);
-                pdebug(DEBUG_WARN,"byte_offset=%d, data size=%d", tag->offset, (int)(data_end - data));
-                rc = PLCTAG_ERR_TOO_LARGE;
-                break;
-            }
-
-            pdebug(DEBUG_INFO, "Got %d bytes of data", (data_end - data));
-
-            /*
-             * copy the data, but only if this is not
-             * a pre-read for a subsequent write!  We do not
-             * want to overwrite the data the upstream has
-             * put into the tag's data buffer.
-             */
-            if (!tag->pre_write_read) {
-                mem_copy(tag->data + tag->offset, data, (int)(data_end - data));
-            }
-
-            /* bump the byte offset */
-            tag->offset += (int)(data_end - data);
-        } else {
-            pdebug(DEBUG_DETAIL, "Response returned no data and no error.");
+        if (!tag->pre_write_read) {
+            mem_copy(tag->data + tag->offset, data, data_size);
         }
 
-        /* set the return code */
-        rc = PLCTAG_STATUS_OK;
+        /* bump the byte offset */
+        tag->offset += data_size;
     } while(0);
 
     /* clean up the request */
@@ -1126,6 +1622,8 @@ static int check_read_status_connected(ab_tag_p tag)
             tag->first_read = 0;
             tag->offset = 0;
 
+            end_name_retry(tag, PLCTAG_STATUS_OK);
+
             /* if this is a pre-read for a write, then pass off to the write routine */
             if (tag->pre_write_read) {
                 pdebug(DEBUG_DETAIL, "Restarting write call now.");
@@ -1141,11 +1639,17 @@ static int check_read_status_connected(ab_tag_p tag)
 
     /* this is not an else clause because the above if could result in bad rc. */
     if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_STATUS_PENDING) {
+        if(tag->instance_id_state == INSTANCE_ID_REJECTED) {
+            return retry_by_name(tag, 0);
+        }
+
         /* error ! */
         pdebug(DEBUG_WARN, "Error received!");
 
         /* clean up everything. */
         ab_tag_abort(tag);
+
+        end_name_retry(tag, rc);
     }
 
     pdebug(DEBUG_SPEW, "Done.");
@@ -1227,13 +1731,13 @@ static int check_read_tag_list_status_connected(ab_tag_p tag)
     /* the request is ours exclusively. */
 
     /* point to the data */
-    cip_resp = (eip_cip_co_resp*)(tag->req->data);
+    cip_resp = (eip_cip_co_resp*)(tag->req->resp_data);
 
     /* point to the start of the data */
-    data = (tag->req->data) + sizeof(eip_cip_co_resp);
+    data = (tag->req->resp_data) + sizeof(eip_cip_co_resp);
 
     /* point the end of the data */
-    data_end = (tag->req->data + le2h16(cip_resp->encap_length) + sizeof(eip_encap));
+    data_end = (tag->req->resp_data + le2h16(cip_resp->encap_length) + sizeof(eip_encap));
 
     /* check the status */
     do {
@@ -1422,13 +1926,13 @@ static int check_read_status_unconnected(ab_tag_p tag)
     /* the request is ours exclusively. */
 
     /* point to the data */
-    cip_resp = (eip_cip_uc_resp*)(tag->req->data);
+    cip_resp = (eip_cip_uc_resp*)(tag->req->resp_data);
 
     /* point to the start of the data */
-    data = (tag->req->data) + sizeof(eip_cip_uc_resp);
+    data = (tag->req->resp_data) + sizeof(eip_cip_uc_resp);
 
     /* point the end of the data */
-    data_end = (tag->req->data + le2h16(cip_resp->encap_length) + sizeof(eip_encap));
+    data_end = (tag->req->resp_data + le2h16(cip_resp->encap_length) + sizeof(eip_encap));
 
     /* check the status */
     do {
@@ -1479,10 +1983,7 @@ static int check_read_status_unconnected(ab_tag_p tag)
 
         if ((*data) >= AB_CIP_DATA_BIT && (*data) <= AB_CIP_DATA_STRINGI) {
             /* copy the type info for later. */
-            if (tag->encoded_type_info_size == 0) {
-                tag->encoded_type_info_size = 2;
-                mem_copy(tag->encoded_type_info, data, tag->encoded_type_info_size);
-            }
+            set_type_info(tag, data, 2);
 
             /* skip the type byte and zero length byte */
             data += 2;
@@ -1504,10 +2005,7 @@ static int check_read_status_unconnected(ab_tag_p tag)
             }
 
             /* copy the type info for later. */
-            if (tag->encoded_type_info_size == 0) {
-                tag->encoded_type_info_size = type_length;
-                mem_copy(tag->encoded_type_info, data, tag->encoded_type_info_size);
-            }
+            set_type_info(tag, data, type_length);
 
             data += type_length;
         } else {
@@ -1593,95 +2091,202 @@ static int check_read_status_unconnected(ab_tag_p tag)
 
 
 /*
- * check_write_status_connected
+ * unpack_write_response_connected
  *
- * This routine must be called with the tag mutex locked.  It checks the current
- * status of a write operation.  If the write is done, it triggers the clean up.
+ * Check the response to a connected write.
  */
 
-static int check_write_status_connected(ab_tag_p tag)
+static int unpack_write_response_connected(ab_tag_p tag, ab_request_p req)
 {
-    eip_cip_co_resp* cip_resp;
-    int rc = PLCTAG_STATUS_OK;
+    eip_cip_co_resp* cip_resp = (eip_cip_co_resp*)(req->resp_data);
 
-    pdebug(DEBUG_SPEW, "Starting.");
+    if (le2h16(cip_resp->encap_command) != AB_EIP_CONNECTED_SEND) {
+        pdebug(DEBUG_WARN, "Unexpected EIP packet type received: %d!", cip_resp->encap_command);
+        return PLCTAG_ERR_BAD_DATA;
+    }
 
-    if(!tag) {
-        pdebug(DEBUG_ERROR,"Null tag pointer passed!");
-        return PLCTAG_ERR_NULL_PTR;
+    if (le2h32(cip_resp->encap_status) != AB_EIP_OK) {
+        pdebug(DEBUG_WARN, "EIP command failed, response code: %d", le2h32(cip_resp->encap_status));
+        return PLCTAG_ERR_REMOTE_ERR;
     }
 
-    if (!tag->req) {
-        tag->write_in_progress = 0;
-        tag->offset = 0;
+    if (cip_resp->reply_service != (AB_EIP_CMD_CIP_WRITE_FRAG | AB_EIP_CMD_CIP_OK)
+        && cip_resp->reply_service != (AB_EIP_CMD_CIP_WRITE | AB_EIP_CMD_CIP_OK)) {
+        pdebug(DEBUG_WARN, "CIP response reply service unexpected: %d", cip_resp->reply_service);
+        return PLCTAG_ERR_BAD_DATA;
+    }
 
-        pdebug(DEBUG_WARN,"Write in progress, but no request in flight!");
+    if (cip_resp->status != AB_CIP_STATUS_OK && cip_resp->status != AB_CIP_STATUS_FRAG) {
+        pdebug(DEBUG_WARN, "CIP read failed with status: 0x%x %s", cip_resp->status, decode_cip_error_short((uint8_t *)&cip_resp->status));
+        pdebug(DEBUG_INFO, decode_cip_error_long((uint8_t *)&cip_resp->status));
+        check_instance_id_error(tag, cip_resp->status);
 
-        return PLCTAG_ERR_WRITE;
+        return decode_cip_error_code((uint8_t *)&cip_resp->status);
     }
 
-    /* request can be used by two threads at once. */
-    spin_block(&tag->req->lock) {
-        if(!tag->req->resp_received) {
-            rc = PLCTAG_STATUS_PENDING;
-            break;
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * check_write_fragments_connected
+ *
+ * Collect the acknowledgements of a write started by
+ * build_write_fragments_connected.  The write is done when every piece
+ * is.  If any piece fails, the rest are dropped and the first failure
+ * seen is the status of the whole write.
+ */
+
+static int check_write_fragments_connected(ab_tag_p tag)
+{
+    int rc = PLCTAG_STATUS_OK;
+    int pending = 0;
+    int plc_rejected = 0;
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    for(int i=0; i < tag->num_frags && rc == PLCTAG_STATUS_OK; i++) {
+        ab_fragment_t *frag = &tag->frags[i];
+
+        if(!frag->req) {
+            continue;
         }
 
-        /* check to see if it was an abort on the session side. */
-        if(tag->req->status != PLCTAG_STATUS_OK) {
-            rc = tag->req->status;
-            tag->req->abort_request = 1;
+        /* request can be used by two threads at once. */
+        spin_block(&frag->req->lock) {
+            if(!frag->req->resp_received) {
+                rc = PLCTAG_STATUS_PENDING;
+                break;
+            }
 
-            pdebug(DEBUG_WARN,"Session reported failure of request: %s.", plc_tag_decode_error(rc));
+            /* check to see if it was an abort on the session side. */
+            if(frag->req->status != PLCTAG_STATUS_OK) {
+                rc = frag->req->status;
+                pdebug(DEBUG_WARN,"Session reported failure of request: %s.", plc_tag_decode_error(rc));
+            }
+        }
 
-            tag->write_in_progress = 0;
-            tag->offset = 0;
+        if(rc == PLCTAG_STATUS_PENDING) {
+            pending = 1;
+            rc = PLCTAG_STATUS_OK;
+            continue;
+        }
 
-            break;
+        /* the request is ours exclusively. */
+
+        if(rc == PLCTAG_STATUS_OK) {
+            rc = unpack_write_response_connected(tag, frag->req);
+            plc_rejected = (rc != PLCTAG_STATUS_OK);
+        }
+
+        frag->req->abort_request = 1;
+        frag->req = rc_dec(frag->req);
+
+        if(rc == PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_DETAIL, "Wrote %d bytes at offset %d.", frag->end - frag->start, frag->start);
+            frag->start = frag->end;
         }
     }
 
     if(rc != PLCTAG_STATUS_OK) {
-        if(rc_is_error(rc)) {
-            /* the request is dead, from session side. */
-            tag->req = rc_dec(tag->req);
+        /* drops the other fragments too. */
+        ab_tag_abort(tag);
+
+        if(tag->instance_id_state == INSTANCE_ID_REJECTED) {
+            return retry_by_name(tag, 1);
+        }
+
+        if(plc_rejected && tag->type_info_unverified) {
+            /* the type we assumed may be why, get it from the PLC and try again. */
+            return retry_write_with_pre_read(tag);
         }
 
+        pdebug(DEBUG_WARN, "Fragmented write failed!");
+
+        end_name_retry(tag, rc);
+
         return rc;
     }
 
-    /* the request is ours exclusively. */
+    if(pending) {
+        return PLCTAG_STATUS_PENDING;
+    }
 
-    /* point to the data */
-    cip_resp = (eip_cip_co_resp*)(tag->req->data);
+    /* done! */
+    tag->num_frags = 0;
+    tag->offset = 0;
+    tag->write_in_progress = 0;
 
-    do {
-        if (le2h16(cip_resp->encap_command) != AB_EIP_CONNECTED_SEND) {
-            pdebug(DEBUG_WARN, "Unexpected EIP packet type received: %d!", cip_resp->encap_command);
-            rc = PLCTAG_ERR_BAD_DATA;
-            break;
-        }
+    end_name_retry(tag, PLCTAG_STATUS_OK);
 
-        if (le2h32(cip_resp->encap_status) != AB_EIP_OK) {
-            pdebug(DEBUG_WARN, "EIP command failed, response code: %d", le2h32(cip_resp->encap_status));
-            rc = PLCTAG_ERR_REMOTE_ERR;
+    pdebug(DEBUG_INFO, "Done.  All fragments written.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * check_write_status_connected
+ *
+ * This routine must be called with the tag mutex locked.  It checks the current
+ * status of a write operation.  If the write is done, it triggers the clean up.
+ */
+
+static int check_write_status_connected(ab_tag_p tag)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!tag) {
+        pdebug(DEBUG_ERROR,"Null tag pointer passed!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if (!tag->req) {
+        tag->write_in_progress = 0;
+        tag->offset = 0;
+
+        pdebug(DEBUG_WARN,"Write in progress, but no request in flight!");
+
+        return PLCTAG_ERR_WRITE;
+    }
+
+    /* request can be used by two threads at once. */
+    spin_block(&tag->req->lock) {
+        if(!tag->req->resp_received) {
+            rc = PLCTAG_STATUS_PENDING;
             break;
         }
 
-        if (cip_resp->reply_service != (AB_EIP_CMD_CIP_WRITE_FRAG | AB_EIP_CMD_CIP_OK)
-            && cip_resp->reply_service != (AB_EIP_CMD_CIP_WRITE | AB_EIP_CMD_CIP_OK)) {
-            pdebug(DEBUG_WARN, "CIP response reply service unexpected: %d", cip_resp->reply_service);
-            rc = PLCTAG_ERR_BAD_DATA;
+        /* check to see if it was an abort on the session side. */
+        if(tag->req->status != PLCTAG_STATUS_OK) {
+            rc = tag->req->status;
+            tag->req->abort_request = 1;
+
+            pdebug(DEBUG_WARN,"Session reported failure of request: %s.", plc_tag_decode_error(rc));
+
+            tag->write_in_progress = 0;
+            tag->offset = 0;
+
             break;
         }
+    }
 
-        if (cip_resp->status != AB_CIP_STATUS_OK && cip_resp->status != AB_CIP_STATUS_FRAG) {
-            pdebug(DEBUG_WARN, "CIP read failed with status: 0x%x %s", cip_resp->status, decode_cip_error_short((uint8_t *)&cip_resp->status));
-            pdebug(DEBUG_INFO, decode_cip_error_long((uint8_t *)&cip_resp->status));
-            rc = decode_cip_error_code((uint8_t *)&cip_resp->status);
-            break;
+    if(rc != PLCTAG_STATUS_OK) {
+        if(rc_is_error(rc)) {
+            /* the request is dead, from session side. */
+            tag->req = rc_dec(tag->req);
         }
-    } while(0);
+
+        return rc;
+    }
+
+    /* the request is ours exclusively. */
+
+    rc = unpack_write_response_connected(tag, tag->req);
 
     /* clean up the request. */
     tag->req->abort_request = 1;
@@ -1696,12 +2301,21 @@ static int check_write_status_connected(ab_tag_p tag)
             /* only clear this if we are done. */
             tag->write_in_progress = 0;
             tag->offset = 0;
+
+            end_name_retry(tag, PLCTAG_STATUS_OK);
         }
+    } else if(tag->instance_id_state == INSTANCE_ID_REJECTED) {
+        rc = retry_by_name(tag, 1);
+    } else if(tag->type_info_unverified) {
+        /* the type we assumed may be why, get it from the PLC and try again. */
+        rc = retry_write_with_pre_read(tag);
     } else {
         pdebug(DEBUG_WARN,"Write failed!");
 
         tag->write_in_progress = 0;
         tag->offset = 0;
+
+        end_name_retry(tag, rc);
     }
 
     pdebug(DEBUG_SPEW, "Done.");
@@ -1767,10 +2381,10 @@ static int check_write_status_unconnected(ab_tag_p tag)
     /* request is exclusively ours. */
 
     /* point to the data */
-    cip_resp = (eip_cip_uc_resp*)(tag->req->data);
+    cip_resp = (eip_cip_uc_resp*)(tag->req->resp_data);
 
     do {
-        if (le2h16(cip_resp->encap_command) != AB_EIP_CONNECTED_SEND) {
+        if (le2h16(cip_resp->encap_command) != AB_EIP_UNCONNECTED_SEND) {
             pdebug(DEBUG_WARN, "Unexpected EIP packet type received: %d!", cip_resp->encap_command);
             rc = PLCTAG_ERR_BAD_DATA;
             break;
@@ -1811,6 +2425,9 @@ static int check_write_status_unconnected(ab_tag_p tag)
             tag->write_in_progress = 0;
             tag->offset = 0;
         }
+    } else if(tag->type_info_unverified) {
+        /* the type we assumed may be why, get it from the PLC and try again. */
+        rc = retry_write_with_pre_read(tag);
     } else {
         pdebug(DEBUG_WARN,"Write failed!");
 
@@ -1837,7 +2454,7 @@ int calculate_write_data_per_packet(ab_tag_p tag)
     /* if we are here, then we have all the type data etc. */
     if(tag->use_connected_msg) {
         pdebug(DEBUG_DETAIL,"Connected tag.");
-        max_payload_size = session_get_max_payload(tag->session);
+        max_payload_size = session_get_max_payload(tag->session, tag->route);
         overhead =  1                               /* service request, one byte */
                     + tag->encoded_name_size        /* full encoded name */
                     + tag->encoded_type_info_size   /* encoded type size */
@@ -1846,11 +2463,11 @@ int calculate_write_data_per_packet(ab_tag_p tag)
                     + 8;                            /* MAGIC fudge factor */
     } else {
         pdebug(DEBUG_DETAIL,"Unconnected tag.");
-        max_payload_size = session_get_max_payload(tag->session);
+        max_payload_size = session_get_max_payload(tag->session, tag->route);
         overhead =  1                               /* service request, one byte */
                     + tag->encoded_name_size        /* full encoded name */
                     + tag->encoded_type_info_size   /* encoded type size */
-                    + tag->session->conn_path_size + 2       /* encoded device path size plus two bytes for length and padding */
+                    + tag->route->conn_path_size + 2       /* encoded device path size plus two bytes for length and padding */
                     + 2                             /* element count, 16-bit int */
                     + 4                             /* byte offset, 32-bit int */
                     + 8;                            /* MAGIC fudge factor */
@@ -1877,3 +2494,519 @@ int calculate_write_data_per_packet(ab_tag_p tag)
 
     return PLCTAG_STATUS_OK;
 }
+
+
+
+/*
+ * set_type_info
+ *
+ * Keep the CIP type the PLC returned with the data, it is needed to
+ * write the tag.  If it is not what we had, the tag changed in the PLC
+ * or the type we assumed was wrong, and the PLC wins.  Either way the cache
+ * is brought up to date.
+ */
+
+void set_type_info(ab_tag_p tag, uint8_t *type_info, int size)
+{
+    int unverified = tag->type_info_unverified;
+
+    /* whatever we had has now been checked against the PLC. */
+    tag->type_info_unverified = 0;
+
+    if(tag->encoded_type_info_size == size && mem_cmp(tag->encoded_type_info, size, type_info, size) == 0) {
+        return;
+    }
+
+    if(tag->encoded_type_info_size) {
+        pdebug(DEBUG_WARN, "Tag type %s, using the type from the PLC.", (unverified ? "was not what we assumed" : "changed"));
+    }
+
+    mem_copy(tag->encoded_type_info, type_info, size);
+    tag->encoded_type_info_size = size;
+
+    if(tag->metadata && tag->metadata_key) {
+        metadata_cache_put_tag(tag->metadata, tag->metadata_key, tag->elem_size, tag->elem_count, tag->encoded_type_info, tag->encoded_type_info_size);
+    }
+}
+
+
+
+/*
+ * retry_write_with_pre_read
+ *
+ * A write using a type that came from the metadata cache or elem_type
+ * failed.  The type may be why, so drop it and start the write over,
+ * reading the tag first to get the type from the PLC.
+ */
+
+int retry_write_with_pre_read(ab_tag_p tag)
+{
+    pdebug(DEBUG_WARN, "Write with an unverified tag type failed, reading the type from the PLC and trying again.");
+
+    if(tag->metadata) {
+        metadata_cache_remove(tag->metadata, tag->metadata_key);
+    }
+
+    tag->type_info_unverified = 0;
+    tag->encoded_type_info_size = 0;
+    tag->first_read = 1;
+    tag->write_in_progress = 0;
+    tag->offset = 0;
+
+    return tag_write_start(tag);
+}
+
+
+
+/*
+ * resolve_instance_id
+ *
+ * Make sure the tag's request path uses the instance ID of its base
+ * symbol, if there is one.  The IDs of a route are listed by the first
+ * tag that needs one and shared with the others.  Returns
+ * PLCTAG_STATUS_PENDING while they are being listed.  The read or write
+ * starts again when they are.
+ *
+ * For a program tag, the program is found among the controller symbols
+ * first and then its own symbols are listed.  Both parts of the name
+ * are replaced by instance IDs.
+ */
+
+int resolve_instance_id(ab_tag_p tag, int for_write)
+{
+    char program[SESSION_MAX_SYMBOL_NAME + 1];
+    char name[SESSION_MAX_SYMBOL_NAME + 1];
+    uint32_t instance_ids[2] = {0, 0};
+    int num_ids = 0;
+    int generation = 0;
+    int must_list = 0;
+    int rc = PLCTAG_STATUS_OK;
+
+    /* IDs from before the connection to the PLC was lost may be stale. */
+    if(tag->instance_id_state == INSTANCE_ID_RESOLVED
+       || tag->instance_id_state == INSTANCE_ID_UNAVAILABLE
+       || tag->instance_id_state == INSTANCE_ID_CHECKING) {
+        if(session_get_symbol_generation(tag->session, tag->route) == tag->instance_id_generation) {
+            return PLCTAG_STATUS_OK;
+        }
+
+        pdebug(DEBUG_DETAIL, "Symbol instance IDs have changed, looking up the tag again.");
+
+        restore_symbolic_name(tag);
+    }
+
+    num_ids = get_base_symbol(tag, program, name, (int)sizeof(name));
+    if(!num_ids) {
+        pdebug(DEBUG_DETAIL, "Tag does not start with a symbol name, using its name.");
+        tag->instance_id_generation = session_get_symbol_generation(tag->session, tag->route);
+        tag->instance_id_state = INSTANCE_ID_UNAVAILABLE;
+        return PLCTAG_STATUS_OK;
+    }
+
+    /* the controller symbols first, a program is one of them. */
+    tag->listing_program[0] = 0;
+
+    rc = session_find_symbol(tag->session, tag->route, (num_ids > 1 ? program : name), &instance_ids[0], &generation, &must_list);
+
+    if(rc == PLCTAG_STATUS_OK && num_ids > 1) {
+        str_copy(tag->listing_program, (int)sizeof(tag->listing_program), program);
+
+        rc = session_find_program_symbol(tag->session, tag->route, program, name, &instance_ids[1], &generation, &must_list);
+    }
+
+    tag->instance_id_generation = generation;
+
+    if(rc == PLCTAG_STATUS_OK) {
+        if(encode_instance_id(tag, instance_ids, num_ids)) {
+            pdebug(DEBUG_DETAIL, "Using instance ID %u for symbol %s.", (unsigned int)instance_ids[num_ids - 1], name);
+            tag->instance_id_state = INSTANCE_ID_RESOLVED;
+        } else {
+            tag->instance_id_state = INSTANCE_ID_UNAVAILABLE;
+        }
+
+        return PLCTAG_STATUS_OK;
+    }
+
+    if(rc == PLCTAG_ERR_NOT_FOUND) {
+        pdebug(DEBUG_DETAIL, "Symbol %s was not listed, using its name.", name);
+        tag->instance_id_state = INSTANCE_ID_UNAVAILABLE;
+        return PLCTAG_STATUS_OK;
+    }
+
+    /* wait for the symbols to be listed, by us if nobody else is doing it. */
+    tag->instance_id_state = INSTANCE_ID_RESOLVING;
+    tag->instance_id_for_write = for_write;
+    tag->read_in_progress = 1;
+    tag->status = PLCTAG_STATUS_PENDING;
+
+    if(must_list) {
+        if(tag->listing_program[0]) {
+            pdebug(DEBUG_INFO, "Listing the symbols of %s to get instance IDs.", tag->listing_program);
+        } else {
+            pdebug(DEBUG_INFO, "Listing the controller symbols to get instance IDs.");
+        }
+
+        tag->next_id = 0;
+
+        rc = build_symbol_list_request_connected(tag, tag->listing_program);
+        if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Unable to build symbol list request!");
+
+            session_end_symbol_listing(tag->session, tag->route, generation, tag->listing_program, 0);
+            tag->instance_id_state = INSTANCE_ID_UNRESOLVED;
+            tag->read_in_progress = 0;
+
+            return rc;
+        }
+    }
+
+    return PLCTAG_STATUS_PENDING;
+}
+
+
+
+/*
+ * check_instance_id_status
+ *
+ * This must be called with the tag mutex locked.  If this tag is
+ * listing the symbols, it adds the ones in each response to the route
+ * and asks for more until it has them all, or the PLC will not give
+ * any more.  Then, or once another tag has listed them, the read or
+ * write the tag was starting goes ahead.
+ */
+
+int check_instance_id_status(ab_tag_p tag)
+{
+    eip_cip_co_resp* cip_resp;
+    uint8_t *data;
+    uint8_t *data_end;
+    int partial_data = 0;
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(tag->req) {
+        /* request can be used by two threads at once. */
+        spin_block(&tag->req->lock) {
+            if(!tag->req->resp_received) {
+                rc = PLCTAG_STATUS_PENDING;
+                break;
+            }
+
+            /* check to see if it was an abort on the session side. */
+            if(tag->req->status != PLCTAG_STATUS_OK) {
+                rc = tag->req->status;
+                tag->req->abort_request = 1;
+
+                pdebug(DEBUG_WARN,"Session reported failure of request: %s.", plc_tag_decode_error(rc));
+
+                break;
+            }
+        }
+
+        if(rc == PLCTAG_STATUS_PENDING) {
+            return rc;
+        }
+
+        if(rc == PLCTAG_STATUS_OK) {
+            /* the request is ours exclusively. */
+            cip_resp = (eip_cip_co_resp*)(tag->req->resp_data);
+            data = (tag->req->resp_data) + sizeof(eip_cip_co_resp);
+            data_end = (tag->req->resp_data + le2h16(cip_resp->encap_length) + sizeof(eip_encap));
+
+            do {
+                if (le2h16(cip_resp->encap_command) != AB_EIP_CONNECTED_SEND) {
+                    pdebug(DEBUG_WARN, "Unexpected EIP packet type received: %d!", cip_resp->encap_command);
+                    rc = PLCTAG_ERR_BAD_DATA;
+                    break;
+                }
+
+                if (le2h32(cip_resp->encap_status) != AB_EIP_OK) {
+                    pdebug(DEBUG_WARN, "EIP command failed, response code: %d", le2h32(cip_resp->encap_status));
+                    rc = PLCTAG_ERR_REMOTE_ERR;
+                    break;
+                }
+
+                if (cip_resp->reply_service != (AB_EIP_CMD_CIP_LIST_TAGS | AB_EIP_CMD_CIP_OK) ) {
+                    pdebug(DEBUG_WARN, "CIP response reply service unexpected: %d", cip_resp->reply_service);
+                    rc = PLCTAG_ERR_BAD_DATA;
+                    break;
+                }
+
+                if (cip_resp->status != AB_CIP_STATUS_OK && cip_resp->status != AB_CIP_STATUS_FRAG) {
+                    pdebug(DEBUG_WARN, "CIP symbol list failed with status: 0x%x %s", cip_resp->status, decode_cip_error_short((uint8_t *)&cip_resp->status));
+                    rc = decode_cip_error_code((uint8_t *)&cip_resp->status);
+                    break;
+                }
+
+                partial_data = (cip_resp->status == AB_CIP_STATUS_FRAG);
+
+                /* each entry is the fixed part followed by the name. */
+                while((data_end - data) >= (ptrdiff_t)sizeof(tag_list_entry)) {
+                    tag_list_entry *entry = (tag_list_entry *)data;
+                    int name_len = le2h16(entry->string_len);
+                    uint32_t instance_id = le2h32(entry->instance_id);
+                    char name[SESSION_MAX_SYMBOL_NAME + 1];
+
+                    if((data_end - data) < (ptrdiff_t)(sizeof(*entry) + (size_t)name_len)) {
+                        pdebug(DEBUG_WARN, "Symbol list entry is truncated!");
+                        rc = PLCTAG_ERR_BAD_DATA;
+                        break;
+                    }
+
+                    if(name_len <= SESSION_MAX_SYMBOL_NAME) {
+                        mem_copy(name, data + sizeof(*entry), name_len);
+                        name[name_len] = 0;
+
+                        session_add_symbol(tag->session, tag->route, tag->instance_id_generation, tag->listing_program, name, instance_id);
+                    }
+
+                    tag->next_id = instance_id + 1;
+                    data += sizeof(*entry) + (size_t)name_len;
+                }
+            } while(0);
+        }
+
+        /* clean up the request */
+        tag->req->abort_request = 1;
+        tag->req = rc_dec(tag->req);
+
+        if(rc == PLCTAG_STATUS_OK && partial_data) {
+            pdebug(DEBUG_DETAIL, "Getting more symbols, starting at instance %u.", (unsigned int)tag->next_id);
+
+            rc = build_symbol_list_request_connected(tag, tag->listing_program);
+            if(rc == PLCTAG_STATUS_OK) {
+                return PLCTAG_STATUS_PENDING;
+            }
+        }
+
+        /* without the full list, the symbols not in it keep using their names. */
+        if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Unable to list all the symbols: %s!", plc_tag_decode_error(rc));
+        }
+
+        session_end_symbol_listing(tag->session, tag->route, tag->instance_id_generation, tag->listing_program, 1);
+
+        tag->next_id = 0;
+    }
+
+    /* start over, this picks up the instance ID or waits some more. */
+    tag->instance_id_state = INSTANCE_ID_UNRESOLVED;
+    tag->read_in_progress = 0;
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return (tag->instance_id_for_write ? tag_write_start(tag) : tag_read_start(tag));
+}
+
+
+
+/*
+ * get_base_symbol
+ *
+ * Copy out the name of the symbol the tag's name starts with.  For a
+ * program tag, "Program:name.tag", the program comes out too.  Returns
+ * how many symbols are named, two for a program tag, or zero if the
+ * name does not start with a symbol.
+ */
+
+int get_base_symbol(ab_tag_p tag, char *program, char *name, int name_size)
+{
+    const char *program_prefix = "program:";
+    int offset = 1; /* skip the word count. */
+    int num_symbols = 0;
+
+    program[0] = 0;
+    name[0] = 0;
+
+    /* 0x91, the length and the name, padded to an even length. */
+    while(num_symbols < 2 && offset + 2 <= tag->symbolic_name_size && tag->symbolic_name[offset] == 0x91) {
+        int name_len = tag->symbolic_name[offset + 1];
+        int is_program = 1;
+
+        if(name_len >= name_size || offset + 2 + name_len > tag->symbolic_name_size) {
+            return 0;
+        }
+
+        /* the first name was the program. */
+        if(num_symbols == 1) {
+            mem_copy(program, name, str_length(name) + 1);
+        }
+
+        mem_copy(name, &tag->symbolic_name[offset + 2], name_len);
+        name[name_len] = 0;
+
+        num_symbols++;
+        offset += 2 + name_len + (name_len & 0x01);
+
+        /* only programs have symbols in them. */
+        for(int i=0; program_prefix[i] && is_program; i++) {
+            is_program = (tolower((unsigned char)name[i]) == program_prefix[i]);
+        }
+
+        if(!is_program) {
+            break;
+        }
+    }
+
+    /* a program alone, or some other name with a colon, is not listed. */
+    for(int i=0; num_symbols > 0 && name[i]; i++) {
+        if(name[i] == ':') {
+            return 0;
+        }
+    }
+
+    return num_symbols;
+}
+
+
+
+/*
+ * encode_instance_id
+ *
+ * Replace the names of the first num_ids symbols in the tag's request
+ * path with their instance IDs in the symbol class.  For a program tag
+ * these are the program and the tag in it.  The rest of the path, array
+ * indexes and structure members, stays as it is.
+ */
+
+int encode_instance_id(ab_tag_p tag, uint32_t *instance_ids, int num_ids)
+{
+    uint8_t segments[2 * 8];
+    int segments_size = 0;
+    int names_size = 0;
+    int rest_size = 0;
+    uint8_t *dp = tag->encoded_name;
+
+    for(int i=0; i < num_ids; i++) {
+        uint32_t instance_id = instance_ids[i];
+        uint8_t *seg = &segments[segments_size];
+        int name_len = tag->symbolic_name[1 + names_size + 1];
+
+        names_size += 2 + name_len + (name_len & 0x01);
+
+        seg[0] = 0x20; /* class */
+        seg[1] = 0x6B; /* symbol class */
+
+        if(instance_id <= 0xFF) {
+            seg[2] = 0x24; /* 8-bit instance */
+            seg[3] = (uint8_t)instance_id;
+            segments_size += 4;
+        } else if(instance_id <= 0xFFFF) {
+            seg[2] = 0x25; /* 16-bit instance */
+            seg[3] = 0; /* padding */
+            seg[4] = (uint8_t)(instance_id & 0xFF);
+            seg[5] = (uint8_t)((instance_id >> 8) & 0xFF);
+            segments_size += 6;
+        } else {
+            seg[2] = 0x26; /* 32-bit instance */
+            seg[3] = 0; /* padding */
+            seg[4] = (uint8_t)(instance_id & 0xFF);
+            seg[5] = (uint8_t)((instance_id >> 8) & 0xFF);
+            seg[6] = (uint8_t)((instance_id >> 16) & 0xFF);
+            seg[7] = (uint8_t)((instance_id >> 24) & 0xFF);
+            segments_size += 8;
+        }
+    }
+
+    rest_size = tag->symbolic_name_size - 1 - names_size;
+
+    if(1 + segments_size + rest_size > MAX_TAG_NAME) {
+        pdebug(DEBUG_WARN, "Tag path with the instance ID is too long, using the name.");
+        return 0;
+    }
+
+    dp++; /* word count goes here. */
+    mem_copy(dp, segments, segments_size);
+    dp += segments_size;
+    mem_copy(dp, &tag->symbolic_name[1 + names_size], rest_size);
+    dp += rest_size;
+
+    tag->encoded_name_size = (int)(dp - tag->encoded_name);
+    tag->encoded_name[0] = (uint8_t)((tag->encoded_name_size - 1) / 2);
+
+    return 1;
+}
+
+
+
+void restore_symbolic_name(ab_tag_p tag)
+{
+    mem_copy(tag->encoded_name, tag->symbolic_name, tag->symbolic_name_size);
+    tag->encoded_name_size = tag->symbolic_name_size;
+    tag->instance_id_state = INSTANCE_ID_UNRESOLVED;
+}
+
+
+
+/*
+ * check_instance_id_error
+ *
+ * If the PLC does not know the path of a tag using an instance ID, the
+ * ID may have changed under us, or the rest of the path may be bad.
+ * The tag goes back to its name and the request is tried again by
+ * retry_by_name to find out which.
+ */
+
+void check_instance_id_error(ab_tag_p tag, uint8_t cip_status)
+{
+    if(tag->instance_id_state != INSTANCE_ID_RESOLVED) {
+        return;
+    }
+
+    if(cip_status == AB_CIP_ERR_PATH_SEGMENT || cip_status == AB_CIP_ERR_PATH_DEST_UNKNOWN) {
+        pdebug(DEBUG_WARN, "PLC rejected the instance ID of the tag, trying its name.");
+
+        restore_symbolic_name(tag);
+        tag->instance_id_state = INSTANCE_ID_REJECTED;
+    }
+}
+
+
+
+/*
+ * retry_by_name
+ *
+ * Start the read or write again using the tag's name, after the PLC
+ * rejected its instance ID.  end_name_retry sorts out the result.
+ */
+
+int retry_by_name(ab_tag_p tag, int for_write)
+{
+    pdebug(DEBUG_INFO, "Trying the %s again by name.", (for_write ? "write" : "read"));
+
+    /* drops any other requests of the tag. */
+    ab_tag_abort(tag);
+
+    tag->instance_id_state = INSTANCE_ID_CHECKING;
+
+    return (for_write ? tag_write_start(tag) : tag_read_start(tag));
+}
+
+
+
+/*
+ * end_name_retry
+ *
+ * If the name works where the instance ID did not, the IDs of the route
+ * are stale and are listed again.  If the name fails too, the ID was not
+ * the problem and the tag just uses its name until the IDs change.
+ */
+
+void end_name_retry(ab_tag_p tag, int rc)
+{
+    if(tag->instance_id_state != INSTANCE_ID_CHECKING) {
+        return;
+    }
+
+    if(rc == PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Instance IDs of the route are stale, looking the symbols up again.");
+
+        session_forget_symbols(tag->session, tag->route, tag->instance_id_generation);
+        tag->instance_id_state = INSTANCE_ID_UNRESOLVED;
+    } else {
+        pdebug(DEBUG_DETAIL, "Tag failed by name too, keeping the instance IDs.");
+
+        tag->instance_id_state = INSTANCE_ID_UNAVAILABLE;
+    }
+}
@@ -140,10 +140,10 @@ int tag_read_start(ab_tag_p tag)
                  +2  /* maximum extended type. */
                  +2; /* maximum extended size. */
 
-    data_per_packet = session_get_max_payload(tag->session) - overhead;
+    data_per_packet = session_get_max_payload(tag->session, tag->route) - overhead;
 
     if(data_per_packet <= 0) {
-        pdebug(DEBUG_WARN,"Unable to send request.  Packet overhead, %d bytes, is too large for packet, %d bytes!", overhead, session_get_max_payload(tag->session));
+        pdebug(DEBUG_WARN,"Unable to send request.  Packet overhead, %d bytes, is too large for packet, %d bytes!", overhead, session_get_max_payload(tag->session, tag->route));
         return PLCTAG_ERR_TOO_LARGE;
     }
 
@@ -153,7 +153,7 @@ int tag_read_start(ab_tag_p tag)
     }
 
     /* get a request buffer */
-    rc = session_create_request(tag->session, tag->tag_id, &req);
+    rc = session_create_request(tag->session, tag->route, tag->tag_id, &req);
     if(rc != PLCTAG_STATUS_OK) {
         pdebug(DEBUG_ERROR,"Unable to get new request.  rc=%d",rc);
         return rc;
@@ -188,7 +188,7 @@ int tag_read_start(ab_tag_p tag)
 
     /* DH+ Routing */
     pccc->dest_link = h2le16(0);
-    pccc->dest_node = h2le16(tag->session->dhp_dest);
+    pccc->dest_node = h2le16(tag->route->dhp_dest);
     pccc->src_link = h2le16(0);
     pccc->src_node = h2le16(0) /*h2le16(tag->dhp_src)*/;
 
@@ -211,6 +211,9 @@ int tag_read_start(ab_tag_p tag)
     /* mark the request ready for sending */
     //req->send_request = 1;
 
+    /* how soon the request needs to go out. */
+    ab_tag_prioritize_request(tag, req);
+
     /* add the request to the session's list. */
     rc = session_add_request(tag->session, req);
 
@@ -262,10 +265,10 @@ int tag_write_start(ab_tag_p tag)
                +(tag->encoded_name_size)
                +2;       /* this request size in elements */
 
-    data_per_packet = session_get_max_payload(tag->session) - overhead;
+    data_per_packet = session_get_max_payload(tag->session, tag->route) - overhead;
 
     if(data_per_packet <= 0) {
-        pdebug(DEBUG_WARN,"Unable to send request.  Packet overhead, %d bytes, is too large for packet, %d bytes!", overhead, session_get_max_payload(tag->session));
+        pdebug(DEBUG_WARN,"Unable to send request.  Packet overhead, %d bytes, is too large for packet, %d bytes!", overhead, session_get_max_payload(tag->session, tag->route));
         return PLCTAG_ERR_TOO_LARGE;
     }
 
@@ -275,7 +278,7 @@ int tag_write_start(ab_tag_p tag)
     }
 
     /* get a request buffer */
-    rc = session_create_request(tag->session, tag->tag_id, &req);
+    rc = session_create_request(tag->session, tag->route, tag->tag_id, &req);
 
     if(rc != PLCTAG_STATUS_OK) {
         pdebug(DEBUG_ERROR,"Unable to get new request.  rc=%d",rc);
@@ -354,7 +357,7 @@ int tag_write_start(ab_tag_p tag)
 
     /* DH+ Routing */
     pccc->dest_link = h2le16(0);
-    pccc->dest_node = h2le16(tag->session->dhp_dest);
+    pccc->dest_node = h2le16(tag->route->dhp_dest);
     pccc->src_link = h2le16(0);
     pccc->src_node = h2le16(0) /*h2le16(tag->dhp_src)*/;
 
@@ -377,6 +380,9 @@ int tag_write_start(ab_tag_p tag)
     /* this request is connected, so it needs the session exclusively */
     //req->connected_request = 1;
 
+    /* how soon the request needs to go out. */
+    ab_tag_prioritize_request(tag, req);
+
     /* add the request to the session's list. */
     rc = session_add_request(tag->session, req);
 
@@ -457,13 +463,13 @@ static int check_read_status(ab_tag_p tag)
 
     /* the request is ours exclusively. */
 
-    resp = (pccc_dhp_co_resp*)(tag->req->data);
+    resp = (pccc_dhp_co_resp*)(tag->req->resp_data);
 
     /* point to the start of the data */
     data = (uint8_t *)resp + sizeof(*resp);
 
     /* point to the end of the data */
-    data_end = (tag->req->data + le2h16(resp->encap_length) + sizeof(eip_encap));
+    data_end = (tag->req->resp_data + le2h16(resp->encap_length) + sizeof(eip_encap));
 
     /* fake exception */
     do {
@@ -587,7 +593,7 @@ static int check_write_status(ab_tag_p tag)
 
     /* the request is ours exclusively. */
 
-    pccc_resp = (pccc_dhp_co_resp*)(tag->req->data);
+    pccc_resp = (pccc_dhp_co_resp*)(tag->req->resp_data);
 
     /* point data just past the header */
     data = (uint8_t *)pccc_resp + sizeof(*pccc_resp);
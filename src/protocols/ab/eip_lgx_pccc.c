@@ -174,10 +174,10 @@ int tag_read_start(ab_tag_p tag)
 
     /* FIXME - this is not correct for this kind of transaction */
 
-    data_per_packet = session_get_max_payload(tag->session) - overhead;
+    data_per_packet = session_get_max_payload(tag->session, tag->route) - overhead;
 
     if(data_per_packet <= 0) {
-        pdebug(DEBUG_WARN,"Unable to send request.  Packet overhead, %d bytes, is too large for packet, %d bytes!", overhead, session_get_max_payload(tag->session));
+        pdebug(DEBUG_WARN,"Unable to send request.  Packet overhead, %d bytes, is too large for packet, %d bytes!", overhead, session_get_max_payload(tag->session, tag->route));
         return PLCTAG_ERR_TOO_LARGE;
     }
 
@@ -187,7 +187,7 @@ int tag_read_start(ab_tag_p tag)
     }
 
     /* get a request buffer */
-    rc = session_create_request(tag->session, tag->tag_id, &req);
+    rc = session_create_request(tag->session, tag->route, tag->tag_id, &req);
 
     if(rc != PLCTAG_STATUS_OK) {
         pdebug(DEBUG_WARN,"Unable to get new request.  rc=%d",rc);
@@ -271,15 +271,15 @@ int tag_read_start(ab_tag_p tag)
     lgx_pccc->uc_cmd_length = h2le16((uint16_t)(data - embed_start));
 
     /* copy the path */
-    if(tag->session->conn_path_size > 0) {
-        *data = (tag->session->conn_path_size) / 2; /* in 16-bit words */
+    if(tag->route->conn_path_size > 0) {
+        *data = (tag->route->conn_path_size) / 2; /* in 16-bit words */
         data++;
         *data = 0; /* reserved/pad */
         data++;
-        mem_copy(data, tag->session->conn_path, tag->session->conn_path_size);
-        data += tag->session->conn_path_size;
+        mem_copy(data, tag->route->conn_path, tag->route->conn_path_size);
+        data += tag->route->conn_path_size;
     } else {
-        pdebug(DEBUG_DETAIL, "connection path is of length %d!", tag->session->conn_path_size);
+        pdebug(DEBUG_DETAIL, "connection path is of length %d!", tag->route->conn_path_size);
     }
 
     /* how big is the unconnected data item? */
@@ -292,6 +292,9 @@ int tag_read_start(ab_tag_p tag)
     //req->send_request = 1;
     req->allow_packing = tag->allow_packing;
 
+    /* how soon the request needs to go out. */
+    ab_tag_prioritize_request(tag, req);
+
     /* add the request to the session's list. */
     rc = session_add_request(tag->session, req);
 
@@ -386,12 +389,12 @@ static int check_read_status(ab_tag_p tag)
         int pccc_res_type;
         int pccc_res_length;
 
-        pccc = (pccc_resp *)(req->data);
+        pccc = (pccc_resp *)(req->resp_data);
 
         /* point to the start of the data */
         data = (uint8_t *)pccc + sizeof(*pccc);
 
-        data_end = (req->data + le2h16(pccc->encap_length) + sizeof(eip_encap));
+        data_end = (req->resp_data + le2h16(pccc->encap_length) + sizeof(eip_encap));
 
         if(le2h16(pccc->encap_command) != AB_EIP_UNCONNECTED_SEND) {
             pdebug(DEBUG_WARN,"Unexpected EIP packet type received: %d!",pccc->encap_command);
@@ -535,20 +538,20 @@ int tag_write_start(ab_tag_p tag)
                  + (tag->encoded_name_size)
                  +2; /* actual request size in elements */
 
-    data_per_packet = session_get_max_payload(tag->session) - overhead;
+    data_per_packet = session_get_max_payload(tag->session, tag->route) - overhead;
 
     if(data_per_packet <= 0) {
-        pdebug(DEBUG_WARN,"Unable to send request.  Packet overhead, %d bytes, is too large for packet, %d bytes!", overhead, session_get_max_payload(tag->session));
+        pdebug(DEBUG_WARN,"Unable to send request.  Packet overhead, %d bytes, is too large for packet, %d bytes!", overhead, session_get_max_payload(tag->session, tag->route));
         return PLCTAG_ERR_TOO_LARGE;
     }
 
     if(data_per_packet < tag->size) {
-        pdebug(DEBUG_DETAIL,"Tag size is %d, write overhead is %d, and write data per packet is %d.", session_get_max_payload(tag->session), overhead, data_per_packet);
+        pdebug(DEBUG_DETAIL,"Tag size is %d, write overhead is %d, and write data per packet is %d.", session_get_max_payload(tag->session, tag->route), overhead, data_per_packet);
         return PLCTAG_ERR_TOO_LARGE;
     }
 
     /* get a request buffer */
-    rc = session_create_request(tag->session, tag->tag_id, &req);
+    rc = session_create_request(tag->session, tag->route, tag->tag_id, &req);
 
     if(rc != PLCTAG_STATUS_OK) {
         pdebug(DEBUG_WARN,"Unable to get new request.  rc=%d",rc);
@@ -636,13 +639,13 @@ int tag_write_start(ab_tag_p tag)
     lgx_pccc->uc_cmd_length = h2le16((uint16_t)(data - embed_start));
 
     /* copy the path */
-    if(tag->session->conn_path_size > 0) {
-        *data = (tag->session->conn_path_size) / 2; /* in 16-bit words */
+    if(tag->route->conn_path_size > 0) {
+        *data = (tag->route->conn_path_size) / 2; /* in 16-bit words */
         data++;
         *data = 0; /* reserved/pad */
         data++;
-        mem_copy(data, tag->session->conn_path, tag->session->conn_path_size);
-        data += tag->session->conn_path_size;
+        mem_copy(data, tag->route->conn_path, tag->route->conn_path_size);
+        data += tag->route->conn_path_size;
     }
 
     /* how big is the unconnected data item? */
@@ -651,6 +654,9 @@ int tag_write_start(ab_tag_p tag)
     /* get ready to add the request to the queue for this session */
     req->request_size = (int)(data - (req->data));
 
+    /* how soon the request needs to go out. */
+    ab_tag_prioritize_request(tag, req);
+
     /* add the request to the session's list. */
     rc = session_add_request(tag->session, req);
 
@@ -734,7 +740,7 @@ static int check_write_status(ab_tag_p tag)
         pccc_resp *pccc;
         uint8_t *data;
 
-        pccc = (pccc_resp *)(req->data);
+        pccc = (pccc_resp *)(req->resp_data);
 
         /* point to the start of the data */
         data = (uint8_t *)pccc + sizeof(*pccc);
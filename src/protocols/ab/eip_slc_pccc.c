@@ -172,10 +172,10 @@ int tag_read_start(ab_tag_p tag)
                 +1      /* PCCC status */
                 +2;     /* PCCC packet sequence number */
 
-    data_per_packet = session_get_max_payload(tag->session) - overhead;
+    data_per_packet = session_get_max_payload(tag->session, tag->route) - overhead;
 
     if(data_per_packet <= 0) {
-        pdebug(DEBUG_WARN,"Unable to send request.  Packet overhead, %d bytes, is too large for packet, %d bytes!", overhead, session_get_max_payload(tag->session));
+        pdebug(DEBUG_WARN,"Unable to send request.  Packet overhead, %d bytes, is too large for packet, %d bytes!", overhead, session_get_max_payload(tag->session, tag->route));
         return PLCTAG_ERR_TOO_LARGE;
     }
 
@@ -185,7 +185,7 @@ int tag_read_start(ab_tag_p tag)
     }
 
     /* get a request buffer */
-    rc = session_create_request(tag->session, tag->tag_id, &req);
+    rc = session_create_request(tag->session, tag->route, tag->tag_id, &req);
     if(rc != PLCTAG_STATUS_OK) {
         pdebug(DEBUG_WARN,"Unable to get new request.  rc=%d",rc);
         return rc;
@@ -248,6 +248,9 @@ int tag_read_start(ab_tag_p tag)
     /* mark it as ready to send */
     //req->send_request = 1;
 
+    /* how soon the request needs to go out. */
+    ab_tag_prioritize_request(tag, req);
+
     /* add the request to the session's list. */
     rc = session_add_request(tag->session, req);
     if(rc != PLCTAG_STATUS_OK) {
@@ -331,12 +334,12 @@ static int check_read_status(ab_tag_p tag)
 
     /* the request is ours exclusively. */
 
-    pccc = (pccc_resp*)(tag->req->data);
+    pccc = (pccc_resp*)(tag->req->resp_data);
 
     /* point to the start of the data */
     data = (uint8_t *)pccc + sizeof(*pccc);
 
-    data_end = (tag->req->data + le2h16(pccc->encap_length) + sizeof(eip_encap));
+    data_end = (tag->req->resp_data + le2h16(pccc->encap_length) + sizeof(eip_encap));
 
     /* fake exceptions */
     do {
@@ -419,20 +422,20 @@ int tag_write_start(ab_tag_p tag)
                  +1  /* request total transfer size in bytes. */
                  + (tag->encoded_name_size);
 
-    data_per_packet = session_get_max_payload(tag->session) - overhead;
+    data_per_packet = session_get_max_payload(tag->session, tag->route) - overhead;
 
     if(data_per_packet <= 0) {
-        pdebug(DEBUG_WARN,"Unable to send request.  Packet overhead, %d bytes, is too large for packet, %d bytes!", overhead, session_get_max_payload(tag->session));
+        pdebug(DEBUG_WARN,"Unable to send request.  Packet overhead, %d bytes, is too large for packet, %d bytes!", overhead, session_get_max_payload(tag->session, tag->route));
         return PLCTAG_ERR_TOO_LARGE;
     }
 
     if(data_per_packet < tag->size) {
-        pdebug(DEBUG_DETAIL,"Tag size is %d, write overhead is %d, and write data per packet is %d.", session_get_max_payload(tag->session), overhead, data_per_packet);
+        pdebug(DEBUG_DETAIL,"Tag size is %d, write overhead is %d, and write data per packet is %d.", session_get_max_payload(tag->session, tag->route), overhead, data_per_packet);
         return PLCTAG_ERR_TOO_LARGE;
     }
 
     /* get a request buffer */
-    rc = session_create_request(tag->session, tag->tag_id, &req);
+    rc = session_create_request(tag->session, tag->route, tag->tag_id, &req);
     if(rc != PLCTAG_STATUS_OK) {
         pdebug(DEBUG_WARN,"Unable to get new request.  rc=%d",rc);
         return rc;
@@ -492,6 +495,9 @@ int tag_write_start(ab_tag_p tag)
     /* get ready to add the request to the queue for this session */
     req->request_size = (int)(data - (req->data));
 
+    /* how soon the request needs to go out. */
+    ab_tag_prioritize_request(tag, req);
+
     /* add the request to the session's list. */
     rc = session_add_request(tag->session, req);
     if(rc != PLCTAG_STATUS_OK) {
@@ -576,7 +582,7 @@ static int check_write_status(ab_tag_p tag)
 
     /* the request is ours exclusively. */
 
-    pccc = (pccc_resp*)(tag->req->data);
+    pccc = (pccc_resp*)(tag->req->resp_data);
 
     /* point to the start of the data */
     data = (uint8_t *)pccc + sizeof(*pccc);
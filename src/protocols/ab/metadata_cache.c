@@ -0,0 +1,1098 @@
+/***************************************************************************
+ *   Copyright (C) 2018 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library/Lesser General Public License as*
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU Library General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <platform.h>
+#include <lib/libplctag.h>
+#include <ab/tag.h>
+#include <ab/metadata_cache.h>
+#include <util/debug.h>
+#include <util/hash.h>
+#include <util/hashtable.h>
+#include <util/vector.h>
+
+
+/*
+ * The file is plain text, one entry per line with tab separated fields:
+ *
+ *     route <gateway> <path> <Forward Open Extended?> <max payload size>
+ *     tag <gateway> <path> <name> <elem size> <elem count> <type info in hex>
+ *     drop <key>
+ *
+ * The key of an entry is its kind and everything up to its values.  A
+ * drop line removes the entry with the key.  Lines starting with # are
+ * comments.
+ */
+
+#define METADATA_CACHE_HEADER "# libplctag metadata cache, version 1"
+
+#define METADATA_CACHE_MAX_LINE (1024)
+#define METADATA_CACHE_MAX_FIELDS (8)
+
+/* the file is rewritten when it has this many more lines than entries. */
+#define METADATA_CACHE_MIN_EXTRA_LINES (1000)
+
+/* how often changes are written to the file. */
+#define METADATA_CACHE_FLUSH_MS (1000)
+
+/* the tests narrow the hash of the keys to make them collide. */
+#ifndef METADATA_CACHE_HASH_MASK
+#define METADATA_CACHE_HASH_MASK (UINT64_MAX)
+#endif
+
+
+typedef struct metadata_entry_t *metadata_entry_p;
+
+struct metadata_entry_t {
+    metadata_entry_p next; /* entries whose keys hash the same. */
+    char *key;
+    int is_tag;
+
+    /* routes */
+    int use_ex;
+    int max_payload_size;
+
+    /* tags */
+    int elem_size;
+    int elem_count;
+    uint8_t type_info[MAX_TAG_TYPE_INFO];
+    int type_info_size;
+};
+
+
+struct metadata_cache_t {
+    char *file_name;
+    mutex_p mutex; /* protects the entries and the pending changes. */
+
+    hashtable_p entries;
+    int num_entries;
+
+    /*
+     * Changes are only noted here, as lines of the file.  The flush
+     * thread writes them out so that nobody waits on the disk.  If the
+     * whole file is to be rewritten, the pending lines are not needed.
+     */
+    vector_p pending;
+    int needs_rewrite;
+
+    /*
+     * Only used by the flush thread.  The file is open for appending, it
+     * is NULL if it is not open yet or cannot be written.
+     */
+    vector_p writing;
+    FILE *file;
+    int file_failed;
+    int num_lines;
+};
+
+
+static mutex_p cache_mutex = NULL;
+static vector_p caches = NULL;
+
+static thread_p flush_thread = NULL;
+static cond_p flush_wait = NULL;
+static volatile int flush_terminating = 0;
+
+
+static metadata_cache_p cache_create(const char *file_name);
+static int cache_load(metadata_cache_p cache);
+static int cache_parse_line(metadata_cache_p cache, char *line);
+static int cache_rewrite(metadata_cache_p cache, vector_p lines);
+static void cache_append(metadata_cache_p cache, vector_p lines);
+static void cache_note_change_unsafe(metadata_cache_p cache, const char *line);
+static void cache_flush(metadata_cache_p cache);
+static THREAD_FUNC(flush_handler);
+static void free_lines(vector_p lines);
+static void cache_destroy(metadata_cache_p cache);
+static int64_t key_hash(const char *key);
+static metadata_entry_p find_entry_unsafe(metadata_cache_p cache, const char *key);
+static metadata_entry_p add_entry_unsafe(metadata_cache_p cache, const char *key);
+static void remove_entry_unsafe(metadata_cache_p cache, const char *key);
+static int format_entry(metadata_entry_p entry, char *buf, int buf_size);
+static int key_part_ok(const char *part);
+
+
+
+int metadata_cache_startup(void)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    if((rc = mutex_create(&cache_mutex)) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to create metadata cache mutex %s!", plc_tag_decode_error(rc));
+        return rc;
+    }
+
+    if((caches = vector_create(5, 5)) == NULL) {
+        pdebug(DEBUG_ERROR, "Unable to create metadata cache vector!");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    if((rc = cond_create(&flush_wait)) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to create metadata cache flush condition %s!", plc_tag_decode_error(rc));
+        return rc;
+    }
+
+    flush_terminating = 0;
+
+    return rc;
+}
+
+
+void metadata_cache_teardown(void)
+{
+    pdebug(DEBUG_INFO, "Starting.");
+
+    /* stop the flush thread, the last changes are written out below. */
+    if(flush_thread) {
+        flush_terminating = 1;
+        cond_signal(flush_wait);
+        thread_join(flush_thread);
+        thread_destroy(&flush_thread);
+        flush_thread = NULL;
+    }
+
+    if(flush_wait) {
+        cond_destroy(&flush_wait);
+        flush_wait = NULL;
+    }
+
+    if(caches) {
+        for(int i=0; i < vector_length(caches); i++) {
+            metadata_cache_p cache = (metadata_cache_p)vector_get(caches, i);
+
+            cache_flush(cache);
+            cache_destroy(cache);
+        }
+
+        vector_destroy(caches);
+        caches = NULL;
+    }
+
+    if(cache_mutex) {
+        mutex_destroy(&cache_mutex);
+    }
+
+    pdebug(DEBUG_INFO, "Done.");
+}
+
+
+
+/*
+ * metadata_cache_get
+ *
+ * Find the cache for the passed file, loading it if this is the first
+ * time it is used.  Caches stay around until the library shuts down.
+ */
+metadata_cache_p metadata_cache_get(const char *file_name)
+{
+    metadata_cache_p cache = NULL;
+
+    if(!file_name || str_length(file_name) == 0) {
+        return NULL;
+    }
+
+    critical_block(cache_mutex) {
+        for(int i=0; i < vector_length(caches) && !cache; i++) {
+            metadata_cache_p tmp = (metadata_cache_p)vector_get(caches, i);
+
+            if(str_cmp(tmp->file_name, file_name) == 0) {
+                cache = tmp;
+            }
+        }
+
+        if(!cache) {
+            cache = cache_create(file_name);
+
+            if(cache) {
+                vector_put(caches, vector_length(caches), cache);
+            }
+        }
+
+        /* the first cache starts the thread that writes them all out. */
+        if(cache && !flush_thread) {
+            if(thread_create(&flush_thread, flush_handler, 32*1024, NULL) != PLCTAG_STATUS_OK) {
+                pdebug(DEBUG_WARN, "Unable to create metadata cache flush thread, changes will not be saved!");
+                flush_thread = NULL;
+            }
+        }
+    }
+
+    return cache;
+}
+
+
+
+/*
+ * metadata_cache_route_key
+ *
+ * Make the key for the packet size of a CIP path through a gateway.
+ */
+char *metadata_cache_route_key(const char *gateway, const char *path)
+{
+    if(!gateway || !key_part_ok(gateway) || !key_part_ok(path)) {
+        return NULL;
+    }
+
+    return str_concat("route\t", gateway, "\t", (path ? path : ""));
+}
+
+
+
+/*
+ * metadata_cache_tag_key
+ *
+ * Make the key for the type information of a tag.
+ */
+char *metadata_cache_tag_key(const char *gateway, const char *path, const char *name)
+{
+    if(!gateway || !name || !key_part_ok(gateway) || !key_part_ok(path) || !key_part_ok(name)) {
+        return NULL;
+    }
+
+    return str_concat("tag\t", gateway, "\t", (path ? path : ""), "\t", name);
+}
+
+
+
+int metadata_cache_get_route(metadata_cache_p cache, const char *key, int *use_ex, int *max_payload_size)
+{
+    int rc = PLCTAG_ERR_NOT_FOUND;
+
+    if(!cache || !key) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    critical_block(cache->mutex) {
+        metadata_entry_p entry = find_entry_unsafe(cache, key);
+
+        if(entry && !entry->is_tag) {
+            *use_ex = entry->use_ex;
+            *max_payload_size = entry->max_payload_size;
+            rc = PLCTAG_STATUS_OK;
+        }
+    }
+
+    return rc;
+}
+
+
+
+void metadata_cache_put_route(metadata_cache_p cache, const char *key, int use_ex, int max_payload_size)
+{
+    char line[METADATA_CACHE_MAX_LINE];
+    int changed = 0;
+
+    if(!cache || !key) {
+        return;
+    }
+
+    critical_block(cache->mutex) {
+        metadata_entry_p entry = find_entry_unsafe(cache, key);
+
+        if(entry && entry->use_ex == use_ex && entry->max_payload_size == max_payload_size) {
+            break;
+        }
+
+        if(!entry) {
+            entry = add_entry_unsafe(cache, key);
+        }
+
+        if(entry) {
+            entry->use_ex = use_ex;
+            entry->max_payload_size = max_payload_size;
+
+            changed = (format_entry(entry, line, (int)sizeof(line)) == PLCTAG_STATUS_OK);
+        }
+
+        if(changed) {
+            cache_note_change_unsafe(cache, line);
+        }
+    }
+
+    if(changed) {
+        pdebug(DEBUG_DETAIL, "Cached packet size %d for %s.", max_payload_size, key);
+    }
+}
+
+
+
+int metadata_cache_get_tag(metadata_cache_p cache, const char *key, int *elem_size, int *elem_count, uint8_t *type_info, int *type_info_size)
+{
+    int rc = PLCTAG_ERR_NOT_FOUND;
+
+    if(!cache || !key) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    critical_block(cache->mutex) {
+        metadata_entry_p entry = find_entry_unsafe(cache, key);
+
+        if(entry && entry->is_tag) {
+            *elem_size = entry->elem_size;
+            *elem_count = entry->elem_count;
+            mem_copy(type_info, entry->type_info, entry->type_info_size);
+            *type_info_size = entry->type_info_size;
+            rc = PLCTAG_STATUS_OK;
+        }
+    }
+
+    return rc;
+}
+
+
+
+void metadata_cache_put_tag(metadata_cache_p cache, const char *key, int elem_size, int elem_count, uint8_t *type_info, int type_info_size)
+{
+    char line[METADATA_CACHE_MAX_LINE];
+    int changed = 0;
+
+    if(!cache || !key || type_info_size <= 0 || type_info_size > MAX_TAG_TYPE_INFO) {
+        return;
+    }
+
+    critical_block(cache->mutex) {
+        metadata_entry_p entry = find_entry_unsafe(cache, key);
+
+        if(entry
+           && entry->elem_size == elem_size
+           && entry->elem_count == elem_count
+           && mem_cmp(entry->type_info, entry->type_info_size, type_info, type_info_size) == 0) {
+            break;
+        }
+
+        if(!entry) {
+            entry = add_entry_unsafe(cache, key);
+        }
+
+        if(entry) {
+            entry->is_tag = 1;
+            entry->elem_size = elem_size;
+            entry->elem_count = elem_count;
+            mem_copy(entry->type_info, type_info, type_info_size);
+            entry->type_info_size = type_info_size;
+
+            changed = (format_entry(entry, line, (int)sizeof(line)) == PLCTAG_STATUS_OK);
+        }
+
+        if(changed) {
+            cache_note_change_unsafe(cache, line);
+        }
+    }
+
+    if(changed) {
+        pdebug(DEBUG_DETAIL, "Cached type information for %s.", key);
+    }
+}
+
+
+
+/*
+ * metadata_cache_remove
+ *
+ * Forget an entry that turned out to be wrong.
+ */
+void metadata_cache_remove(metadata_cache_p cache, const char *key)
+{
+    char line[METADATA_CACHE_MAX_LINE];
+
+    if(!cache || !key) {
+        return;
+    }
+
+    critical_block(cache->mutex) {
+        if(!find_entry_unsafe(cache, key)) {
+            break;
+        }
+
+        remove_entry_unsafe(cache, key);
+
+        snprintf(line, sizeof(line), "drop\t%s", key);
+        cache_note_change_unsafe(cache, line);
+    }
+
+    pdebug(DEBUG_DETAIL, "Dropped %s from the metadata cache.", key);
+}
+
+
+
+
+/***********************************************************************
+ *************************** Helper Functions **************************
+ **********************************************************************/
+
+
+metadata_cache_p cache_create(const char *file_name)
+{
+    metadata_cache_p cache = NULL;
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_INFO, "Loading metadata cache %s.", file_name);
+
+    cache = (metadata_cache_p)mem_alloc((int)sizeof(struct metadata_cache_t));
+    if(!cache) {
+        pdebug(DEBUG_ERROR, "Unable to allocate metadata cache!");
+        return NULL;
+    }
+
+    cache->file_name = str_dup(file_name);
+    cache->entries = hashtable_create(1000);
+    cache->pending = vector_create(100, 100);
+    cache->writing = vector_create(100, 100);
+
+    if(!cache->file_name || !cache->entries || !cache->pending || !cache->writing || mutex_create(&cache->mutex) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to set up metadata cache!");
+        cache_destroy(cache);
+        return NULL;
+    }
+
+    rc = cache_load(cache);
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to load metadata cache %s, error %s!", file_name, plc_tag_decode_error(rc));
+        cache_destroy(cache);
+        return NULL;
+    }
+
+    return cache;
+}
+
+
+
+/*
+ * cache_load
+ *
+ * Read in the file, if there is one.  The flush thread opens it for
+ * appending, or writes a fresh one.
+ */
+int cache_load(metadata_cache_p cache)
+{
+    char line[METADATA_CACHE_MAX_LINE];
+    FILE *file = fopen(cache->file_name, "r");
+
+    if(file) {
+        while(fgets(line, (int)sizeof(line), file)) {
+            cache->num_lines++;
+
+            if(cache_parse_line(cache, line) != PLCTAG_STATUS_OK) {
+                pdebug(DEBUG_WARN, "Skipping bad line %d of %s.", cache->num_lines, cache->file_name);
+            }
+        }
+
+        fclose(file);
+
+        pdebug(DEBUG_INFO, "Loaded %d entries from %s.", cache->num_entries, cache->file_name);
+    }
+
+    /* start over if the file is new or mostly old entries. */
+    if(cache->num_lines == 0 || cache->num_lines > (2 * cache->num_entries) + METADATA_CACHE_MIN_EXTRA_LINES) {
+        cache->needs_rewrite = 1;
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * cache_parse_line
+ *
+ * Apply one line of the file to the cache.
+ */
+int cache_parse_line(metadata_cache_p cache, char *line)
+{
+    char *fields[METADATA_CACHE_MAX_FIELDS];
+    int num_fields = 0;
+    char *p = line;
+    char *key = NULL;
+    metadata_entry_p entry = NULL;
+    int rc = PLCTAG_STATUS_OK;
+
+    /* comments and blank lines. */
+    if(line[0] == '#' || line[0] == '\n' || line[0] == '\r' || line[0] == 0) {
+        return PLCTAG_STATUS_OK;
+    }
+
+    /* split the fields in place, empty ones are fine. */
+    fields[num_fields++] = p;
+
+    while(*p && *p != '\n' && *p != '\r') {
+        if(*p == '\t') {
+            if(num_fields >= METADATA_CACHE_MAX_FIELDS) {
+                return PLCTAG_ERR_BAD_DATA;
+            }
+
+            *p = 0;
+            fields[num_fields++] = p + 1;
+        }
+
+        p++;
+    }
+
+    *p = 0;
+
+    if(str_cmp(fields[0], "drop") == 0) {
+        if(num_fields == 4 && str_cmp(fields[1], "route") == 0) {
+            key = str_concat(fields[1], "\t", fields[2], "\t", fields[3]);
+        } else if(num_fields == 5 && str_cmp(fields[1], "tag") == 0) {
+            key = str_concat(fields[1], "\t", fields[2], "\t", fields[3], "\t", fields[4]);
+        } else {
+            return PLCTAG_ERR_BAD_DATA;
+        }
+
+        if(key) {
+            remove_entry_unsafe(cache, key);
+            mem_free(key);
+        }
+
+        return PLCTAG_STATUS_OK;
+    }
+
+    if(str_cmp(fields[0], "route") == 0 && num_fields == 5) {
+        int use_ex = 0;
+        int max_payload_size = 0;
+
+        if(str_to_int(fields[3], &use_ex) || str_to_int(fields[4], &max_payload_size) || max_payload_size <= 0) {
+            return PLCTAG_ERR_BAD_DATA;
+        }
+
+        key = str_concat(fields[0], "\t", fields[1], "\t", fields[2]);
+        if(!key) {
+            return PLCTAG_ERR_NO_MEM;
+        }
+
+        entry = find_entry_unsafe(cache, key);
+        if(!entry) {
+            entry = add_entry_unsafe(cache, key);
+        }
+
+        if(entry) {
+            entry->is_tag = 0;
+            entry->use_ex = use_ex;
+            entry->max_payload_size = max_payload_size;
+        } else {
+            rc = PLCTAG_ERR_NO_MEM;
+        }
+
+        mem_free(key);
+
+        return rc;
+    }
+
+    if(str_cmp(fields[0], "tag") == 0 && num_fields == 7) {
+        int elem_size = 0;
+        int elem_count = 0;
+        uint8_t type_info[MAX_TAG_TYPE_INFO];
+        int type_info_size = str_length(fields[6]) / 2;
+
+        if(str_to_int(fields[4], &elem_size) || str_to_int(fields[5], &elem_count)) {
+            return PLCTAG_ERR_BAD_DATA;
+        }
+
+        if(type_info_size <= 0 || type_info_size > MAX_TAG_TYPE_INFO || str_length(fields[6]) != type_info_size * 2) {
+            return PLCTAG_ERR_BAD_DATA;
+        }
+
+        for(int i=0; i < type_info_size; i++) {
+            unsigned int byte_val = 0;
+
+            if(sscanf(&fields[6][i * 2], "%2x", &byte_val) != 1) {
+                return PLCTAG_ERR_BAD_DATA;
+            }
+
+            type_info[i] = (uint8_t)byte_val;
+        }
+
+        key = str_concat(fields[0], "\t", fields[1], "\t", fields[2], "\t", fields[3]);
+        if(!key) {
+            return PLCTAG_ERR_NO_MEM;
+        }
+
+        entry = find_entry_unsafe(cache, key);
+        if(!entry) {
+            entry = add_entry_unsafe(cache, key);
+        }
+
+        if(entry) {
+            entry->is_tag = 1;
+            entry->elem_size = elem_size;
+            entry->elem_count = elem_count;
+            mem_copy(entry->type_info, type_info, type_info_size);
+            entry->type_info_size = type_info_size;
+        } else {
+            rc = PLCTAG_ERR_NO_MEM;
+        }
+
+        mem_free(key);
+
+        return rc;
+    }
+
+    return PLCTAG_ERR_BAD_DATA;
+}
+
+
+
+/*
+ * cache_rewrite
+ *
+ * Write out the passed lines, all the entries, to a new file and put it
+ * in place of the old one.  Later changes are appended to the new file.
+ * Only called by the flush thread, or at teardown.
+ */
+int cache_rewrite(metadata_cache_p cache, vector_p lines)
+{
+    char *tmp_name = str_concat(cache->file_name, ".tmp");
+    FILE *file = NULL;
+    int ok = 1;
+
+    if(!tmp_name) {
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    pdebug(DEBUG_INFO, "Rewriting %s with %d entries.", cache->file_name, vector_length(lines));
+
+    if(cache->file) {
+        fclose(cache->file);
+        cache->file = NULL;
+    }
+
+    file = fopen(tmp_name, "w");
+    if(!file) {
+        pdebug(DEBUG_WARN, "Unable to create %s, changes will not be saved!", tmp_name);
+        cache->file_failed = 1;
+        mem_free(tmp_name);
+        return PLCTAG_STATUS_OK;
+    }
+
+    ok = (fprintf(file, "%s\n", METADATA_CACHE_HEADER) > 0);
+
+    for(int i=0; ok && i < vector_length(lines); i++) {
+        ok = (fprintf(file, "%s\n", (char *)vector_get(lines, i)) > 0);
+    }
+
+    if(fclose(file) != 0) {
+        ok = 0;
+    }
+
+    /* Windows will not rename over an existing file. */
+    if(ok && rename(tmp_name, cache->file_name) != 0) {
+        remove(cache->file_name);
+        ok = (rename(tmp_name, cache->file_name) == 0);
+    }
+
+    if(!ok) {
+        pdebug(DEBUG_WARN, "Unable to write %s, changes will not be saved!", cache->file_name);
+        cache->file_failed = 1;
+        remove(tmp_name);
+        mem_free(tmp_name);
+        return PLCTAG_STATUS_OK;
+    }
+
+    mem_free(tmp_name);
+
+    cache->num_lines = vector_length(lines) + 1;
+
+    cache->file = fopen(cache->file_name, "a");
+    if(!cache->file) {
+        pdebug(DEBUG_WARN, "Unable to open %s for writing, changes will not be saved!", cache->file_name);
+        cache->file_failed = 1;
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * cache_append
+ *
+ * Add the passed lines to the end of the file.  Only called by the
+ * flush thread, or at teardown.
+ */
+void cache_append(metadata_cache_p cache, vector_p lines)
+{
+    if(!cache->file && !cache->file_failed) {
+        cache->file = fopen(cache->file_name, "a");
+
+        if(!cache->file) {
+            pdebug(DEBUG_WARN, "Unable to open %s for writing, changes will not be saved!", cache->file_name);
+            cache->file_failed = 1;
+        }
+    }
+
+    if(!cache->file) {
+        return;
+    }
+
+    for(int i=0; i < vector_length(lines); i++) {
+        if(fprintf(cache->file, "%s\n", (char *)vector_get(lines, i)) < 0) {
+            break;
+        }
+
+        cache->num_lines++;
+    }
+
+    if(ferror(cache->file) || fflush(cache->file) != 0) {
+        pdebug(DEBUG_WARN, "Unable to write to %s, changes will not be saved!", cache->file_name);
+        fclose(cache->file);
+        cache->file = NULL;
+        cache->file_failed = 1;
+    }
+}
+
+
+
+/*
+ * cache_note_change_unsafe
+ *
+ * Queue a line for the flush thread to add to the file.  Call with the
+ * cache mutex held.
+ */
+void cache_note_change_unsafe(metadata_cache_p cache, const char *line)
+{
+    char *copy = NULL;
+
+    /* a rewrite will have the change anyway. */
+    if(cache->needs_rewrite) {
+        return;
+    }
+
+    copy = str_dup(line);
+    if(!copy || vector_put(cache->pending, vector_length(cache->pending), copy) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to queue change, rewriting %s instead.", cache->file_name);
+
+        if(copy) {
+            mem_free(copy);
+        }
+
+        cache->needs_rewrite = 1;
+    }
+}
+
+
+
+/*
+ * cache_flush
+ *
+ * Write out the changes to the cache since the last flush.  The lines
+ * are taken under the mutex and written without it.  When the file has
+ * too many lines for the number of entries, or the file needs to be
+ * written from scratch, all the entries are written to a new file
+ * instead.
+ */
+void cache_flush(metadata_cache_p cache)
+{
+    char line[METADATA_CACHE_MAX_LINE];
+    int rewrite = 0;
+
+    if(cache->file_failed) {
+        critical_block(cache->mutex) {
+            free_lines(cache->pending);
+            cache->needs_rewrite = 0;
+        }
+
+        return;
+    }
+
+    critical_block(cache->mutex) {
+        vector_p tmp = NULL;
+
+        rewrite = cache->needs_rewrite
+                  || (cache->num_lines + vector_length(cache->pending) > (2 * cache->num_entries) + METADATA_CACHE_MIN_EXTRA_LINES);
+
+        if(!rewrite) {
+            /* take the pending lines. */
+            tmp = cache->writing;
+            cache->writing = cache->pending;
+            cache->pending = tmp;
+            break;
+        }
+
+        free_lines(cache->pending);
+        cache->needs_rewrite = 0;
+
+        for(int i=0; i < hashtable_capacity(cache->entries); i++) {
+            metadata_entry_p entry = (metadata_entry_p)hashtable_get_index(cache->entries, i);
+
+            for(; entry; entry = entry->next) {
+                char *copy = NULL;
+
+                if(format_entry(entry, line, (int)sizeof(line)) != PLCTAG_STATUS_OK) {
+                    continue;
+                }
+
+                copy = str_dup(line);
+                if(copy && vector_put(cache->writing, vector_length(cache->writing), copy) != PLCTAG_STATUS_OK) {
+                    mem_free(copy);
+                }
+            }
+        }
+    }
+
+    if(rewrite) {
+        cache_rewrite(cache, cache->writing);
+    } else if(vector_length(cache->writing) > 0) {
+        cache_append(cache, cache->writing);
+    }
+
+    free_lines(cache->writing);
+}
+
+
+
+/*
+ * flush_handler
+ *
+ * Write out the changes to all the caches now and then.
+ */
+THREAD_FUNC(flush_handler)
+{
+    (void)arg;
+
+    debug_set_tag_id(0);
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    while(!flush_terminating) {
+        int num_caches = 0;
+
+        cond_wait(flush_wait, METADATA_CACHE_FLUSH_MS);
+
+        if(flush_terminating) {
+            break;
+        }
+
+        critical_block(cache_mutex) {
+            num_caches = vector_length(caches);
+        }
+
+        /* caches are only added and stay until teardown. */
+        for(int i=0; i < num_caches; i++) {
+            metadata_cache_p cache = NULL;
+
+            critical_block(cache_mutex) {
+                cache = (metadata_cache_p)vector_get(caches, i);
+            }
+
+            if(cache) {
+                cache_flush(cache);
+            }
+        }
+    }
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    THREAD_RETURN(0);
+}
+
+
+
+void free_lines(vector_p lines)
+{
+    while(vector_length(lines) > 0) {
+        mem_free(vector_remove(lines, vector_length(lines) - 1));
+    }
+}
+
+
+
+void cache_destroy(metadata_cache_p cache)
+{
+    if(!cache) {
+        return;
+    }
+
+    if(cache->file) {
+        fclose(cache->file);
+    }
+
+    if(cache->pending) {
+        free_lines(cache->pending);
+        vector_destroy(cache->pending);
+    }
+
+    if(cache->writing) {
+        free_lines(cache->writing);
+        vector_destroy(cache->writing);
+    }
+
+    if(cache->entries) {
+        for(int i=0; i < hashtable_capacity(cache->entries); i++) {
+            metadata_entry_p entry = (metadata_entry_p)hashtable_get_index(cache->entries, i);
+
+            while(entry) {
+                metadata_entry_p next = entry->next;
+
+                mem_free(entry->key);
+                mem_free(entry);
+
+                entry = next;
+            }
+        }
+
+        hashtable_destroy(cache->entries);
+    }
+
+    if(cache->mutex) {
+        mutex_destroy(&cache->mutex);
+    }
+
+    if(cache->file_name) {
+        mem_free(cache->file_name);
+    }
+
+    mem_free(cache);
+}
+
+
+
+int64_t key_hash(const char *key)
+{
+    size_t len = (size_t)str_length(key);
+    uint64_t result = (((uint64_t)hash((uint8_t *)key, len, 1) << 32) | (uint64_t)hash((uint8_t *)key, len, 2));
+
+    /* zero marks an empty slot in the hashtable. */
+    return (int64_t)((result & METADATA_CACHE_HASH_MASK) | 1);
+}
+
+
+
+metadata_entry_p find_entry_unsafe(metadata_cache_p cache, const char *key)
+{
+    metadata_entry_p entry = (metadata_entry_p)hashtable_get(cache->entries, key_hash(key));
+
+    while(entry && str_cmp(entry->key, key) != 0) {
+        entry = entry->next;
+    }
+
+    return entry;
+}
+
+
+
+metadata_entry_p add_entry_unsafe(metadata_cache_p cache, const char *key)
+{
+    int64_t hash_key = key_hash(key);
+    metadata_entry_p head = (metadata_entry_p)hashtable_get(cache->entries, hash_key);
+    metadata_entry_p entry = (metadata_entry_p)mem_alloc((int)sizeof(struct metadata_entry_t));
+
+    if(!entry) {
+        return NULL;
+    }
+
+    entry->key = str_dup(key);
+    if(!entry->key) {
+        mem_free(entry);
+        return NULL;
+    }
+
+    /* keys that hash the same share a table slot. */
+    if(head) {
+        entry->next = head->next;
+        head->next = entry;
+    } else if(hashtable_put(cache->entries, hash_key, entry) != PLCTAG_STATUS_OK) {
+        mem_free(entry->key);
+        mem_free(entry);
+        return NULL;
+    }
+
+    cache->num_entries++;
+
+    return entry;
+}
+
+
+
+void remove_entry_unsafe(metadata_cache_p cache, const char *key)
+{
+    int64_t hash_key = key_hash(key);
+    metadata_entry_p head = (metadata_entry_p)hashtable_get(cache->entries, hash_key);
+    metadata_entry_p entry = head;
+    metadata_entry_p prev = NULL;
+
+    while(entry && str_cmp(entry->key, key) != 0) {
+        prev = entry;
+        entry = entry->next;
+    }
+
+    if(!entry) {
+        return;
+    }
+
+    if(prev) {
+        prev->next = entry->next;
+    } else {
+        hashtable_remove(cache->entries, hash_key);
+
+        if(entry->next) {
+            hashtable_put(cache->entries, hash_key, entry->next);
+        }
+    }
+
+    cache->num_entries--;
+
+    mem_free(entry->key);
+    mem_free(entry);
+}
+
+
+
+int format_entry(metadata_entry_p entry, char *buf, int buf_size)
+{
+    int len = 0;
+
+    if(!entry->is_tag) {
+        len = snprintf(buf, (size_t)buf_size, "%s\t%d\t%d", entry->key, entry->use_ex, entry->max_payload_size);
+    } else {
+        len = snprintf(buf, (size_t)buf_size, "%s\t%d\t%d\t", entry->key, entry->elem_size, entry->elem_count);
+
+        for(int i=0; i < entry->type_info_size && len > 0 && len < buf_size; i++) {
+            len += snprintf(buf + len, (size_t)(buf_size - len), "%02x", (unsigned int)entry->type_info[i]);
+        }
+    }
+
+    if(len <= 0 || len >= buf_size) {
+        return PLCTAG_ERR_TOO_LARGE;
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * key_part_ok
+ *
+ * Tabs and line breaks would break up the lines in the file.
+ */
+int key_part_ok(const char *part)
+{
+    if(!part) {
+        return 1;
+    }
+
+    for(; *part; part++) {
+        if(*part == '\t' || *part == '\n' || *part == '\r') {
+            return 0;
+        }
+    }
+
+    return 1;
+}
@@ -0,0 +1,61 @@
+/***************************************************************************
+ *   Copyright (C) 2018 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library/Lesser General Public License as*
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU Library General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __PLCTAG_AB_METADATA_CACHE_H__
+#define __PLCTAG_AB_METADATA_CACHE_H__ 1
+
+#include <stdint.h>
+
+/*
+ * A metadata cache remembers what was learned from the PLCs in an
+ * earlier run, so that it does not have to be learned again: the packet
+ * size each CIP path negotiated and the CIP type of each tag.  It is
+ * kept in the file named by the metadata_cache attribute.
+ *
+ * The file is loaded when the first tag names it.  Changes are appended
+ * to it by a background thread about once a second, so that nothing
+ * waits on the disk.  Later lines override earlier ones, and the file
+ * is rewritten from scratch when it has grown too much.  Nothing in it
+ * is trusted: whatever the PLC says wins and the entry is fixed or
+ * dropped.
+ *
+ * Keys are built by the metadata_cache_*_key() functions.  They return
+ * NULL if the parts cannot be stored in the file.
+ */
+
+typedef struct metadata_cache_t *metadata_cache_p;
+
+extern int metadata_cache_startup(void);
+extern void metadata_cache_teardown(void);
+
+extern metadata_cache_p metadata_cache_get(const char *file_name);
+
+extern char *metadata_cache_route_key(const char *gateway, const char *path);
+extern char *metadata_cache_tag_key(const char *gateway, const char *path, const char *name);
+
+extern int metadata_cache_get_route(metadata_cache_p cache, const char *key, int *use_ex, int *max_payload_size);
+extern void metadata_cache_put_route(metadata_cache_p cache, const char *key, int use_ex, int max_payload_size);
+
+extern int metadata_cache_get_tag(metadata_cache_p cache, const char *key, int *elem_size, int *elem_count, uint8_t *type_info, int *type_info_size);
+extern void metadata_cache_put_tag(metadata_cache_p cache, const char *key, int elem_size, int elem_count, uint8_t *type_info, int type_info_size);
+
+extern void metadata_cache_remove(metadata_cache_p cache, const char *key);
+
+#endif
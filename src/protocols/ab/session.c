@@ -24,15 +24,17 @@
 #include <ab/cip.h>
 #include <ab/defs.h>
 #include <ab/error_codes.h>
+#include <ab/metadata_cache.h>
 #include <ab/session.h>
+#include <lib/tag.h>
 #include <util/debug.h>
+#include <util/hash.h>
+#include <ctype.h>
 #include <inttypes.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <time.h>
 
-#define MAX_REQUESTS (200)
-
 #define EIP_CIP_PREFIX_SIZE (44) /* bytes of encap header and CFP connected header */
 
 /* WARNING: this must fit within 9 bits! */
@@ -54,44 +56,149 @@
 
 #define SESSION_DISCONNECT_TIMEOUT (5000)
 
+/*
+ * While connecting, only one of the racing connection attempts is
+ * watched, so check on all of them this often.
+ */
+#define SESSION_CONNECT_POLL_MS (20)
+
+/* how long to wait for the PLC to answer a Forward Close. */
+#define SESSION_FORWARD_CLOSE_TIMEOUT (250)
+
+/*
+ * Single responses at least this big are handed to the request in the
+ * receive buffer instead of being copied.  Smaller ones are cheaper to
+ * copy than a new receive buffer is to allocate.
+ */
+#define SESSION_MIN_ZERO_COPY_SIZE (1024)
+
+
+
+/*
+ * A controller symbol and its instance ID.  Symbols whose names hash
+ * the same share a slot in the route's symbol table.
+ */
+typedef struct ab_symbol_t *ab_symbol_p;
+
+struct ab_symbol_t {
+    ab_symbol_p next;
+    uint32_t instance_id;
+    char *name;
+
+    /* for a program, whether its own symbols have been listed. */
+    symbols_state_t program_state;
+};
+
+
+
+/*
+ * A kind of request that cannot go out now.  Whether a request can go
+ * depends only on its route, whether it is connected and whether it is a
+ * fragment, see route_can_send().
+ */
+typedef struct {
+    ab_route_p route;
+    int connected;
+    int fragment;
+} ab_blocked_t;
+
 
 
-static ab_session_p session_create_unsafe(const char *host, int gw_port, const char *path, int plc_type, int use_connected_msg);
+static ab_session_p session_create_unsafe(const char *host, int gw_port);
 static int session_init(ab_session_p session);
+static ab_route_p route_create(const char *path, int plc_type, int use_connected_msg);
+static void route_destroy(ab_route_p route);
+static int64_t symbol_hash(const char *name);
+static ab_symbol_p find_symbol_unsafe(ab_route_p route, const char *name);
+static void forget_symbols_unsafe(ab_route_p route);
+static void program_symbol_name(char *full_name, int full_name_size, const char *program, const char *name);
+static ab_route_p find_route_unsafe(ab_session_p session, const char *path);
+static ab_route_p route_to_connect(ab_session_p session, int64_t now);
+static int route_can_send(ab_session_p session, ab_request_p request);
 static int get_plc_type(attr attribs);
 static int add_session_unsafe(ab_session_p n);
 static int remove_session_unsafe(ab_session_p n);
-static ab_session_p find_session_by_host_unsafe(const char *gateway, const char *path);
-static int session_match_valid(const char *host, const char *path, ab_session_p session);
-static int session_add_request_unsafe(ab_session_p sess, ab_request_p req);
+static ab_session_p find_session_by_host_unsafe(const char *gateway);
+static int session_match_valid(const char *host, ab_session_p session);
 static int session_open_socket(ab_session_p session);
 static void session_destroy(void *session);
 static int session_register(ab_session_p session);
+static int session_register_check(ab_session_p session);
 static int session_close_socket(ab_session_p session);
 static int session_unregister(ab_session_p session);
-static THREAD_FUNC(session_handler);
-static int process_requests(ab_session_p session);
+static THREAD_FUNC(session_io_handler);
+static void session_tick(ab_session_p session);
+static void session_run_state(ab_session_p session);
+static void session_update_watch(ab_session_p session);
+static int process_requests(ab_session_p session, int max_in_flight);
+static int get_max_in_flight(ab_session_p session);
+static int get_connection_depth(ab_session_p session, int fragment);
+static void gather_requests(ab_session_p session);
+static int request_before(ab_request_p first, ab_request_p second);
+static ab_request_p merge_requests(ab_request_p first, ab_request_p second);
+static ab_request_p sort_requests(ab_request_p head);
+static void check_deadline(ab_session_p session, ab_request_p request);
+static void unlink_request(ab_session_p session, ab_request_p prev, ab_request_p request);
+static int has_requests(ab_session_p session);
+static void abort_request(ab_request_p request);
+static int bundle_requests(ab_session_p session, ab_bundle_t *bundle);
+static int is_blocked(ab_blocked_t *blocked, int num_blocked, ab_request_p request);
+static int get_uc_send_overhead(ab_request_p request);
+static int send_bundle(ab_session_p session, ab_bundle_t *bundle);
+static int recv_bundle_response(ab_session_p session);
+static void fail_bundle(ab_bundle_t *bundle, int status);
+static void fail_all_bundles(ab_session_p session, int status);
 //static int check_packing(ab_session_p session, ab_request_p request);
 static int get_payload_size(ab_request_p request);
 static int pack_requests(ab_session_p session, ab_request_p *requests, int num_requests);
-static int prepare_request(ab_session_p session);
-static int send_eip_request(ab_session_p session, int timeout);
-static int recv_eip_response(ab_session_p session, int timeout);
+static int pack_uc_requests(ab_session_p session, ab_request_p *requests, int num_requests);
+static int is_uc_send(ab_request_p request);
+static int prepare_request(ab_session_p session, ab_bundle_t *bundle);
+static int pick_connection(ab_route_p route);
+static int send_eip_request(ab_session_p session);
+static void consume_send_bufs(ab_session_p session, int amount);
+static int recv_eip_response(ab_session_p session);
+static int session_transact(ab_session_p session);
 static int unpack_response(ab_session_p session, ab_request_p request, int sub_packet);
-static int perform_forward_open(ab_session_p session);
-static int perform_forward_close(ab_session_p session);
-static int try_forward_open_ex(ab_session_p session, int *max_payload_size_guess);
-static int try_forward_open(ab_session_p session);
+static int start_forward_open(ab_session_p session);
+static int check_forward_open(ab_session_p session);
 static int send_forward_open_req(ab_session_p session);
 static int send_forward_open_req_ex(ab_session_p session);
 static int recv_forward_open_resp(ab_session_p session, int *max_payload_size_guess);
 static int send_forward_close_req(ab_session_p session);
 static int recv_forward_close_resp(ab_session_p session);
 static void request_destroy(void *req_arg);
+static uint8_t *rx_buffer_create(ab_session_p session);
+static void rx_buffer_destroy(void *buf_arg);
+
+
+/*
+ * All sessions are run by a small pool of IO threads.  Each thread
+ * waits on its event loop until one of its sessions' sockets is ready
+ * or the next session timer expires, then steps the state machines of
+ * those sessions.  The state machines never block.
+ */
+
+#define SESSION_IO_MAX_BATCH (64)
+#define SESSION_IO_MAX_WAIT_MS (1000)
+
+struct session_io_t {
+    thread_p thread;
+    event_loop_p loop;
+    mutex_p mutex;
+    vector_p sessions; /* not reference counted, sessions remove themselves when destroyed. */
+    volatile int terminating;
+};
 
 
 static volatile mutex_p session_mutex = NULL;
 static volatile vector_p sessions = NULL;
+static struct session_io_t session_io[SESSION_NUM_IO_THREADS];
+static int session_io_next = 0;
+
+/* the deadline counters of all sessions, even closed ones. */
+static lock_t deadline_stats_lock = LOCK_INIT;
+static session_deadline_stats_t deadline_stats;
 
 
 
@@ -110,12 +217,51 @@ int session_startup()
         return PLCTAG_ERR_NO_MEM;
     }
 
+    for(int i=0; i < SESSION_NUM_IO_THREADS; i++) {
+        struct session_io_t *io = &session_io[i];
+
+        io->terminating = 0;
+
+        if((rc = mutex_create(&io->mutex)) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_ERROR, "Unable to create session IO mutex %s!", plc_tag_decode_error(rc));
+            return rc;
+        }
+
+        if((io->sessions = vector_create(25, 5)) == NULL) {
+            pdebug(DEBUG_ERROR, "Unable to create session IO vector!");
+            return PLCTAG_ERR_NO_MEM;
+        }
+
+        if((rc = event_loop_create(&io->loop)) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_ERROR, "Unable to create session IO event loop %s!", plc_tag_decode_error(rc));
+            return rc;
+        }
+
+        if((rc = thread_create(&io->thread, session_io_handler, 32*1024, io)) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_ERROR, "Unable to create session IO thread %s!", plc_tag_decode_error(rc));
+            return rc;
+        }
+    }
+
     return rc;
 }
 
 
 void session_teardown()
 {
+    /* stop the IO threads first so that no session is in use while it is released. */
+    for(int i=0; i < SESSION_NUM_IO_THREADS; i++) {
+        struct session_io_t *io = &session_io[i];
+
+        if(io->thread) {
+            io->terminating = 1;
+            event_loop_wake(io->loop);
+
+            thread_join(io->thread);
+            thread_destroy(&io->thread);
+        }
+    }
+
     if(sessions) {
         for(int i=0; i < vector_length(sessions); i++) {
             ab_session_p session = vector_get(sessions, i);
@@ -129,6 +275,22 @@ void session_teardown()
         sessions = NULL;
     }
 
+    for(int i=0; i < SESSION_NUM_IO_THREADS; i++) {
+        struct session_io_t *io = &session_io[i];
+
+        if(io->loop) {
+            event_loop_destroy(&io->loop);
+        }
+
+        if(io->sessions) {
+            vector_destroy(io->sessions);
+            io->sessions = NULL;
+        }
+
+        if(io->mutex) {
+            mutex_destroy(&io->mutex);
+        }
+    }
 
     if(session_mutex) {
         mutex_destroy((mutex_p *)&session_mutex);
@@ -177,1214 +339,2749 @@ uint64_t session_get_new_seq_id(ab_session_p sess)
 
 
 
-int session_get_max_payload(ab_session_p session)
+int session_get_max_payload(ab_session_p session, ab_route_p route)
 {
     int result = 0;
 
-    if(!session) {
-        pdebug(DEBUG_WARN, "Called with null session pointer!");
+    if(!session || !route) {
+        pdebug(DEBUG_WARN, "Called with null session or route pointer!");
         return 0;
     }
 
     critical_block(session->mutex) {
-        result = session->max_payload_size;
+        result = route->max_payload_size;
     }
 
     return result;
 }
 
-int session_find_or_create(ab_session_p *tag_session, attr attribs)
-{
-    /*int debug = attr_get_int(attribs,"debug",0);*/
-    const char *session_gw = attr_get_str(attribs, "gateway", "");
-    const char *session_path = attr_get_str(attribs, "path", "");
-    int use_connected_msg = attr_get_int(attribs, "use_connected_msg", 0);
-    int session_gw_port = attr_get_int(attribs, "gateway_port", AB_EIP_DEFAULT_PORT);
-    int plc_type = get_plc_type(attribs);
-    ab_session_p session = AB_SESSION_NULL;
-    int new_session = 0;
-    int shared_session = attr_get_int(attribs, "share_session", 1); /* share the session by default. */
-    int rc = PLCTAG_STATUS_OK;
-    int auto_disconnect_enabled = 0;
-    int auto_disconnect_timeout_ms = INT_MAX;
 
-    pdebug(DEBUG_DETAIL, "Starting");
 
-    auto_disconnect_timeout_ms = attr_get_int(attribs, "auto_disconnect_ms", INT_MAX);
-    if(auto_disconnect_timeout_ms != INT_MAX) {
-        pdebug(DEBUG_DETAIL,"Setting auto-disconnect after %dms.", auto_disconnect_timeout_ms);
-        auto_disconnect_enabled = 1;
+/*
+ * session_route_is_connected
+ *
+ * Does the route have a CIP connection open?  Until it does, the packet
+ * size is the small one used before the Forward Open.
+ */
+int session_route_is_connected(ab_session_p session, ab_route_p route)
+{
+    int result = 0;
+
+    if(!session || !route) {
+        pdebug(DEBUG_WARN, "Called with null session or route pointer!");
+        return 0;
     }
 
-    if(plc_type == AB_PROTOCOL_PLC && str_length(session_path) > 0) {
-        /* this means it is DH+ */
-        use_connected_msg = 1;
-        attr_set_int(attribs, "use_connected_msg", 1);
+    critical_block(session->mutex) {
+        result = (route->num_open_connections > 0);
     }
 
-    critical_block(session_mutex) {
-        /* if we are to share sessions, then look for an existing one. */
-        if (shared_session) {
-            session = find_session_by_host_unsafe(session_gw, session_path);
-        } else {
-            /* no sharing, create a new one */
-            session = AB_SESSION_NULL;
-        }
+    return result;
+}
 
-        if (session == AB_SESSION_NULL) {
-            pdebug(DEBUG_DETAIL,"Creating new session.");
-            session = session_create_unsafe(session_gw, session_gw_port, session_path, plc_type, use_connected_msg);
+/*
+ * session_find_symbol
+ *
+ * Look up the instance ID of a controller symbol of the route.  If the
+ * symbols have not been listed yet, the first caller is told to list
+ * them with *must_list and everyone gets PLCTAG_STATUS_PENDING until the
+ * listing is done.  Returns PLCTAG_ERR_NOT_FOUND if the symbols are
+ * listed and the name is not one of them.
+ */
 
-            if (session == AB_SESSION_NULL) {
-                pdebug(DEBUG_WARN, "unable to create or find a session!");
-                rc = PLCTAG_ERR_BAD_GATEWAY;
-            } else {
-                session->auto_disconnect_enabled = auto_disconnect_enabled;
-                session->auto_disconnect_timeout_ms = auto_disconnect_timeout_ms;
+int session_find_symbol(ab_session_p session, ab_route_p route, const char *name, uint32_t *instance_id, int *generation, int *must_list)
+{
+    int rc = PLCTAG_STATUS_OK;
 
-                new_session = 1;
-            }
-        } else {
-            /* turn on auto disconnect if we need to. */
-            if(!session->auto_disconnect_enabled && auto_disconnect_enabled) {
-                session->auto_disconnect_enabled = auto_disconnect_enabled;
-            }
+    *must_list = 0;
 
-            /* disconnect period always goes down. */
-            if(session->auto_disconnect_enabled && session->auto_disconnect_timeout_ms > auto_disconnect_timeout_ms) {
-                session->auto_disconnect_timeout_ms = auto_disconnect_timeout_ms;
-            }
+    critical_block(session->mutex) {
+        ab_symbol_p symbol = NULL;
 
-            pdebug(DEBUG_DETAIL,"Reusing existing session.");
-        }
-    }
+        *generation = route->symbol_generation;
 
-    /*
-     * do this OUTSIDE the mutex in order to let other threads not block if
-     * the session creation process blocks.
-     */
+        if(route->symbols_state == SYMBOLS_UNLISTED) {
+            route->symbols_state = SYMBOLS_LISTING;
+            *must_list = 1;
+            rc = PLCTAG_STATUS_PENDING;
+            break;
+        }
 
-    if(new_session) {
-        rc = session_init(session);
-        if(rc != PLCTAG_STATUS_OK) {
-            rc_dec(session);
-            session = AB_SESSION_NULL;
-        } else {
-            /* save the status */
-            //session->status = rc;
+        if(route->symbols_state == SYMBOLS_LISTING) {
+            rc = PLCTAG_STATUS_PENDING;
+            break;
         }
-    }
 
-    /* store it into the tag */
-    *tag_session = session;
+        symbol = find_symbol_unsafe(route, name);
+        if(!symbol) {
+            rc = PLCTAG_ERR_NOT_FOUND;
+            break;
+        }
 
-    pdebug(DEBUG_DETAIL, "Done");
+        *instance_id = symbol->instance_id;
+    }
 
     return rc;
 }
 
 
 
+/*
+ * session_find_program_symbol
+ *
+ * Look up the instance ID of a symbol in a program.  The controller
+ * symbols must be listed already, since the program is one of them.
+ * Each program's symbols are listed on their own, the first caller is
+ * told to list them with *must_list.  They are kept with the program
+ * name in front, as in "Program:Main.tag".
+ */
 
-int get_plc_type(attr attribs)
+int session_find_program_symbol(ab_session_p session, ab_route_p route, const char *program, const char *name, uint32_t *instance_id, int *generation, int *must_list)
 {
-    const char *cpu_type = attr_get_str(attribs, "plc", attr_get_str(attribs, "cpu", "NONE"));
+    char full_name[(SESSION_MAX_SYMBOL_NAME * 2) + 2];
+    int rc = PLCTAG_STATUS_OK;
 
-    if (!str_cmp_i(cpu_type, "plc") || !str_cmp_i(cpu_type, "plc5") || !str_cmp_i(cpu_type, "slc") ||
-        !str_cmp_i(cpu_type, "slc500")) {
-        return AB_PROTOCOL_PLC;
-    } else if (!str_cmp_i(cpu_type, "lgxpccc") || !str_cmp_i(cpu_type, "logixpccc") || !str_cmp_i(cpu_type, "lgxplc5") || !str_cmp_i(cpu_type, "logixplc5") ||
-               !str_cmp_i(cpu_type, "lgx-pccc") || !str_cmp_i(cpu_type, "logix-pccc") || !str_cmp_i(cpu_type, "lgx-plc5") || !str_cmp_i(cpu_type, "logix-plc5")) {
-        return AB_PROTOCOL_LGX_PCCC;
-    } else if (!str_cmp_i(cpu_type, "micrologix800") || !str_cmp_i(cpu_type, "mlgx800") || !str_cmp_i(cpu_type, "micro800")) {
-        return AB_PROTOCOL_MLGX800;
-    } else if (!str_cmp_i(cpu_type, "micrologix") || !str_cmp_i(cpu_type, "mlgx")) {
-        return AB_PROTOCOL_MLGX;
-    } else if (!str_cmp_i(cpu_type, "compactlogix") || !str_cmp_i(cpu_type, "clgx") || !str_cmp_i(cpu_type, "lgx") ||
-               !str_cmp_i(cpu_type, "controllogix") || !str_cmp_i(cpu_type, "contrologix") ||
-               !str_cmp_i(cpu_type, "flexlogix") || !str_cmp_i(cpu_type, "flgx")) {
-        return AB_PROTOCOL_LGX;
-    } else {
-        pdebug(DEBUG_WARN, "Unsupported device type: %s", cpu_type);
+    *must_list = 0;
 
-        return PLCTAG_ERR_BAD_DEVICE;
-    }
+    program_symbol_name(full_name, (int)sizeof(full_name), program, name);
 
-    return PLCTAG_STATUS_OK;
-}
+    critical_block(session->mutex) {
+        ab_symbol_p symbol = NULL;
 
+        *generation = route->symbol_generation;
 
-int add_session_unsafe(ab_session_p session)
-{
-    pdebug(DEBUG_DETAIL, "Starting");
+        /* the symbols were forgotten, start over. */
+        if(route->symbols_state != SYMBOLS_LISTED) {
+            rc = PLCTAG_STATUS_PENDING;
+            break;
+        }
 
-    if (!session) {
-        return PLCTAG_ERR_NULL_PTR;
-    }
+        symbol = find_symbol_unsafe(route, program);
+        if(!symbol) {
+            rc = PLCTAG_ERR_NOT_FOUND;
+            break;
+        }
 
-    vector_put(sessions, vector_length(sessions), session);
+        if(symbol->program_state == SYMBOLS_UNLISTED) {
+            symbol->program_state = SYMBOLS_LISTING;
+            *must_list = 1;
+            rc = PLCTAG_STATUS_PENDING;
+            break;
+        }
 
-//    n->prev = NULL;
-//    n->next = sessions;
-//
-//    if (sessions) {
-//        sessions->prev = n;
-//    }
-//
-//    sessions = n;
+        if(symbol->program_state == SYMBOLS_LISTING) {
+            rc = PLCTAG_STATUS_PENDING;
+            break;
+        }
 
-    pdebug(DEBUG_DETAIL, "Done");
+        symbol = find_symbol_unsafe(route, full_name);
+        if(!symbol) {
+            rc = PLCTAG_ERR_NOT_FOUND;
+            break;
+        }
 
-    return PLCTAG_STATUS_OK;
+        *instance_id = symbol->instance_id;
+    }
+
+    return rc;
 }
 
 
 
-int add_session(ab_session_p s)
+/*
+ * session_add_symbol
+ *
+ * Remember a symbol found while listing.  A symbol found while listing
+ * a program is kept with the program name in front.  Symbols from a
+ * listing of an older generation are ignored.
+ */
+
+void session_add_symbol(ab_session_p session, ab_route_p route, int generation, const char *program, const char *symbol_name, uint32_t instance_id)
 {
-    int rc = PLCTAG_STATUS_OK;
+    char full_name[(SESSION_MAX_SYMBOL_NAME * 2) + 2];
+    const char *name = symbol_name;
+    int name_len = str_length(symbol_name);
 
-    pdebug(DEBUG_DETAIL, "Starting.");
+    if(name_len <= 0 || name_len > SESSION_MAX_SYMBOL_NAME) {
+        pdebug(DEBUG_DETAIL, "Skipping symbol with a name of %d characters.", name_len);
+        return;
+    }
 
-    critical_block(session_mutex) {
-        rc = add_session_unsafe(s);
+    if(program && program[0]) {
+        program_symbol_name(full_name, (int)sizeof(full_name), program, symbol_name);
+        name = full_name;
+        name_len = str_length(full_name);
     }
 
-    pdebug(DEBUG_DETAIL, "Done.");
+    critical_block(session->mutex) {
+        ab_symbol_p symbol = NULL;
+        ab_symbol_p head = NULL;
+        int64_t hash_key = symbol_hash(name);
 
-    return rc;
+        if(generation != route->symbol_generation || find_symbol_unsafe(route, name)) {
+            break;
+        }
+
+        if(!route->symbols) {
+            route->symbols = hashtable_create(1000);
+            if(!route->symbols) {
+                pdebug(DEBUG_WARN, "Unable to allocate symbol table!");
+                break;
+            }
+        }
+
+        symbol = (ab_symbol_p)mem_alloc((int)sizeof(*symbol) + name_len + 1);
+        if(!symbol) {
+            pdebug(DEBUG_WARN, "Unable to allocate symbol!");
+            break;
+        }
+
+        symbol->instance_id = instance_id;
+        symbol->name = (char *)(symbol + 1);
+        mem_copy(symbol->name, (void *)name, name_len);
+
+        head = (ab_symbol_p)hashtable_get(route->symbols, hash_key);
+        if(head) {
+            symbol->next = head->next;
+            head->next = symbol;
+        } else if(hashtable_put(route->symbols, hash_key, symbol) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Unable to add symbol to the table!");
+            mem_free(symbol);
+        }
+    }
 }
 
 
 
+/*
+ * session_end_symbol_listing
+ *
+ * The tag listing the symbols is done.  If it gave up before asking the
+ * PLC for all of them, the next lookup starts over.  The program is
+ * empty for the controller symbols.
+ */
 
-int remove_session_unsafe(ab_session_p session)
+void session_end_symbol_listing(ab_session_p session, ab_route_p route, int generation, const char *program, int listed)
 {
-    pdebug(DEBUG_DETAIL, "Starting");
+    critical_block(session->mutex) {
+        if(generation != route->symbol_generation) {
+            break;
+        }
 
-    if (!session || !sessions) {
-        return 0;
-    }
+        if(program && program[0]) {
+            ab_symbol_p symbol = find_symbol_unsafe(route, program);
 
-    for(int i=0; i < vector_length(sessions); i++) {
-        ab_session_p tmp = vector_get(sessions, i);
+            if(symbol && symbol->program_state == SYMBOLS_LISTING) {
+                pdebug(DEBUG_DETAIL, "Done listing symbols of %s for path %s.", program, route->path);
+                symbol->program_state = (listed ? SYMBOLS_LISTED : SYMBOLS_UNLISTED);
+            }
 
-        if(tmp == session) {
-            vector_remove(sessions, i);
             break;
         }
+
+        if(route->symbols_state != SYMBOLS_LISTING) {
+            break;
+        }
+
+        if(listed) {
+            pdebug(DEBUG_DETAIL, "Done listing symbols for path %s.", route->path);
+            route->symbols_state = SYMBOLS_LISTED;
+        } else {
+            forget_symbols_unsafe(route);
+        }
     }
+}
 
-//    tmp = sessions;
-//
-//    while (tmp && tmp != n)
-//        tmp = tmp->next;
-//
-//    if (!tmp || tmp != n) {
-//        pdebug(DEBUG_WARN, "Session not found!");
-//        return PLCTAG_ERR_NOT_FOUND;
-//    }
-//
-//    if (n->next) {
-//        n->next->prev = n->prev;
-//    }
-//
-//    if (n->prev) {
-//        n->prev->next = n->next;
-//    } else {
-//        sessions = n->next;
-//    }
-//
-//    n->next = NULL;
-//    n->prev = NULL;
-
-    pdebug(DEBUG_DETAIL, "Done");
 
-    return PLCTAG_STATUS_OK;
-}
 
-int remove_session(ab_session_p s)
+int session_get_symbol_generation(ab_session_p session, ab_route_p route)
 {
-    int rc = PLCTAG_STATUS_OK;
-
-    pdebug(DEBUG_DETAIL, "Starting.");
+    int generation = 0;
 
-    critical_block(session_mutex) {
-        rc = remove_session_unsafe(s);
+    critical_block(session->mutex) {
+        generation = route->symbol_generation;
     }
 
-    pdebug(DEBUG_DETAIL, "Done.");
-
-    return rc;
+    return generation;
 }
 
 
-int session_match_valid(const char *host, const char *path, ab_session_p session)
+
+/*
+ * session_forget_symbols
+ *
+ * A tag found its instance ID to be wrong.  The others are likely wrong
+ * too, so all of them are listed again.
+ */
+
+void session_forget_symbols(ab_session_p session, ab_route_p route, int generation)
 {
-    if(!session) {
-        return 0;
+    critical_block(session->mutex) {
+        if(generation == route->symbol_generation) {
+            pdebug(DEBUG_INFO, "Forgetting symbol instance IDs of path %s.", route->path);
+            forget_symbols_unsafe(route);
+        }
     }
+}
 
-//    if(session->status !=  PLCTAG_STATUS_OK && session->status != PLCTAG_STATUS_PENDING) {
-//        return 0;
-//    }
 
-    /* don't use sessions that failed immediately. */
-    if(session->failed) {
-        return 0;
+
+int64_t symbol_hash(const char *name)
+{
+    uint8_t lower[SESSION_MAX_SYMBOL_NAME];
+    int len = 0;
+
+    /* Logix symbol names are not case sensitive. */
+    for(len = 0; name[len] && len < SESSION_MAX_SYMBOL_NAME; len++) {
+        lower[len] = (uint8_t)tolower((unsigned char)name[len]);
     }
 
-    if(str_cmp_i(host,session->host)) {
-        return 0;
+    return (int64_t)(((uint64_t)hash(lower, (size_t)len, 1) << 32) | (uint64_t)hash(lower, (size_t)len, 2));
+}
+
+
+
+ab_symbol_p find_symbol_unsafe(ab_route_p route, const char *name)
+{
+    ab_symbol_p symbol = NULL;
+
+    if(!route->symbols) {
+        return NULL;
     }
 
-    if(str_cmp_i(path,session->path)) {
-        return 0;
+    symbol = (ab_symbol_p)hashtable_get(route->symbols, symbol_hash(name));
+    while(symbol && str_cmp_i(symbol->name, name) != 0) {
+        symbol = symbol->next;
     }
 
-    return 1;
+    return symbol;
 }
 
 
-ab_session_p find_session_by_host_unsafe(const char *host, const char *path)
+
+/*
+ * forget_symbols_unsafe
+ *
+ * Drop all the symbols of the route and start a new generation.  Must
+ * be called with the session mutex held, if the route is in use.
+ */
+
+void forget_symbols_unsafe(ab_route_p route)
 {
-    for(int i=0; i < vector_length(sessions); i++) {
-        ab_session_p session = vector_get(sessions, i);
+    if(route->symbols) {
+        for(int i=0; i < hashtable_capacity(route->symbols); i++) {
+            ab_symbol_p symbol = (ab_symbol_p)hashtable_get_index(route->symbols, i);
 
-        /* is this session in the process of destruction? */
-        session = rc_inc(session);
-        if(session) {
-            if(session_match_valid(host, path, session)) {
-                return session;
-            }
+            while(symbol) {
+                ab_symbol_p next = symbol->next;
 
-            rc_dec(session);
+                mem_free(symbol);
+                symbol = next;
+            }
         }
+
+        hashtable_destroy(route->symbols);
+        route->symbols = NULL;
     }
 
-    return NULL;
+    route->symbols_state = SYMBOLS_UNLISTED;
+    route->symbol_generation++;
 }
 
 
 
-ab_session_p session_create_unsafe(const char *host, int gw_port, const char *path, int plc_type, int use_connected_msg)
+/*
+ * program_symbol_name
+ *
+ * Build the name a program's symbol is kept under, "program.name".  The
+ * buffer must hold two symbol names and the dot.
+ */
+
+void program_symbol_name(char *full_name, int full_name_size, const char *program, const char *name)
 {
-    static volatile uint32_t srand_setup = 0;
-    static volatile uint32_t connection_id = 0;
+    int len = 0;
 
-    int rc = PLCTAG_STATUS_OK;
-    ab_session_p session = AB_SESSION_NULL;
+    str_copy(full_name, full_name_size, program);
+    full_name[full_name_size - 1] = 0;
 
-    pdebug(DEBUG_INFO, "Starting");
+    len = str_length(full_name);
+    if(len + 1 < full_name_size) {
+        full_name[len] = '.';
+        str_copy(&full_name[len + 1], full_name_size - len - 1, name);
+    }
 
-    pdebug(DEBUG_DETAIL, "Warning: not using passed port %d", gw_port);
+    full_name[full_name_size - 1] = 0;
+}
 
-    session = (ab_session_p)rc_alloc(sizeof(struct ab_session_t), session_destroy);
-    if (!session) {
-        pdebug(DEBUG_WARN, "Error allocating new session.");
-        return AB_SESSION_NULL;
-    }
 
-    session->host = str_dup(host);
-    if(!session->host) {
-        pdebug(DEBUG_WARN, "Unable to duplicate host string!");
-        rc_dec(session);
-        return NULL;
-    }
 
-    session->path = str_dup(path);
-    if(path && str_length(path) && !session->path) {
-        pdebug(DEBUG_WARN, "Unable to duplicate path string!");
-        rc_dec(session);
-        return NULL;
+int session_find_or_create(ab_session_p *tag_session, ab_route_p *tag_route, attr attribs)
+{
+    /*int debug = attr_get_int(attribs,"debug",0);*/
+    const char *session_gw = attr_get_str(attribs, "gateway", "");
+    const char *session_path = attr_get_str(attribs, "path", "");
+    int use_connected_msg = attr_get_int(attribs, "use_connected_msg", 0);
+    int session_gw_port = attr_get_int(attribs, "gateway_port", AB_EIP_DEFAULT_PORT);
+    int plc_type = get_plc_type(attribs);
+    ab_session_p session = AB_SESSION_NULL;
+    ab_route_p route = AB_ROUTE_NULL;
+    int new_session = 0;
+    int new_route = 0;
+    int shared_session = attr_get_int(attribs, "share_session", 1); /* share the session by default. */
+    int rc = PLCTAG_STATUS_OK;
+    int auto_disconnect_enabled = 0;
+    int auto_disconnect_timeout_ms = INT_MAX;
+    int pipeline_depth = attr_get_int(attribs, "pipeline_depth", SESSION_DEFAULT_PIPELINE_DEPTH);
+    int packing_window = attr_get_int(attribs, "packing_window", SESSION_DEFAULT_PACKING_WINDOW);
+    int num_connections = attr_get_int(attribs, "connections", SESSION_DEFAULT_CONNECTIONS);
+    int connect_timeout_ms = attr_get_int(attribs, "connect_timeout_ms", SESSION_DEFAULT_CONNECT_TIMEOUT);
+    const char *metadata_file = attr_get_str(attribs, "metadata_cache", NULL);
+
+    pdebug(DEBUG_DETAIL, "Starting");
+
+    if(pipeline_depth < 1 || pipeline_depth > SESSION_MAX_PIPELINE_DEPTH) {
+        pdebug(DEBUG_WARN, "Pipeline depth must be between 1 and %d, got %d.", SESSION_MAX_PIPELINE_DEPTH, pipeline_depth);
+        return PLCTAG_ERR_BAD_PARAM;
     }
 
-    rc = cip_encode_path(path, use_connected_msg, plc_type, &session->conn_path, &session->conn_path_size, &session->dhp_dest);
-    if(rc != PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_INFO,"Unable to convert path links strings to binary path!");
-        rc_dec(session);
-        return NULL;
+    if(packing_window < 1 || packing_window > SESSION_MAX_PACKING_WINDOW) {
+        pdebug(DEBUG_WARN, "Packing window must be between 1 and %d, got %d.", SESSION_MAX_PACKING_WINDOW, packing_window);
+        return PLCTAG_ERR_BAD_PARAM;
     }
 
-    session->requests = vector_create(SESSION_MIN_REQUESTS, SESSION_INC_REQUESTS);
-    if(!session->requests) {
-        pdebug(DEBUG_WARN,"Unable to allocate vector for requests!");
-        rc_dec(session);
-        return NULL;
+    if(num_connections < 1 || num_connections > SESSION_MAX_CONNECTIONS) {
+        pdebug(DEBUG_WARN, "Number of connections must be between 1 and %d, got %d.", SESSION_MAX_CONNECTIONS, num_connections);
+        return PLCTAG_ERR_BAD_PARAM;
     }
 
-    session->plc_type = plc_type;
-    session->data_capacity = MAX_PACKET_SIZE_EX;
-    session->use_connected_msg = use_connected_msg;
-//    session->status = PLCTAG_STATUS_PENDING;
-    session->failed = 0;
-    session->conn_serial_number = (uint16_t)(intptr_t)(session);
+    if(connect_timeout_ms <= 0) {
+        pdebug(DEBUG_WARN, "Connect timeout must be greater than zero, got %d.", connect_timeout_ms);
+        return PLCTAG_ERR_BAD_PARAM;
+    }
 
-    /* check for ID set up. This does not need to be thread safe since we just need a random value. */
-    if(srand_setup == 0) {
-        srand((unsigned int)time_ms());
-        srand_setup = 1;
+    auto_disconnect_timeout_ms = attr_get_int(attribs, "auto_disconnect_ms", INT_MAX);
+    if(auto_disconnect_timeout_ms != INT_MAX) {
+        pdebug(DEBUG_DETAIL,"Setting auto-disconnect after %dms.", auto_disconnect_timeout_ms);
+        auto_disconnect_enabled = 1;
     }
 
-    if(connection_id == 0) {
-        connection_id = (uint32_t)rand();
+    if(plc_type == AB_PROTOCOL_PLC && str_length(session_path) > 0) {
+        /* this means it is DH+ */
+        use_connected_msg = 1;
+        attr_set_int(attribs, "use_connected_msg", 1);
     }
 
-    session->session_seq_id = (uint64_t)rand();
+    critical_block(session_mutex) {
+        /*
+         * if we are to share sessions, then look for an existing one to the
+         * same gateway.  All the CIP paths through the gateway share it.
+         */
+        if (shared_session) {
+            session = find_session_by_host_unsafe(session_gw);
+        } else {
+            /* no sharing, create a new one */
+            session = AB_SESSION_NULL;
+        }
 
-    /* guess the max CIP payload size. */
-    switch(plc_type) {
-    case AB_PROTOCOL_SLC:
-        session->max_payload_size = MAX_CIP_SLC_MSG_SIZE;
-        break;
+        if (session != AB_SESSION_NULL) {
+            route = find_route_unsafe(session, session_path);
 
-    case AB_PROTOCOL_MLGX:
-        session->max_payload_size = MAX_CIP_MLGX_MSG_SIZE;
-        break;
+            if(route == AB_ROUTE_NULL && session->num_routes >= SESSION_MAX_ROUTES) {
+                pdebug(DEBUG_DETAIL, "Session already has %d routes, creating another session.", session->num_routes);
+                rc_dec(session);
+                session = AB_SESSION_NULL;
+            }
+        }
 
-    case AB_PROTOCOL_PLC:
-    case AB_PROTOCOL_LGX_PCCC:
-        session->max_payload_size = MAX_CIP_PLC5_MSG_SIZE;
-        break;
+        if(route == AB_ROUTE_NULL) {
+            route = route_create(session_path, plc_type, use_connected_msg);
+            new_route = 1;
 
-    case AB_PROTOCOL_LGX:
-        session->max_payload_size = MAX_CIP_MSG_SIZE;
-        break;
+            if(route != AB_ROUTE_NULL && metadata_file) {
+                route->metadata = metadata_cache_get(metadata_file);
+                route->metadata_key = metadata_cache_route_key(session_gw, session_path);
+            }
+        }
 
-    case AB_PROTOCOL_MLGX800:
-        session->max_payload_size = MAX_CIP_MSG_SIZE;
-        break;
+        if(route == AB_ROUTE_NULL) {
+            pdebug(DEBUG_WARN, "Unable to create route for path %s!", session_path);
+            rc_dec(session);
+            session = AB_SESSION_NULL;
+            rc = PLCTAG_ERR_BAD_GATEWAY;
+        } else if (session == AB_SESSION_NULL) {
+            pdebug(DEBUG_DETAIL,"Creating new session.");
+            session = session_create_unsafe(session_gw, session_gw_port);
 
-    default:
-        pdebug(DEBUG_WARN,"Unknown protocol/cpu type!");
-        rc_dec(session);
-        return NULL;
-        break;
-    }
+            if (session == AB_SESSION_NULL) {
+                pdebug(DEBUG_WARN, "unable to create or find a session!");
+                route_destroy(route);
+                route = AB_ROUTE_NULL;
+                rc = PLCTAG_ERR_BAD_GATEWAY;
+            } else {
+                session->auto_disconnect_enabled = auto_disconnect_enabled;
+                session->auto_disconnect_timeout_ms = auto_disconnect_timeout_ms;
+                session->pipeline_depth = pipeline_depth;
+                session->packing_window = packing_window;
+                session->connect_timeout_ms = connect_timeout_ms;
 
+                route->num_connections = num_connections;
 
-    /*
-     * Why is connection_id global?  Because it looks like the PLC might
-     * be treating it globally.  I am seeing ForwardOpen errors that seem
-     * to be because of duplicate connection IDs even though the session
-     * was closed.
-     *
-     * So, this is more or less unique across all invocations of the library.
-     * FIXME - this could collide.  The probability is low, but it could happen
-     * as there are only 32 bits.
-     */
-    session->orig_connection_id = ++connection_id;
+                /* no IO thread yet, so no need for the session mutex. */
+                session->routes[0] = route;
+                session->num_routes = 1;
 
-    /* add the new session to the list. */
-    add_session_unsafe(session);
+                new_session = 1;
+            }
+        } else {
+            /* turn on auto disconnect if we need to. */
+            if(!session->auto_disconnect_enabled && auto_disconnect_enabled) {
+                session->auto_disconnect_enabled = auto_disconnect_enabled;
+            }
 
-    pdebug(DEBUG_INFO, "Done");
+            /* disconnect period always goes down. */
+            if(session->auto_disconnect_enabled && session->auto_disconnect_timeout_ms > auto_disconnect_timeout_ms) {
+                session->auto_disconnect_timeout_ms = auto_disconnect_timeout_ms;
+            }
 
-    return session;
-}
+            /* connect timeout always goes down. */
+            if(session->connect_timeout_ms > connect_timeout_ms) {
+                session->connect_timeout_ms = connect_timeout_ms;
+            }
 
+            /* pipeline depth always goes up. */
+            if(session->pipeline_depth < pipeline_depth) {
+                session->pipeline_depth = pipeline_depth;
+            }
 
-/*
- * session_init
- *
- * This calls several blocking methods and so must not keep the main mutex
- * locked during them.
- */
-int session_init(ab_session_p session)
-{
-    int rc = PLCTAG_STATUS_OK;
+            /* so does the packing window. */
+            if(session->packing_window < packing_window) {
+                session->packing_window = packing_window;
+            }
 
-    pdebug(DEBUG_INFO, "Starting.");
+            /* and the number of connections, the new ones are opened when the session is idle. */
+            if(route->num_connections < num_connections) {
+                route->num_connections = num_connections;
+            }
 
-    if((rc = mutex_create(&(session->mutex))) != PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_WARN, "Unable to create session mutex!");
-        session->failed = 1;
-        return rc;
+            /* a new route is picked up by the IO thread on its next tick. */
+            if(new_route) {
+                critical_block(session->mutex) {
+                    session->routes[session->num_routes] = route;
+                    session->num_routes++;
+                }
+
+                pdebug(DEBUG_DETAIL, "Added route %s to existing session.", session_path);
+            }
+
+            pdebug(DEBUG_DETAIL,"Reusing existing session.");
+        }
     }
 
-    if((rc = thread_create((thread_p *)&(session->handler_thread), session_handler, 32*1024, session)) != PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_WARN, "Unable to create session thread!");
-        session->failed = 1;
-        return rc;
+    /*
+     * do this OUTSIDE the mutex in order to let other threads not block if
+     * the session creation process blocks.
+     */
+
+    if(new_session) {
+        rc = session_init(session);
+        if(rc != PLCTAG_STATUS_OK) {
+            rc_dec(session);
+            session = AB_SESSION_NULL;
+            route = AB_ROUTE_NULL;
+        } else {
+            /* save the status */
+            //session->status = rc;
+        }
     }
 
-    pdebug(DEBUG_INFO, "Done.");
+    /* store it into the tag */
+    *tag_session = session;
+    *tag_route = route;
+
+    pdebug(DEBUG_DETAIL, "Done");
 
     return rc;
 }
 
-/*
- * session_open_socket()
- *
- * Connect to the host/port passed via TCP.
- */
 
-int session_open_socket(ab_session_p session)
-{
-    int rc = PLCTAG_STATUS_OK;
 
-    pdebug(DEBUG_INFO, "Starting.");
 
-    /* Open a socket for communication with the gateway. */
-    rc = socket_create(&(session->sock));
+int get_plc_type(attr attribs)
+{
+    const char *cpu_type = attr_get_str(attribs, "plc", attr_get_str(attribs, "cpu", "NONE"));
 
-    if (rc) {
-        pdebug(DEBUG_WARN, "Unable to create socket for session!");
+    if (!str_cmp_i(cpu_type, "plc") || !str_cmp_i(cpu_type, "plc5") || !str_cmp_i(cpu_type, "slc") ||
+        !str_cmp_i(cpu_type, "slc500")) {
+        return AB_PROTOCOL_PLC;
+    } else if (!str_cmp_i(cpu_type, "lgxpccc") || !str_cmp_i(cpu_type, "logixpccc") || !str_cmp_i(cpu_type, "lgxplc5") || !str_cmp_i(cpu_type, "logixplc5") ||
+               !str_cmp_i(cpu_type, "lgx-pccc") || !str_cmp_i(cpu_type, "logix-pccc") || !str_cmp_i(cpu_type, "lgx-plc5") || !str_cmp_i(cpu_type, "logix-plc5")) {
+        return AB_PROTOCOL_LGX_PCCC;
+    } else if (!str_cmp_i(cpu_type, "micrologix800") || !str_cmp_i(cpu_type, "mlgx800") || !str_cmp_i(cpu_type, "micro800")) {
+        return AB_PROTOCOL_MLGX800;
+    } else if (!str_cmp_i(cpu_type, "micrologix") || !str_cmp_i(cpu_type, "mlgx")) {
+        return AB_PROTOCOL_MLGX;
+    } else if (!str_cmp_i(cpu_type, "compactlogix") || !str_cmp_i(cpu_type, "clgx") || !str_cmp_i(cpu_type, "lgx") ||
+               !str_cmp_i(cpu_type, "controllogix") || !str_cmp_i(cpu_type, "contrologix") ||
+               !str_cmp_i(cpu_type, "flexlogix") || !str_cmp_i(cpu_type, "flgx")) {
+        return AB_PROTOCOL_LGX;
+    } else {
+        pdebug(DEBUG_WARN, "Unsupported device type: %s", cpu_type);
+
+        return PLCTAG_ERR_BAD_DEVICE;
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+int add_session_unsafe(ab_session_p session)
+{
+    pdebug(DEBUG_DETAIL, "Starting");
+
+    if (!session) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    vector_put(sessions, vector_length(sessions), session);
+
+//    n->prev = NULL;
+//    n->next = sessions;
+//
+//    if (sessions) {
+//        sessions->prev = n;
+//    }
+//
+//    sessions = n;
+
+    pdebug(DEBUG_DETAIL, "Done");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+int add_session(ab_session_p s)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    critical_block(session_mutex) {
+        rc = add_session_unsafe(s);
+    }
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return rc;
+}
+
+
+
+
+int remove_session_unsafe(ab_session_p session)
+{
+    pdebug(DEBUG_DETAIL, "Starting");
+
+    if (!session || !sessions) {
+        return 0;
+    }
+
+    for(int i=0; i < vector_length(sessions); i++) {
+        ab_session_p tmp = vector_get(sessions, i);
+
+        if(tmp == session) {
+            vector_remove(sessions, i);
+            break;
+        }
+    }
+
+//    tmp = sessions;
+//
+//    while (tmp && tmp != n)
+//        tmp = tmp->next;
+//
+//    if (!tmp || tmp != n) {
+//        pdebug(DEBUG_WARN, "Session not found!");
+//        return PLCTAG_ERR_NOT_FOUND;
+//    }
+//
+//    if (n->next) {
+//        n->next->prev = n->prev;
+//    }
+//
+//    if (n->prev) {
+//        n->prev->next = n->next;
+//    } else {
+//        sessions = n->next;
+//    }
+//
+//    n->next = NULL;
+//    n->prev = NULL;
+
+    pdebug(DEBUG_DETAIL, "Done");
+
+    return PLCTAG_STATUS_OK;
+}
+
+int remove_session(ab_session_p s)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    critical_block(session_mutex) {
+        rc = remove_session_unsafe(s);
+    }
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return rc;
+}
+
+
+int session_match_valid(const char *host, ab_session_p session)
+{
+    if(!session) {
+        return 0;
+    }
+
+//    if(session->status !=  PLCTAG_STATUS_OK && session->status != PLCTAG_STATUS_PENDING) {
+//        return 0;
+//    }
+
+    /* don't use sessions that failed immediately. */
+    if(session->failed) {
+        return 0;
+    }
+
+    if(str_cmp_i(host,session->host)) {
         return 0;
     }
 
-    rc = socket_connect_tcp(session->sock, session->host, AB_EIP_DEFAULT_PORT);
+    return 1;
+}
+
+
+ab_session_p find_session_by_host_unsafe(const char *host)
+{
+    for(int i=0; i < vector_length(sessions); i++) {
+        ab_session_p session = vector_get(sessions, i);
+
+        /* is this session in the process of destruction? */
+        session = rc_inc(session);
+        if(session) {
+            if(session_match_valid(host, session)) {
+                return session;
+            }
+
+            rc_dec(session);
+        }
+    }
+
+    return NULL;
+}
+
+
+
+ab_session_p session_create_unsafe(const char *host, int gw_port)
+{
+    static volatile uint32_t srand_setup = 0;
+
+    ab_session_p session = AB_SESSION_NULL;
+
+    pdebug(DEBUG_INFO, "Starting");
+
+    pdebug(DEBUG_DETAIL, "Warning: not using passed port %d", gw_port);
+
+    session = (ab_session_p)rc_alloc(sizeof(struct ab_session_t), session_destroy);
+    if (!session) {
+        pdebug(DEBUG_WARN, "Error allocating new session.");
+        return AB_SESSION_NULL;
+    }
+
+    session->host = str_dup(host);
+    if(!session->host) {
+        pdebug(DEBUG_WARN, "Unable to duplicate host string!");
+        rc_dec(session);
+        return NULL;
+    }
+
+    /* other threads can find the session as soon as it is in the list. */
+    if(mutex_create(&(session->mutex)) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to create session mutex!");
+        rc_dec(session);
+        return NULL;
+    }
+
+    session->queue_lock = LOCK_INIT;
+
+    session->data_capacity = MAX_PACKET_SIZE_EX;
+
+    session->data = rx_buffer_create(session);
+    if(!session->data) {
+        pdebug(DEBUG_WARN,"Unable to allocate receive buffer!");
+        rc_dec(session);
+        return NULL;
+    }
+
+//    session->status = PLCTAG_STATUS_PENDING;
+    session->failed = 0;
+    session->pipeline_depth = SESSION_DEFAULT_PIPELINE_DEPTH;
+    session->packing_window = SESSION_DEFAULT_PACKING_WINDOW;
+    session->num_in_flight = 0;
+    session->state = SESSION_OPEN_SOCKET;
+
+    /* check for ID set up. This does not need to be thread safe since we just need a random value. */
+    if(srand_setup == 0) {
+        srand((unsigned int)time_ms());
+        srand_setup = 1;
+    }
+
+    session->session_seq_id = (uint64_t)rand();
+
+    /* add the new session to the list. */
+    add_session_unsafe(session);
+
+    pdebug(DEBUG_INFO, "Done");
+
+    return session;
+}
+
+
+
+/*
+ * route_create
+ *
+ * Set up a CIP path through the gateway.  This must be called with the
+ * global session mutex held.
+ */
+ab_route_p route_create(const char *path, int plc_type, int use_connected_msg)
+{
+    static volatile uint32_t connection_id = 0;
+
+    int rc = PLCTAG_STATUS_OK;
+    ab_route_p route = AB_ROUTE_NULL;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    route = (ab_route_p)mem_alloc((int)sizeof(struct ab_route_t));
+    if(!route) {
+        pdebug(DEBUG_WARN, "Unable to allocate new route!");
+        return AB_ROUTE_NULL;
+    }
+
+    route->path = str_dup(path);
+    if(path && str_length(path) && !route->path) {
+        pdebug(DEBUG_WARN, "Unable to duplicate path string!");
+        route_destroy(route);
+        return AB_ROUTE_NULL;
+    }
+
+    rc = cip_encode_path(path, use_connected_msg, plc_type, &route->conn_path, &route->conn_path_size, &route->dhp_dest);
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_INFO,"Unable to convert path links strings to binary path!");
+        route_destroy(route);
+        return AB_ROUTE_NULL;
+    }
+
+    route->plc_type = plc_type;
+    route->use_connected_msg = use_connected_msg;
+    route->num_connections = SESSION_DEFAULT_CONNECTIONS;
+
+    /* guess the max CIP payload size. */
+    switch(plc_type) {
+    case AB_PROTOCOL_SLC:
+        route->max_payload_size = MAX_CIP_SLC_MSG_SIZE;
+        break;
+
+    case AB_PROTOCOL_MLGX:
+        route->max_payload_size = MAX_CIP_MLGX_MSG_SIZE;
+        break;
+
+    case AB_PROTOCOL_PLC:
+    case AB_PROTOCOL_LGX_PCCC:
+        route->max_payload_size = MAX_CIP_PLC5_MSG_SIZE;
+        break;
+
+    case AB_PROTOCOL_LGX:
+        route->max_payload_size = MAX_CIP_MSG_SIZE;
+        break;
+
+    case AB_PROTOCOL_MLGX800:
+        route->max_payload_size = MAX_CIP_MSG_SIZE;
+        break;
+
+    default:
+        pdebug(DEBUG_WARN,"Unknown protocol/cpu type!");
+        route_destroy(route);
+        return AB_ROUTE_NULL;
+        break;
+    }
+
+    if(connection_id == 0) {
+        connection_id = (uint32_t)rand();
+    }
+
+    /*
+     * Why is connection_id global?  Because it looks like the PLC might
+     * be treating it globally.  I am seeing ForwardOpen errors that seem
+     * to be because of duplicate connection IDs even though the session
+     * was closed.
+     *
+     * So, this is more or less unique across all invocations of the library.
+     * FIXME - this could collide.  The probability is low, but it could happen
+     * as there are only 32 bits.
+     *
+     * The serial number must also be different for each connection.
+     */
+    for(int i=0; i < SESSION_MAX_CONNECTIONS; i++) {
+        route->conns[i].orig_connection_id = ++connection_id;
+        route->conns[i].conn_serial_number = (uint16_t)((intptr_t)(route) + i);
+    }
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return route;
+}
+
+
+
+void route_destroy(ab_route_p route)
+{
+    if(!route) {
+        return;
+    }
+
+    if(route->conn_path) {
+        mem_free(route->conn_path);
+        route->conn_path = NULL;
+    }
+
+    if(route->path) {
+        mem_free(route->path);
+        route->path = NULL;
+    }
+
+    if(route->metadata_key) {
+        mem_free(route->metadata_key);
+        route->metadata_key = NULL;
+    }
+
+    forget_symbols_unsafe(route);
+
+    mem_free(route);
+}
+
+
+
+/*
+ * find_route_unsafe
+ *
+ * Look for the route with the passed path in the session.  This must be
+ * called with the global session mutex held.
+ */
+ab_route_p find_route_unsafe(ab_session_p session, const char *path)
+{
+    for(int i=0; i < session->num_routes; i++) {
+        if(!str_cmp_i(path, session->routes[i]->path)) {
+            return session->routes[i];
+        }
+    }
+
+    return AB_ROUTE_NULL;
+}
+
+/*
+ * session_init
+ *
+ * Hand the session over to one of the IO threads.  The thread starts
+ * connecting to the PLC right away.
+ */
+int session_init(ab_session_p session)
+{
+    int rc = PLCTAG_STATUS_OK;
+    struct session_io_t *io = NULL;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    /* spread the sessions across the IO threads. */
+    critical_block(session_mutex) {
+        io = &session_io[session_io_next];
+        session_io_next = (session_io_next + 1) % SESSION_NUM_IO_THREADS;
+    }
+
+    session->io = io;
+
+    critical_block(io->mutex) {
+        session->wake_time = 0;
+        vector_put(io->sessions, vector_length(io->sessions), session);
+    }
+
+    event_loop_wake(io->loop);
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return rc;
+}
+
+/*
+ * session_open_socket()
+ *
+ * Start connecting to the host/port passed via TCP.  Returns
+ * PLCTAG_STATUS_PENDING if the connection is still in progress.
+ */
+
+int session_open_socket(ab_session_p session)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    /* Open a socket for communication with the gateway. */
+    rc = socket_create(&(session->sock));
+
+    if (rc) {
+        pdebug(DEBUG_WARN, "Unable to create socket for session!");
+        return rc;
+    }
+
+    rc = socket_connect_tcp_start(session->sock, session->host, AB_EIP_DEFAULT_PORT);
+
+    if (rc != PLCTAG_STATUS_OK && rc != PLCTAG_STATUS_PENDING) {
+        pdebug(DEBUG_WARN, "Unable to connect socket for session!");
+        return rc;
+    }
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return rc;
+}
+
+
+
+/*
+ * session_register
+ *
+ * Set up the session registration request in the send buffer.
+ */
+int session_register(ab_session_p session)
+{
+    eip_session_reg_req *req;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    /* clear the send buffer. */
+    mem_set(session->send_data, 0, sizeof(eip_session_reg_req));
+
+    req = (eip_session_reg_req *)(session->send_data);
+
+    /* fill in the fields of the request */
+    req->encap_command = h2le16(AB_EIP_REGISTER_SESSION);
+    req->encap_length = h2le16(sizeof(eip_session_reg_req) - sizeof(eip_encap));
+    req->encap_session_handle = h2le32(session->session_handle);
+    req->encap_status = h2le32(0);
+    req->encap_sender_context = h2le64((uint64_t)0);
+    req->encap_options = h2le32(0);
+
+    req->eip_version = h2le16(AB_EIP_VERSION);
+    req->option_flags = h2le16(0);
+
+    session->send_size = sizeof(eip_session_reg_req);
+    session->send_offset = 0;
+    session->send_num_bufs = 0;
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * session_register_check
+ *
+ * Check the session registration response in the receive buffer.
+ */
+int session_register_check(ab_session_p session)
+{
+    eip_encap *resp;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    /* encap header is at the start of the buffer */
+    resp = (eip_encap *)(session->data);
+
+    /* check the response status */
+    if (le2h16(resp->encap_command) != AB_EIP_REGISTER_SESSION) {
+        pdebug(DEBUG_WARN, "EIP unexpected response packet type: %d!", resp->encap_command);
+        return PLCTAG_ERR_BAD_DATA;
+    }
+
+    if (le2h32(resp->encap_status) != AB_EIP_OK) {
+        pdebug(DEBUG_WARN, "EIP command failed, response code: %d", le2h32(resp->encap_status));
+        return PLCTAG_ERR_REMOTE_ERR;
+    }
+
+    /*
+     * after all that, save the session handle, we will
+     * use it in future packets.
+     */
+    session->session_handle = le2h32(resp->encap_session_handle);
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+int session_unregister(ab_session_p session)
+{
+    (void)session;
+
+    pdebug(DEBUG_INFO,"Starting.");
+
+    /* nothing to do, perhaps. */
+
+    pdebug(DEBUG_INFO,"Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+int session_close_socket(ab_session_p session)
+{
+    pdebug(DEBUG_INFO,"Starting.");
+
+    if (session->sock) {
+        if(session->io) {
+            event_loop_unwatch(session->io->loop, session->sock);
+        }
+
+        socket_close(session->sock);
+        socket_destroy(&(session->sock));
+        session->sock = NULL;
+    }
+
+    /* anything partially sent or received is gone. */
+    session->send_size = 0;
+    session->send_offset = 0;
+    session->send_num_bufs = 0;
+    session->send_buf_index = 0;
+    session->data_size = 0;
+    session->data_offset = 0;
+
+    pdebug(DEBUG_INFO,"Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+void session_destroy(void *session_arg)
+{
+    ab_session_p session = session_arg;
+//    ab_request_p req = NULL;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if (!session) {
+        pdebug(DEBUG_WARN, "Session ptr is null!");
+
+        return;
+    }
+
+    /* so remove the session from the list so no one else can reference it. */
+    remove_session(session);
+
+    pdebug(DEBUG_INFO, "Session sent %"PRId64" packets.", session->packet_count);
+    pdebug(DEBUG_INFO, "Session missed %" PRIu64 " of %" PRIu64 " request deadlines, worst by %" PRId64 "ms.",
+           session->deadline_missed,
+           session->deadline_count,
+           session->deadline_max_late_ms);
+
+    /* take the session away from its IO thread first. */
+    if(session->io && session->io->mutex) {
+        critical_block(session->io->mutex) {
+            for(int i=0; i < vector_length(session->io->sessions); i++) {
+                if(vector_get(session->io->sessions, i) == session) {
+                    vector_remove(session->io->sessions, i);
+                    break;
+                }
+            }
+        }
+
+        if(session->sock) {
+            event_loop_unwatch(session->io->loop, session->sock);
+        }
+    }
+
+    /*
+     * Close the connections cleanly if they are up and nothing is half
+     * sent.  No other thread can touch the session now, so just wait
+     * for the responses.  There is still a timeout that applies.
+     */
+    if(session->state == SESSION_IDLE && session->send_offset >= session->send_size) {
+        int rc = PLCTAG_STATUS_OK;
+
+        for(int i=0; rc == PLCTAG_STATUS_OK && i < session->num_routes; i++) {
+            session->conn_route = session->routes[i];
+
+            while(rc == PLCTAG_STATUS_OK && session->conn_route->num_open_connections > 0) {
+                rc = send_forward_close_req(session);
+
+                while(rc == PLCTAG_STATUS_OK) {
+                    rc = session_transact(session);
+
+                    if(rc == PLCTAG_STATUS_PENDING) {
+                        sleep_ms(1);
+                        rc = PLCTAG_STATUS_OK;
+                    } else {
+                        if(rc == PLCTAG_STATUS_OK) {
+                            recv_forward_close_resp(session);
+                        }
+
+                        break;
+                    }
+                }
+
+                session->conn_route->num_open_connections--;
+            }
+        }
+    }
+
+    if(session->session_handle) {
+        session_unregister(session);
+    }
+
+    if(session->sock) {
+        session_close_socket(session);
+    }
+
+    /* release any requests that were never sent. */
+    gather_requests(session);
+
+    while(session->pending) {
+        ab_request_p req = session->pending;
+
+        unlink_request(session, NULL, req);
+
+        rc_dec(req);
+    }
+
+    /* anything still waiting for a response is not going to get one. */
+    fail_all_bundles(session, PLCTAG_ERR_ABORT);
+
+    /* we are done with the mutex, finally destroy it. */
+    if(session->mutex) {
+        mutex_destroy(&(session->mutex));
+        session->mutex = NULL;
+    }
+
+    for(int i=0; i < session->num_routes; i++) {
+        route_destroy(session->routes[i]);
+        session->routes[i] = NULL;
+    }
+
+    session->num_routes = 0;
+
+    if(session->data) {
+        session->data = rc_dec(session->data);
+    }
+
+    if(session->host) {
+        mem_free(session->host);
+        session->host = NULL;
+    }
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return;
+}
+
+
+
+
+/*
+ * session_add_request
+ *
+ * Stamp the request with its deadline and put it at the end of the
+ * session queue.  This is safe to call from any thread.
+ */
+int session_add_request(ab_session_p sess, ab_request_p req)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_DETAIL, "Starting. sess=%p, req=%p", sess, req);
+
+    if(!sess) {
+        pdebug(DEBUG_WARN, "Session is null!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    req = rc_inc(req);
+
+    if(!req) {
+        pdebug(DEBUG_WARN, "Request is either null or in the process of being deleted.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    req->next = NULL;
+    req->deadline = time_ms() + (req->deadline_ms > 0 ? req->deadline_ms : SESSION_DEFAULT_DEADLINE_MS);
+
+    spin_block(&sess->queue_lock) {
+        if(sess->queue_tail) {
+            sess->queue_tail->next = req;
+        } else {
+            sess->queue_head = req;
+        }
+
+        sess->queue_tail = req;
+    }
+
+    /*
+     * ring the doorbell so that the IO thread sends the request right away.
+     * If the doorbell is already ringing, the IO thread will pick up this
+     * request along with the others when it runs.
+     */
+    if(sess->io) {
+        int need_wake = 0;
+
+        critical_block(sess->io->mutex) {
+            need_wake = !sess->wake_requested;
+            sess->wake_requested = 1;
+        }
+
+        if(need_wake) {
+            event_loop_wake(sess->io->loop);
+        }
+    }
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return rc;
+}
+
+
+
+/*
+ * gather_requests
+ *
+ * Move everything in the shared queue into the IO thread's private
+ * list in one step.  The new requests are sorted and merged so that
+ * the list stays in priority and deadline order.  Only call this from
+ * the IO thread.
+ */
+void gather_requests(ab_session_p session)
+{
+    ab_request_p head = NULL;
+    ab_request_p tail = NULL;
+
+    spin_block(&session->queue_lock) {
+        head = session->queue_head;
+        session->queue_head = NULL;
+        session->queue_tail = NULL;
+    }
+
+    if(!head) {
+        return;
+    }
+
+    head = sort_requests(head);
+
+    tail = head;
+    while(tail->next) {
+        tail = tail->next;
+    }
+
+    if(!session->pending) {
+        session->pending = head;
+        session->pending_tail = tail;
+        return;
+    }
+
+    /* usually the new requests all go after the ones already here. */
+    if(!request_before(head, session->pending_tail)) {
+        session->pending_tail->next = head;
+        session->pending_tail = tail;
+        return;
+    }
+
+    session->pending = merge_requests(session->pending, head);
+
+    if(!request_before(tail, session->pending_tail)) {
+        session->pending_tail = tail;
+    }
+}
+
+
+
+/*
+ * request_before
+ *
+ * Should the first request go out before the second?  Higher priority
+ * goes first, then the earlier deadline.
+ */
+int request_before(ab_request_p first, ab_request_p second)
+{
+    if(first->priority != second->priority) {
+        return first->priority > second->priority;
+    }
+
+    return first->deadline < second->deadline;
+}
+
+
+
+/*
+ * merge_requests
+ *
+ * Merge two sorted lists of requests.  On a tie, requests in the first
+ * list go first so that requests stay in the order they were queued.
+ */
+ab_request_p merge_requests(ab_request_p first, ab_request_p second)
+{
+    ab_request_p head = NULL;
+    ab_request_p *tail = &head;
+
+    while(first && second) {
+        if(request_before(second, first)) {
+            *tail = second;
+            second = second->next;
+        } else {
+            *tail = first;
+            first = first->next;
+        }
+
+        tail = &((*tail)->next);
+    }
+
+    *tail = (first ? first : second);
+
+    return head;
+}
+
+
+
+/*
+ * sort_requests
+ *
+ * Stable merge sort of a list of requests.
+ */
+ab_request_p sort_requests(ab_request_p head)
+{
+    ab_request_p middle = head;
+    ab_request_p end = NULL;
+    ab_request_p second = NULL;
+
+    if(!head || !head->next) {
+        return head;
+    }
+
+    for(end = head->next; end && end->next; end = end->next->next) {
+        middle = middle->next;
+    }
+
+    second = middle->next;
+    middle->next = NULL;
+
+    return merge_requests(sort_requests(head), sort_requests(second));
+}
+
+
+
+/*
+ * check_deadline
+ *
+ * Count requests with deadlines as they complete and note the late ones.
+ */
+void check_deadline(ab_session_p session, ab_request_p request)
+{
+    int64_t late_ms = 0;
+
+    if(request->deadline_ms <= 0) {
+        return;
+    }
+
+    session->deadline_count++;
+
+    late_ms = time_ms() - request->deadline;
+
+    spin_block(&deadline_stats_lock) {
+        deadline_stats.count++;
+
+        if(late_ms > 0) {
+            deadline_stats.missed++;
+
+            if(late_ms > deadline_stats.max_late_ms) {
+                deadline_stats.max_late_ms = late_ms;
+            }
+        }
+    }
+
+    if(late_ms > 0) {
+        session->deadline_missed++;
+
+        if(late_ms > session->deadline_max_late_ms) {
+            session->deadline_max_late_ms = late_ms;
+        }
+
+        pdebug(DEBUG_INFO, "Request missed its %dms deadline by %" PRId64 "ms, %" PRIu64 " of %" PRIu64 " missed.",
+               request->deadline_ms,
+               late_ms,
+               session->deadline_missed,
+               session->deadline_count);
+    }
+}
+
+
+
+/*
+ * session_get_deadline_stats
+ *
+ * Copy out the deadline counters of all sessions since the library
+ * started.
+ */
+void session_get_deadline_stats(session_deadline_stats_t *stats)
+{
+    spin_block(&deadline_stats_lock) {
+        *stats = deadline_stats;
+    }
+}
+
+
+
+/*
+ * unlink_request
+ *
+ * Take the request out of the IO thread's private list.  prev is the
+ * request in front of it or NULL if it is first.  The caller takes
+ * over the queue's reference to the request.
+ */
+void unlink_request(ab_session_p session, ab_request_p prev, ab_request_p request)
+{
+    if(prev) {
+        prev->next = request->next;
+    } else {
+        session->pending = request->next;
+    }
+
+    if(session->pending_tail == request) {
+        session->pending_tail = prev;
+    }
+
+    request->next = NULL;
+}
+
+
+
+/*
+ * has_requests
+ *
+ * Is anything waiting to be sent?  Only call this from the IO thread.
+ */
+int has_requests(ab_session_p session)
+{
+    int result = 0;
+
+    if(session->pending) {
+        return 1;
+    }
+
+    spin_block(&session->queue_lock) {
+        result = (session->queue_head != NULL);
+    }
+
+    return result;
+}
+
+
+
+
+/*****************************************************************
+ **************** Session handling functions *********************
+ ****************************************************************/
+
+
+THREAD_FUNC(session_io_handler)
+{
+    struct session_io_t *io = arg;
+    void *ready[SESSION_IO_MAX_BATCH];
+    ab_session_p to_tick[SESSION_IO_MAX_BATCH];
+    int num_ready = 0;
+    int num_to_tick = 0;
+    int64_t next_wake = 0;
+
+    pdebug(DEBUG_INFO, "Starting session IO thread.");
+
+    while(!io->terminating) {
+        int64_t now = time_ms();
+        int timeout_ms = SESSION_IO_MAX_WAIT_MS;
+
+        if(next_wake - now < timeout_ms) {
+            timeout_ms = (next_wake > now) ? (int)(next_wake - now) : 0;
+        }
+
+        num_ready = event_loop_wait(io->loop, ready, SESSION_IO_MAX_BATCH, timeout_ms);
+        if(num_ready < 0) {
+            pdebug(DEBUG_WARN, "Error waiting for socket events %s!", plc_tag_decode_error(num_ready));
+
+            /* do not spin on a broken event loop. */
+            num_ready = 0;
+            sleep_ms(1);
+        }
+
+        if(io->terminating) {
+            break;
+        }
+
+        now = time_ms();
+        num_to_tick = 0;
+
+        /*
+         * find the sessions that need to run.  The ready list can hold
+         * sessions that were destroyed while we waited, so only sessions
+         * still in our list are used.
+         */
+        critical_block(io->mutex) {
+            for(int i=0; i < vector_length(io->sessions) && num_to_tick < SESSION_IO_MAX_BATCH; i++) {
+                ab_session_p session = vector_get(io->sessions, i);
+                int need_tick = (session->wake_time <= now) || session->wake_requested;
+
+                for(int j=0; !need_tick && j < num_ready; j++) {
+                    need_tick = (ready[j] == session);
+                }
+
+                if(need_tick) {
+                    /* is this session in the process of destruction? */
+                    session = rc_inc(session);
+                    if(session) {
+                        /* clear this before the tick so that no doorbell is lost. */
+                        session->wake_requested = 0;
+                        to_tick[num_to_tick] = session;
+                        num_to_tick++;
+                    }
+                }
+            }
+        }
+
+        /* this can cause destroy actions so do this outside the mutex. */
+        for(int i=0; i < num_to_tick; i++) {
+            session_tick(to_tick[i]);
+            to_tick[i] = rc_dec(to_tick[i]);
+        }
+
+        /* when do we need to run again? */
+        next_wake = INT64_MAX;
+
+        critical_block(io->mutex) {
+            for(int i=0; i < vector_length(io->sessions); i++) {
+                ab_session_p session = vector_get(io->sessions, i);
+
+                if(session->wake_requested) {
+                    next_wake = 0;
+                } else if(session->wake_time < next_wake) {
+                    next_wake = session->wake_time;
+                }
+            }
+        }
+    }
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    THREAD_RETURN(0);
+}
+
+
+
+/*
+ * session_tick
+ *
+ * Run the session state machine until it stops changing state, then
+ * update what the IO thread waits for on the session socket.
+ */
+void session_tick(ab_session_p session)
+{
+    session_state_t old_state;
+
+    debug_set_tag_id(0);
+
+    /* pick up any routes added since the last tick. */
+    critical_block(session->mutex) {
+        session->num_io_routes = session->num_routes;
+    }
+
+    do {
+        old_state = session->state;
+
+        /* each state sets its own timer if it needs one. */
+        session->wake_time = INT64_MAX;
+
+        session_run_state(session);
+    } while(session->state != old_state);
+
+    session_update_watch(session);
+}
+
+
+
+void session_run_state(ab_session_p session)
+{
+    int rc = PLCTAG_STATUS_OK;
+    int64_t now = time_ms();
+    ab_route_p route = AB_ROUTE_NULL;
+
+    switch(session->state) {
+    case SESSION_OPEN_SOCKET:
+        pdebug(DEBUG_DETAIL,"in SESSION_OPEN_SOCKET state.");
+
+        /* start connecting to the gateway. */
+        rc = session_open_socket(session);
+        if(rc == PLCTAG_STATUS_PENDING) {
+            session->state_timeout = now + session->connect_timeout_ms;
+            session->wake_time = now + SESSION_CONNECT_POLL_MS;
+            session->state = SESSION_OPEN_SOCKET_WAIT;
+        } else if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "session connect failed %s!", plc_tag_decode_error(rc));
+            session->state = SESSION_CLOSE_SOCKET;
+        } else {
+            /* set the timeout for disconnect. */
+            session->auto_disconnect_time = now + SESSION_DISCONNECT_TIMEOUT;
+            session->state = SESSION_REGISTER;
+        }
+        break;
+
+    case SESSION_OPEN_SOCKET_WAIT:
+        pdebug(DEBUG_SPEW,"in SESSION_OPEN_SOCKET_WAIT state.");
+
+        rc = socket_connect_tcp_check(session->sock, 0);
+        if(rc == PLCTAG_STATUS_OK) {
+            session->auto_disconnect_time = now + SESSION_DISCONNECT_TIMEOUT;
+            session->state = SESSION_REGISTER;
+        } else if(rc != PLCTAG_STATUS_PENDING) {
+            pdebug(DEBUG_WARN, "session connect failed %s!", plc_tag_decode_error(rc));
+            session->state = SESSION_CLOSE_SOCKET;
+        } else if(session->state_timeout <= now) {
+            pdebug(DEBUG_WARN, "Timed out connecting to %s after %dms!", session->host, session->connect_timeout_ms);
+            session->state = SESSION_CLOSE_SOCKET;
+        } else if(session->state_timeout < now + SESSION_CONNECT_POLL_MS) {
+            session->wake_time = session->state_timeout;
+        } else {
+            session->wake_time = now + SESSION_CONNECT_POLL_MS;
+        }
+        break;
+
+    case SESSION_REGISTER:
+        pdebug(DEBUG_DETAIL,"in SESSION_REGISTER state.");
+
+        session_register(session);
+
+        session->state_timeout = now + SESSION_DEFAULT_TIMEOUT;
+        session->state = SESSION_REGISTER_WAIT;
+        break;
+
+    case SESSION_REGISTER_WAIT:
+        pdebug(DEBUG_SPEW,"in SESSION_REGISTER_WAIT state.");
+
+        rc = session_transact(session);
+        if(rc == PLCTAG_STATUS_PENDING) {
+            session->wake_time = session->state_timeout;
+            break;
+        }
+
+        if(rc == PLCTAG_STATUS_OK) {
+            rc = session_register_check(session);
+        }
+
+        if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "session registration failed %s!", plc_tag_decode_error(rc));
+            session->state = SESSION_CLOSE_SOCKET;
+        } else {
+            /* the idle state opens the connections the routes need. */
+            session->state = SESSION_IDLE;
+        }
+        break;
+
+    case SESSION_CONNECT:
+        pdebug(DEBUG_DETAIL,"in SESSION_CONNECT state.");
+
+        if((rc = start_forward_open(session)) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Forward open failed %s!", plc_tag_decode_error(rc));
+            session->state = SESSION_DISCONNECT;
+        } else {
+            session->state = SESSION_CONNECT_WAIT;
+        }
+        break;
+
+    case SESSION_CONNECT_WAIT:
+        pdebug(DEBUG_SPEW,"in SESSION_CONNECT_WAIT state.");
+
+        rc = session_transact(session);
+        if(rc == PLCTAG_STATUS_OK) {
+            /* this may set up another try. */
+            rc = check_forward_open(session);
+        }
+
+        route = session->conn_route;
+
+        if(rc == PLCTAG_STATUS_PENDING) {
+            session->wake_time = session->state_timeout;
+        } else if(rc != PLCTAG_STATUS_OK && route->num_open_connections == 0) {
+            /*
+             * only this route is affected.  The others keep going and this
+             * one tries again later.  If the socket is gone, the idle state
+             * finds out.
+             */
+            pdebug(DEBUG_WARN, "Forward open for path %s failed %s!", route->path, plc_tag_decode_error(rc));
+            route->retry_time = now + RETRY_WAIT_MS;
+            session->state = SESSION_IDLE;
+        } else if(rc != PLCTAG_STATUS_OK) {
+            /* the PLC may limit connections, carry on with the ones we have. */
+            pdebug(DEBUG_WARN, "Unable to open more than %d connections %s!", route->num_open_connections, plc_tag_decode_error(rc));
+            route->num_connections = route->num_open_connections;
+            session->state = SESSION_IDLE;
+        } else {
+            route->num_open_connections++;
+            route->retry_time = 0;
+
+            if(route->num_open_connections < route->num_connections) {
+                pdebug(DEBUG_DETAIL,"forward open succeeded, opening connection %d.", route->num_open_connections + 1);
+                session->state = SESSION_CONNECT;
+            } else {
+                pdebug(DEBUG_DETAIL,"forward open succeeded, going to idle state.");
+                session->state = SESSION_IDLE;
+            }
+        }
+        break;
+
+    case SESSION_IDLE:
+        pdebug(DEBUG_SPEW, "in SESSION_IDLE state.");
+
+        /* if there is work to do, make sure we do not disconnect. */
+        if(session->num_in_flight > 0 || has_requests(session)) {
+            session->auto_disconnect_time = now + SESSION_DISCONNECT_TIMEOUT;
+        }
+
+        /*
+         * a route needs a connection opened.  Forward Open responses are
+         * not matched up with packets in flight, so stop sending and let
+         * the pipeline drain first.
+         */
+        route = route_to_connect(session, now);
+
+        if((rc = process_requests(session, (route ? 0 : get_max_in_flight(session)))) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Error while processing requests %s!", plc_tag_decode_error(rc));
+            session->state = SESSION_DISCONNECT;
+            break;
+        }
+
+        if(route && session->num_in_flight == 0 && session->send_offset >= session->send_size) {
+            pdebug(DEBUG_DETAIL, "Opening connection %d for path %s.", route->num_open_connections + 1, route->path);
+            session->conn_route = route;
+            session->state = SESSION_CONNECT;
+            break;
+        }
+
+        /* check if we should disconnect */
+        if(session->auto_disconnect_time <= time_ms()) {
+            pdebug(DEBUG_DETAIL, "Disconnecting due to inactivity.");
+
+            session->auto_disconnect = 1;
+            session->state = SESSION_DISCONNECT;
+
+            break;
+        }
+
+        /* come back when it is time to disconnect, the oldest packet times out or a route can retry. */
+        session->wake_time = session->auto_disconnect_time;
+
+        for(int i=0; i < session->num_in_flight; i++) {
+            if(session->in_flight[i].time_sent + SESSION_DEFAULT_TIMEOUT < session->wake_time) {
+                session->wake_time = session->in_flight[i].time_sent + SESSION_DEFAULT_TIMEOUT;
+            }
+        }
+
+        for(int i=0; i < session->num_io_routes; i++) {
+            if(session->routes[i]->retry_time > now && session->routes[i]->retry_time < session->wake_time) {
+                session->wake_time = session->routes[i]->retry_time;
+            }
+        }
+
+        break;
+
+    case SESSION_DISCONNECT:
+        pdebug(DEBUG_DETAIL,"in SESSION_DISCONNECT state.");
+
+        /* close the connections one at a time, last route first. */
+        for(int i=session->num_io_routes - 1; i >= 0 && !route; i--) {
+            if(session->routes[i]->num_open_connections > 0) {
+                route = session->routes[i];
+            }
+        }
+
+        /* we cannot send the Forward Close in the middle of another packet. */
+        if(route && session->send_offset >= session->send_size) {
+            session->conn_route = route;
+            send_forward_close_req(session);
+            session->state = SESSION_DISCONNECT_WAIT;
+        } else {
+            for(int i=0; i < session->num_io_routes; i++) {
+                session->routes[i]->num_open_connections = 0;
+            }
+
+            session->state = SESSION_UNREGISTER;
+        }
+        break;
+
+    case SESSION_DISCONNECT_WAIT:
+        pdebug(DEBUG_SPEW,"in SESSION_DISCONNECT_WAIT state.");
+
+        rc = session_transact(session);
+        if(rc == PLCTAG_STATUS_PENDING) {
+            session->wake_time = session->state_timeout;
+            break;
+        }
+
+        if(rc == PLCTAG_STATUS_OK) {
+            rc = recv_forward_close_resp(session);
+        }
+
+        if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Forward close failed %s!", plc_tag_decode_error(rc));
+        }
+
+        /* close the connections one at a time, last first. */
+        session->conn_route->num_open_connections--;
+        session->state = SESSION_DISCONNECT;
+        break;
+
+    case SESSION_UNREGISTER:
+        pdebug(DEBUG_DETAIL,"in SESSION_UNREGISTER state.");
+        if((rc = session_unregister(session)) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Unregistering session failed %s!", plc_tag_decode_error(rc));
+        }
+
+        session->state = SESSION_CLOSE_SOCKET;
+        break;
+
+    case SESSION_CLOSE_SOCKET:
+        pdebug(DEBUG_DETAIL,"in SESSION_CLOSE_SOCKET state.");
+        if((rc = session_close_socket(session)) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Closing session socket failed %s!", plc_tag_decode_error(rc));
+        }
+
+        /* nothing sent on the old connection will be answered now. */
+        fail_all_bundles(session, PLCTAG_ERR_ABORT);
 
-    if (rc != PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_WARN, "Unable to connect socket for session!");
-        return rc;
-    }
+        for(int i=0; i < session->num_io_routes; i++) {
+            session->routes[i]->num_open_connections = 0;
+            session->routes[i]->retry_time = 0;
+        }
 
-    pdebug(DEBUG_INFO, "Done.");
+        /* the PLC may have been downloaded to while we were away. */
+        critical_block(session->mutex) {
+            for(int i=0; i < session->num_io_routes; i++) {
+                if(session->routes[i]->symbols_state != SYMBOLS_UNLISTED) {
+                    forget_symbols_unsafe(session->routes[i]);
+                }
+            }
+        }
 
-    return rc;
-}
+        if(session->auto_disconnect) {
+            session->state = SESSION_WAIT_RECONNECT;
+        } else {
+            session->state = SESSION_START_RETRY;
+        }
 
+        break;
 
+    case SESSION_START_RETRY:
+        pdebug(DEBUG_DETAIL, "in SESSION_START_RETRY state.");
 
-int session_register(ab_session_p session)
-{
-    eip_session_reg_req *req;
-    eip_encap *resp;
-    int rc = PLCTAG_STATUS_OK;
+        /* set up timer for retry. */
 
-    pdebug(DEBUG_INFO, "Starting.");
+        /* FIXME - make this a tag attribute. */
+        session->state_timeout = now + RETRY_WAIT_MS;
 
-    /*
-     * clear the session data.
-     *
-     * We use the receiving buffer because we do not have a request and nothing can
-     * be coming in (we hope) on the socket yet.
-     */
-    mem_set(session->data, 0, sizeof(eip_session_reg_req));
+        /* start waiting. */
+        session->state = SESSION_WAIT_RETRY;
 
-    req = (eip_session_reg_req *)(session->data);
+        break;
 
-    /* fill in the fields of the request */
-    req->encap_command = h2le16(AB_EIP_REGISTER_SESSION);
-    req->encap_length = h2le16(sizeof(eip_session_reg_req) - sizeof(eip_encap));
-    req->encap_session_handle = h2le32(session->session_handle);
-    req->encap_status = h2le32(0);
-    req->encap_sender_context = h2le64((uint64_t)0);
-    req->encap_options = h2le32(0);
+    case SESSION_WAIT_RETRY:
+        pdebug(DEBUG_SPEW, "in SESSION_WAIT_RETRY state.");
 
-    req->eip_version = h2le16(AB_EIP_VERSION);
-    req->option_flags = h2le16(0);
+        if(session->state_timeout <= now) {
+            pdebug(DEBUG_DETAIL, "Transitioning to SESSION_OPEN_SOCKET.");
+            session->state = SESSION_OPEN_SOCKET;
+        } else {
+            session->wake_time = session->state_timeout;
+        }
 
-    /*
-     * socket ops here are _ASYNCHRONOUS_!
-     *
-     * This is done this way because we do not have everything
-     * set up for a request to be handled by the thread.  I think.
-     */
+        break;
 
-    /* send registration to the gateway */
-    session->data_size = sizeof(eip_session_reg_req);
-    session->data_offset = 0;
+    case SESSION_WAIT_RECONNECT:
+        /* wait for at least one request to queue before reconnecting. */
+        pdebug(DEBUG_SPEW, "in SESSION_WAIT_RECONNECT state.");
 
-    rc = send_eip_request(session, SESSION_DEFAULT_TIMEOUT);
-    if(rc != PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_WARN,"Error sending session registration request %s!", plc_tag_decode_error(rc));
-        return rc;
-    }
+        session->auto_disconnect = 0;
 
-    /* get the response from the gateway */
-    rc = recv_eip_response(session, SESSION_DEFAULT_TIMEOUT);
-    if(rc != PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_WARN, "Error receiving session registration response %s!", plc_tag_decode_error(rc));
-        return rc;
-    }
+        /* if there is work to do, reconnect.. */
+        if(has_requests(session)) {
+            pdebug(DEBUG_DETAIL, "There are requests waiting, reopening connection to PLC.");
 
-    /* encap header is at the start of the buffer */
-    resp = (eip_encap *)(session->data);
+            session->state = SESSION_OPEN_SOCKET;
+        }
 
-    /* check the response status */
-    if (le2h16(resp->encap_command) != AB_EIP_REGISTER_SESSION) {
-        pdebug(DEBUG_WARN, "EIP unexpected response packet type: %d!", resp->encap_command);
-        return PLCTAG_ERR_BAD_DATA;
-    }
+        break;
 
-    if (le2h32(resp->encap_status) != AB_EIP_OK) {
-        pdebug(DEBUG_WARN, "EIP command failed, response code: %d", le2h32(resp->encap_status));
-        return PLCTAG_ERR_REMOTE_ERR;
-    }
 
-    /*
-     * after all that, save the session handle, we will
-     * use it in future packets.
-     */
-    session->session_handle = le2h32(resp->encap_session_handle);
+    default:
+        pdebug(DEBUG_ERROR, "Unknown state %d!",session->state);
 
-    pdebug(DEBUG_INFO, "Done.");
+        /* FIXME - this logic is not complete.  We might be here without
+         * a connected session or a registered session. */
+        session->state = SESSION_DISCONNECT;
 
-    return PLCTAG_STATUS_OK;
+        break;
+    }
 }
 
 
-int session_unregister(ab_session_p session)
-{
-    (void)session;
 
-    pdebug(DEBUG_INFO,"Starting.");
+/*
+ * session_update_watch
+ *
+ * We always want to hear about incoming data.  We want to hear about
+ * space in the socket buffers only while we have something to send or
+ * are waiting for the connection to the PLC to complete.
+ */
+void session_update_watch(ab_session_p session)
+{
+    int events = EVENT_LOOP_READ;
+    int rc = PLCTAG_STATUS_OK;
 
-    /* nothing to do, perhaps. */
+    if(!session->sock) {
+        return;
+    }
 
-    pdebug(DEBUG_INFO,"Done.");
+    if(session->state == SESSION_OPEN_SOCKET_WAIT) {
+        events = EVENT_LOOP_WRITE;
+    } else if(session->send_offset < session->send_size) {
+        events |= EVENT_LOOP_WRITE;
+    }
 
-    return PLCTAG_STATUS_OK;
+    rc = event_loop_watch(session->io->loop, session->sock, events, session);
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to watch session socket %s, polling instead!", plc_tag_decode_error(rc));
+        session->wake_time = time_ms() + 1;
+    }
 }
 
 
 
-int session_close_socket(ab_session_p session)
+/*
+ * process_requests
+ *
+ * Send packets until max_in_flight are waiting for responses, then pick
+ * up all the responses that are in.
+ */
+int process_requests(ab_session_p session, int max_in_flight)
 {
-    pdebug(DEBUG_INFO,"Starting.");
+    int rc = PLCTAG_STATUS_OK;
+    int got_response = 0;
 
-    if (session->sock) {
-        socket_close(session->sock);
-        socket_destroy(&(session->sock));
-        session->sock = NULL;
+    debug_set_tag_id(0);
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!session) {
+        pdebug(DEBUG_WARN, "Null session pointer!");
+        return PLCTAG_ERR_NULL_PTR;
     }
 
-    pdebug(DEBUG_INFO,"Done.");
+    pdebug(DEBUG_SPEW, "Checking for requests to process.");
 
-    return PLCTAG_STATUS_OK;
-}
+    debug_set_tag_id(0);
 
+    do {
+        got_response = 0;
 
+        /* finish sending any packet already started, then fill the pipeline. */
+        rc = send_eip_request(session);
 
-void session_destroy(void *session_arg)
-{
-    ab_session_p session = session_arg;
-//    ab_request_p req = NULL;
+        while(rc == PLCTAG_STATUS_OK && session->num_in_flight < max_in_flight) {
+            ab_bundle_t *bundle = &session->in_flight[session->num_in_flight];
 
-    pdebug(DEBUG_INFO, "Starting.");
+            bundle->num_requests = 0;
 
-    if (!session) {
-        pdebug(DEBUG_WARN, "Session ptr is null!");
+            bundle_requests(session, bundle);
 
-        return;
-    }
+            if(bundle->num_requests == 0) {
+                /* nothing to do. */
+                break;
+            }
 
-    /* so remove the session from the list so no one else can reference it. */
-    remove_session(session);
+            pdebug(DEBUG_DETAIL, "%d requests to process.", bundle->num_requests);
 
-    pdebug(DEBUG_INFO, "Session sent %"PRId64" packets.", session->packet_count);
+            rc = send_bundle(session, bundle);
+            if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_STATUS_PENDING) {
+                pdebug(DEBUG_WARN, "Error sending bundle %s!", plc_tag_decode_error(rc));
+                fail_bundle(bundle, rc);
+                break;
+            }
 
-    /* terminate the thread first. */
-    session->terminating = 1;
+            /* the response can come any time once the packet starts going out. */
+            session->num_in_flight++;
 
-    /* get rid of the handler thread. */
-    if(session->handler_thread) {
-        thread_join(session->handler_thread);
-        thread_destroy(&(session->handler_thread));
-        session->handler_thread = NULL;
-    }
+            if(bundle->conn_index >= 0) {
+                bundle->route->conns[bundle->conn_index].num_in_flight++;
+            } else {
+                bundle->route->num_uc_in_flight++;
+            }
 
-    if(session->targ_connection_id) {
-        /*
-         * we do not want the internal loop to immediately
-         * return, so set the flag like we are not terminating.
-         * There is still a timeout that applies.
-         */
-        session->terminating = 0;
-        perform_forward_close(session);
-        session->terminating = 1;
-    }
+            pdebug(DEBUG_DETAIL, "%d packets in flight.", session->num_in_flight);
+        }
 
-    if(session->session_handle) {
-        session_unregister(session);
-    }
+        /* the socket is full, we will be woken when it drains. */
+        if(rc == PLCTAG_STATUS_PENDING) {
+            rc = PLCTAG_STATUS_OK;
+        }
 
-    if(session->sock) {
-        session_close_socket(session);
-    }
+        if(rc != PLCTAG_STATUS_OK) {
+            break;
+        }
 
-    if(session->requests) {
-        for(int i=0; i < vector_length(session->requests); i++) {
-            rc_dec(vector_get(session->requests, i));
+        /*
+         * pick up every response that is ready.  Read even if nothing is
+         * in flight so that we notice when the PLC closes the connection.
+         */
+        while((rc = recv_eip_response(session)) == PLCTAG_STATUS_OK) {
+            rc = recv_bundle_response(session);
+            if(rc != PLCTAG_STATUS_OK) {
+                break;
+            }
+
+            got_response = 1;
         }
 
-        vector_destroy(session->requests);
-        session->requests = NULL;
-    }
+        if(rc == PLCTAG_STATUS_PENDING) {
+            rc = PLCTAG_STATUS_OK;
+        }
+    } while(rc == PLCTAG_STATUS_OK && got_response);
 
-    /* we are done with the mutex, finally destroy it. */
-    if(session->mutex) {
-        mutex_destroy(&(session->mutex));
-        session->mutex = NULL;
-    }
+    /* has anything been waiting too long? */
+    if(rc == PLCTAG_STATUS_OK) {
+        int64_t now = time_ms();
 
-    if(session->conn_path) {
-        mem_free(session->conn_path);
-        session->conn_path = NULL;
+        for(int i=0; i < session->num_in_flight; i++) {
+            if(session->in_flight[i].time_sent + SESSION_DEFAULT_TIMEOUT <= now) {
+                pdebug(DEBUG_WARN, "Timed out waiting for a response!");
+                rc = PLCTAG_ERR_TIMEOUT;
+                break;
+            }
+        }
     }
 
-    if(session->path) {
-        mem_free(session->path);
-        session->path = NULL;
+    /* problem? clean up the pending requests and dump everything. */
+    if(rc != PLCTAG_STATUS_OK) {
+        fail_all_bundles(session, rc);
     }
 
-    if(session->host) {
-        mem_free(session->host);
-        session->host = NULL;
-    }
+    debug_set_tag_id(0);
 
-    pdebug(DEBUG_INFO, "Done.");
+    pdebug(DEBUG_SPEW,"Done.");
 
-    return;
+    return rc;
 }
 
 
 
-
 /*
- * session_add_request_unsafe
+ * get_max_in_flight
  *
- * You must hold the mutex before calling this!
+ * Every open connection gets its own pipeline and so does every route
+ * that only uses unconnected messages.  Connections leave room for
+ * fragment bursts, route_can_send keeps other requests to the pipeline
+ * depth.
  */
-int session_add_request_unsafe(ab_session_p session, ab_request_p req)
+int get_max_in_flight(ab_session_p session)
 {
-    int rc = PLCTAG_STATUS_OK;
-//    ab_request_p cur, prev;
-//    int total_requests = 0;
+    int conn_depth = get_connection_depth(session, 1);
+    int result = 0;
 
-    pdebug(DEBUG_INFO, "Starting.");
+    for(int i=0; i < session->num_io_routes; i++) {
+        ab_route_p route = session->routes[i];
 
-    if(!session) {
-        pdebug(DEBUG_WARN, "Session is null!");
-        return PLCTAG_ERR_NULL_PTR;
+        if(route->use_connected_msg) {
+            result += conn_depth * route->num_open_connections;
+        } else {
+            result += session->pipeline_depth;
+        }
     }
 
-    req = rc_inc(req);
-
-    if(!req) {
-        pdebug(DEBUG_WARN, "Request is either null or in the process of being deleted.");
-        return PLCTAG_ERR_NULL_PTR;
+    if(result == 0) {
+        result = session->pipeline_depth;
     }
 
-    /* make sure the request points to the session */
-    //req->session = sess;
-
-    /* insert into the requests vector */
-    vector_put(session->requests, vector_length(session->requests), req);
-
-    pdebug(DEBUG_INFO,"Total requests in the queue: %d",vector_length(session->requests));
+    return (result < SESSION_MAX_IN_FLIGHT ? result : SESSION_MAX_IN_FLIGHT);
+}
 
-    pdebug(DEBUG_INFO, "Done.");
 
-    return rc;
-}
 
 /*
- * session_add_request
+ * route_to_connect
  *
- * This is a thread-safe version of the above routine.
+ * Find a route that needs another connection opened, if any.  Routes
+ * that failed to connect are skipped until it is time to try again.
  */
-int session_add_request(ab_session_p sess, ab_request_p req)
+ab_route_p route_to_connect(ab_session_p session, int64_t now)
 {
-    int rc = PLCTAG_STATUS_OK;
-
-    pdebug(DEBUG_DETAIL, "Starting. sess=%p, req=%p", sess, req);
+    for(int i=0; i < session->num_io_routes; i++) {
+        ab_route_p route = session->routes[i];
 
-    critical_block(sess->mutex) {
-        rc = session_add_request_unsafe(sess, req);
+        if(route->use_connected_msg
+           && route->num_open_connections < route->num_connections
+           && route->retry_time <= now) {
+            return route;
+        }
     }
 
-    pdebug(DEBUG_DETAIL, "Done.");
-
-    return rc;
+    return AB_ROUTE_NULL;
 }
 
 
+
 /*
- * session_remove_request_unsafe
+ * route_can_send
  *
- * You must hold the mutex before calling this!
+ * Can the request go out now?  Connected requests need an open connection
+ * on their route with room in its pipeline.  Unconnected requests share
+ * one pipeline per route.
  */
-int session_remove_request_unsafe(ab_session_p session, ab_request_p req)
+int route_can_send(ab_session_p session, ab_request_p request)
 {
-    int rc = PLCTAG_STATUS_OK;
-//    ab_request_p cur, prev;
+    ab_route_p route = request->route;
+    int conn_depth = get_connection_depth(session, request->fragment);
 
-    pdebug(DEBUG_DETAIL, "Starting.");
-
-    if(session == NULL || req == NULL) {
-        return rc;
+    if(le2h16(((eip_encap *)(request->data))->encap_command) != AB_EIP_CONNECTED_SEND) {
+        return route->num_uc_in_flight < session->pipeline_depth;
     }
 
-    for(int i=0; i < vector_length(session->requests); i++) {
-        if(vector_get(session->requests, i) == req) {
-            vector_remove(session->requests, i);
-            break;
+    for(int i=0; i < route->num_open_connections; i++) {
+        if(route->conns[i].num_in_flight < conn_depth) {
+            return 1;
         }
     }
 
-    /* release the request refcount */
-    rc_dec(req);
-
-    pdebug(DEBUG_DETAIL, "Done.");
-
-    return rc;
+    return 0;
 }
 
 
 
-/*****************************************************************
- **************** Session handling functions *********************
- ****************************************************************/
-
-
-typedef enum { SESSION_OPEN_SOCKET, SESSION_REGISTER, SESSION_CONNECT,
-               SESSION_IDLE, SESSION_DISCONNECT, SESSION_UNREGISTER,
-               SESSION_CLOSE_SOCKET, SESSION_START_RETRY, SESSION_WAIT_RETRY,
-               SESSION_WAIT_RECONNECT
-             } session_state_t;
-
-
-THREAD_FUNC(session_handler)
+/*
+ * get_connection_depth
+ *
+ * How many packets a connection can have in flight.  Fragments of a
+ * large tag can go deeper than the pipeline depth.
+ */
+int get_connection_depth(ab_session_p session, int fragment)
 {
-    ab_session_p session = arg;
-    int rc = PLCTAG_STATUS_OK;
-    session_state_t state = SESSION_OPEN_SOCKET;
-    int64_t timeout_time = 0;
-    int64_t auto_disconnect_time = 0;
-    int auto_disconnect = 0;
-
-
-    pdebug(DEBUG_INFO, "Starting thread for session %p", session);
-
-    while(!session->terminating) {
-        int idle = 0;
-
-        switch(state) {
-        case SESSION_OPEN_SOCKET:
-            pdebug(DEBUG_DETAIL,"in SESSION_OPEN_SOCKET state.");
-//            session->status = PLCTAG_STATUS_PENDING;
-
-            /* we must connect to the gateway*/
-            if ((rc = session_open_socket(session)) != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "session connect failed %s!", plc_tag_decode_error(rc));
-//                session->status = rc;
-                state = SESSION_CLOSE_SOCKET;
-            } else {
-                /* set the timeout for disconnect. */
-                //if(session->auto_disconnect_enabled) {
-                    auto_disconnect_time = time_ms() + SESSION_DISCONNECT_TIMEOUT;
-                //}
-
-                state = SESSION_REGISTER;
-            }
-            break;
+    if(fragment && session->pipeline_depth < SESSION_FRAGMENT_PIPELINE_DEPTH) {
+        return SESSION_FRAGMENT_PIPELINE_DEPTH;
+    }
 
-        case SESSION_REGISTER:
-            pdebug(DEBUG_DETAIL,"in SESSION_REGISTER state.");
-            if ((rc = session_register(session)) != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "session registration failed %s!", plc_tag_decode_error(rc));
-//                session->status = rc;
-                state = SESSION_CLOSE_SOCKET;
-            } else {
-                if(session->use_connected_msg) {
-                    state = SESSION_CONNECT;
-                } else {
-                    state = SESSION_IDLE;
-                }
-            }
-            break;
+    return session->pipeline_depth;
+}
 
-        case SESSION_CONNECT:
-            pdebug(DEBUG_DETAIL,"in SESSION_CONNECT state.");
-            if((rc = perform_forward_open(session)) != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "Forward open failed %s!", plc_tag_decode_error(rc));
-//                session->status = rc;
-                state = SESSION_UNREGISTER;
-            } else {
-                pdebug(DEBUG_DETAIL,"forward open succeeded, going to idle state.");
-                state = SESSION_IDLE;
-            }
-            break;
 
-        case SESSION_IDLE:
-            pdebug(DEBUG_SPEW, "in SESSION_IDLE state.");
 
-            idle = 1;
-//            session->status = PLCTAG_STATUS_OK;
+/*
+ * bundle_requests
+ *
+ * Fill the passed bundle from the queue.  The first request that can go
+ * out now is taken.  If it can be packed, the next requests within the
+ * packing window are scanned and every packable one that still fits is
+ * taken too (first fit).  A request is never sent ahead of an earlier
+ * request for the same tag that was passed over.  Aborted requests are
+ * dropped as they come up.  Only requests for the same route are packed
+ * together.
+ *
+ * Requests whose route cannot take another packet yet are passed over
+ * without counting against the packing window, so that a stalled route
+ * does not hold up the others.  All later requests of the same kind are
+ * passed over too, which keeps them in order.
+ */
+int bundle_requests(ab_session_p session, ab_bundle_t *bundle)
+{
+    ab_request_p request = NULL;
+    ab_request_p prev = NULL;
+    ab_request_p next = NULL;
+    int max_space = 0;
+    int remaining_space = 0;
+    int skipped_tags[SESSION_MAX_PACKING_WINDOW];
+    int num_skipped = 0;
+    ab_blocked_t blocked[SESSION_MAX_BLOCKED];
+    int num_blocked = 0;
+    int num_passed = 0;
+    int num_scanned = 0;
+    int num_aborted = 0;
+
+    gather_requests(session);
+
+    for(request = session->pending; request && num_scanned < session->packing_window; request = next) {
+        int payload_size = 0;
+        int take = 0;
+
+        next = request->next;
+
+        if(request->abort_request) {
+            unlink_request(session, prev, request);
+            abort_request(request);
+            num_aborted++;
+            continue;
+        }
 
-            /* if there is work to do, make sure we do not disconnect. */
-            critical_block(session->mutex) {
-                if(vector_length(session->requests) > 0) {
-                    auto_disconnect_time = time_ms() + SESSION_DISCONNECT_TIMEOUT;
-                }
-            }
+        /* wait for the route, this does not count against the window. */
+        if(is_blocked(blocked, num_blocked, request)) {
+            num_passed++;
+            prev = request;
+            continue;
+        }
 
-            if((rc = process_requests(session)) != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "Error while processing requests %s!", plc_tag_decode_error(rc));
-//                session->status = rc;
-                idle = 0;
-                if(session->use_connected_msg) {
-                    state = SESSION_DISCONNECT;
-                } else {
-                    state = SESSION_UNREGISTER;
-                }
+        if(!route_can_send(session, request)) {
+            if(num_blocked >= SESSION_MAX_BLOCKED) {
+                /* too many kinds waiting, keep the order of the rest. */
+                break;
             }
 
-            /* check if we should disconnect */
-            //if(session->auto_disconnect_enabled) {
-                if(auto_disconnect_time < time_ms()) {
-                    pdebug(DEBUG_DETAIL, "Disconnecting due to inactivity.");
+            blocked[num_blocked].route = request->route;
+            blocked[num_blocked].connected = (le2h16(((eip_encap *)(request->data))->encap_command) == AB_EIP_CONNECTED_SEND);
+            blocked[num_blocked].fragment = request->fragment;
+            num_blocked++;
 
-                    auto_disconnect = 1;
-                    idle = 0;
+            num_passed++;
+            prev = request;
+            continue;
+        }
 
-                    if(session->use_connected_msg) {
-                        state = SESSION_DISCONNECT;
-                    } else {
-                        state = SESSION_UNREGISTER;
-                    }
-                }
-            //}
+        num_scanned++;
 
-            break;
+        payload_size = get_payload_size(request);
+
+        if(bundle->num_requests == 0) {
+            take = 1;
+        } else if(request->allow_packing && payload_size < remaining_space
+                  && request->route == bundle->requests[0]->route
+                  && le2h16(((eip_encap *)(request->data))->encap_command) == le2h16(((eip_encap *)(bundle->requests[0]->data))->encap_command)) {
+            take = 1;
+        }
 
-        case SESSION_DISCONNECT:
-            pdebug(DEBUG_DETAIL,"in SESSION_DISCONNECT state.");
-            if((rc = perform_forward_close(session)) != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "Forward close failed %s!", plc_tag_decode_error(rc));
-//                session->status = rc;
+        /* keep the order of requests for the same tag. */
+        for(int i=0; take && i < num_skipped; i++) {
+            if(skipped_tags[i] == request->tag_id) {
+                take = 0;
             }
+        }
 
-            state = SESSION_UNREGISTER;
-            break;
+        if(take && bundle->num_requests == 0) {
+            max_space = request->route->max_payload_size - (int)sizeof(cip_multi_req_header);
 
-        case SESSION_UNREGISTER:
-            pdebug(DEBUG_DETAIL,"in SESSION_UNREGISTER state.");
-            if((rc = session_unregister(session)) != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "Unregistering session failed %s!", plc_tag_decode_error(rc));
-//                session->status = rc;
+            /* the Unconnected Send around a packed request and its route path count too. */
+            if(le2h16(((eip_encap *)(request->data))->encap_command) != AB_EIP_CONNECTED_SEND) {
+                max_space -= get_uc_send_overhead(request);
             }
 
-            state = SESSION_CLOSE_SOCKET;
-            break;
+            remaining_space = max_space;
+        }
 
-        case SESSION_CLOSE_SOCKET:
-            pdebug(DEBUG_DETAIL,"in SESSION_CLOSE_SOCKET state.");
-            if((rc = session_close_socket(session)) != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "Closing session socket failed %s!", plc_tag_decode_error(rc));
-//                session->status = rc;
-            }
+        if(take) {
+            unlink_request(session, prev, request);
 
-            if(auto_disconnect) {
-                state = SESSION_WAIT_RECONNECT;
-            } else {
-                state = SESSION_START_RETRY;
+            bundle->requests[bundle->num_requests] = request;
+            bundle->num_requests++;
+
+            remaining_space -= payload_size;
+
+            /* a non-packable request goes alone. */
+            if(!request->allow_packing || remaining_space <= 0 || bundle->num_requests >= MAX_REQUESTS) {
+                break;
             }
+        } else {
+            skipped_tags[num_skipped] = request->tag_id;
+            num_skipped++;
 
-            break;
+            prev = request;
+        }
+    }
 
-        case SESSION_START_RETRY:
-            pdebug(DEBUG_DETAIL, "in SESSION_START_RETRY state.");
+    if(num_aborted > 0) {
+        pdebug(DEBUG_SPEW, "%d requests aborted.", num_aborted);
+        plc_tag_tickler_wake();
+    }
 
-            /* set up timer for retry. */
+    if(bundle->num_requests > 1) {
+        pdebug(DEBUG_DETAIL, "Packed %d requests into %d of %d bytes (%d%% full), passed over %d and %d waiting for their routes.",
+               bundle->num_requests,
+               max_space - remaining_space,
+               max_space,
+               ((max_space - remaining_space) * 100) / max_space,
+               num_skipped,
+               num_passed);
+    }
 
-            /* FIXME - make this a tag attribute. */
-            timeout_time = time_ms() + RETRY_WAIT_MS;
+    return bundle->num_requests;
+}
 
-            /* start waiting. */
-            state = SESSION_WAIT_RETRY;
 
-            break;
 
-        case SESSION_WAIT_RETRY:
-            pdebug(DEBUG_SPEW, "in SESSION_WAIT_RETRY state.");
+/*
+ * is_blocked
+ *
+ * Is the request of a kind that was found unable to go out now?
+ */
+int is_blocked(ab_blocked_t *blocked, int num_blocked, ab_request_p request)
+{
+    int connected = (le2h16(((eip_encap *)(request->data))->encap_command) == AB_EIP_CONNECTED_SEND);
 
-            /* make us sleep on each iteration. */
-            idle = 1;
+    for(int i=0; i < num_blocked; i++) {
+        if(blocked[i].route == request->route
+           && blocked[i].connected == connected
+           && (connected ? blocked[i].fragment == request->fragment : 1)) {
+            return 1;
+        }
+    }
 
-            if(timeout_time < time_ms()) {
-                pdebug(DEBUG_DETAIL, "Transitioning to SESSION_OPEN_SOCKET.");
-                state = SESSION_OPEN_SOCKET;
-            }
+    return 0;
+}
 
-            break;
 
-        case SESSION_WAIT_RECONNECT:
-            /* wait for at least one request to queue before reconnecting. */
-            pdebug(DEBUG_SPEW, "in SESSION_WAIT_RECONNECT state.");
 
-            idle = 1;
-            auto_disconnect = 0;
-//            session->status = PLCTAG_STATUS_OK; /* no error, just waiting. */
+/*
+ * get_uc_send_overhead
+ *
+ * How many bytes of an Unconnected Send are not the embedded message.
+ * That is the Connection Manager request, the pad byte after an odd
+ * length message and the route path with its size and reserved bytes.
+ * Only pack_uc_requests() sets the pad byte, so it is always counted.
+ */
+int get_uc_send_overhead(ab_request_p request)
+{
+    eip_cip_uc_req *uc_req = (eip_cip_uc_req *)(request->data);
+    int cm_size = (int)((uint8_t *)(uc_req + 1) - (uint8_t *)(&uc_req->cm_service_code));
+    int route_size = 0;
 
-            /* if there is work to do, reconnect.. */
-            critical_block(session->mutex) {
-                if(vector_length(session->requests) > 0) {
-                    pdebug(DEBUG_DETAIL, "There are requests waiting, reopening connection to PLC.");
+    if(!is_uc_send(request)) {
+        return 0;
+    }
 
-                    idle = 0;
-                    state = SESSION_OPEN_SOCKET;
-                }
-            }
+    route_size = request->request_size - (int)sizeof(eip_cip_uc_req) - le2h16(uc_req->uc_cmd_length);
 
-            break;
+    return cm_size + 1 + route_size;
+}
 
 
-        default:
-            pdebug(DEBUG_ERROR, "Unknown state %d!",state);
 
-            /* FIXME - this logic is not complete.  We might be here without
-             * a connected session or a registered session. */
-            if(session->use_connected_msg) {
-                state = SESSION_DISCONNECT;
-            } else {
-                state = SESSION_UNREGISTER;
-            }
+/*
+ * abort_request
+ *
+ * Mark a request taken off the queue as aborted and release the
+ * queue's reference to it.
+ */
+void abort_request(ab_request_p request)
+{
+    debug_set_tag_id(request->tag_id);
 
-            break;
-        }
+    pdebug(DEBUG_DETAIL, "Request %p is aborted.", request);
 
-        /*
-         * give up the CPU a bit, but only if we are not
-         * doing some linked states.
-         */
-        if(idle && !session->terminating) {
-            sleep_ms(1);
-        }
+    spin_block(&request->lock) {
+        request->status = PLCTAG_ERR_ABORT;
+        request->request_size = 0;
+        request->resp_received = 1;
     }
 
-    THREAD_RETURN(0);
+    rc_dec(request);
+
+    debug_set_tag_id(0);
 }
 
 
-int process_requests(ab_session_p session)
+
+/*
+ * send_bundle
+ *
+ * Pack the requests in the bundle into the send buffer and start
+ * sending it.  The sequence ID used to match the response is saved
+ * in the bundle.  Returns PLCTAG_STATUS_PENDING if the socket could
+ * not take the whole packet yet.
+ */
+int send_bundle(ab_session_p session, ab_bundle_t *bundle)
 {
     int rc = PLCTAG_STATUS_OK;
-    ab_request_p request = NULL;
-    ab_request_p bundled_requests[MAX_REQUESTS] = {NULL};
-    int num_bundled_requests = 0;
-    ab_request_p aborted_requests[MAX_REQUESTS] = {NULL};
-    int num_aborted_requests = 0;
-    int remaining_space = 0;
+    eip_encap *encap = NULL;
 
-    debug_set_tag_id(0);
+    /* copy and pack the requests into the send buffer. */
+    rc = pack_requests(session, bundle->requests, bundle->num_requests);
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Error while packing requests, %s!", plc_tag_decode_error(rc));
+        return rc;
+    }
 
-    pdebug(DEBUG_SPEW, "Starting.");
+    bundle->route = bundle->requests[0]->route;
 
-    if(!session) {
-        pdebug(DEBUG_WARN, "Null session pointer!");
-        return PLCTAG_ERR_NULL_PTR;
+    /* fill in all the necessary parts to the request. */
+    if((rc = prepare_request(session, bundle)) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to prepare request, %s!", plc_tag_decode_error(rc));
+        return rc;
     }
 
-    pdebug(DEBUG_SPEW, "Checking for requests to process.");
+    /* remember how to find the response. */
+    encap = (eip_encap *)(session->send_data);
+    if(le2h16(encap->encap_command) == AB_EIP_CONNECTED_SEND) {
+        bundle->seq_id = le2h16(((eip_cip_co_req *)(session->send_data))->cpf_conn_seq_num);
+    } else {
+        bundle->seq_id = le2h64(encap->encap_sender_context);
+    }
 
-    rc = PLCTAG_STATUS_OK;
-    request = NULL;
-    session->data_size = 0;
-    session->data_offset = 0;
+    bundle->time_sent = time_ms();
 
-    /* grab a request off the front of the list. */
-    critical_block(session->mutex) {
-        /* is there anything to do? */
-        if(vector_length(session->requests)) {
-            //int blocked = 0;
+    /* send the request */
+    session->send_offset = 0;
 
-            /* remove the aborted requests. */
-            for(int i=0; i < vector_length(session->requests) && num_aborted_requests < MAX_REQUESTS; i++) {
-                request = vector_get(session->requests, i);
+    return send_eip_request(session);
+}
 
-                /* filter out the aborts. */
-                if(request && request->abort_request) {
-                    aborted_requests[num_aborted_requests] = request;
-                    num_aborted_requests++;
 
-                    /* remove it from the queue. */
-                    vector_remove(session->requests, i);
 
-                    /* vector size has changed, back up one. */
-                    i--;
+/*
+ * recv_bundle_response
+ *
+ * Hand the results in the response packet in the receive buffer back
+ * to the requests in the bundle it belongs to.  Responses are matched
+ * by EIP sender context for unconnected messages and by the CPF
+ * connection sequence number for connected messages.
+ */
+int recv_bundle_response(ab_session_p session)
+{
+    int rc = PLCTAG_STATUS_OK;
+    eip_encap *encap = (eip_encap *)(session->data);
+    uint64_t seq_id = 0;
+    ab_route_p route = AB_ROUTE_NULL;
+    int conn_index = -1;
+    int bundle_index = -1;
+    ab_bundle_t *bundle = NULL;
+
+    if(le2h16(encap->encap_command) == AB_EIP_CONNECTED_SEND) {
+        eip_cip_co_resp *resp = (eip_cip_co_resp *)(session->data);
+
+        seq_id = le2h16(resp->cpf_conn_seq_num);
+
+        for(int i=0; i < session->num_io_routes && conn_index < 0; i++) {
+            for(int j=0; j < session->routes[i]->num_open_connections; j++) {
+                if(session->routes[i]->conns[j].orig_connection_id == le2h32(resp->cpf_orig_conn_id)) {
+                    route = session->routes[i];
+                    conn_index = j;
+                    break;
                 }
             }
+        }
 
-            remaining_space = session->max_payload_size - (int)sizeof(cip_multi_req_header);
-
-            /* if there are still requests after purging all the aborted requests, process them. */
-            if(vector_length(session->requests)) {
-                do {
-                    request = vector_get(session->requests, 0);
+        if(conn_index < 0) {
+            pdebug(DEBUG_WARN, "Received response for unknown connection ID %x, dropping it.", le2h32(resp->cpf_orig_conn_id));
+            return PLCTAG_STATUS_OK;
+        }
+    } else {
+        seq_id = session->resp_seq_id;
+    }
 
-                    remaining_space = remaining_space - get_payload_size(request);
+    for(int i=0; i < session->num_in_flight; i++) {
+        if(session->in_flight[i].conn_index == conn_index
+           && (conn_index < 0 || session->in_flight[i].route == route)
+           && session->in_flight[i].seq_id == seq_id) {
+            bundle_index = i;
+            break;
+        }
+    }
 
+    if(bundle_index < 0) {
+        pdebug(DEBUG_WARN, "Received response with sequence ID %" PRIx64 " that does not match any outstanding packet, dropping it.", seq_id);
+        return PLCTAG_STATUS_OK;
+    }
 
-                    /*
-                     * If we have a non-packable request, only queue it if it is the first one.
-                     * If the request is packable, keep queuing as long as there is space.
-                     */
+    bundle = &session->in_flight[bundle_index];
 
-                    if(num_bundled_requests == 0 || (request->allow_packing && remaining_space > 0)) {
-                        //pdebug(DEBUG_DETAIL, "packed %d requests with remaining space %d", num_bundled_requests+1, remaining_space);
-                        bundled_requests[num_bundled_requests] = request;
-                        num_bundled_requests++;
+    pdebug(DEBUG_DETAIL, "Response matched packet with %d requests sent %" PRId64 "ms ago.", bundle->num_requests, time_ms() - bundle->time_sent);
 
-                        /* remove it from the queue. */
-                        vector_remove(session->requests, 0);
-                    }
-                } while(vector_length(session->requests) && remaining_space > 0 && num_bundled_requests < MAX_REQUESTS && request->allow_packing);
-            } else {
-                pdebug(DEBUG_DETAIL, "All requests in queue were aborted, nothing to do.");
+    do {
+        /*
+         * check the CIP status, but only if this is a bundled
+         * response.   If it is a singleton, then we pass the
+         * status back to the tag.
+         */
+        if(bundle->num_requests > 1) {
+            if(le2h16(encap->encap_command) == AB_EIP_UNCONNECTED_SEND) {
+                eip_cip_uc_resp *resp = (eip_cip_uc_resp *)(session->data);
+                pdebug(DEBUG_INFO,"Received unconnected packet with session sequence ID %llx",resp->encap_sender_context);
+
+                /* punt if we got an overall error or it is not a partial/bundled error. */
+                if(resp->status != AB_EIP_OK && resp->status != AB_CIP_ERR_PARTIAL_ERROR) {
+                    rc = decode_cip_error_code(&(resp->status));
+                    pdebug(DEBUG_WARN,"Command failed! (%d/%d) %s", resp->status, rc, plc_tag_decode_error(rc));
+                    break;
+                }
+            } else if(le2h16(encap->encap_command) == AB_EIP_CONNECTED_SEND) {
+                eip_cip_co_resp *resp = (eip_cip_co_resp *)(session->data);
+                pdebug(DEBUG_INFO,"Received connected packet with connection ID %x and sequence ID %u(%x)",le2h32(resp->cpf_orig_conn_id), le2h16(resp->cpf_conn_seq_num), le2h16(resp->cpf_conn_seq_num));
+
+                /* punt if we got an overall error or it is not a partial/bundled error. */
+                if(resp->status != AB_EIP_OK && resp->status != AB_CIP_ERR_PARTIAL_ERROR) {
+                    rc = decode_cip_error_code(&(resp->status));
+                    pdebug(DEBUG_WARN,"Command failed! (%d/%d) %s", resp->status, rc, plc_tag_decode_error(rc));
+                    break;
+                }
             }
         }
-    }
-
-    /* this can cause destroy actions so do this outside the mutex. */
-    if(num_aborted_requests > 0) {
 
-        pdebug(DEBUG_SPEW, "%d requests to abort.", num_aborted_requests);
+        /* copy the results back out. Every request gets a copy. */
+        for(int i=0; i < bundle->num_requests; i++) {
+            debug_set_tag_id(bundle->requests[i]->tag_id);
 
-        for(int i=0; i < num_aborted_requests; i++) {
-            request = aborted_requests[i];
+            check_deadline(session, bundle->requests[i]);
 
-            debug_set_tag_id(request->tag_id);
+            rc = unpack_response(session, bundle->requests[i], i);
+            if(rc != PLCTAG_STATUS_OK) {
+                pdebug(DEBUG_WARN, "Unable to unpack response!");
+                break;
+            }
 
-            pdebug(DEBUG_DETAIL, "Request %p is aborted.", request);
+            /* release our reference */
+            bundle->requests[i] = rc_dec(bundle->requests[i]);
+        }
 
-            request->status = PLCTAG_ERR_ABORT;
-            request->request_size = 0;
-            request->resp_received = 1;
+        debug_set_tag_id(0);
+    } while(0);
 
-            aborted_requests[i] = rc_dec(request);
-        }
+    /* this bundle is done, error or not. */
+    if(rc != PLCTAG_STATUS_OK) {
+        fail_bundle(bundle, rc);
     }
 
-    debug_set_tag_id(0);
+    bundle->num_requests = 0;
 
-    if(num_bundled_requests > 0) {
+    if(conn_index >= 0) {
+        route->conns[conn_index].num_in_flight--;
+    } else {
+        bundle->route->num_uc_in_flight--;
+    }
 
-        pdebug(DEBUG_DETAIL, "%d requests to process.", num_bundled_requests);
+    /* fill the hole with the last bundle in flight. */
+    session->num_in_flight--;
+    if(bundle_index != session->num_in_flight) {
+        mem_copy(bundle, &session->in_flight[session->num_in_flight], (int)sizeof(*bundle));
+    }
 
-        do {
-            /* copy and pack the requests into the session buffer. */
-            rc = pack_requests(session, bundled_requests, num_bundled_requests);
-            if(rc != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "Error while packing requests, %s!", plc_tag_decode_error(rc));
-                break;
-            }
+    return rc;
+}
 
-            /* fill in all the necessary parts to the request. */
-            if((rc = prepare_request(session)) != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "Unable to prepare request, %s!", plc_tag_decode_error(rc));
-                break;
-            }
 
-            /* send the request */
-            if((rc = send_eip_request(session, SESSION_DEFAULT_TIMEOUT)) != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "Error sending packet %s!", plc_tag_decode_error(rc));
-                break;
-            }
 
-            /* wait for the response */
-            if((rc = recv_eip_response(session, SESSION_DEFAULT_TIMEOUT)) != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "Error receiving packet response %s!", plc_tag_decode_error(rc));
-                break;
-            }
+/*
+ * fail_bundle
+ *
+ * Set the passed status on every request still held by the bundle
+ * and release them.
+ */
+void fail_bundle(ab_bundle_t *bundle, int status)
+{
+    for(int i=0; i < bundle->num_requests; i++) {
+        if(bundle->requests[i]) {
+            bundle->requests[i]->status = status;
+            bundle->requests[i]->request_size = 0;
+            bundle->requests[i]->resp_received = 1;
+            plc_tag_wake(bundle->requests[i]->tag_id);
+            bundle->requests[i] = rc_dec(bundle->requests[i]);
+        }
+    }
 
-            /*
-             * check the CIP status, but only if this is a bundled
-             * response.   If it is a singleton, then we pass the
-             * status back to the tag.
-             */
-            if(num_bundled_requests > 1) {
-                if(le2h16(((eip_encap *)(session->data))->encap_command) == AB_EIP_UNCONNECTED_SEND) {
-                    eip_cip_uc_resp *resp = (eip_cip_uc_resp *)(session->data);
-                    pdebug(DEBUG_INFO,"Received unconnected packet with session sequence ID %llx",resp->encap_sender_context);
-
-                    /* punt if we got an overall error or it is not a partial/bundled error. */
-                    if(resp->status != AB_EIP_OK && resp->status != AB_CIP_ERR_PARTIAL_ERROR) {
-                        rc = decode_cip_error_code(&(resp->status));
-                        pdebug(DEBUG_WARN,"Command failed! (%d/%d) %s", resp->status, rc, plc_tag_decode_error(rc));
-                        break;
-                    }
-                } else if(le2h16(((eip_encap *)(session->data))->encap_command) == AB_EIP_CONNECTED_SEND) {
-                    eip_cip_co_resp *resp = (eip_cip_co_resp *)(session->data);
-                    pdebug(DEBUG_INFO,"Received connected packet with connection ID %x and sequence ID %u(%x)",le2h32(resp->cpf_orig_conn_id), le2h16(resp->cpf_conn_seq_num), le2h16(resp->cpf_conn_seq_num));
-
-                    /* punt if we got an overall error or it is not a partial/bundled error. */
-                    if(resp->status != AB_EIP_OK && resp->status != AB_CIP_ERR_PARTIAL_ERROR) {
-                        rc = decode_cip_error_code(&(resp->status));
-                        pdebug(DEBUG_WARN,"Command failed! (%d/%d) %s", resp->status, rc, plc_tag_decode_error(rc));
-                        break;
-                    }
-                }
-            }
+    bundle->num_requests = 0;
+}
 
-            /* copy the results back out. Every request gets a copy. */
-            for(int i=0; i < num_bundled_requests; i++) {
-                debug_set_tag_id(bundled_requests[i]->tag_id);
 
-                rc = unpack_response(session, bundled_requests[i], i);
-                if(rc != PLCTAG_STATUS_OK) {
-                    pdebug(DEBUG_WARN, "Unable to unpack response!");
-                    break;
-                }
 
-                /* release our reference */
-                bundled_requests[i] = rc_dec(bundled_requests[i]);
-            }
+/*
+ * fail_all_bundles
+ *
+ * Nothing in flight is going to get a response.
+ */
+void fail_all_bundles(ab_session_p session, int status)
+{
+    for(int i=0; i < session->num_in_flight; i++) {
+        ab_bundle_t *bundle = &session->in_flight[i];
 
-            rc = PLCTAG_STATUS_OK;
-        } while(0);
+        fail_bundle(bundle, status);
 
-        /* problem? clean up the pending requests and dump everything. */
-        if(rc != PLCTAG_STATUS_OK) {
-            for(int i=0; i < num_bundled_requests; i++) {
-                if(bundled_requests[i]) {
-                    bundled_requests[i]->status = rc;
-                    bundled_requests[i]->request_size = 0;
-                    bundled_requests[i]->resp_received = 1;
-                    bundled_requests[i] = rc_dec(bundled_requests[i]);
-                }
-            }
+        if(bundle->conn_index >= 0) {
+            bundle->route->conns[bundle->conn_index].num_in_flight--;
+        } else {
+            bundle->route->num_uc_in_flight--;
         }
     }
 
-    debug_set_tag_id(0);
-
-    pdebug(DEBUG_SPEW,"Done.");
-
-    return rc;
+    session->num_in_flight = 0;
 }
 
 
 int unpack_response(ab_session_p session, ab_request_p request, int sub_packet)
 {
-    eip_cip_co_resp *packed_resp = (eip_cip_co_resp *)(session->data);
-    eip_cip_co_resp *unpacked_resp = NULL;
+    eip_encap *encap = (eip_encap *)(session->data);
+    int is_connected = (le2h16(encap->encap_command) == AB_EIP_CONNECTED_SEND);
+    uint8_t *reply_service = NULL;
+    int header_size = 0;
     uint8_t *pkt_start = NULL;
     uint8_t *pkt_end = NULL;
     int new_eip_len = 0;
 
     pdebug(DEBUG_DETAIL, "Starting.");
 
-    /* clear out the request data. */
-    mem_set(request->data, 0, request->request_capacity);
+    /* the CIP reply starts in a different place for connected and unconnected messages. */
+    if(is_connected) {
+        reply_service = &((eip_cip_co_resp *)(session->data))->reply_service;
+    } else {
+        reply_service = &((eip_cip_uc_resp *)(session->data))->reply_service;
+    }
+
+    header_size = (int)(reply_service - session->data);
+
+    /*
+     * Only the bytes of the response are ever looked at, so the request
+     * buffer does not need to be cleared first.
+     */
 
     /* change what we do depending on the type. */
-    if(packed_resp->reply_service != (AB_EIP_CMD_CIP_MULTI | AB_EIP_CMD_CIP_OK)) {
-        /* copy the data back into the request buffer. */
+    if(*reply_service != (AB_EIP_CMD_CIP_MULTI | AB_EIP_CMD_CIP_OK)) {
         new_eip_len = (int)session->data_size;
-        pdebug(DEBUG_DETAIL, "Got single response packet.  Copying %d bytes unchanged.", new_eip_len);
 
-        if(new_eip_len > request->request_capacity) {
-            pdebug(DEBUG_WARN,"Request data buffer (%d bytes) smaller than result (%d bytes) from PLC!", request->request_capacity, new_eip_len);
-            return PLCTAG_ERR_TOO_LARGE;
-        }
+        if(new_eip_len >= SESSION_MIN_ZERO_COPY_SIZE || new_eip_len > request->request_capacity) {
+            /*
+             * hand the whole receive buffer to the request.  The session
+             * gets a new one before it reads the next packet.  This also
+             * covers requests made before a larger packet size was
+             * negotiated, whose own buffers are too small.
+             */
+            pdebug(DEBUG_DETAIL, "Got single response packet.  Handing over %d bytes in the receive buffer.", new_eip_len);
+
+            request->resp_buf = session->data;
+            request->resp_data = request->resp_buf;
+            session->data = NULL;
+        } else {
+            /* copy the data back into the request buffer. */
+            pdebug(DEBUG_DETAIL, "Got single response packet.  Copying %d bytes unchanged.", new_eip_len);
 
-        mem_copy(request->data, session->data, new_eip_len);
+            mem_copy(request->data, session->data, new_eip_len);
+            request->resp_data = request->data;
+        }
     } else {
-        cip_multi_resp_header *multi = (cip_multi_resp_header *)(&packed_resp->reply_service);
+        cip_multi_resp_header *multi = (cip_multi_resp_header *)reply_service;
         uint16_t total_responses = le2h16(multi->request_count);
         int pkt_len = 0;
 
@@ -1400,37 +3097,49 @@ int unpack_response(ab_session_p session, ab_request_p request, int sub_packet)
             /* not the last response */
             pkt_end = (uint8_t *)(&multi->request_count) + le2h16(multi->request_offsets[sub_packet + 1]);
         } else {
-            pkt_end = (session->data + le2h16(packed_resp->encap_length) + sizeof(eip_encap));
+            pkt_end = (session->data + le2h16(encap->encap_length) + sizeof(eip_encap));
         }
 
         pkt_len = (int)(pkt_end - pkt_start);
 
-        /* point to the response buffer in a structured way. */
-        unpacked_resp = (eip_cip_co_resp *)(request->data);
-
-        /* copy the header down */
-        mem_copy(request->data, session->data, (int)sizeof(eip_cip_co_resp));
-
         /* size of the new packet */
-        new_eip_len = (uint16_t)(((uint8_t *)(&unpacked_resp->reply_service) + pkt_len) /* end of the packet */
-                                 - (uint8_t *)(request->data));                                      /* start of the packet */
+        new_eip_len = header_size + pkt_len;
 
-        /* too big? */
+        /* too big?  The request was made before a larger packet size was negotiated. */
         if(new_eip_len > request->request_capacity) {
-            pdebug(DEBUG_WARN,"Request data buffer (%d bytes) smaller than result (%d bytes) from PLC!", request->request_capacity, new_eip_len);
-            return PLCTAG_ERR_TOO_LARGE;
+            pdebug(DEBUG_DETAIL, "Request data buffer (%d bytes) smaller than result (%d bytes), using a receive buffer.", request->request_capacity, new_eip_len);
+
+            request->resp_buf = rx_buffer_create(session);
+            if(!request->resp_buf) {
+                pdebug(DEBUG_WARN, "Unable to allocate receive buffer!");
+                return PLCTAG_ERR_NO_MEM;
+            }
+
+            request->resp_data = request->resp_buf;
+        } else {
+            request->resp_data = request->data;
         }
 
-        /* now copy the packet over that. */
-        mem_copy(&unpacked_resp->reply_service, pkt_start, pkt_len);
+        /* copy the header down and then the packet after it. */
+        mem_copy(request->resp_data, session->data, header_size);
+        mem_copy(request->resp_data + header_size, pkt_start, pkt_len);
 
         /* stitch up the packet sizes. */
-        unpacked_resp->cpf_cdi_item_length = h2le16((uint16_t)(pkt_len + (int)sizeof(uint16_le))); /* extra for the connection sequence */
-        unpacked_resp->encap_length = h2le16((uint16_t)(new_eip_len - (uint16_t)sizeof(eip_encap)));
+        if(is_connected) {
+            eip_cip_co_resp *unpacked_resp = (eip_cip_co_resp *)(request->resp_data);
+
+            unpacked_resp->cpf_cdi_item_length = h2le16((uint16_t)(pkt_len + (int)sizeof(uint16_le))); /* extra for the connection sequence */
+            unpacked_resp->encap_length = h2le16((uint16_t)(new_eip_len - (uint16_t)sizeof(eip_encap)));
+        } else {
+            eip_cip_uc_resp *unpacked_resp = (eip_cip_uc_resp *)(request->resp_data);
+
+            unpacked_resp->cpf_udi_item_length = h2le16((uint16_t)pkt_len);
+            unpacked_resp->encap_length = h2le16((uint16_t)(new_eip_len - (uint16_t)sizeof(eip_encap)));
+        }
     }
 
     pdebug(DEBUG_DETAIL, "Unpacked packet:");
-    pdebug_dump_bytes(DEBUG_DETAIL, request->data, new_eip_len);
+    pdebug_dump_bytes(DEBUG_DETAIL, request->resp_data, new_eip_len);
 
     /* notify the reading thread that the request is ready */
     spin_block(&request->lock) {
@@ -1439,6 +3148,8 @@ int unpack_response(ab_session_p session, ab_request_p request, int sub_packet)
         request->resp_received = 1;
     }
 
+    plc_tag_wake(request->tag_id);
+
     pdebug(DEBUG_DETAIL, "Done.");
 
     return PLCTAG_STATUS_OK;
@@ -1474,7 +3185,7 @@ int get_payload_size(ab_request_p request)
     int request_data_size = 0;
     eip_encap *header = (eip_encap *)(request->data);
     eip_cip_co_req *co_req = NULL;
-//    eip_cip_uc_req *uc_req = NULL;
+    eip_cip_uc_req *uc_req = NULL;
 
     if(le2h16(header->encap_command) == AB_EIP_CONNECTED_SEND) {
         co_req = (eip_cip_co_req *)(request->data);
@@ -1483,17 +3194,13 @@ int get_payload_size(ab_request_p request)
                             - 2  /* for connection sequence ID */
                             + 2  /* for multipacket offset */
                             ;
-    }
-//    else if(le2h16(header->encap_command) == AB_EIP_UNCONNECTED_SEND) {
-//        uc_req = (eip_cip_uc_req *)(request->data);
-//        /* get length of new request */
-//        request_data_size = le2h16(uc_req->uc_cmd_length)
-//                            - 2  /* for connection sequence ID */
-//                            + 2  /* for multipacket offset */
-//                            ;
-//
-//    }
-    else {
+    } else if(le2h16(header->encap_command) == AB_EIP_UNCONNECTED_SEND && is_uc_send(request)) {
+        uc_req = (eip_cip_uc_req *)(request->data);
+        /* get length of the embedded request */
+        request_data_size = le2h16(uc_req->uc_cmd_length)
+                            + 2  /* for multipacket offset */
+                            ;
+    } else {
         pdebug(DEBUG_WARN, "Not a supported type EIP packet type %d!", le2h16(header->encap_command));
         request_data_size = INT_MAX;
     }
@@ -1504,30 +3211,57 @@ int get_payload_size(ab_request_p request)
 
 
 
+/*
+ * pack_requests
+ *
+ * Set up the packet for the requests as a list of buffers.  Only the
+ * encapsulation headers and, when there is more than one request, the
+ * multi-service header are built in the send buffer.  The body of each
+ * request is sent straight out of the request's own buffer.
+ */
 int pack_requests(ab_session_p session, ab_request_p *requests, int num_requests)
 {
+    eip_encap *encap = NULL;
     eip_cip_co_req *new_req = NULL;
     eip_cip_co_req *packed_req = NULL;
-    /* FIXME - is this the right way to check? */
-    //int is_connected = (session->conn_serial_number ? 1 : 0);
     int header_size = 0;
+    int multi_header_size = 0;
     cip_multi_req_header *multi_header = NULL;
     int current_offset = 0;
     uint8_t *pkt_start = NULL;
     int pkt_len = 0;
-    uint8_t *first_pkt_data = NULL;
-    uint8_t *next_pkt_data = NULL;
+    int total_size = 0;
 
     pdebug(DEBUG_INFO, "Starting.");
 
     debug_set_tag_id(requests[0]->tag_id);
 
-    /* get the header info from the first request. Just copy the whole thing. */
-    mem_copy(session->data, requests[0]->data, requests[0]->request_size);
-    session->data_size = (uint32_t)requests[0]->request_size;
+    /* get the header info from the first request. */
+    encap = (eip_encap *)(requests[0]->data);
+    if(le2h16(encap->encap_command) == AB_EIP_CONNECTED_SEND) {
+        header_size = (int)sizeof(eip_cip_co_req);
+    } else {
+        header_size = (int)sizeof(eip_encap);
+    }
+
+    if(header_size > requests[0]->request_size) {
+        pdebug(DEBUG_WARN, "Request is too short (%d bytes) to hold its headers!", requests[0]->request_size);
+        debug_set_tag_id(0);
+        return PLCTAG_ERR_BAD_DATA;
+    }
+
+    mem_copy(session->send_data, requests[0]->data, header_size);
 
     /* special case the case where there is just one request. */
     if(num_requests == 1) {
+        session->send_bufs[0].data = session->send_data;
+        session->send_bufs[0].size = header_size;
+        session->send_bufs[1].data = requests[0]->data + header_size;
+        session->send_bufs[1].size = requests[0]->request_size - header_size;
+        session->send_num_bufs = 2;
+        session->send_buf_index = 0;
+        session->send_size = (uint32_t)requests[0]->request_size;
+
         pdebug(DEBUG_INFO, "Only one request, so done.");
 
         debug_set_tag_id(0);
@@ -1535,29 +3269,113 @@ int pack_requests(ab_session_p session, ab_request_p *requests, int num_requests
         return PLCTAG_STATUS_OK;
     }
 
-    /* set up Multi packet header. */
+    if(le2h16(encap->encap_command) != AB_EIP_CONNECTED_SEND) {
+        debug_set_tag_id(0);
+        return pack_uc_requests(session, requests, num_requests);
+    }
+
+    /* set up Multi packet header right after the connected message headers. */
+
+    multi_header_size = (int)(sizeof(cip_multi_req_header)
+                              + (sizeof(uint16_le) * (size_t)num_requests)); /* offsets for each request. */
+
+    pdebug(DEBUG_DETAIL, "header size %d", multi_header_size);
+
+    packed_req = (eip_cip_co_req *)(session->send_data);
+
+    multi_header = (cip_multi_req_header *)(session->send_data + header_size);
+    multi_header->service_code = AB_EIP_CMD_CIP_MULTI;
+    multi_header->req_path_size = 0x02; /* length of path in words */
+    multi_header->req_path[0] = 0x20; /* Class */
+    multi_header->req_path[1] = 0x02; /* CM */
+    multi_header->req_path[2] = 0x24; /* Instance */
+    multi_header->req_path[3] = 0x01; /* #1 */
+    multi_header->request_count = h2le16((uint16_t)num_requests);
+
+    total_size = header_size + multi_header_size;
+
+    session->send_bufs[0].data = session->send_data;
+    session->send_bufs[0].size = total_size;
+    session->send_num_bufs = 1;
+    session->send_buf_index = 0;
+
+    /* offsets are from the request count. */
+    current_offset = (int)(sizeof(uint16_le) + (sizeof(uint16_le) * (size_t)num_requests));
+
+    /* now point to each of the requests. */
+    for(int i=0; i<num_requests; i++) {
+        debug_set_tag_id(requests[i]->tag_id);
+
+        /* set up the offset */
+        multi_header->request_offsets[i] = h2le16((uint16_t)current_offset);
+
+        /* get a pointer to the request. */
+        new_req = (eip_cip_co_req *)(requests[i]->data);
+
+        /* calculate the request start and length */
+        pkt_start = (uint8_t *)(&new_req->cpf_conn_seq_num) + sizeof(new_req->cpf_conn_seq_num);
+        pkt_len = (int)le2h16(new_req->cpf_cdi_item_length) - (int)sizeof(new_req->cpf_conn_seq_num);
+
+        pdebug(DEBUG_DETAIL, "packet %d is of length %d.", i, pkt_len);
+
+        session->send_bufs[session->send_num_bufs].data = pkt_start;
+        session->send_bufs[session->send_num_bufs].size = pkt_len;
+        session->send_num_bufs++;
+
+        /* calculate the next packet info. */
+        current_offset += pkt_len;
+        total_size += pkt_len;
+    }
+
+    /* stitch up the CPF packet length, it includes the connection sequence number. */
+    packed_req->cpf_cdi_item_length = h2le16((uint16_t)(total_size - (header_size - (int)sizeof(packed_req->cpf_conn_seq_num))));
+
+    /* stick up the EIP packet length */
+    packed_req->encap_length = h2le16((uint16_t)((size_t)total_size - sizeof(eip_encap)));
+
+    /* set the total data size */
+    session->send_size = (uint32_t)total_size;
+
+    debug_set_tag_id(0);
+
+    pdebug(DEBUG_INFO, "Done.");
 
-    header_size = (int)(sizeof(cip_multi_req_header)
-                        + (sizeof(uint16_le) * (size_t)num_requests)); /* offsets for each request. */
+    return PLCTAG_STATUS_OK;
+}
 
-    pdebug(DEBUG_DETAIL, "header size %d", header_size);
 
-    packed_req = (eip_cip_co_req *)(session->data);
 
-    /* make room in the request packet in the session for the header. */
-    pkt_start = (uint8_t *)(&packed_req->cpf_conn_seq_num) + sizeof(packed_req->cpf_conn_seq_num);
-    pkt_len = (int)le2h16(packed_req->cpf_cdi_item_length) - (int)sizeof(packed_req->cpf_conn_seq_num);
+/*
+ * pack_uc_requests
+ *
+ * Pack several unconnected requests into one Unconnected Send.  The
+ * embedded message is a multi-service request holding the embedded
+ * message of each request.  Only requests for the same route are packed
+ * together, so the route path from the first request is used.
+ */
+int pack_uc_requests(ab_session_p session, ab_request_p *requests, int num_requests)
+{
+    eip_cip_uc_req *first_req = (eip_cip_uc_req *)(requests[0]->data);
+    eip_cip_uc_req *packed_req = (eip_cip_uc_req *)(session->send_data);
+    int header_size = (int)sizeof(eip_cip_uc_req);
+    int multi_header_size = 0;
+    cip_multi_req_header *multi_header = NULL;
+    int current_offset = 0;
+    int embed_size = 0;
+    uint8_t *route_start = NULL;
+    int route_size = 0;
+    uint8_t *tail = NULL;
+    int tail_size = 0;
+    int total_size = 0;
 
-    pdebug(DEBUG_DETAIL, "packet 0 is of length %d.", pkt_len);
+    pdebug(DEBUG_INFO, "Starting.");
 
-    /* point to where we want the current packet to start. */
-    first_pkt_data = pkt_start + header_size;
+    mem_copy(session->send_data, requests[0]->data, header_size);
 
-    /* move the data over to make room */
-    mem_move(first_pkt_data, pkt_start, pkt_len);
+    multi_header_size = (int)(sizeof(cip_multi_req_header)
+                              + (sizeof(uint16_le) * (size_t)num_requests)); /* offsets for each request. */
 
-    /* now fill in the header. Use pkt_start as it is pointing to the right location. */
-    multi_header = (cip_multi_req_header *)pkt_start;
+    multi_header = (cip_multi_req_header *)(session->send_data + header_size);
     multi_header->service_code = AB_EIP_CMD_CIP_MULTI;
     multi_header->req_path_size = 0x02; /* length of path in words */
     multi_header->req_path[0] = 0x20; /* Class */
@@ -1566,45 +3384,61 @@ int pack_requests(ab_session_p session, ab_request_p *requests, int num_requests
     multi_header->req_path[3] = 0x01; /* #1 */
     multi_header->request_count = h2le16((uint16_t)num_requests);
 
-    /* set up the offset for the first request. */
+    session->send_bufs[0].data = session->send_data;
+    session->send_bufs[0].size = header_size + multi_header_size;
+    session->send_num_bufs = 1;
+    session->send_buf_index = 0;
+
+    embed_size = multi_header_size;
+
+    /* offsets are from the request count. */
     current_offset = (int)(sizeof(uint16_le) + (sizeof(uint16_le) * (size_t)num_requests));
-    multi_header->request_offsets[0] = h2le16((uint16_t)current_offset);
 
-    next_pkt_data = first_pkt_data + pkt_len;
-    current_offset = current_offset + pkt_len;
+    for(int i=0; i<num_requests; i++) {
+        eip_cip_uc_req *uc_req = (eip_cip_uc_req *)(requests[i]->data);
+        int pkt_len = le2h16(uc_req->uc_cmd_length);
 
-    /* now process the rest of the requests. */
-    for(int i=1; i<num_requests; i++) {
         debug_set_tag_id(requests[i]->tag_id);
 
-        /* set up the offset */
+        pdebug(DEBUG_DETAIL, "packet %d is of length %d.", i, pkt_len);
+
         multi_header->request_offsets[i] = h2le16((uint16_t)current_offset);
 
-        /* get a pointer to the request. */
-        new_req = (eip_cip_co_req *)(requests[i]->data);
+        session->send_bufs[session->send_num_bufs].data = requests[i]->data + sizeof(eip_cip_uc_req);
+        session->send_bufs[session->send_num_bufs].size = pkt_len;
+        session->send_num_bufs++;
 
-        /* calculate the request start and length */
-        pkt_start = (uint8_t *)(&new_req->cpf_conn_seq_num) + sizeof(new_req->cpf_conn_seq_num);
-        pkt_len = (int)le2h16(new_req->cpf_cdi_item_length) - (int)sizeof(new_req->cpf_conn_seq_num);
+        current_offset += pkt_len;
+        embed_size += pkt_len;
+    }
 
-        pdebug(DEBUG_DETAIL, "packet %d is of length %d.", i, pkt_len);
+    /* the route path follows the embedded packet of the first request. */
+    route_start = requests[0]->data + sizeof(eip_cip_uc_req) + le2h16(first_req->uc_cmd_length);
+    route_size = requests[0]->request_size - (int)(route_start - requests[0]->data);
 
-        /* copy the request into the session buffer. */
-        mem_copy(next_pkt_data, pkt_start, pkt_len);
+    /* the embedded packet is padded to an even length before the route path. */
+    tail = session->send_data + header_size + multi_header_size;
 
-        /* calculate the next packet info. */
-        next_pkt_data += pkt_len;
-        current_offset += pkt_len;
+    if(embed_size & 0x01) {
+        tail[tail_size] = 0;
+        tail_size++;
     }
 
-    /* stitch up the CPF packet length */
-    packed_req->cpf_cdi_item_length = h2le16((uint16_t)(next_pkt_data - (uint8_t *)(&packed_req->cpf_conn_seq_num)));
+    mem_copy(tail + tail_size, route_start, route_size);
+    tail_size += route_size;
 
-    /* stick up the EIP packet length */
-    packed_req->encap_length = h2le16((uint16_t)((size_t)(next_pkt_data - session->data) - sizeof(eip_encap)));
+    session->send_bufs[session->send_num_bufs].data = tail;
+    session->send_bufs[session->send_num_bufs].size = tail_size;
+    session->send_num_bufs++;
 
-    /* set the total data size */
-    session->data_size = (uint32_t)(next_pkt_data - session->data);
+    total_size = header_size + embed_size + tail_size;
+
+    /* stitch up the lengths. */
+    packed_req->uc_cmd_length = h2le16((uint16_t)embed_size);
+    packed_req->cpf_udi_item_length = h2le16((uint16_t)(total_size - (int)((uint8_t *)(&packed_req->cm_service_code) - session->send_data)));
+    packed_req->encap_length = h2le16((uint16_t)((size_t)total_size - sizeof(eip_encap)));
+
+    session->send_size = (uint32_t)total_size;
 
     debug_set_tag_id(0);
 
@@ -1615,15 +3449,71 @@ int pack_requests(ab_session_p session, ab_request_p *requests, int num_requests
 
 
 
-int prepare_request(ab_session_p session)
+/*
+ * is_uc_send
+ *
+ * Is this an unconnected request wrapped in an Unconnected Send to the
+ * Connection Manager?  Only those can be packed.
+ */
+int is_uc_send(ab_request_p request)
+{
+    eip_cip_uc_req *uc_req = (eip_cip_uc_req *)(request->data);
+
+    if(request->request_size < (int)sizeof(eip_cip_uc_req)) {
+        return 0;
+    }
+
+    return (uc_req->cm_service_code == AB_EIP_CMD_UNCONNECTED_SEND
+            && uc_req->cm_req_path[0] == 0x20
+            && uc_req->cm_req_path[1] == 0x06);
+}
+
+
+
+/*
+ * pick_connection
+ *
+ * Choose the open connection of the route with the fewest packets in
+ * flight for the next connected packet.  Ties go round robin.  Returns
+ * -1 if the route has no open connection.
+ */
+int pick_connection(ab_route_p route)
+{
+    int best = -1;
+
+    for(int i=0; i < route->num_open_connections; i++) {
+        int index = (route->next_connection + i) % route->num_open_connections;
+
+        if(best < 0 || route->conns[index].num_in_flight < route->conns[best].num_in_flight) {
+            best = index;
+        }
+    }
+
+    if(best >= 0) {
+        route->next_connection = (best + 1) % route->num_open_connections;
+    }
+
+    return best;
+}
+
+
+
+/*
+ * prepare_request
+ *
+ * Fill in the session and sequence information of the packet in the
+ * send buffer.  Connected packets are put on one of the open
+ * connections of the bundle's route, which is noted in the bundle.
+ */
+int prepare_request(ab_session_p session, ab_bundle_t *bundle)
 {
     eip_encap *encap = NULL;
     int payload_size = 0;
 
     pdebug(DEBUG_DETAIL, "Starting.");
 
-    encap = (eip_encap *)(session->data);
-    payload_size = (int)session->data_size - (int)sizeof(eip_encap);
+    encap = (eip_encap *)(session->send_data);
+    payload_size = (int)session->send_size - (int)sizeof(eip_encap);
 
     if(!session) {
         pdebug(DEBUG_WARN,"Called with null session!");
@@ -1641,33 +3531,41 @@ int prepare_request(ab_session_p session)
     if(le2h16(encap->encap_command) == AB_EIP_UNCONNECTED_SEND) {
         /* get new ID */
         session->session_seq_id++;
+        bundle->conn_index = -1;
 
         //request->session_seq_id = session->session_seq_id;
         encap->encap_sender_context = h2le64(session->session_seq_id); /* link up the request seq ID and the packet seq ID */
 
         pdebug(DEBUG_INFO,"Preparing unconnected packet with session sequence ID %llx",session->session_seq_id);
     } else if(le2h16(encap->encap_command) == AB_EIP_CONNECTED_SEND) {
-        eip_cip_co_req *conn_req = (eip_cip_co_req *)(session->data);
+        eip_cip_co_req *conn_req = (eip_cip_co_req *)(session->send_data);
+        ab_connection_t *conn = NULL;
+
+        bundle->conn_index = pick_connection(bundle->route);
+        if(bundle->conn_index < 0) {
+            pdebug(DEBUG_WARN, "No open connection for connected packet!");
+            return PLCTAG_ERR_BAD_CONNECTION;
+        }
 
-        pdebug(DEBUG_DETAIL, "cpf_targ_conn_id=%x", session->targ_connection_id);
+        conn = &bundle->route->conns[bundle->conn_index];
+
+        pdebug(DEBUG_DETAIL, "cpf_targ_conn_id=%x", conn->targ_connection_id);
 
         /* set up the connection information */
-        conn_req->cpf_targ_conn_id = h2le32(session->targ_connection_id);
-//        request->conn_id = session->orig_connection_id;
+        conn_req->cpf_targ_conn_id = h2le32(conn->targ_connection_id);
 
-        session->conn_seq_num++;
-        conn_req->cpf_conn_seq_num = h2le16(session->conn_seq_num);
-//        request->conn_seq = session->conn_seq_num;
+        conn->conn_seq_num++;
+        conn_req->cpf_conn_seq_num = h2le16(conn->conn_seq_num);
 
-        pdebug(DEBUG_INFO,"Preparing connected packet with connection ID %x and sequence ID %u(%x)", session->orig_connection_id, session->conn_seq_num, session->conn_seq_num);
+        pdebug(DEBUG_INFO,"Preparing connected packet with connection ID %x and sequence ID %u(%x)", conn->orig_connection_id, conn->conn_seq_num, conn->conn_seq_num);
     } else {
         pdebug(DEBUG_WARN, "Unsupported packet type %x!", le2h16(encap->encap_command));
         return PLCTAG_ERR_UNSUPPORTED;
     }
 
-    /* display the data */
-    pdebug(DEBUG_INFO,"Prepared packet of size %d",session->data_size);
-    pdebug_dump_bytes(DEBUG_INFO, session->data, (int)session->data_size);
+    /* display the headers, the rest is dumped when it is sent. */
+    pdebug(DEBUG_INFO,"Prepared packet of size %d",session->send_size);
+    pdebug_dump_bytes(DEBUG_INFO, session->send_data, (session->send_num_bufs > 0 ? session->send_bufs[0].size : (int)session->send_size));
 
     pdebug(DEBUG_INFO,"Done.");
 
@@ -1677,98 +3575,154 @@ int prepare_request(ab_session_p session)
 
 
 
-int send_eip_request(ab_session_p session, int timeout)
+/*
+ * send_eip_request
+ *
+ * Write as much of the packet in the send buffer as the socket
+ * will take.  Returns PLCTAG_STATUS_PENDING if there is more left
+ * to send.
+ */
+int send_eip_request(ab_session_p session)
 {
     int rc = PLCTAG_STATUS_OK;
-    int64_t timeout_time = 0;
 
-    pdebug(DEBUG_DETAIL, "Starting.");
+    pdebug(DEBUG_SPEW, "Starting.");
 
     if(!session) {
         pdebug(DEBUG_WARN, "Session pointer is null.");
         return PLCTAG_ERR_NULL_PTR;
     }
 
-    if(timeout > 0) {
-        timeout_time = time_ms() + timeout;
-    } else {
-        timeout_time = INT64_MAX;
+    if(session->send_offset >= session->send_size) {
+        /* nothing to send. */
+        return PLCTAG_STATUS_OK;
     }
 
-    pdebug(DEBUG_DETAIL,"Sending packet of size %d",session->data_size);
-    pdebug_dump_bytes(DEBUG_DETAIL, session->data, (int)(session->data_size));
+    if(session->send_offset == 0) {
+        pdebug(DEBUG_DETAIL,"Sending packet of size %d",session->send_size);
 
-    session->data_offset = 0;
-    session->packet_count++;
+        if(session->send_num_bufs > 0) {
+            for(int i=0; i < session->send_num_bufs; i++) {
+                pdebug_dump_bytes(DEBUG_DETAIL, session->send_bufs[i].data, session->send_bufs[i].size);
+            }
+        } else {
+            pdebug_dump_bytes(DEBUG_DETAIL, session->send_data, (int)(session->send_size));
+        }
+
+        session->packet_count++;
+    }
 
     /* send the packet */
-    do {
-        rc = socket_write(session->sock, session->data + session->data_offset, (int)session->data_size - (int)session->data_offset);
+    while(session->send_offset < session->send_size) {
+        if(session->send_num_bufs > 0) {
+            rc = socket_write_bufs(session->sock, &session->send_bufs[session->send_buf_index], session->send_num_bufs - session->send_buf_index);
+        } else {
+            rc = socket_write(session->sock, session->send_data + session->send_offset, (int)session->send_size - (int)session->send_offset);
+        }
 
-        if(rc >= 0) {
-            session->data_offset += (uint32_t)rc;
+        if(rc == 0 || rc == PLCTAG_ERR_NO_DATA) {
+            /* the socket buffer is full, try again later. */
+            return PLCTAG_STATUS_PENDING;
         }
 
-        /* give up the CPU if we still are looping */
-        if(!session->terminating && rc >= 0 && session->data_offset < session->data_size) {
-            sleep_ms(1);
+        if(rc < 0) {
+            pdebug(DEBUG_WARN,"Error, %d, writing socket!", rc);
+            return rc;
         }
-    } while(!session->terminating && rc >= 0 && session->data_offset < session->data_size && timeout_time > time_ms());
 
-    if(session->terminating) {
-        pdebug(DEBUG_WARN, "Session is terminating.");
-        return PLCTAG_ERR_ABORT;
-    }
+        session->send_offset += (uint32_t)rc;
 
-    if(rc < 0) {
-        pdebug(DEBUG_WARN,"Error, %d, writing socket!", rc);
-        return rc;
+        /* step past what was written. */
+        if(session->send_num_bufs > 0) {
+            consume_send_bufs(session, rc);
+        }
     }
 
-    if(timeout_time <= time_ms()) {
-        pdebug(DEBUG_WARN, "Timed out waiting to send data!");
-        return PLCTAG_ERR_TIMEOUT;
-    }
+    /* the buffers point into the requests, do not keep them around. */
+    session->send_num_bufs = 0;
+    session->send_buf_index = 0;
 
-    pdebug(DEBUG_DETAIL, "Done.");
+    pdebug(DEBUG_SPEW, "Done.");
 
     return PLCTAG_STATUS_OK;
 }
 
 
 
+/*
+ * consume_send_bufs
+ *
+ * Move past the bytes that the socket took.  A partly written buffer
+ * is trimmed so the next write starts where this one stopped.
+ */
+void consume_send_bufs(ab_session_p session, int amount)
+{
+    while(amount > 0 && session->send_buf_index < session->send_num_bufs) {
+        sock_buf_t *buf = &session->send_bufs[session->send_buf_index];
+
+        if(amount < buf->size) {
+            buf->data += amount;
+            buf->size -= amount;
+            amount = 0;
+        } else {
+            amount -= buf->size;
+            buf->size = 0;
+            session->send_buf_index++;
+        }
+    }
+}
+
+
+
 /*
  * recv_eip_response
  *
  * Look at the passed session and read any data we can
- * to fill in a packet.  If we already have a full packet,
- * punt.
+ * to fill in a packet.  Returns PLCTAG_STATUS_PENDING until
+ * there is a full packet in the receive buffer.
  */
-int recv_eip_response(ab_session_p session, int timeout)
+int recv_eip_response(ab_session_p session)
 {
-    uint32_t data_needed = 0;
+    uint32_t data_needed = sizeof(eip_encap);
     int rc = PLCTAG_STATUS_OK;
-    int64_t timeout_time = 0;
 
-    pdebug(DEBUG_DETAIL,"Starting.");
+    pdebug(DEBUG_SPEW,"Starting.");
 
     if(!session) {
         pdebug(DEBUG_WARN,"Called with null session!");
         return PLCTAG_ERR_NULL_PTR;
     }
 
+    /* the last packet has been used, start on the next one. */
+    if(session->data_size > 0) {
+        session->data_offset = 0;
+        session->data_size = 0;
+    }
 
-    if(timeout > 0) {
-        timeout_time = time_ms() + timeout;
-    } else {
-        timeout_time = INT64_MAX;
+    /* the last receive buffer may have been handed to a request. */
+    if(!session->data) {
+        session->data = rx_buffer_create(session);
+        if(!session->data) {
+            pdebug(DEBUG_WARN,"Unable to allocate receive buffer!");
+            return PLCTAG_ERR_NO_MEM;
+        }
     }
 
-    session->data_offset = 0;
-    session->data_size = 0;
-    data_needed = sizeof(eip_encap);
+    while(1) {
+        /* recalculate the amount of data needed once we have the encap header */
+        if(session->data_offset >= sizeof(eip_encap)) {
+            data_needed = (uint32_t)(sizeof(eip_encap) + le2h16(((eip_encap *)(session->data))->encap_length));
+
+            if(data_needed > session->data_capacity) {
+                pdebug(DEBUG_WARN,"Packet response (%d) is larger than possible buffer size (%d)!", data_needed, session->data_capacity);
+                return PLCTAG_ERR_TOO_LARGE;
+            }
+
+            if(session->data_offset >= data_needed) {
+                break;
+            }
+        }
 
-    do {
         rc = socket_read(session->sock, session->data + session->data_offset,
                          (int)(data_needed - session->data_offset));
 
@@ -1776,37 +3730,14 @@ int recv_eip_response(ab_session_p session, int timeout)
             /* error! */
             pdebug(DEBUG_WARN,"Error reading socket! rc=%d",rc);
             return rc;
-        } else {
-            session->data_offset += (uint32_t)rc;
-
-            /*pdebug_dump_bytes(session->debug, session->data, session->data_offset);*/
-
-            /* recalculate the amount of data needed if we have just completed the read of an encap header */
-            if(session->data_offset >= sizeof(eip_encap)) {
-                data_needed = (uint32_t)(sizeof(eip_encap) + le2h16(((eip_encap *)(session->data))->encap_length));
-
-                if(data_needed > session->data_capacity) {
-                    pdebug(DEBUG_WARN,"Packet response (%d) is larger than possible buffer size (%d)!", data_needed, session->data_capacity);
-                    return PLCTAG_ERR_TOO_LARGE;
-                }
-            }
         }
 
-        /* did we get all the data? */
-        if(!session->terminating && session->data_offset < data_needed) {
-            /* do not hog the CPU */
-            sleep_ms(1);
+        if(rc == 0) {
+            /* no more data yet. */
+            return PLCTAG_STATUS_PENDING;
         }
-    } while(!session->terminating && session->data_offset < data_needed && timeout_time > time_ms());
 
-    if(session->terminating) {
-        pdebug(DEBUG_INFO,"Session is terminating, returning...");
-        return PLCTAG_ERR_ABORT;
-    }
-
-    if(timeout_time <= time_ms()) {
-        pdebug(DEBUG_WARN, "Timed out waiting for data to read!");
-        return PLCTAG_ERR_TIMEOUT;
+        session->data_offset += (uint32_t)rc;
     }
 
     session->resp_seq_id = le2h64(((eip_encap *)(session->data))->encap_sender_context);
@@ -1823,185 +3754,171 @@ int recv_eip_response(ab_session_p session, int timeout)
         rc = PLCTAG_ERR_BAD_STATUS;
     }
 
-    pdebug(DEBUG_DETAIL, "Done.");
+    pdebug(DEBUG_SPEW, "Done.");
 
     return rc;
 }
 
 
 
-int perform_forward_open(ab_session_p session)
+/*
+ * session_transact
+ *
+ * Send the packet in the send buffer and get the response.  This is
+ * only used to set up and tear down the connection when nothing else
+ * is going on.  Returns PLCTAG_STATUS_PENDING until the response is
+ * in or the state timeout passes.
+ */
+int session_transact(ab_session_p session)
 {
     int rc = PLCTAG_STATUS_OK;
-    int max_payload_size = session->max_payload_size;
-
-    pdebug(DEBUG_INFO, "Starting.");
-
-    do {
-        /*
-         * Try with a large packet if this is a Logix-class PLC
-         * and we are doing connected messaging.
-         */
 
-        if(session->plc_type == AB_PROTOCOL_LGX && session->use_connected_msg) {
-            max_payload_size = MAX_CIP_MSG_SIZE_EX;
-        }
-
-        rc = try_forward_open_ex(session, &max_payload_size);
-        if(rc == PLCTAG_ERR_TOO_LARGE) {
-            /* we support the Forward Open Extended command, but we need to use a smaller size. */
-            pdebug(DEBUG_DETAIL,"ForwardOpenEx is supported but packet size of %d is not, trying %d.", MAX_CIP_MSG_SIZE_EX, max_payload_size);
-
-            rc = try_forward_open_ex(session, &max_payload_size);
-            if(rc != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN,"Unable to open connection to PLC (%s)!", plc_tag_decode_error(rc));
-            } else {
-                pdebug(DEBUG_DETAIL,"ForwardOpenEx succeeded with packet size %d.", session->max_payload_size);
-            }
-        } else if(rc == PLCTAG_ERR_UNSUPPORTED) {
-            rc = try_forward_open(session);
-            if(rc == PLCTAG_ERR_TOO_LARGE) {
-                /* we support the Forward Open Extended command, but we need to use a smaller size. */
-                pdebug(DEBUG_DETAIL,"ForwardOpen is supported but packet size of %d is not, trying %d.", MAX_CIP_MSG_SIZE, session->max_payload_size);
-
-                rc = try_forward_open(session);
-                if(rc != PLCTAG_STATUS_OK) {
-                    pdebug(DEBUG_WARN,"Unable to open connection to PLC (%s)!", plc_tag_decode_error(rc));
-                } else {
-                    pdebug(DEBUG_DETAIL,"ForwardOpen succeeded with packet size %d.", session->max_payload_size);
-                }
-            }
-        } /*else {
-            pdebug(DEBUG_WARN, "Unknown error! rc=%d", rc);
-        }*/
-    } while(0);
+    rc = send_eip_request(session);
 
     if(rc == PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_DETAIL, "ForwardOpen succeeded and maximum CIP packet size is %d.", session->max_payload_size);
+        rc = recv_eip_response(session);
     }
 
-    //session->status = rc;
-
-    pdebug(DEBUG_INFO, "Done.");
+    if(rc == PLCTAG_STATUS_PENDING && session->state_timeout <= time_ms()) {
+        pdebug(DEBUG_WARN, "Timed out waiting for response!");
+        rc = PLCTAG_ERR_TIMEOUT;
+    }
 
     return rc;
 }
 
 
-int perform_forward_close(ab_session_p session)
+
+/*
+ * start_forward_open
+ *
+ * Set up the first Forward Open request for the next connection of the
+ * route being connected.  Try with a large packet if this is the first
+ * connection to a Logix-class PLC and we are doing connected messaging.
+ */
+int start_forward_open(ab_session_p session)
 {
-    int rc = PLCTAG_STATUS_OK;
+    ab_route_p route = session->conn_route;
 
     pdebug(DEBUG_INFO, "Starting.");
 
-    do {
-        rc = send_forward_close_req(session);
-        if(rc != PLCTAG_STATUS_OK) {
-            pdebug(DEBUG_DETAIL,"Sending forward close failed, %s!",plc_tag_decode_error(rc));
-            break;
-        }
-
-        rc = recv_forward_close_resp(session);
-        if(rc != PLCTAG_STATUS_OK) {
-            pdebug(DEBUG_DETAIL,"Forward close not received, %s!", plc_tag_decode_error(rc));
-            break;
-        }
-    } while(0);
-
-    pdebug(DEBUG_INFO, "Done.");
+    critical_block(session->mutex) {
+        session->fo_old_max_payload_size = route->max_payload_size;
+    }
 
-    return rc;
-}
+    /* later connections use whatever the first one worked out. */
+    if(route->num_open_connections > 0) {
+        session->fo_retried = 1;
+        session->fo_size_guess = session->fo_old_max_payload_size;
 
+        pdebug(DEBUG_INFO, "Done.");
 
-int try_forward_open_ex(ab_session_p session, int *packet_size_guess)
-{
-    int rc = PLCTAG_STATUS_OK;
-    ab_request_p req=NULL;
-    uint16_t old_max_payload_size = 0;
+        return (session->fo_use_ex ? send_forward_open_req_ex(session) : send_forward_open_req(session));
+    }
 
+    session->fo_use_ex = 1;
+    session->fo_retried = 0;
+    session->fo_size_guess = session->fo_old_max_payload_size;
+    session->fo_from_cache = 0;
 
-    pdebug(DEBUG_INFO,"Starting.");
+    /* skip the probing if an earlier run already did it. */
+    if(route->metadata && route->metadata_key) {
+        int use_ex = 0;
+        int max_payload_size = 0;
 
-    critical_block(session->mutex) {
-        old_max_payload_size = session->max_payload_size;
-        session->max_payload_size = (uint16_t)*packet_size_guess;
-    }
+        if(metadata_cache_get_route(route->metadata, route->metadata_key, &use_ex, &max_payload_size) == PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_DETAIL, "Using cached ForwardOpen%s with packet size %d.", (use_ex ? "Ex" : ""), max_payload_size);
 
-    /* get a request buffer */
-    rc = session_create_request(session, 0, &req);
+            session->fo_use_ex = use_ex;
+            session->fo_size_guess = max_payload_size;
+            session->fo_from_cache = 1;
 
-    do {
-        if(rc != PLCTAG_STATUS_OK) {
-            pdebug(DEBUG_WARN,"Unable to get new request, %s!",plc_tag_decode_error(rc));
-            rc = 0;
-            break;
-        }
+            if(!use_ex) {
+                critical_block(session->mutex) {
+                    route->max_payload_size = (uint16_t)max_payload_size;
+                }
+            }
 
-        /* send the ForwardOpenEx command to the PLC */
-        if((rc = send_forward_open_req_ex(session)) != PLCTAG_STATUS_OK) {
-            pdebug(DEBUG_WARN,"Unable to send ForwardOpenEx packet!");
-            break;
-        }
+            pdebug(DEBUG_INFO, "Done.");
 
-        /* check for the ForwardOpen response. */
-        if((rc = recv_forward_open_resp(session, packet_size_guess)) != PLCTAG_STATUS_OK) {
-            pdebug(DEBUG_WARN,"Unable to use ForwardOpen response!");
-            break;
+            return (use_ex ? send_forward_open_req_ex(session) : send_forward_open_req(session));
         }
-    } while(0);
-
-    if(req) {
-        req = rc_dec(req);
     }
 
-    if(rc != PLCTAG_STATUS_OK) {
-        critical_block(session->mutex) {
-            session->max_payload_size = old_max_payload_size;
-        }
+    if(route->plc_type == AB_PROTOCOL_LGX && route->use_connected_msg) {
+        session->fo_size_guess = MAX_CIP_MSG_SIZE_EX;
     }
 
-    pdebug(DEBUG_INFO,"Done.");
+    pdebug(DEBUG_INFO, "Done.");
 
-    return rc;
+    return send_forward_open_req_ex(session);
 }
 
 
-int try_forward_open(ab_session_p session)
+
+/*
+ * check_forward_open
+ *
+ * Look at the Forward Open response.  If the PLC supports Forward Open
+ * Extended but not our packet size, try once more with the size it
+ * tells us.  If it does not support Forward Open Extended at all, fall
+ * back to the old Forward Open.  Returns PLCTAG_STATUS_PENDING if
+ * another request was set up.
+ */
+int check_forward_open(ab_session_p session)
 {
     int rc = PLCTAG_STATUS_OK;
-    ab_request_p req=NULL;
 
-    pdebug(DEBUG_INFO,"Starting.");
+    pdebug(DEBUG_INFO, "Starting.");
 
-    /* get a request buffer */
-    rc = session_create_request(session, 0, &req);
+    rc = recv_forward_open_resp(session, (session->fo_use_ex ? &session->fo_size_guess : NULL));
+    if(rc == PLCTAG_STATUS_OK) {
+        ab_route_p route = session->conn_route;
 
-    do {
-        if(rc != PLCTAG_STATUS_OK) {
-            pdebug(DEBUG_WARN,"Unable to get new request, %s!",plc_tag_decode_error(rc));
-            rc = 0;
-            break;
-        }
+        pdebug(DEBUG_DETAIL, "ForwardOpen succeeded and maximum CIP packet size is %d.", route->max_payload_size);
 
-        /* send the ForwardOpen command to the PLC */
-        if((rc = send_forward_open_req(session)) != PLCTAG_STATUS_OK) {
-            pdebug(DEBUG_WARN,"Unable to send ForwardOpenEx packet!");
-            break;
+        if(route->metadata && route->metadata_key) {
+            metadata_cache_put_route(route->metadata, route->metadata_key, session->fo_use_ex, session_get_max_payload(session, route));
         }
 
-        /* check for the ForwardOpen response. */
-        if((rc = recv_forward_open_resp(session, NULL)) != PLCTAG_STATUS_OK) {
-            pdebug(DEBUG_WARN,"Unable to use ForwardOpen response!");
-            break;
+        return rc;
+    }
+
+    /* put back the packet size from before we tried. */
+    critical_block(session->mutex) {
+        session->conn_route->max_payload_size = session->fo_old_max_payload_size;
+    }
+
+    if(rc == PLCTAG_ERR_TOO_LARGE && session->fo_use_ex && !session->fo_retried) {
+        /* we support the Forward Open Extended command, but we need to use a smaller size. */
+        pdebug(DEBUG_DETAIL,"ForwardOpenEx is supported but packet size of %d is not, trying %d.", MAX_CIP_MSG_SIZE_EX, session->fo_size_guess);
+
+        session->fo_retried = 1;
+        rc = send_forward_open_req_ex(session);
+    } else if(rc == PLCTAG_ERR_UNSUPPORTED && session->fo_use_ex) {
+        pdebug(DEBUG_DETAIL,"ForwardOpenEx is not supported, trying ForwardOpen.");
+
+        session->fo_use_ex = 0;
+        rc = send_forward_open_req(session);
+    } else {
+        pdebug(DEBUG_WARN,"Unable to open connection to PLC (%s)!", plc_tag_decode_error(rc));
+
+        /* the PLC may have changed since the sizes were cached. */
+        if(session->fo_from_cache) {
+            ab_route_p route = session->conn_route;
+
+            metadata_cache_remove(route->metadata, route->metadata_key);
+            session->fo_from_cache = 0;
         }
-    } while(0);
 
-    if(req) {
-        req = rc_dec(req);
+        return rc;
     }
 
-    pdebug(DEBUG_INFO,"Done.");
+    if(rc == PLCTAG_STATUS_OK) {
+        rc = PLCTAG_STATUS_PENDING;
+    }
+
+    pdebug(DEBUG_INFO, "Done.");
 
     return rc;
 }
@@ -2011,21 +3928,22 @@ int try_forward_open(ab_session_p session)
 int send_forward_open_req(ab_session_p session)
 {
     eip_forward_open_request_t *fo = NULL;
+    ab_route_p route = session->conn_route;
+    ab_connection_t *conn = &route->conns[route->num_open_connections];
     uint8_t *data;
-    int rc = PLCTAG_STATUS_OK;
 
     pdebug(DEBUG_INFO,"Starting");
 
-    mem_set(session->data, 0, (int)(sizeof(*fo) + session->conn_path_size));
+    mem_set(session->send_data, 0, (int)(sizeof(*fo) + route->conn_path_size));
 
-    fo = (eip_forward_open_request_t *)(session->data);
+    fo = (eip_forward_open_request_t *)(session->send_data);
 
     /* point to the end of the struct */
-    data = (session->data) + sizeof(eip_forward_open_request_t);
+    data = (session->send_data) + sizeof(eip_forward_open_request_t);
 
     /* set up the path information. */
-    mem_copy(data, session->conn_path, session->conn_path_size);
-    data += session->conn_path_size;
+    mem_copy(data, route->conn_path, route->conn_path_size);
+    data += route->conn_path_size;
 
     /* fill in the static parts */
 
@@ -2055,27 +3973,30 @@ int send_forward_open_req(ab_session_p session)
     fo->secs_per_tick = AB_EIP_SECS_PER_TICK;         /* seconds per tick, no used? */
     fo->timeout_ticks = AB_EIP_TIMEOUT_TICKS;         /* timeout = srd_secs_per_tick * src_timeout_ticks, not used? */
     fo->orig_to_targ_conn_id = h2le32(0);             /* is this right?  Our connection id on the other machines? */
-    fo->targ_to_orig_conn_id = h2le32(session->orig_connection_id); /* Our connection id in the other direction. */
+    fo->targ_to_orig_conn_id = h2le32(conn->orig_connection_id); /* Our connection id in the other direction. */
     /* this might need to be globally unique */
-    fo->conn_serial_number = h2le16(session->conn_serial_number); /* our connection SEQUENCE number. */
+    fo->conn_serial_number = h2le16(conn->conn_serial_number); /* our connection SEQUENCE number. */
     fo->orig_vendor_id = h2le16(AB_EIP_VENDOR_ID);               /* our unique :-) vendor ID */
     fo->orig_serial_number = h2le32(AB_EIP_VENDOR_SN);           /* our serial number. */
     fo->conn_timeout_multiplier = AB_EIP_TIMEOUT_MULTIPLIER;     /* timeout = mult * RPI */
     fo->orig_to_targ_rpi = h2le32(AB_EIP_RPI); /* us to target RPI - Request Packet Interval in microseconds */
-    fo->orig_to_targ_conn_params = h2le16(AB_EIP_CONN_PARAM | session->max_payload_size); /* packet size and some other things, based on protocol/cpu type */
+    fo->orig_to_targ_conn_params = h2le16(AB_EIP_CONN_PARAM | route->max_payload_size); /* packet size and some other things, based on protocol/cpu type */
     fo->targ_to_orig_rpi = h2le32(AB_EIP_RPI); /* target to us RPI - not really used for explicit messages? */
-    fo->targ_to_orig_conn_params = h2le16(AB_EIP_CONN_PARAM | session->max_payload_size); /* packet size and some other things, based on protocol/cpu type */
+    fo->targ_to_orig_conn_params = h2le16(AB_EIP_CONN_PARAM | route->max_payload_size); /* packet size and some other things, based on protocol/cpu type */
     fo->transport_class = AB_EIP_TRANSPORT_CLASS_T3; /* 0xA3, server transport, class 3, application trigger */
-    fo->path_size = session->conn_path_size/2; /* size in 16-bit words */
+    fo->path_size = route->conn_path_size/2; /* size in 16-bit words */
 
     /* set the size of the request */
-    session->data_size = (uint32_t)(data - (session->data));
+    session->send_size = (uint32_t)(data - (session->send_data));
+    session->send_offset = 0;
+    session->send_num_bufs = 0;
 
-    rc = send_eip_request(session, 0);
+    /* the IO thread sends it, this is how long we wait for the response. */
+    session->state_timeout = time_ms() + SESSION_DEFAULT_TIMEOUT;
 
     pdebug(DEBUG_INFO, "Done");
 
-    return rc;
+    return PLCTAG_STATUS_OK;
 }
 
 
@@ -2083,21 +4004,27 @@ int send_forward_open_req(ab_session_p session)
 int send_forward_open_req_ex(ab_session_p session)
 {
     eip_forward_open_request_ex_t *fo = NULL;
+    ab_route_p route = session->conn_route;
+    ab_connection_t *conn = &route->conns[route->num_open_connections];
     uint8_t *data;
-    int rc = PLCTAG_STATUS_OK;
 
     pdebug(DEBUG_INFO,"Starting");
 
-    mem_set(session->data, 0, (int)(sizeof(*fo) + session->conn_path_size));
+    /* ask for the packet size we are trying for. */
+    critical_block(session->mutex) {
+        route->max_payload_size = (uint16_t)session->fo_size_guess;
+    }
+
+    mem_set(session->send_data, 0, (int)(sizeof(*fo) + route->conn_path_size));
 
-    fo = (eip_forward_open_request_ex_t *)(session->data);
+    fo = (eip_forward_open_request_ex_t *)(session->send_data);
 
     /* point to the end of the struct */
-    data = (session->data) + sizeof(eip_forward_open_request_ex_t);
+    data = (session->send_data) + sizeof(eip_forward_open_request_ex_t);
 
     /* set up the path information. */
-    mem_copy(data, session->conn_path, session->conn_path_size);
-    data += session->conn_path_size;
+    mem_copy(data, route->conn_path, route->conn_path_size);
+    data += route->conn_path_size;
 
     /* fill in the static parts */
 
@@ -2127,27 +4054,30 @@ int send_forward_open_req_ex(ab_session_p session)
     fo->secs_per_tick = AB_EIP_SECS_PER_TICK;         /* seconds per tick, no used? */
     fo->timeout_ticks = AB_EIP_TIMEOUT_TICKS;         /* timeout = srd_secs_per_tick * src_timeout_ticks, not used? */
     fo->orig_to_targ_conn_id = h2le32(0);             /* is this right?  Our connection id on the other machines? */
-    fo->targ_to_orig_conn_id = h2le32(session->orig_connection_id); /* Our connection id in the other direction. */
+    fo->targ_to_orig_conn_id = h2le32(conn->orig_connection_id); /* Our connection id in the other direction. */
     /* this might need to be globally unique */
-    fo->conn_serial_number = h2le16(session->conn_serial_number); /* our connection ID/serial number. */
+    fo->conn_serial_number = h2le16(conn->conn_serial_number); /* our connection ID/serial number. */
     fo->orig_vendor_id = h2le16(AB_EIP_VENDOR_ID);               /* our unique :-) vendor ID */
     fo->orig_serial_number = h2le32(AB_EIP_VENDOR_SN);           /* our serial number. */
     fo->conn_timeout_multiplier = AB_EIP_TIMEOUT_MULTIPLIER;     /* timeout = mult * RPI */
     fo->orig_to_targ_rpi = h2le32(AB_EIP_RPI); /* us to target RPI - Request Packet Interval in microseconds */
-    fo->orig_to_targ_conn_params_ex = h2le32(AB_EIP_CONN_PARAM_EX | session->max_payload_size); /* packet size and some other things, based on protocol/cpu type */
+    fo->orig_to_targ_conn_params_ex = h2le32(AB_EIP_CONN_PARAM_EX | route->max_payload_size); /* packet size and some other things, based on protocol/cpu type */
     fo->targ_to_orig_rpi = h2le32(AB_EIP_RPI); /* target to us RPI - not really used for explicit messages? */
-    fo->targ_to_orig_conn_params_ex = h2le32(AB_EIP_CONN_PARAM_EX | session->max_payload_size); /* packet size and some other things, based on protocol/cpu type */
+    fo->targ_to_orig_conn_params_ex = h2le32(AB_EIP_CONN_PARAM_EX | route->max_payload_size); /* packet size and some other things, based on protocol/cpu type */
     fo->transport_class = AB_EIP_TRANSPORT_CLASS_T3; /* 0xA3, server transport, class 3, application trigger */
-    fo->path_size = session->conn_path_size/2; /* size in 16-bit words */
+    fo->path_size = route->conn_path_size/2; /* size in 16-bit words */
 
     /* set the size of the request */
-    session->data_size = (uint32_t)(data - (session->data));
+    session->send_size = (uint32_t)(data - (session->send_data));
+    session->send_offset = 0;
+    session->send_num_bufs = 0;
 
-    rc = send_eip_request(session, SESSION_DEFAULT_TIMEOUT);
+    /* the IO thread sends it, this is how long we wait for the response. */
+    session->state_timeout = time_ms() + SESSION_DEFAULT_TIMEOUT;
 
     pdebug(DEBUG_INFO, "Done");
 
-    return rc;
+    return PLCTAG_STATUS_OK;
 }
 
 
@@ -2156,16 +4086,11 @@ int send_forward_open_req_ex(ab_session_p session)
 int recv_forward_open_resp(ab_session_p session, int *max_payload_size_guess)
 {
     eip_forward_open_response_t *fo_resp;
+    ab_connection_t *conn = &session->conn_route->conns[session->conn_route->num_open_connections];
     int rc = PLCTAG_STATUS_OK;
 
     pdebug(DEBUG_INFO,"Starting");
 
-    rc = recv_eip_response(session, 0);
-    if(rc != PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_WARN,"Unable to receive Forward Open response.");
-        return rc;
-    }
-
     fo_resp = (eip_forward_open_response_t *)(session->data);
 
     do {
@@ -2196,7 +4121,7 @@ int recv_forward_open_resp(ab_session_p session, int *max_payload_size_guess)
 
                     if(extended_status == 0x109) { /* MAGIC */
                         pdebug(DEBUG_WARN,"Error from forward open request, unsupported size, but size %d is supported.", supported_size);
-                        //session->max_payload_size = (uint16_t)supported_size;
+                        //route->max_payload_size = (uint16_t)supported_size;
                         *max_payload_size_guess = supported_size;
                         rc = PLCTAG_ERR_TOO_LARGE;
                     } else {
@@ -2211,10 +4136,12 @@ int recv_forward_open_resp(ab_session_p session, int *max_payload_size_guess)
         }
 
         /* success! */
-        session->targ_connection_id = le2h32(fo_resp->orig_to_targ_conn_id);
-        session->orig_connection_id = le2h32(fo_resp->targ_to_orig_conn_id);
+        conn->targ_connection_id = le2h32(fo_resp->orig_to_targ_conn_id);
+        conn->orig_connection_id = le2h32(fo_resp->targ_to_orig_conn_id);
+        conn->conn_seq_num = 0;
+        conn->num_in_flight = 0;
 
-        pdebug(DEBUG_INFO,"ForwardOpen succeeded with our connection ID %x and the PLC connection ID %x",session->orig_connection_id, session->targ_connection_id);
+        pdebug(DEBUG_INFO,"ForwardOpen succeeded with our connection ID %x and the PLC connection ID %x",conn->orig_connection_id, conn->targ_connection_id);
 
         pdebug(DEBUG_DETAIL,"Connection set up succeeded.");
 
@@ -2232,25 +4159,29 @@ int recv_forward_open_resp(ab_session_p session, int *max_payload_size_guess)
 int send_forward_close_req(ab_session_p session)
 {
     eip_forward_close_req_t *fo;
+    ab_route_p route = session->conn_route;
+    ab_connection_t *conn = &route->conns[route->num_open_connections - 1];
     uint8_t *data;
-    int rc = PLCTAG_STATUS_OK;
 
     pdebug(DEBUG_INFO,"Starting");
 
-    fo = (eip_forward_close_req_t *)(session->data);
+    mem_set(session->send_data, 0, (int)(sizeof(*fo) + route->conn_path_size));
+
+    fo = (eip_forward_close_req_t *)(session->send_data);
 
     /* point to the end of the struct */
-    data = (session->data) + sizeof(eip_forward_close_req_t);
+    data = (session->send_data) + sizeof(eip_forward_close_req_t);
 
     /* set up the path information. */
-    mem_copy(data, session->conn_path, session->conn_path_size);
-    data += session->conn_path_size;
+    mem_copy(data, route->conn_path, route->conn_path_size);
+    data += route->conn_path_size;
 
     /* fill in the static parts */
 
     /* encap header parts */
     fo->encap_command = h2le16(AB_EIP_UNCONNECTED_SEND); /* 0x006F EIP Send RR Data command */
     fo->encap_length = h2le16((uint16_t)(data - (uint8_t *)(&fo->interface_handle))); /* total length of packet except for encap header */
+    fo->encap_session_handle = h2le32(session->session_handle);
     fo->encap_sender_context = h2le64(++session->session_seq_id);
     fo->router_timeout = h2le16(1);                       /* one second is enough ? */
 
@@ -2272,19 +4203,22 @@ int send_forward_close_req(ab_session_p session)
     /* Forward Open Params */
     fo->secs_per_tick = AB_EIP_SECS_PER_TICK;         /* seconds per tick, no used? */
     fo->timeout_ticks = AB_EIP_TIMEOUT_TICKS;         /* timeout = srd_secs_per_tick * src_timeout_ticks, not used? */
-    fo->conn_serial_number = h2le16(session->conn_serial_number); /* our connection SEQUENCE number. */
+    fo->conn_serial_number = h2le16(conn->conn_serial_number); /* our connection SEQUENCE number. */
     fo->orig_vendor_id = h2le16(AB_EIP_VENDOR_ID);               /* our unique :-) vendor ID */
     fo->orig_serial_number = h2le32(AB_EIP_VENDOR_SN);           /* our serial number. */
-    fo->path_size = session->conn_path_size/2; /* size in 16-bit words */
+    fo->path_size = route->conn_path_size/2; /* size in 16-bit words */
 
     /* set the size of the request */
-    session->data_size = (uint32_t)(data - (session->data));
+    session->send_size = (uint32_t)(data - (session->send_data));
+    session->send_offset = 0;
+    session->send_num_bufs = 0;
 
-    rc = send_eip_request(session, 100);
+    /* the IO thread sends it, this is how long we wait for the response. */
+    session->state_timeout = time_ms() + SESSION_FORWARD_CLOSE_TIMEOUT;
 
     pdebug(DEBUG_INFO, "Done");
 
-    return rc;
+    return PLCTAG_STATUS_OK;
 }
 
 
@@ -2295,12 +4229,6 @@ int recv_forward_close_resp(ab_session_p session)
 
     pdebug(DEBUG_INFO,"Starting");
 
-    rc = recv_eip_response(session, 150);
-    if(rc != PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_WARN, "Unable to receive Forward Close response, %s!", plc_tag_decode_error(rc));
-        return rc;
-    }
-
     fo_resp = (eip_forward_close_resp_t *)(session->data);
 
     do {
@@ -2334,14 +4262,14 @@ int recv_forward_close_resp(ab_session_p session)
 
 
 
-int session_create_request(ab_session_p session, int tag_id, ab_request_p *req)
+int session_create_request(ab_session_p session, ab_route_p route, int tag_id, ab_request_p *req)
 {
     int rc = PLCTAG_STATUS_OK;
     ab_request_p res;
     size_t request_capacity = 0;
 
     critical_block(session->mutex) {
-        request_capacity = (size_t)(session->max_payload_size + EIP_CIP_PREFIX_SIZE);
+        request_capacity = (size_t)(route->max_payload_size + EIP_CIP_PREFIX_SIZE);
     }
 
     pdebug(DEBUG_DETAIL,"Starting.");
@@ -2352,6 +4280,7 @@ int session_create_request(ab_session_p session, int tag_id, ab_request_p *req)
         rc = PLCTAG_ERR_NO_MEM;
     } else {
         res->tag_id = tag_id;
+        res->route = route;
         res->request_capacity = (int)request_capacity;
         res->lock = LOCK_INIT;
 
@@ -2381,5 +4310,36 @@ void request_destroy(void *req_arg)
 
     req->abort_request = 1;
 
+    if(req->resp_buf) {
+        req->resp_buf = rc_dec(req->resp_buf);
+    }
+
     pdebug(DEBUG_DETAIL, "Done.");
 }
+
+
+
+
+/*
+ * rx_buffer_create
+ *
+ * Allocate a refcounted buffer big enough for any packet the session
+ * can receive.
+ */
+uint8_t *rx_buffer_create(ab_session_p session)
+{
+    return (uint8_t *)rc_alloc((int)session->data_capacity, rx_buffer_destroy);
+}
+
+
+/*
+ * rx_buffer_destroy
+ *
+ * Nothing to clean up, the memory is freed by the refcount code.
+ */
+void rx_buffer_destroy(void *buf_arg)
+{
+    (void)buf_arg;
+
+    pdebug(DEBUG_DETAIL, "Releasing receive buffer.");
+}
@@ -30,6 +30,8 @@
 
 #include <ab/ab_common.h>
 #include <ab/defs.h>
+#include <ab/metadata_cache.h>
+#include <util/hashtable.h>
 #include <util/rc.h>
 #include <util/vector.h>
 
@@ -37,35 +39,159 @@
 
 #define SESSION_DEFAULT_TIMEOUT (2000)
 
+/* how long to try to connect to the gateway before starting over. */
+#define SESSION_DEFAULT_CONNECT_TIMEOUT (5000)
+
 #define MAX_PACKET_SIZE_EX  (44 + 4002)
 
-#define SESSION_MIN_REQUESTS    (10)
-#define SESSION_INC_REQUESTS    (10)
+/* maximum number of requests packed into one packet. */
+#define MAX_REQUESTS (200)
 
+/* number of packets we can have outstanding to the PLC at once. */
+#define SESSION_DEFAULT_PIPELINE_DEPTH (1)
+#define SESSION_MAX_PIPELINE_DEPTH (16)
 
-struct ab_session_t {
-//    int status;
-    int failed;
+/* number of CIP connections a session opens to the PLC. */
+#define SESSION_DEFAULT_CONNECTIONS (1)
+#define SESSION_MAX_CONNECTIONS (8)
 
-    /* gateway connection related info */
-    char *host;
-    int port;
-    char *path;
-    sock_p sock;
+/*
+ * the pieces of one large tag can go past the pipeline depth, up to this
+ * many packets on a connection.  Otherwise they would go out one at a
+ * time with the default depth.
+ */
+#define SESSION_FRAGMENT_PIPELINE_DEPTH (4)
 
-    /* connection variables. */
-    int use_connected_msg;
+/* each connection can have a full pipeline. */
+#define SESSION_MAX_IN_FLIGHT (SESSION_MAX_PIPELINE_DEPTH * SESSION_MAX_CONNECTIONS)
+
+/* number of CIP paths that can share one session to a gateway. */
+#define SESSION_MAX_ROUTES (32)
+
+/* kinds of requests, per route, that can wait for their route while filling one packet. */
+#define SESSION_MAX_BLOCKED (SESSION_MAX_ROUTES * 3)
+
+/* number of queued requests looked at when filling one packet. */
+#define SESSION_DEFAULT_PACKING_WINDOW (100)
+#define SESSION_MAX_PACKING_WINDOW (1000)
+
+/* requests without a deadline of their own are scheduled as if they had this one. */
+#define SESSION_DEFAULT_DEADLINE_MS (1000)
+
+
+/* number of threads that run all the session state machines. */
+#define SESSION_NUM_IO_THREADS (4)
+
+/* longest symbol name kept for instance ID lookups, with the program name for program symbols. */
+#define SESSION_MAX_SYMBOL_NAME (255)
+
+
+typedef enum { SYMBOLS_UNLISTED, SYMBOLS_LISTING, SYMBOLS_LISTED } symbols_state_t;
+
+typedef enum { SESSION_OPEN_SOCKET, SESSION_OPEN_SOCKET_WAIT, SESSION_REGISTER, SESSION_REGISTER_WAIT,
+               SESSION_CONNECT, SESSION_CONNECT_WAIT, SESSION_IDLE, SESSION_DISCONNECT, SESSION_DISCONNECT_WAIT,
+               SESSION_UNREGISTER, SESSION_CLOSE_SOCKET, SESSION_START_RETRY, SESSION_WAIT_RETRY,
+               SESSION_WAIT_RECONNECT
+             } session_state_t;
+
+
+/*
+ * One CIP connection to the PLC.  All the connections of a route
+ * share its packet size, but each one has its own IDs and sequence
+ * numbers.
+ */
+typedef struct {
     uint32_t orig_connection_id;
     uint32_t targ_connection_id;
     uint16_t conn_seq_num;
     uint16_t conn_serial_number;
-
+    int num_in_flight;
+} ab_connection_t;
+
+
+/*
+ * One CIP path through the gateway, such as a slot in the chassis or a
+ * node on a DH+ network.  All the routes of a session share its TCP
+ * socket and registration, but each route has its own CIP connections
+ * and packet size.  Connections are opened in order, so the first
+ * num_open_connections are the open ones.  Packets are striped across
+ * them.
+ */
+struct ab_route_t {
+    char *path;
     plc_type_t plc_type;
+    int use_connected_msg;
 
-    uint16_t max_payload_size;
     uint8_t *conn_path;
     uint8_t conn_path_size;
     uint16_t dhp_dest;
+    uint16_t max_payload_size; /* protected by the session mutex. */
+
+    int num_connections;
+    int num_open_connections;
+    int next_connection;
+    ab_connection_t conns[SESSION_MAX_CONNECTIONS];
+
+    /* unconnected packets in flight. */
+    int num_uc_in_flight;
+
+    /* when to try to open the first connection again after it failed. */
+    int64_t retry_time;
+
+    /* where the negotiated packet size is remembered between runs. */
+    metadata_cache_p metadata;
+    char *metadata_key;
+
+    /*
+     * instance IDs of the controller symbols, and of the symbols of each
+     * program once a tag needs one, protected by the session mutex.  One
+     * tag lists them for all the others.  They are forgotten
+     * when the socket is closed, since a download to the PLC can change
+     * them, and the generation tells tags that their IDs are stale.
+     */
+    hashtable_p symbols;
+    symbols_state_t symbols_state;
+    int symbol_generation;
+};
+
+
+/*
+ * A bundle is one packet worth of requests that has been sent
+ * to the PLC and for which we are waiting for a response.  The
+ * seq_id is either the EIP sender context (unconnected) or the
+ * CPF connection sequence number (connected) used to match up
+ * the response.  conn_index is the connection of the route that the
+ * packet went out on, or -1 if it is unconnected.
+ */
+typedef struct {
+    uint64_t seq_id;
+    ab_route_p route;
+    int conn_index;
+    int64_t time_sent;
+    int num_requests;
+    ab_request_p requests[MAX_REQUESTS];
+} ab_bundle_t;
+
+
+struct ab_session_t {
+//    int status;
+    int failed;
+
+    /* gateway connection related info */
+    char *host;
+    int port;
+    sock_p sock;
+    int connect_timeout_ms;
+
+    /*
+     * CIP paths that share this session.  Routes are added under the
+     * mutex and are only freed with the session.  The IO thread picks up
+     * new ones at the start of each tick and only looks at the first
+     * num_io_routes.
+     */
+    int num_routes;
+    int num_io_routes;
+    ab_route_p routes[SESSION_MAX_ROUTES];
 
     /* registration info */
     uint32_t session_handle;
@@ -73,28 +199,80 @@ struct ab_session_t {
     /* Sequence ID for requests. */
     uint64_t session_seq_id;
 
-    /* list of outstanding requests for this session */
-    vector_p requests;
-
-    /* data for receiving messages */
+    /*
+     * queue of outstanding requests for this session.  Any thread can
+     * append to the queue under the queue lock.  The IO thread takes
+     * the whole queue at once and merges it into the pending list,
+     * which is kept in priority and then deadline order.
+     */
+    lock_t queue_lock;
+    ab_request_p queue_head;
+    ab_request_p queue_tail;
+    ab_request_p pending; /* only touched by the IO thread. */
+    ab_request_p pending_tail;
+    int packing_window;
+
+    /* packets sent to the PLC that are waiting for responses, per connection or unconnected route. */
+    int pipeline_depth;
+    int num_in_flight;
+    ab_bundle_t in_flight[SESSION_MAX_IN_FLIGHT];
+
+    /* data for sending messages */
+    uint32_t send_offset;
+    uint32_t send_size;
+    uint8_t send_data[MAX_PACKET_SIZE_EX];
+
+    /*
+     * packets built from requests are sent as the headers in send_data
+     * followed by pieces of the requests' own buffers.  If there are
+     * no send_bufs, the whole packet is in send_data.
+     */
+    int send_num_bufs;
+    int send_buf_index;
+    sock_buf_t send_bufs[MAX_REQUESTS + 1];
+
+    /* data for receiving messages, refcounted so that a request can keep the packet. */
     uint64_t resp_seq_id;
     uint32_t data_offset;
     uint32_t data_capacity;
     uint32_t data_size;
-    uint8_t data[MAX_PACKET_SIZE_EX];
+    uint8_t *data;
 
     uint64_t packet_count;
 
-    thread_p handler_thread;
-    int terminating;
+    /* requests with deadlines that completed and how many were late. */
+    uint64_t deadline_count;
+    uint64_t deadline_missed;
+    int64_t deadline_max_late_ms;
+
     mutex_p mutex;
 
+    /* state machine, only touched by the IO thread that owns the session. */
+    struct session_io_t *io;
+    session_state_t state;
+    int64_t wake_time;
+    int wake_requested; /* protected by the IO thread mutex */
+    int64_t state_timeout;
+    int64_t auto_disconnect_time;
+    int auto_disconnect;
+
+    /* Forward Open negotiation, for one connection of conn_route at a time. */
+    ab_route_p conn_route;
+    int fo_use_ex;
+    int fo_retried;
+    int fo_size_guess;
+    uint16_t fo_old_max_payload_size;
+    int fo_from_cache;
+
     /* disconnect handling */
     int auto_disconnect_enabled;
     int auto_disconnect_timeout_ms;
 };
 
 struct ab_request_t {
+    /* next request in the session queue. */
+    ab_request_p next;
+
     /* used to force interlocks with other threads. */
     lock_t lock;
 
@@ -107,16 +285,32 @@ struct ab_request_t {
     /* debugging info */
     int tag_id;
 
+    /* the CIP path the request goes out on. */
+    ab_route_p route;
+
     /* allow requests to be packed in the session */
     int allow_packing;
     int packing_num;
 
+    /* one of several packets for the same tag, see SESSION_FRAGMENT_PIPELINE_DEPTH. */
+    int fragment;
+
+    /* scheduling, higher priority first, then the earliest deadline. */
+    int priority;
+    int deadline_ms; /* zero if the request has no deadline. */
+    int64_t deadline;
+
     /* time stamp for debugging output */
     int64_t time_sent;
 
     /* used by the background thread for incrementally getting data */
     int request_size; /* total bytes, not just data */
     int request_capacity;
+
+    /* the response, either in a session receive buffer or copied into data. */
+    uint8_t *resp_buf; /* refcounted, NULL if the response was copied. */
+    uint8_t *resp_data;
+
     uint8_t data[];
 };
 
@@ -125,12 +319,29 @@ struct ab_request_t {
 uint64_t session_get_new_seq_id_unsafe(ab_session_p sess);
 uint64_t session_get_new_seq_id(ab_session_p sess);
 
+/* request deadline counters of all sessions. */
+typedef struct {
+    uint64_t count;      /* requests with deadlines that completed. */
+    uint64_t missed;     /* how many of them were late. */
+    int64_t max_late_ms; /* how late the worst one was. */
+} session_deadline_stats_t;
+
 extern int session_startup();
 extern void session_teardown();
 
-extern int session_find_or_create(ab_session_p *session, attr attribs);
-extern int session_get_max_payload(ab_session_p session);
-extern int session_create_request(ab_session_p session, int tag_id, ab_request_p *request);
+extern int session_find_or_create(ab_session_p *session, ab_route_p *route, attr attribs);
+extern int session_get_max_payload(ab_session_p session, ab_route_p route);
+extern int session_route_is_connected(ab_session_p session, ab_route_p route);
+extern int session_create_request(ab_session_p session, ab_route_p route, int tag_id, ab_request_p *request);
 extern int session_add_request(ab_session_p sess, ab_request_p req);
 
+extern int session_find_symbol(ab_session_p session, ab_route_p route, const char *name, uint32_t *instance_id, int *generation, int *must_list);
+extern int session_find_program_symbol(ab_session_p session, ab_route_p route, const char *program, const char *name, uint32_t *instance_id, int *generation, int *must_list);
+extern void session_add_symbol(ab_session_p session, ab_route_p route, int generation, const char *program, const char *name, uint32_t instance_id);
+extern void session_end_symbol_listing(ab_session_p session, ab_route_p route, int generation, const char *program, int listed);
+extern int session_get_symbol_generation(ab_session_p session, ab_route_p route);
+extern void session_forget_symbols(ab_session_p session, ab_route_p route, int generation);
+
+extern void session_get_deadline_stats(session_deadline_stats_t *stats);
+
 #endif
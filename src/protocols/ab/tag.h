@@ -39,6 +39,7 @@
 #include <ab/ab_common.h>
 #include <ab/session.h>
 #include <ab/pccc.h>
+#include <ab/metadata_cache.h>
 
 typedef enum {
     AB_TYPE_BOOL,
@@ -57,6 +58,27 @@ typedef enum {
     AB_TYPE_TAG_ENTRY /* not a real AB type, but a pseudo UDT. */
 } elem_type_t;
 
+/*
+ * where a tag is in addressing its symbol by instance ID.  When the PLC
+ * rejects the ID, the request is tried again by name to see if the ID
+ * was stale.
+ */
+typedef enum {
+    INSTANCE_ID_UNRESOLVED,
+    INSTANCE_ID_RESOLVING,
+    INSTANCE_ID_RESOLVED,
+    INSTANCE_ID_UNAVAILABLE,
+    INSTANCE_ID_REJECTED,
+    INSTANCE_ID_CHECKING
+} instance_id_state_t;
+
+/* one of the requests of a large operation that are in flight at once. */
+typedef struct {
+    ab_request_p req;
+    int start;  /* byte offset of the data still to come. */
+    int end;    /* byte offset just past the data of this fragment. */
+} ab_fragment_t;
+
 
 struct ab_tag_t {
     /*struct plc_tag_t p_tag;*/
@@ -65,14 +87,29 @@ struct ab_tag_t {
     /* how do we talk to this device? */
     int protocol_type;
 
-    /* pointers back to session */
+    /* pointers back to session and the CIP path within it */
     ab_session_p session;
+    ab_route_p route;
     int use_connected_msg;
 
     /* this contains the encoded name */
     uint8_t encoded_name[MAX_TAG_NAME];
     int encoded_name_size;
 
+    /*
+     * with use_instance_id, encoded_name addresses the base symbol by its
+     * instance ID once that is known.  The name as given is kept here.
+     */
+    int use_instance_id;
+    instance_id_state_t instance_id_state;
+    int instance_id_generation;
+    int instance_id_for_write;
+    uint8_t symbolic_name[MAX_TAG_NAME];
+    int symbolic_name_size;
+
+    /* the program whose symbols this tag is listing, empty for the controller. */
+    char listing_program[SESSION_MAX_SYMBOL_NAME + 1];
+
     const char *read_group;
 
     /* the connection IOI path */
@@ -83,6 +120,15 @@ struct ab_tag_t {
     uint8_t encoded_type_info[MAX_TAG_TYPE_INFO];
     int encoded_type_info_size;
 
+    /*
+     * where the type is remembered between runs.  If the type came from
+     * there or from elem_type, type_info_unverified is set until the PLC
+     * has confirmed it.
+     */
+    metadata_cache_p metadata;
+    char *metadata_key;
+    int type_info_unverified;
+
     /* how much data can we send per packet? */
     int write_data_per_packet;
 
@@ -100,8 +146,17 @@ struct ab_tag_t {
     ab_request_p req;
     int offset;
 
+    /* a large read or write is split up front and all the pieces sent at once. */
+    ab_fragment_t *frags;
+    int num_frags;
+    int frags_capacity;
+
     int allow_packing;
 
+    /* scheduling of requests in the session queue. */
+    int priority;
+    int deadline_ms;
+
     /* flags for operations */
     int read_in_progress;
     int write_in_progress;
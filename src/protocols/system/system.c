@@ -27,6 +27,7 @@
 #include <system/tag.h>
 #include <lib/init.h>
 #include <util/rc.h>
+#include <ab/ab.h>
 
 
 /* we'll need to set these per protocol type.
@@ -46,6 +47,7 @@ static int system_tag_abort(plc_tag_p tag);
 static int system_tag_read(plc_tag_p tag);
 static int system_tag_status(plc_tag_p tag);
 static int system_tag_write(plc_tag_p tag);
+static void system_tag_set_uint32(system_tag_p tag, int offset, uint64_t val);
 
 struct tag_vtable_t system_tag_vtable = {
         /* abort */     system_tag_abort,
@@ -122,6 +124,18 @@ static void system_tag_destroy(plc_tag_p ptag)
         return;
     }
 
+    if(tag->ext_mutex) {
+        mutex_destroy(&(tag->ext_mutex));
+    }
+
+    if(tag->api_mutex) {
+        mutex_destroy(&(tag->api_mutex));
+    }
+
+    if(tag->tag_cond_wait) {
+        cond_destroy(&(tag->tag_cond_wait));
+    }
+
     //mem_free(tag);
 
     return;
@@ -154,6 +168,38 @@ static int system_tag_read(plc_tag_p ptag)
         return PLCTAG_STATUS_OK;
     }
 
+    /* counters of the gateway host name cache, one 32-bit value each. */
+    if(str_cmp_i(&tag->name[0],"resolver") == 0) {
+        socket_resolver_stats_t stats;
+
+        socket_get_resolver_stats(&stats);
+
+        system_tag_set_uint32(tag, 0, stats.hits);
+        system_tag_set_uint32(tag, 4, stats.misses);
+        system_tag_set_uint32(tag, 8, stats.refreshes);
+        system_tag_set_uint32(tag, 12, stats.failures);
+        system_tag_set_uint32(tag, 16, stats.lookups);
+        system_tag_set_uint32(tag, 20, (uint64_t)stats.lookup_total_ms);
+        system_tag_set_uint32(tag, 24, (uint64_t)stats.lookup_max_ms);
+
+        return PLCTAG_STATUS_OK;
+    }
+
+    /* request deadline counters of all sessions, one 32-bit value each. */
+    if(str_cmp_i(&tag->name[0],"deadlines") == 0) {
+        uint64_t count = 0;
+        uint64_t missed = 0;
+        int64_t max_late_ms = 0;
+
+        ab_get_deadline_stats(&count, &missed, &max_late_ms);
+
+        system_tag_set_uint32(tag, 0, count);
+        system_tag_set_uint32(tag, 4, missed);
+        system_tag_set_uint32(tag, 8, (uint64_t)max_late_ms);
+
+        return PLCTAG_STATUS_OK;
+    }
+
     pdebug(DEBUG_WARN,"Unknown system tag %s", tag->name);
     return PLCTAG_ERR_UNSUPPORTED;
 }
@@ -179,6 +225,11 @@ static int system_tag_write(plc_tag_p ptag)
         return PLCTAG_ERR_NOT_IMPLEMENTED;
     }
 
+    /* so are the counters, as far as the user is concerned. */
+    if(str_cmp_i(&tag->name[0],"resolver") == 0 || str_cmp_i(&tag->name[0],"deadlines") == 0) {
+        return PLCTAG_ERR_NOT_IMPLEMENTED;
+    }
+
     if(str_cmp_i(&tag->name[0],"debug") == 0) {
         int res = 0;
         res = (int32_t)(((uint32_t)(tag->data[0])) +
@@ -193,3 +244,18 @@ static int system_tag_write(plc_tag_p ptag)
     return PLCTAG_ERR_NOT_IMPLEMENTED;
 }
 
+
+
+/*
+ * system_tag_set_uint32
+ *
+ * Store a counter in the tag data, little endian.  Counters that do
+ * not fit wrap around.
+ */
+static void system_tag_set_uint32(system_tag_p tag, int offset, uint64_t val)
+{
+    tag->data[offset] = (uint8_t)(val & 0xFF);
+    tag->data[offset + 1] = (uint8_t)((val >> 8) & 0xFF);
+    tag->data[offset + 2] = (uint8_t)((val >> 16) & 0xFF);
+    tag->data[offset + 3] = (uint8_t)((val >> 24) & 0xFF);
+}
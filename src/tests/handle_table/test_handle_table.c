@@ -0,0 +1,205 @@
+/***************************************************************************
+ *   Copyright (C) 2018 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU Library General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/* the checks must run in release builds too. */
+#undef NDEBUG
+#include <assert.h>
+#include <stdio.h>
+#include "../../lib/libplctag.h"
+#include "../../util/handle_table.h"
+#include "../../util/rc.h"
+#include "../../util/debug.h"
+
+/* more than two chunks of slots. */
+#define INSERT_ENTRIES (2500)
+
+/* more than the number of generations a slot has. */
+#define REUSE_ROUNDS (300)
+
+static int values[INSERT_ENTRIES];
+static int handles[INSERT_ENTRIES];
+
+
+static void ref_cleanup(void *ref)
+{
+    (void)ref;
+}
+
+
+static void *make_ref(int value)
+{
+    int *ref = rc_alloc((int)sizeof(int), ref_cleanup);
+
+    assert(ref != NULL);
+
+    *ref = value;
+
+    return ref;
+}
+
+
+static int get_value(handle_table_p table, int handle)
+{
+    int *ref = handle_table_get(table, handle);
+    int value = -1;
+
+    if(ref) {
+        value = *ref;
+        rc_dec(ref);
+    }
+
+    return value;
+}
+
+
+int main(int argc, const char **argv)
+{
+    handle_table_p table = NULL;
+    int old_handle = 0;
+    int handle = 0;
+    int *ref = NULL;
+    int rc = PLCTAG_STATUS_OK;
+
+    (void)argc;
+    (void)argv;
+
+    pdebug(DEBUG_INFO,"Starting handle table tests.");
+
+    set_debug_level(DEBUG_WARN);
+
+    table = handle_table_create();
+    assert(table != NULL);
+
+    /* nothing is there yet. */
+    ref = handle_table_get(table, 1);
+    assert(ref == NULL);
+    ref = handle_table_get(table, 0);
+    assert(ref == NULL);
+    ref = handle_table_get(table, -1);
+    assert(ref == NULL);
+    ref = handle_table_get(table, HANDLE_TABLE_MAX_HANDLE + 1);
+    assert(ref == NULL);
+    ref = handle_table_remove(table, 1);
+    assert(ref == NULL);
+
+    /* insert tests, these grow the table across several chunks. */
+    pdebug(DEBUG_INFO, "Inserting %d entries.", INSERT_ENTRIES);
+    for(int i=0; i < INSERT_ENTRIES; i++) {
+        values[i] = i * 3;
+        handles[i] = handle_table_add(table, make_ref(values[i]));
+
+        assert(handles[i] > 0);
+        assert(handles[i] <= HANDLE_TABLE_MAX_HANDLE);
+
+        for(int j=0; j < i; j += 97) {
+            assert(handles[j] != handles[i]);
+        }
+    }
+
+    /* retrieval tests. */
+    pdebug(DEBUG_INFO, "Running retrieval tests.");
+    for(int i=INSERT_ENTRIES-1; i >= 0; i--) {
+        assert(get_value(table, handles[i]) == values[i]);
+    }
+
+    /* remove every other entry. */
+    pdebug(DEBUG_INFO, "Running remove tests.");
+    for(int i=0; i < INSERT_ENTRIES; i += 2) {
+        ref = handle_table_remove(table, handles[i]);
+        assert(ref != NULL);
+        assert(*ref == values[i]);
+        rc_dec(ref);
+
+        /* a second remove finds nothing. */
+        ref = handle_table_remove(table, handles[i]);
+        assert(ref == NULL);
+    }
+
+    for(int i=0; i < INSERT_ENTRIES; i++) {
+        assert(get_value(table, handles[i]) == ((i & 1) ? values[i] : -1));
+    }
+
+    /* new entries reuse the freed slots and the old handles stay dead. */
+    pdebug(DEBUG_INFO, "Running stale handle tests.");
+    for(int i=0; i < INSERT_ENTRIES; i += 2) {
+        old_handle = handles[i];
+
+        values[i] = -i * 7 - 2;
+        handles[i] = handle_table_add(table, make_ref(values[i]));
+
+        assert(handles[i] > 0);
+        assert(handles[i] != old_handle);
+        assert(get_value(table, old_handle) == -1);
+
+        ref = handle_table_remove(table, old_handle);
+        assert(ref == NULL);
+
+        assert(get_value(table, handles[i]) == values[i]);
+    }
+
+    for(int i=0; i < INSERT_ENTRIES; i++) {
+        assert(get_value(table, handles[i]) == values[i]);
+    }
+
+    /*
+     * reuse one slot until its generation wraps around.  Handles must
+     * stay valid and only the current one may find the object.
+     */
+    pdebug(DEBUG_INFO, "Running generation wraparound tests.");
+    ref = handle_table_remove(table, handles[0]);
+    assert(ref != NULL);
+    rc_dec(ref);
+
+    handle = handle_table_add(table, make_ref(1));
+    for(int i=0; i < REUSE_ROUNDS; i++) {
+        old_handle = handle;
+
+        ref = handle_table_remove(table, old_handle);
+        assert(ref != NULL);
+        assert(*ref == i + 1);
+        rc_dec(ref);
+
+        handle = handle_table_add(table, make_ref(i + 2));
+        assert(handle > 0);
+        assert(handle <= HANDLE_TABLE_MAX_HANDLE);
+        assert(handle != old_handle);
+        assert(get_value(table, old_handle) == -1);
+        assert(get_value(table, handle) == i + 2);
+    }
+
+    /* clean up, the table does not release what is left in it. */
+    ref = handle_table_remove(table, handle);
+    assert(ref != NULL);
+    rc_dec(ref);
+
+    for(int i=1; i < INSERT_ENTRIES; i++) {
+        ref = handle_table_remove(table, handles[i]);
+        assert(ref != NULL);
+        assert(*ref == values[i]);
+        rc_dec(ref);
+    }
+
+    rc = handle_table_destroy(table);
+    assert(rc == PLCTAG_STATUS_OK);
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return 0;
+}
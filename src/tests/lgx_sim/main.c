@@ -8,6 +8,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <netdb.h>
@@ -93,6 +94,13 @@ int main(void)
         if (newsock == -1) {
             log("accept() failed!\n");
         } else {
+            int nodelay = 1;
+
+            /* the client may pipeline requests, so do not hold back responses. */
+            if (setsockopt(newsock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) == -1) {
+                log("setsockopt() failed to set TCP_NODELAY!\n");
+            }
+
             log("Got a connection from %s on port %d\n", inet_ntoa(client_addr.sin_addr), htons(client_addr.sin_port));
 
             /*
@@ -10,6 +10,7 @@
 
 
 static void print_buf(uint8_t *buf, size_t data_len);
+static ssize_t read_packet(session_context *session);
 static int process_packet(session_context *session);
 static void register_session(session_context *session);
 
@@ -35,10 +36,10 @@ void *session_handler(void *session_arg)
     session_context *session = (session_context *)session_arg;
 
     while(continue_running) {
-        ssize_t rc = read(session->sock, session->buf, BUFFER_LEN);
+        ssize_t rc = read_packet(session);
 
-        if(rc < 0) {
-            log("read() failed!\n");
+        if(rc <= 0) {
+            log("read_packet() failed!\n");
             break;
         }
 
@@ -60,6 +61,39 @@ void *session_handler(void *session_arg)
 }
 
 
+/*
+ * Read exactly one EIP packet.  The client may have several requests
+ * in flight, so more than one packet can be waiting in the socket.
+ */
+ssize_t read_packet(session_context *session)
+{
+    size_t needed = sizeof(eip_header);
+    size_t got = 0;
+
+    while(got < needed) {
+        ssize_t rc = read(session->sock, session->buf + got, needed - got);
+
+        if(rc <= 0) {
+            return rc;
+        }
+
+        got += (size_t)rc;
+
+        if(got == sizeof(eip_header)) {
+            needed = sizeof(eip_header) + ((eip_header *)session->buf)->length;
+
+            if(needed > BUFFER_LEN) {
+                log("read_packet() packet of %d bytes is too large!\n", (int)needed);
+                return -1;
+            }
+        }
+    }
+
+    return (ssize_t)got;
+}
+
+
+
 int process_packet(session_context *session)
 {
     eip_header *header = (eip_header*)session->buf;
@@ -0,0 +1,397 @@
+/***************************************************************************
+ *   Copyright (C) 2018 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU Library General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*
+ * The cache is built in here with only a few hash values, so that most
+ * keys collide.  This also gives the tests the internal functions.
+ */
+#define METADATA_CACHE_HASH_MASK (0x6)
+
+/* the checks must run in release builds too. */
+#undef NDEBUG
+#include <assert.h>
+#include "../../protocols/ab/metadata_cache.c"
+
+#define TEST_FILE "test_metadata_cache.txt"
+
+/* more than there are hash values. */
+#define NUM_TAGS (40)
+
+
+static void write_file(const char *text)
+{
+    FILE *file = fopen(TEST_FILE, "w");
+    int rc = 0;
+
+    assert(file != NULL);
+
+    rc = fputs(text, file);
+    assert(rc >= 0);
+
+    rc = fclose(file);
+    assert(rc == 0);
+}
+
+
+static int count_lines(void)
+{
+    FILE *file = fopen(TEST_FILE, "r");
+    int lines = 0;
+    int c = 0;
+
+    assert(file != NULL);
+
+    while((c = fgetc(file)) != EOF) {
+        if(c == '\n') {
+            lines++;
+        }
+    }
+
+    fclose(file);
+
+    return lines;
+}
+
+
+static char *tag_key(int i)
+{
+    char name[32];
+
+    snprintf(name, sizeof(name), "Tag%d.Member", i);
+
+    return metadata_cache_tag_key("10.1.2.3", "1,0", name);
+}
+
+
+static void put_tag(metadata_cache_p cache, int i, int value)
+{
+    char *key = tag_key(i);
+    uint8_t type_info[4] = { 0xA0, 0x02, (uint8_t)value, (uint8_t)i };
+
+    metadata_cache_put_tag(cache, key, value, i + 1, type_info, (int)sizeof(type_info));
+
+    mem_free(key);
+}
+
+
+/* returns -1 if the tag is not in the cache. */
+static int get_tag(metadata_cache_p cache, int i)
+{
+    char *key = tag_key(i);
+    uint8_t type_info[MAX_TAG_TYPE_INFO];
+    int type_info_size = 0;
+    int elem_size = 0;
+    int elem_count = 0;
+    int rc = metadata_cache_get_tag(cache, key, &elem_size, &elem_count, type_info, &type_info_size);
+
+    mem_free(key);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        assert(rc == PLCTAG_ERR_NOT_FOUND);
+        return -1;
+    }
+
+    assert(elem_count == i + 1);
+    assert(type_info_size == 4);
+    assert(type_info[0] == 0xA0 && type_info[1] == 0x02);
+    assert(type_info[2] == (uint8_t)elem_size);
+    assert(type_info[3] == (uint8_t)i);
+
+    return elem_size;
+}
+
+
+static void remove_tag(metadata_cache_p cache, int i)
+{
+    char *key = tag_key(i);
+
+    metadata_cache_remove(cache, key);
+
+    mem_free(key);
+}
+
+
+static void check_tags(metadata_cache_p cache, int *expected)
+{
+    for(int i=0; i < NUM_TAGS; i++) {
+        int value = get_tag(cache, i);
+
+        assert(value == expected[i]);
+    }
+}
+
+
+/* parse the lines of a hand written file, good and bad. */
+static void test_parse(void)
+{
+    metadata_cache_p cache = NULL;
+    uint8_t type_info[MAX_TAG_TYPE_INFO];
+    int type_info_size = 0;
+    int elem_size = 0;
+    int elem_count = 0;
+    int use_ex = 0;
+    int max_payload_size = 0;
+    int rc = 0;
+
+    pdebug(DEBUG_INFO, "Running file parsing tests.");
+
+    write_file("# libplctag metadata cache, version 1\n"
+               "\n"
+               "route\t10.1.2.3\t1,0\t1\t4002\n"
+               "route\t10.1.2.3\t\t0\t504\n"
+               "tag\t10.1.2.3\t1,0\tGood\t4\t10\tc400\n"
+               "tag\t10.1.2.3\t1,0\tOverridden\t2\t1\tc300\n"
+               "tag\t10.1.2.3\t1,0\tOverridden\t4\t3\tc400\n"
+               "tag\t10.1.2.3\t1,0\tDropped\t4\t1\tc400\n"
+               "drop\ttag\t10.1.2.3\t1,0\tDropped\n"
+               "tag\t10.1.2.3\t1,0\tBadHex\t4\t1\tc4zz\n"
+               "tag\t10.1.2.3\t1,0\tOddHex\t4\t1\tc40\n"
+               "tag\t10.1.2.3\t1,0\tNoType\t4\t1\t\n"
+               "tag\t10.1.2.3\t1,0\tBadSize\tfour\t1\tc400\n"
+               "tag\t10.1.2.3\t1,0\tShort\t4\n"
+               "route\t10.1.2.3\t1,1\t1\t0\n"
+               "drop\ttag\t10.1.2.3\n"
+               "drop\troute\t10.1.2.3\t1,5\n"
+               "nonsense\tline\n"
+               "tag\ta\tb\tc\td\te\tf\tg\th\ti\n"
+               "tag\t10.1.2.3\t1,0\tLast\t8\t2\tc500\n");
+
+    cache = cache_create(TEST_FILE);
+    assert(cache != NULL);
+
+    /* route, route without a path, Good, Overridden and Last. */
+    assert(cache->num_entries == 5);
+    assert(cache->num_lines == 20);
+    assert(!cache->needs_rewrite);
+
+    rc = metadata_cache_get_route(cache, "route\t10.1.2.3\t1,0", &use_ex, &max_payload_size);
+    assert(rc == PLCTAG_STATUS_OK);
+    assert(use_ex == 1 && max_payload_size == 4002);
+
+    rc = metadata_cache_get_route(cache, "route\t10.1.2.3\t", &use_ex, &max_payload_size);
+    assert(rc == PLCTAG_STATUS_OK);
+    assert(use_ex == 0 && max_payload_size == 504);
+
+    rc = metadata_cache_get_route(cache, "route\t10.1.2.3\t1,1", &use_ex, &max_payload_size);
+    assert(rc == PLCTAG_ERR_NOT_FOUND);
+
+    rc = metadata_cache_get_tag(cache, "tag\t10.1.2.3\t1,0\tGood", &elem_size, &elem_count, type_info, &type_info_size);
+    assert(rc == PLCTAG_STATUS_OK);
+    assert(elem_size == 4 && elem_count == 10 && type_info_size == 2 && type_info[0] == 0xC4 && type_info[1] == 0x00);
+
+    /* later lines win. */
+    rc = metadata_cache_get_tag(cache, "tag\t10.1.2.3\t1,0\tOverridden", &elem_size, &elem_count, type_info, &type_info_size);
+    assert(rc == PLCTAG_STATUS_OK);
+    assert(elem_size == 4 && elem_count == 3 && type_info[0] == 0xC4);
+
+    rc = metadata_cache_get_tag(cache, "tag\t10.1.2.3\t1,0\tLast", &elem_size, &elem_count, type_info, &type_info_size);
+    assert(rc == PLCTAG_STATUS_OK);
+    assert(elem_size == 8 && elem_count == 2 && type_info[0] == 0xC5);
+
+    /* a route is not a tag. */
+    rc = metadata_cache_get_tag(cache, "route\t10.1.2.3\t1,0", &elem_size, &elem_count, type_info, &type_info_size);
+    assert(rc == PLCTAG_ERR_NOT_FOUND);
+
+    /* dropped and bad lines. */
+    rc = metadata_cache_get_tag(cache, "tag\t10.1.2.3\t1,0\tDropped", &elem_size, &elem_count, type_info, &type_info_size);
+    assert(rc == PLCTAG_ERR_NOT_FOUND);
+    rc = metadata_cache_get_tag(cache, "tag\t10.1.2.3\t1,0\tBadHex", &elem_size, &elem_count, type_info, &type_info_size);
+    assert(rc == PLCTAG_ERR_NOT_FOUND);
+    rc = metadata_cache_get_tag(cache, "tag\t10.1.2.3\t1,0\tOddHex", &elem_size, &elem_count, type_info, &type_info_size);
+    assert(rc == PLCTAG_ERR_NOT_FOUND);
+    rc = metadata_cache_get_tag(cache, "tag\t10.1.2.3\t1,0\tNoType", &elem_size, &elem_count, type_info, &type_info_size);
+    assert(rc == PLCTAG_ERR_NOT_FOUND);
+    rc = metadata_cache_get_tag(cache, "tag\t10.1.2.3\t1,0\tBadSize", &elem_size, &elem_count, type_info, &type_info_size);
+    assert(rc == PLCTAG_ERR_NOT_FOUND);
+    rc = metadata_cache_get_tag(cache, "tag\t10.1.2.3\t1,0\tShort", &elem_size, &elem_count, type_info, &type_info_size);
+    assert(rc == PLCTAG_ERR_NOT_FOUND);
+
+    cache_destroy(cache);
+
+    /* an empty file is written from scratch. */
+    write_file("");
+
+    cache = cache_create(TEST_FILE);
+    assert(cache != NULL);
+    assert(cache->num_entries == 0);
+    assert(cache->needs_rewrite);
+
+    cache_flush(cache);
+    assert(count_lines() == 1);
+
+    cache_destroy(cache);
+}
+
+
+/* keys that share a hash value, and the file through changes, a rewrite and a reload. */
+static void test_round_trip(void)
+{
+    metadata_cache_p cache = NULL;
+    int expected[NUM_TAGS];
+    int lines = 0;
+
+    pdebug(DEBUG_INFO, "Running round trip tests.");
+
+    remove(TEST_FILE);
+
+    cache = cache_create(TEST_FILE);
+    assert(cache != NULL);
+    assert(cache->needs_rewrite);
+
+    for(int i=0; i < NUM_TAGS; i++) {
+        put_tag(cache, i, 10 + i);
+        expected[i] = 10 + i;
+    }
+
+    assert(cache->num_entries == NUM_TAGS);
+    check_tags(cache, expected);
+
+    /* nothing is written until the cache is flushed. */
+    assert(vector_length(cache->pending) == 0);
+
+    cache_flush(cache);
+    assert(!cache->needs_rewrite);
+    assert(count_lines() == NUM_TAGS + 1);
+
+    /* the same value again is not a change. */
+    put_tag(cache, 3, expected[3]);
+    assert(vector_length(cache->pending) == 0);
+
+    /* remove from the head, middle and end of the chains. */
+    for(int i=0; i < NUM_TAGS; i += 3) {
+        remove_tag(cache, i);
+        expected[i] = -1;
+        check_tags(cache, expected);
+    }
+
+    /* removing what is not there changes nothing. */
+    remove_tag(cache, 0);
+
+    /* change some and put some back. */
+    for(int i=0; i < NUM_TAGS; i += 2) {
+        put_tag(cache, i, 100 + i);
+        expected[i] = 100 + i;
+    }
+
+    check_tags(cache, expected);
+
+    lines = count_lines() + vector_length(cache->pending);
+
+    cache_flush(cache);
+    assert(count_lines() == lines);
+    assert(cache->num_lines == lines);
+
+    cache_destroy(cache);
+
+    /* the drop and change lines give the same cache back. */
+    cache = cache_create(TEST_FILE);
+    assert(cache != NULL);
+    assert(cache->num_lines == lines);
+    check_tags(cache, expected);
+
+    /* enough changes make the file be rewritten. */
+    for(int i=0; i < METADATA_CACHE_MIN_EXTRA_LINES; i++) {
+        put_tag(cache, 1, i & 0xFF);
+    }
+
+    expected[1] = (METADATA_CACHE_MIN_EXTRA_LINES - 1) & 0xFF;
+
+    cache_flush(cache);
+    assert(vector_length(cache->pending) == 0);
+    assert(count_lines() == cache->num_entries + 1);
+    assert(cache->num_lines == cache->num_entries + 1);
+
+    cache_destroy(cache);
+
+    cache = cache_create(TEST_FILE);
+    assert(cache != NULL);
+    assert(!cache->needs_rewrite);
+    check_tags(cache, expected);
+    cache_destroy(cache);
+}
+
+
+/* the flush thread writes the changes and teardown writes the rest. */
+static void test_flush_thread(void)
+{
+    metadata_cache_p cache = NULL;
+    metadata_cache_p other = NULL;
+    int expected[NUM_TAGS];
+    int rc = 0;
+
+    pdebug(DEBUG_INFO, "Running flush thread tests.");
+
+    remove(TEST_FILE);
+
+    rc = metadata_cache_startup();
+    assert(rc == PLCTAG_STATUS_OK);
+
+    cache = metadata_cache_get(TEST_FILE);
+    assert(cache != NULL);
+
+    other = metadata_cache_get(TEST_FILE);
+    assert(other == cache);
+
+    for(int i=0; i < NUM_TAGS; i++) {
+        put_tag(cache, i, i);
+        expected[i] = i;
+    }
+
+    sleep_ms(METADATA_CACHE_FLUSH_MS * 3);
+    assert(count_lines() == NUM_TAGS + 1);
+
+    remove_tag(cache, 5);
+    expected[5] = -1;
+
+    metadata_cache_teardown();
+
+    rc = metadata_cache_startup();
+    assert(rc == PLCTAG_STATUS_OK);
+
+    cache = metadata_cache_get(TEST_FILE);
+    assert(cache != NULL);
+    check_tags(cache, expected);
+
+    metadata_cache_teardown();
+}
+
+
+int main(int argc, const char **argv)
+{
+    (void)argc;
+    (void)argv;
+
+    pdebug(DEBUG_INFO, "Starting metadata cache tests.");
+
+    set_debug_level(DEBUG_WARN);
+
+    /* check the keys really do collide. */
+    assert(((uint64_t)key_hash("a") & ~(uint64_t)0x7) == 0);
+
+    test_parse();
+    test_round_trip();
+    test_flush_thread();
+
+    remove(TEST_FILE);
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return 0;
+}
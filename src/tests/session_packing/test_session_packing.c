@@ -0,0 +1,252 @@
+/***************************************************************************
+ *   Copyright (C) 2018 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU Library General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/* the checks must run in release builds too. */
+#undef NDEBUG
+#include <assert.h>
+
+/* this gives the tests the internal functions of the session. */
+#include "../../protocols/ab/session.c"
+
+/* the route path is "1,0", one word. */
+static const uint8_t ROUTE_PATH[] = { 0x01, 0x00, 0x01, 0x00 };
+
+#define MAX_TEST_REQUESTS (300)
+
+
+/* an Unconnected Send with an embedded message of the passed size. */
+static ab_request_p make_uc_request(ab_route_p route, int tag_id, int embed_size)
+{
+    int size = (int)sizeof(eip_cip_uc_req) + embed_size + (int)sizeof(ROUTE_PATH);
+    ab_request_p req = mem_alloc((int)sizeof(struct ab_request_t) + size);
+    eip_cip_uc_req *uc_req = NULL;
+    uint8_t *embed = NULL;
+
+    assert(req != NULL);
+
+    uc_req = (eip_cip_uc_req *)(req->data);
+    uc_req->encap_command = h2le16(AB_EIP_UNCONNECTED_SEND);
+    uc_req->cm_service_code = AB_EIP_CMD_UNCONNECTED_SEND;
+    uc_req->cm_req_path_size = 2;
+    uc_req->cm_req_path[0] = 0x20;
+    uc_req->cm_req_path[1] = 0x06;
+    uc_req->cm_req_path[2] = 0x24;
+    uc_req->cm_req_path[3] = 0x01;
+    uc_req->uc_cmd_length = h2le16((uint16_t)embed_size);
+
+    embed = (uint8_t *)(uc_req + 1);
+    embed[0] = AB_EIP_CMD_CIP_READ;
+    for(int i=1; i < embed_size; i++) {
+        embed[i] = (uint8_t)i;
+    }
+
+    mem_copy(embed + embed_size, (void *)ROUTE_PATH, (int)sizeof(ROUTE_PATH));
+
+    req->request_size = size;
+    req->request_capacity = size;
+    req->tag_id = tag_id;
+    req->route = route;
+    req->allow_packing = 1;
+
+    return req;
+}
+
+
+static void queue_request(ab_session_p session, ab_request_p req)
+{
+    if(session->pending_tail) {
+        session->pending_tail->next = req;
+    } else {
+        session->pending = req;
+    }
+
+    session->pending_tail = req;
+}
+
+
+static void free_requests(ab_request_p *requests, int num_requests)
+{
+    for(int i=0; i < num_requests; i++) {
+        mem_free(requests[i]);
+    }
+}
+
+
+/* bytes of the Unconnected Send after the CPF item header, what the PLC limits. */
+static int get_uc_item_size(ab_session_p session)
+{
+    eip_cip_uc_req *packed_req = (eip_cip_uc_req *)(session->send_data);
+
+    return le2h16(packed_req->cpf_udi_item_length);
+}
+
+
+/* fill packets with requests of the passed size, each must fit the route limit. */
+static void test_pack_to_limit(ab_session_p session, ab_route_p route, int embed_size)
+{
+    ab_request_p requests[MAX_TEST_REQUESTS];
+    ab_bundle_t bundle;
+    int num_sent = 0;
+
+    pdebug(DEBUG_INFO, "Packing requests with %d byte messages.", embed_size);
+
+    for(int i=0; i < MAX_TEST_REQUESTS; i++) {
+        requests[i] = make_uc_request(route, i + 1, embed_size);
+        queue_request(session, requests[i]);
+    }
+
+    while(num_sent < MAX_TEST_REQUESTS) {
+        sock_buf_t *tail = NULL;
+        int item_size = 0;
+        int rc = PLCTAG_STATUS_OK;
+
+        mem_set(&bundle, 0, (int)sizeof(bundle));
+
+        rc = bundle_requests(session, &bundle);
+        assert(rc > 0);
+
+        /* requests go out in order. */
+        for(int i=0; i < bundle.num_requests; i++) {
+            assert(bundle.requests[i] == requests[num_sent + i]);
+        }
+
+        num_sent += bundle.num_requests;
+
+        rc = pack_requests(session, bundle.requests, bundle.num_requests);
+        assert(rc == PLCTAG_STATUS_OK);
+
+        if(bundle.num_requests < 2) {
+            continue;
+        }
+
+        item_size = get_uc_item_size(session);
+        assert(item_size <= route->max_payload_size);
+
+        /* and it was full, another request would not have fit. */
+        if(num_sent < MAX_TEST_REQUESTS) {
+            assert(item_size + embed_size + 2 >= route->max_payload_size - 1);
+        }
+
+        /* the route path is at the end, after any pad byte. */
+        tail = &session->send_bufs[session->send_num_bufs - 1];
+        assert(tail->size == (int)sizeof(ROUTE_PATH) + (embed_size & bundle.num_requests & 0x01));
+        assert(mem_cmp(tail->data + tail->size - (int)sizeof(ROUTE_PATH), (int)sizeof(ROUTE_PATH), (void *)ROUTE_PATH, (int)sizeof(ROUTE_PATH)) == 0);
+    }
+
+    assert(session->pending == NULL);
+
+    free_requests(requests, MAX_TEST_REQUESTS);
+}
+
+
+/* a route that cannot send must not hold up another route. */
+static void test_stalled_route(ab_session_p session, ab_route_p route, ab_route_p stalled)
+{
+    ab_request_p requests[MAX_TEST_REQUESTS];
+    int num_stalled = session->packing_window * 2;
+    ab_bundle_t bundle;
+    ab_request_p req = NULL;
+    int rc = 0;
+
+    pdebug(DEBUG_INFO, "Running stalled route tests.");
+
+    stalled->num_uc_in_flight = session->pipeline_depth;
+
+    for(int i=0; i < MAX_TEST_REQUESTS; i++) {
+        requests[i] = make_uc_request((i < num_stalled ? stalled : route), i + 1, 20);
+        queue_request(session, requests[i]);
+    }
+
+    mem_set(&bundle, 0, (int)sizeof(bundle));
+
+    rc = bundle_requests(session, &bundle);
+    assert(rc > 1);
+
+    for(int i=0; i < bundle.num_requests; i++) {
+        assert(bundle.requests[i] == requests[num_stalled + i]);
+    }
+
+    /* the stalled requests stay queued in order. */
+    req = session->pending;
+    for(int i=0; i < num_stalled; i++) {
+        assert(req == requests[i]);
+        req = req->next;
+    }
+
+    /* once the route can send, its requests come first. */
+    stalled->num_uc_in_flight = 0;
+
+    mem_set(&bundle, 0, (int)sizeof(bundle));
+
+    rc = bundle_requests(session, &bundle);
+    assert(rc > 1);
+    assert(bundle.requests[0] == requests[0]);
+
+    session->pending = NULL;
+    session->pending_tail = NULL;
+
+    free_requests(requests, MAX_TEST_REQUESTS);
+}
+
+
+int main(int argc, const char **argv)
+{
+    ab_session_p session = NULL;
+    ab_route_p route = NULL;
+    ab_route_p stalled = NULL;
+
+    (void)argc;
+    (void)argv;
+
+    pdebug(DEBUG_INFO, "Starting session packing tests.");
+
+    set_debug_level(DEBUG_WARN);
+
+    session = mem_alloc((int)sizeof(struct ab_session_t));
+    route = mem_alloc((int)sizeof(struct ab_route_t));
+    stalled = mem_alloc((int)sizeof(struct ab_route_t));
+    assert(session != NULL && route != NULL && stalled != NULL);
+
+    session->packing_window = SESSION_DEFAULT_PACKING_WINDOW;
+    session->pipeline_depth = 1;
+    session->routes[0] = route;
+    session->routes[1] = stalled;
+    session->num_routes = 2;
+    session->num_io_routes = 2;
+
+    route->max_payload_size = MAX_CIP_MSG_SIZE;
+    stalled->max_payload_size = MAX_CIP_MSG_SIZE;
+
+    /* even and odd sizes, the odd ones need a pad byte. */
+    test_pack_to_limit(session, route, 20);
+    test_pack_to_limit(session, route, 21);
+    test_pack_to_limit(session, route, 120);
+    test_pack_to_limit(session, route, 230);
+
+    test_stalled_route(session, route, stalled);
+
+    mem_free(stalled);
+    mem_free(route);
+    mem_free(session);
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return 0;
+}
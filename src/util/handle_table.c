@@ -0,0 +1,301 @@
+/***************************************************************************
+ *   Copyright (C) 2018 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library/Lesser General Public License as*
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU Library General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#include <lib/libplctag.h>
+#include <platform.h>
+#include <util/debug.h>
+#include <util/handle_table.h>
+#include <util/rc.h>
+
+/*
+ * The table is a fixed directory of chunks of slots.  Chunks are only
+ * allocated, never moved or freed until the table is destroyed, so a
+ * reader can find a slot without any table-wide lock.  Each slot has
+ * its own spin lock that protects the object pointer and generation.
+ *
+ * A handle is (generation << HANDLE_INDEX_BITS) | index.  Generations
+ * run from 1 to HANDLE_MAX_GEN so that a handle is never zero.
+ *
+ * Freed slots are reused in FIFO order.  Combined with the generation
+ * this makes it very unlikely that a stale handle finds a new object.
+ */
+
+#define HANDLE_INDEX_BITS (20)
+#define HANDLE_INDEX_MASK ((1 << HANDLE_INDEX_BITS) - 1)
+#define HANDLE_MAX_GEN (HANDLE_TABLE_MAX_HANDLE >> HANDLE_INDEX_BITS)
+
+#define HANDLE_CHUNK_BITS (10)
+#define HANDLE_CHUNK_SIZE (1 << HANDLE_CHUNK_BITS)
+#define HANDLE_MAX_CHUNKS (1 << (HANDLE_INDEX_BITS - HANDLE_CHUNK_BITS))
+
+struct handle_slot_t {
+    lock_t lock;
+    int gen;
+    void *ref;
+    int next_free;
+};
+
+typedef struct handle_slot_t *handle_slot_p;
+
+struct handle_table_t {
+    mutex_p mutex;          /* protects everything below the chunk directory */
+    int next_unused;
+    int free_head;
+    int free_tail;
+    handle_slot_p volatile chunks[HANDLE_MAX_CHUNKS];
+};
+
+
+static handle_slot_p get_slot(handle_table_p table, int index);
+
+
+
+handle_table_p handle_table_create(void)
+{
+    handle_table_p table = NULL;
+
+    pdebug(DEBUG_INFO,"Starting");
+
+    table = mem_alloc((int)sizeof(struct handle_table_t));
+    if(!table) {
+        pdebug(DEBUG_ERROR,"Unable to allocate memory for handle table!");
+        return NULL;
+    }
+
+    if(mutex_create(&table->mutex) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR,"Unable to create handle table mutex!");
+        mem_free(table);
+        return NULL;
+    }
+
+    table->next_unused = 0;
+    table->free_head = -1;
+    table->free_tail = -1;
+
+    pdebug(DEBUG_INFO,"Done");
+
+    return table;
+}
+
+
+
+/*
+ * handle_table_add
+ *
+ * Put the object into a free slot and return its handle, or an error.
+ * The table takes over the caller's reference.
+ */
+
+int handle_table_add(handle_table_p table, void *ref)
+{
+    int index = -1;
+    int rc = PLCTAG_STATUS_OK;
+    handle_slot_p slot = NULL;
+
+    pdebug(DEBUG_DETAIL,"Starting");
+
+    if(!table || !ref) {
+        pdebug(DEBUG_WARN,"Called with null table or reference!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    critical_block(table->mutex) {
+        if(table->free_head >= 0) {
+            index = table->free_head;
+            slot = get_slot(table, index);
+
+            table->free_head = slot->next_free;
+            if(table->free_head < 0) {
+                table->free_tail = -1;
+            }
+        } else if(table->next_unused <= HANDLE_INDEX_MASK) {
+            int chunk = table->next_unused >> HANDLE_CHUNK_BITS;
+
+            if(!table->chunks[chunk]) {
+                handle_slot_p new_chunk = mem_alloc((int)sizeof(struct handle_slot_t) * HANDLE_CHUNK_SIZE);
+
+                if(!new_chunk) {
+                    pdebug(DEBUG_ERROR,"Unable to allocate memory for handle table chunk!");
+                    rc = PLCTAG_ERR_NO_MEM;
+                    break;
+                }
+
+                for(int i=0; i < HANDLE_CHUNK_SIZE; i++) {
+                    new_chunk[i].lock = LOCK_INIT;
+                    new_chunk[i].gen = 1;
+                    new_chunk[i].next_free = -1;
+                }
+
+                table->chunks[chunk] = new_chunk;
+            }
+
+            index = table->next_unused;
+            table->next_unused++;
+            slot = get_slot(table, index);
+        } else {
+            pdebug(DEBUG_WARN,"Handle table is full!");
+            rc = PLCTAG_ERR_NO_RESOURCES;
+            break;
+        }
+
+        spin_block(&slot->lock) {
+            slot->ref = ref;
+            slot->next_free = -1;
+            rc = (slot->gen << HANDLE_INDEX_BITS) | index;
+        }
+    }
+
+    pdebug(DEBUG_DETAIL,"Done with handle %d", rc);
+
+    return rc;
+}
+
+
+
+/*
+ * handle_table_get
+ *
+ * Return a new strong reference to the object with the passed handle,
+ * or NULL if there is no such object.
+ */
+
+void *handle_table_get(handle_table_p table, int handle)
+{
+    handle_slot_p slot = NULL;
+    void *result = NULL;
+
+    if(!table || handle <= 0 || handle > HANDLE_TABLE_MAX_HANDLE) {
+        return NULL;
+    }
+
+    slot = get_slot(table, handle & HANDLE_INDEX_MASK);
+    if(!slot) {
+        return NULL;
+    }
+
+    spin_block(&slot->lock) {
+        if(slot->ref && slot->gen == (handle >> HANDLE_INDEX_BITS)) {
+            result = rc_inc(slot->ref);
+        }
+    }
+
+    return result;
+}
+
+
+
+/*
+ * handle_table_remove
+ *
+ * Take the object with the passed handle out of the table and return
+ * the table's reference to it.  The caller must release it.
+ */
+
+void *handle_table_remove(handle_table_p table, int handle)
+{
+    int index = handle & HANDLE_INDEX_MASK;
+    handle_slot_p slot = NULL;
+    void *result = NULL;
+
+    if(!table || handle <= 0 || handle > HANDLE_TABLE_MAX_HANDLE) {
+        return NULL;
+    }
+
+    slot = get_slot(table, index);
+    if(!slot) {
+        return NULL;
+    }
+
+    critical_block(table->mutex) {
+        spin_block(&slot->lock) {
+            if(slot->ref && slot->gen == (handle >> HANDLE_INDEX_BITS)) {
+                result = slot->ref;
+                slot->ref = NULL;
+                slot->gen = (slot->gen >= HANDLE_MAX_GEN ? 1 : slot->gen + 1);
+            }
+        }
+
+        /* put the slot at the end of the free list. */
+        if(result) {
+            if(table->free_tail >= 0) {
+                get_slot(table, table->free_tail)->next_free = index;
+            } else {
+                table->free_head = index;
+            }
+
+            table->free_tail = index;
+        }
+    }
+
+    return result;
+}
+
+
+
+/*
+ * handle_table_destroy
+ *
+ * Free the table.  Any objects left in it are not released.
+ */
+
+int handle_table_destroy(handle_table_p table)
+{
+    pdebug(DEBUG_INFO,"Starting");
+
+    if(!table) {
+        pdebug(DEBUG_WARN,"Called with null pointer!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    for(int i=0; i < HANDLE_MAX_CHUNKS; i++) {
+        if(table->chunks[i]) {
+            mem_free(table->chunks[i]);
+            table->chunks[i] = NULL;
+        }
+    }
+
+    mutex_destroy(&table->mutex);
+
+    mem_free(table);
+
+    pdebug(DEBUG_INFO,"Done");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+
+/***********************************************************************
+ *************************** Helper Functions **************************
+ **********************************************************************/
+
+
+handle_slot_p get_slot(handle_table_p table, int index)
+{
+    handle_slot_p chunk = table->chunks[index >> HANDLE_CHUNK_BITS];
+
+    if(!chunk) {
+        return NULL;
+    }
+
+    return &chunk[index & (HANDLE_CHUNK_SIZE - 1)];
+}
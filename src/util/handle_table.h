@@ -0,0 +1,47 @@
+/***************************************************************************
+ *   Copyright (C) 2018 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library/Lesser General Public License as*
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU Library General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __UTIL_HANDLE_TABLE_H__
+#define __UTIL_HANDLE_TABLE_H__ 1
+
+#include <stdint.h>
+
+/*
+ * A handle table maps small positive integer handles to reference
+ * counted objects.  The handle encodes the slot index and a generation
+ * counter, so a lookup is a direct index with no hashing and no global
+ * lock.  Removing an entry bumps the slot generation so that stale
+ * handles do not find the next object put in the same slot.
+ *
+ * All handles fit within HANDLE_TABLE_MAX_HANDLE.
+ */
+
+#define HANDLE_TABLE_MAX_HANDLE (0xFFFFFFF)
+
+typedef struct handle_table_t *handle_table_p;
+
+extern handle_table_p handle_table_create(void);
+extern int handle_table_add(handle_table_p table, void *ref);
+extern void *handle_table_get(handle_table_p table, int handle);
+extern void *handle_table_remove(handle_table_p table, int handle);
+extern int handle_table_destroy(handle_table_p table);
+
+
+#endif